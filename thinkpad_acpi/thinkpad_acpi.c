@@ -37,40 +37,57 @@
 #include <linux/acpi.h>
 #include <linux/backlight.h>
 #include <linux/bitops.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dmi.h>
 #include <linux/fb.h>
 #include <linux/freezer.h>
 #include <linux/hwmon.h>
+#include <linux/hrtimer.h>
 #include <linux/hwmon-sysfs.h>
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/input/sparse-keymap.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/kernel_stat.h>
+#include <linux/kfifo.h>
 #include <linux/kthread.h>
 #include <linux/leds.h>
 #include <linux/list.h>
 #include <linux/lockdep.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/notifier.h>
 #include <linux/nvram.h>
 #include <linux/pci.h>
+#include <linux/perf_event.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
 #include <linux/platform_profile.h>
+#include <linux/poll.h>
 #include <linux/power_supply.h>
 #include <linux/proc_fs.h>
+#include <linux/relay.h>
 #include <linux/rfkill.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
 #include <linux/string.h>
 #include <linux/string_helpers.h>
 #include <linux/sysfs.h>
+#include <linux/thermal.h>
+#include <linux/tick.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/units.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 
 #include "thinkpad_acpi.h"
@@ -85,6 +102,9 @@
 
 #include "dual_accel_detect.h"
 
+#define CREATE_TRACE_POINTS
+#include "thinkpad_acpi_trace.h"
+
 /* ThinkPad CMOS commands */
 #define TP_CMOS_VOLUME_DOWN	0
 #define TP_CMOS_VOLUME_UP	1
@@ -360,6 +380,7 @@ static struct {
 	u32 light_status:1;
 	u32 bright_acpimode:1;
 	u32 bright_unkfw:1;
+	u32 bright_ucms_direct:1;
 	u32 wan:1;
 	u32 uwb:1;
 	u32 fan_ctrl_status_undef:1;
@@ -410,6 +431,7 @@ static int experimental;
 static u32 dbg_level;
 
 static struct workqueue_struct *tpacpi_wq;
+static struct dentry *tpacpi_debugfs_dir;
 
 enum led_status_t {
 	TPACPI_LED_OFF = 0,
@@ -724,6 +746,54 @@ static int issue_thinkpad_cmos_command(int cmos_cmd)
 	return 0;
 }
 
+/*
+ * NVRAM write-behind: state the firmware keeps in NVRAM but which we
+ * change through the EC is marked dirty, and tpacpi_nvram_work copies it
+ * back once nvram_writeback_delay ms pass without further changes.  A
+ * clean bit means NVRAM is known to match, so suspend has nothing to do.
+ */
+enum {
+	TPACPI_NVRAM_BRIGHTNESS = 0,
+	TPACPI_NVRAM_MIXER,
+};
+
+static unsigned int nvram_writeback_delay = 5000;	/* ms */
+
+static unsigned long tpacpi_nvram_dirty;
+
+static void tpacpi_nvram_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(tpacpi_nvram_work, tpacpi_nvram_worker);
+
+static void tpacpi_nvram_writeback(unsigned int what);
+
+static void tpacpi_nvram_mark_dirty(unsigned int what)
+{
+	set_bit(what, &tpacpi_nvram_dirty);
+	mod_delayed_work(tpacpi_wq, &tpacpi_nvram_work,
+			 msecs_to_jiffies(nvram_writeback_delay));
+}
+
+/*
+ * For the checkpoint functions, once NVRAM is known to match: under the
+ * same lock the setters mark it dirty with, so no change is lost.
+ */
+static void tpacpi_nvram_mark_clean(unsigned int what)
+{
+	clear_bit(what, &tpacpi_nvram_dirty);
+}
+
+/* For the suspend, shutdown and exit paths */
+static void tpacpi_nvram_sync(unsigned int what)
+{
+	cancel_delayed_work_sync(&tpacpi_nvram_work);
+	tpacpi_nvram_writeback(what);
+
+	/* the other subdriver's bits are its own business */
+	if (READ_ONCE(tpacpi_nvram_dirty))
+		queue_delayed_work(tpacpi_wq, &tpacpi_nvram_work,
+				   msecs_to_jiffies(nvram_writeback_delay));
+}
+
 /*************************************************************************
  * ACPI device model
  */
@@ -1888,12 +1958,74 @@ static unsigned int hotkey_poll_freq = 10; /* Hz */
 #define HOTKEY_CONFIG_CRITICAL_END \
 	mutex_unlock(&hotkey_thread_data_mutex);
 
+/* Automatic hotkey_source_mask management, see hotkey_autosrc_worker() */
+static bool hotkey_source_auto;
+static u32 hotkey_autosrc_fw_mask;	/* kept enabled in firmware */
+
+/*
+ * The driver's own NVRAM writes (backlight and mixer checkpoints, UCMS
+ * brightness steps) are bracketed by hotkey_nvram_self_write_begin/end(),
+ * so whoever watches NVRAM for key presses can tell them apart.
+ * hotkey_nvram_self_gen changes with every completed write, and
+ * hotkey_nvram_self_busy counts the writes in progress.
+ */
+static atomic_t hotkey_nvram_self_busy = ATOMIC_INIT(0);
+static atomic_t hotkey_nvram_self_gen = ATOMIC_INIT(0);
+
+static void hotkey_nvram_self_write_begin(void)
+{
+	atomic_inc(&hotkey_nvram_self_busy);
+	smp_mb__after_atomic();
+}
+
+static void hotkey_nvram_self_write_end(void)
+{
+	smp_mb__before_atomic();
+	atomic_inc(&hotkey_nvram_self_gen);
+	atomic_dec(&hotkey_nvram_self_busy);
+}
+
+/* Take before reading NVRAM */
+static unsigned int hotkey_nvram_self_snapshot(void)
+{
+	unsigned int gen = atomic_read(&hotkey_nvram_self_gen);
+
+	smp_rmb();
+	return gen;
+}
+
+/*
+ * After reading NVRAM: true if the driver may have written it since the
+ * snapshot taken before the previous read (*seen), or during this one.
+ */
+static bool hotkey_nvram_self_written(unsigned int *seen, unsigned int snap)
+{
+	bool written;
+
+	smp_rmb();
+	written = snap != *seen ||
+		  atomic_read(&hotkey_nvram_self_busy) ||
+		  atomic_read(&hotkey_nvram_self_gen) != snap;
+	*seen = snap;
+
+	return written;
+}
+
 #else /* CONFIG_THINKPAD_ACPI_HOTKEY_POLL */
 
 #define hotkey_source_mask 0U
+#define hotkey_autosrc_fw_mask 0U
 #define HOTKEY_CONFIG_CRITICAL_START
 #define HOTKEY_CONFIG_CRITICAL_END
 
+static inline void hotkey_nvram_self_write_begin(void)
+{
+}
+
+static inline void hotkey_nvram_self_write_end(void)
+{
+}
+
 #endif /* CONFIG_THINKPAD_ACPI_HOTKEY_POLL */
 
 static struct mutex hotkey_mutex;
@@ -1916,6 +2048,10 @@ static u32 hotkey_acpi_mask;		/* events enabled in firmware */
 
 static bool tpacpi_driver_event(const unsigned int hkey_event);
 static void hotkey_poll_setup(const bool may_warn);
+static inline bool hotkey_injecting(void);
+#ifdef CONFIG_THINKPAD_ACPI_DEBUGFACILITIES
+static const struct file_operations hotkey_inject_fops;
+#endif
 
 /* HKEY.MHKG() return bits */
 #define TP_HOTKEY_TABLET_MASK (1 << 3)
@@ -2122,6 +2258,9 @@ static int hotkey_mask_set(u32 mask)
 
 	lockdep_assert_held(&hotkey_mutex);
 
+	/* auto source management watches these in firmware */
+	mask |= hotkey_autosrc_fw_mask;
+
 	if (tp_features.hotkey_mask) {
 		for (i = 0; i < 32; i++) {
 			if (!acpi_evalf(hkey_handle,
@@ -2234,7 +2373,7 @@ static void tpacpi_input_send_tabletsw(void)
 {
 	int state;
 
-	if (tp_features.hotkey_tablet &&
+	if (tp_features.hotkey_tablet && !hotkey_injecting() &&
 	    !hotkey_get_tablet_mode(&state)) {
 		mutex_lock(&tpacpi_inputdev_send_mutex);
 
@@ -2291,6 +2430,11 @@ static bool tpacpi_input_send_key(const u32 hkey, bool *send_acpi_ev)
 		scancode = hkey;
 	}
 
+	/* injected key presses are looked up but never reported */
+	if (hotkey_injecting())
+		return sparse_keymap_entry_from_scancode(tpacpi_inputdev,
+							 scancode) != NULL;
+
 	mutex_lock(&tpacpi_inputdev_send_mutex);
 	known_ev = sparse_keymap_report_event(tpacpi_inputdev, scancode, 1, true);
 	mutex_unlock(&tpacpi_inputdev_send_mutex);
@@ -2388,6 +2532,8 @@ static void issue_brightnesschange(const unsigned int oldbrt,
 	}
 }
 
+static void volume_alsa_notify_change(void);
+
 static void hotkey_compare_and_issue_event(struct tp_nvram_state *oldn,
 					   struct tp_nvram_state *newn,
 					   const u32 event_mask)
@@ -2419,6 +2565,11 @@ static void hotkey_compare_and_issue_event(struct tp_nvram_state *oldn,
 	 * Just to make our life interesting, some newer Lenovo ThinkPads have
 	 * bugs in the BIOS and may fail to update volume_toggle properly.
 	 */
+	if (oldn->mute != newn->mute ||
+	    oldn->volume_level != newn->volume_level ||
+	    oldn->volume_toggle != newn->volume_toggle)
+		volume_alsa_notify_change();
+
 	if (newn->mute) {
 		/* muted */
 		if (!oldn->mute ||
@@ -2465,6 +2616,22 @@ static void hotkey_compare_and_issue_event(struct tp_nvram_state *oldn,
 #undef TPACPI_MAY_SEND_KEY
 }
 
+/*
+ * The NVRAM write-behind and UCMS steps change the brightness and mixer
+ * bytes too.  Take whatever changed there as the new baseline, so that
+ * a driver write is not reported back as key presses; a real key press
+ * in the same poll cycle is lost.
+ */
+static void hotkey_nvram_forget_self(struct tp_nvram_state *oldn,
+				     const struct tp_nvram_state *newn)
+{
+	oldn->brightness_toggle = newn->brightness_toggle;
+	oldn->brightness_level = newn->brightness_level;
+	oldn->volume_toggle = newn->volume_toggle;
+	oldn->volume_level = newn->volume_level;
+	oldn->mute = newn->mute;
+}
+
 /*
  * Polling driver
  *
@@ -2480,6 +2647,7 @@ static int hotkey_kthread(void *data)
 	unsigned long t;
 	unsigned int change_detector;
 	unsigned int poll_freq;
+	unsigned int self_seen, self_snap;
 	bool was_frozen;
 
 	if (tpacpi_lifecycle == TPACPI_LIFE_EXITING)
@@ -2499,6 +2667,7 @@ static int hotkey_kthread(void *data)
 			(hotkey_driver_mask | hotkey_user_mask);
 	poll_freq = hotkey_poll_freq;
 	mutex_unlock(&hotkey_thread_data_mutex);
+	self_seen = hotkey_nvram_self_snapshot();
 	hotkey_read_nvram(&s[so], poll_mask);
 
 	while (!kthread_should_stop()) {
@@ -2529,7 +2698,10 @@ static int hotkey_kthread(void *data)
 		mutex_unlock(&hotkey_thread_data_mutex);
 
 		if (likely(poll_mask)) {
+			self_snap = hotkey_nvram_self_snapshot();
 			hotkey_read_nvram(&s[si], poll_mask);
+			if (hotkey_nvram_self_written(&self_seen, self_snap))
+				hotkey_nvram_forget_self(&s[so], &s[si]);
 			if (likely(si != so)) {
 				hotkey_compare_and_issue_event(&s[so], &s[si],
 								event_mask);
@@ -2599,6 +2771,192 @@ static void hotkey_poll_set_freq(unsigned int freq)
 	hotkey_poll_freq = freq;
 }
 
+/*
+ * Automatic hotkey_source_mask management for volume and brightness
+ *
+ * Polling NVRAM for these keys is lossy and costs continuous CMOS reads,
+ * yet most firmware delivers TP_HKEY_EV_VOL_* and TP_HKEY_EV_BRGHT_*
+ * through ACPI anyway.  In auto mode a slow work item samples the NVRAM
+ * levels and checks every change against the ACPI events seen meanwhile.
+ * Once the firmware has accounted for enough changes of a group, that
+ * group is dropped from hotkey_source_mask; a change the firmware did not
+ * report puts it back.
+ *
+ * The groups stay enabled in the firmware mask while in auto mode, even
+ * when polled, or their ACPI events could never be seen; the events of
+ * polled keys are counted and then dropped in hotkey_notify_hotkey().
+ * Periods in which the driver wrote NVRAM itself prove nothing either
+ * way and are skipped.
+ */
+
+#define TPACPI_HKEY_AUTOSRC_PERIOD_MS	2000
+#define TPACPI_HKEY_AUTOSRC_CONFIRM	3
+#define TPACPI_HKEY_AUTOSRC_MASK	(TP_NVRAM_HKEY_GROUP_VOLUME | \
+					 TP_NVRAM_HKEY_GROUP_BRIGHTNESS)
+
+static struct hotkey_autosrc_group {
+	const char *name;
+	u32 mask;
+	atomic_t acpi_events;		/* seen in the current period */
+	unsigned int prev_events;	/* seen in the previous period */
+	unsigned int confirmations;
+} hotkey_autosrc_groups[] = {
+	{ .name = "volume", .mask = TP_NVRAM_HKEY_GROUP_VOLUME },
+	{ .name = "brightness", .mask = TP_NVRAM_HKEY_GROUP_BRIGHTNESS },
+};
+
+static struct tp_nvram_state hotkey_autosrc_nvram;
+static bool hotkey_autosrc_have_nvram;
+static unsigned int hotkey_autosrc_self_gen;
+
+static void hotkey_autosrc_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hotkey_autosrc_work, hotkey_autosrc_worker);
+
+/* Called for every original hotkey the firmware reports through ACPI */
+static void hotkey_autosrc_note_acpi(const unsigned int scancode)
+{
+	unsigned int i;
+
+	if (!hotkey_source_auto)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(hotkey_autosrc_groups); i++) {
+		if (hotkey_autosrc_groups[i].mask & (1 << scancode))
+			atomic_inc(&hotkey_autosrc_groups[i].acpi_events);
+	}
+}
+
+static bool hotkey_autosrc_changed(const struct hotkey_autosrc_group *g,
+				   const struct tp_nvram_state *o,
+				   const struct tp_nvram_state *n)
+{
+	if (g->mask == TP_NVRAM_HKEY_GROUP_VOLUME)
+		return o->volume_level != n->volume_level ||
+		       o->mute != n->mute ||
+		       o->volume_toggle != n->volume_toggle;
+
+	return o->brightness_level != n->brightness_level ||
+	       o->brightness_toggle != n->brightness_toggle;
+}
+
+static void hotkey_autosrc_set_polled(const struct hotkey_autosrc_group *g,
+				      bool polled)
+{
+	u32 user_mask;
+
+	mutex_lock(&hotkey_mutex);
+
+	/* hotkey_mask_get() trims the user mask, which is not ours to change */
+	user_mask = hotkey_user_mask;
+
+	HOTKEY_CONFIG_CRITICAL_START
+	if (polled)
+		hotkey_source_mask |= g->mask;
+	else
+		hotkey_source_mask &= ~g->mask;
+	HOTKEY_CONFIG_CRITICAL_END
+
+	if (hotkey_mask_set((user_mask | hotkey_driver_mask) &
+			    ~hotkey_source_mask) < 0)
+		pr_err("hotkey_source_mask: failed to update the firmware event mask!\n");
+
+	/* the firmware would not take the keys after all, keep polling */
+	if (!polled && (hotkey_acpi_mask & g->mask) != g->mask) {
+		HOTKEY_CONFIG_CRITICAL_START
+		hotkey_source_mask |= g->mask;
+		HOTKEY_CONFIG_CRITICAL_END
+		polled = true;
+	}
+
+	hotkey_user_mask = user_mask & (hotkey_acpi_mask | hotkey_source_mask);
+	hotkey_poll_setup(false);
+
+	mutex_unlock(&hotkey_mutex);
+
+	pr_info("%s events %s\n", g->name,
+		polled ? "were missed by the firmware, polling NVRAM again"
+		       : "are reported by the firmware, NVRAM polling disabled");
+}
+
+static void hotkey_autosrc_worker(struct work_struct *work)
+{
+	struct tp_nvram_state n = { 0 };
+	struct hotkey_autosrc_group *g;
+	unsigned int i, events, snap;
+	bool changed, polled, self;
+
+	if (!hotkey_source_auto || tpacpi_lifecycle == TPACPI_LIFE_EXITING)
+		return;
+
+	snap = hotkey_nvram_self_snapshot();
+	hotkey_read_nvram(&n, TPACPI_HKEY_AUTOSRC_MASK);
+	self = hotkey_nvram_self_written(&hotkey_autosrc_self_gen, snap);
+
+	for (i = 0; i < ARRAY_SIZE(hotkey_autosrc_groups); i++) {
+		g = &hotkey_autosrc_groups[i];
+
+		/* read after NVRAM: a late event is credited next period */
+		events = atomic_xchg(&g->acpi_events, 0);
+		changed = hotkey_autosrc_have_nvram && !self &&
+			  hotkey_autosrc_changed(g, &hotkey_autosrc_nvram, &n);
+		polled = (hotkey_source_mask & g->mask) == g->mask;
+
+		if (changed && (events || g->prev_events)) {
+			if (g->confirmations < TPACPI_HKEY_AUTOSRC_CONFIRM)
+				g->confirmations++;
+			if (polled &&
+			    g->confirmations >= TPACPI_HKEY_AUTOSRC_CONFIRM)
+				hotkey_autosrc_set_polled(g, false);
+		} else if (changed) {
+			g->confirmations = 0;
+			if (!polled)
+				hotkey_autosrc_set_polled(g, true);
+		}
+
+		g->prev_events = events;
+	}
+
+	hotkey_autosrc_nvram = n;
+	hotkey_autosrc_have_nvram = true;
+
+	queue_delayed_work(tpacpi_wq, &hotkey_autosrc_work,
+			   msecs_to_jiffies(TPACPI_HKEY_AUTOSRC_PERIOD_MS));
+}
+
+/* Must not be called with hotkey_mutex held */
+static void hotkey_autosrc_start(void)
+{
+	unsigned int i;
+
+	hotkey_autosrc_have_nvram = false;
+	for (i = 0; i < ARRAY_SIZE(hotkey_autosrc_groups); i++) {
+		atomic_set(&hotkey_autosrc_groups[i].acpi_events, 0);
+		hotkey_autosrc_groups[i].prev_events = 0;
+	}
+
+	mutex_lock(&hotkey_mutex);
+	hotkey_autosrc_fw_mask = TPACPI_HKEY_AUTOSRC_MASK;
+	if (hotkey_mask_set((hotkey_user_mask | hotkey_driver_mask) &
+			    ~hotkey_source_mask) < 0)
+		pr_err("hotkey_source_mask: failed to update the firmware event mask!\n");
+	mutex_unlock(&hotkey_mutex);
+
+	queue_delayed_work(tpacpi_wq, &hotkey_autosrc_work, 0);
+}
+
+/*
+ * Must not be called with hotkey_mutex held, the worker takes it.  The
+ * firmware keeps the auto groups enabled until the next hotkey_mask_set().
+ */
+static void hotkey_autosrc_stop_sync(void)
+{
+	cancel_delayed_work_sync(&hotkey_autosrc_work);
+
+	mutex_lock(&hotkey_mutex);
+	hotkey_autosrc_fw_mask = 0;
+	mutex_unlock(&hotkey_mutex);
+}
+
 #else /* CONFIG_THINKPAD_ACPI_HOTKEY_POLL */
 
 static void hotkey_poll_setup(const bool __unused)
@@ -2612,6 +2970,18 @@ static void hotkey_poll_setup_safe(const bool __unused)
 static void hotkey_poll_stop_sync(void)
 {
 }
+
+static void hotkey_autosrc_note_acpi(const unsigned int __unused)
+{
+}
+
+static void hotkey_autosrc_start(void)
+{
+}
+
+static void hotkey_autosrc_stop_sync(void)
+{
+}
 #endif /* CONFIG_THINKPAD_ACPI_HOTKEY_POLL */
 
 static int hotkey_inputdev_open(struct input_dev *dev)
@@ -2789,6 +3159,12 @@ static ssize_t hotkey_source_mask_store(struct device *dev,
 		((t & ~TPACPI_HKEY_NVRAM_KNOWN_MASK) != 0))
 		return -EINVAL;
 
+	/* an explicit mask overrides automatic management */
+	if (hotkey_source_auto) {
+		hotkey_source_auto = false;
+		hotkey_autosrc_stop_sync();
+	}
+
 	if (mutex_lock_killable(&hotkey_mutex))
 		return -ERESTARTSYS;
 
@@ -2820,6 +3196,46 @@ static ssize_t hotkey_source_mask_store(struct device *dev,
 
 static DEVICE_ATTR_RW(hotkey_source_mask);
 
+/* sysfs hotkey hotkey_source_mask_auto -------------------------------- */
+static ssize_t hotkey_source_mask_auto_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	return sysfs_emit(buf, "%d\n", hotkey_source_auto);
+}
+
+static ssize_t hotkey_source_mask_auto_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	unsigned long t;
+
+	if (parse_strtoul(buf, 1, &t))
+		return -EINVAL;
+
+	if (hotkey_source_auto != !!t) {
+		hotkey_source_auto = !!t;
+		if (t) {
+			hotkey_autosrc_start();
+		} else {
+			hotkey_autosrc_stop_sync();
+
+			mutex_lock(&hotkey_mutex);
+			if (hotkey_mask_set((hotkey_user_mask |
+					     hotkey_driver_mask) &
+					    ~hotkey_source_mask) < 0)
+				pr_err("hotkey_source_mask: failed to update the firmware event mask!\n");
+			mutex_unlock(&hotkey_mutex);
+		}
+	}
+
+	tpacpi_disclose_usertask("hotkey_source_mask_auto", "set to %lu\n", t);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(hotkey_source_mask_auto);
+
 /* sysfs hotkey hotkey_poll_freq --------------------------------------- */
 static ssize_t hotkey_poll_freq_show(struct device *dev,
 			   struct device_attribute *attr,
@@ -3009,6 +3425,7 @@ static struct attribute *hotkey_attributes[] = {
 	&dev_attr_hotkey_radio_sw.attr,
 #ifdef CONFIG_THINKPAD_ACPI_HOTKEY_POLL
 	&dev_attr_hotkey_source_mask.attr,
+	&dev_attr_hotkey_source_mask_auto.attr,
 	&dev_attr_hotkey_poll_freq.attr,
 #endif
 	NULL
@@ -3062,7 +3479,7 @@ static void tpacpi_send_radiosw_update(void)
 		tpacpi_rfk_update_hwblock_state(false);
 
 	/* Issue rfkill input event for WLSW switch */
-	if (!(wlsw < 0)) {
+	if (!(wlsw < 0) && !hotkey_injecting()) {
 		mutex_lock(&tpacpi_inputdev_send_mutex);
 
 		input_report_switch(tpacpi_inputdev,
@@ -3079,88 +3496,420 @@ static void tpacpi_send_radiosw_update(void)
 	hotkey_radio_sw_notify_change();
 }
 
-static void hotkey_exit(void)
+static inline u16 tpacpi_hkey_category(const u32 hkey)
 {
-	mutex_lock(&hotkey_mutex);
-	hotkey_poll_stop_sync();
-	dbg_printk(TPACPI_DBG_EXIT | TPACPI_DBG_HKEY,
-		   "restoring original HKEY status and mask\n");
-	/* yes, there is a bitwise or below, we want the
-	 * functions to be called even if one of them fail */
-	if (((tp_features.hotkey_mask &&
-	      hotkey_mask_set(hotkey_orig_mask)) |
-	     hotkey_status_set(false)) != 0)
-		pr_err("failed to restore hot key mask to BIOS defaults\n");
-
-	mutex_unlock(&hotkey_mutex);
+	return (hkey >> 12) <= TPACPI_HKEY_CAT_MISC2 ?
+			hkey >> 12 : TPACPI_HKEY_CAT_UNKNOWN;
 }
 
+/* HKEY event latency accounting --------------------------------------- */
+
 /*
- * HKEY quirks:
- *   TPACPI_HK_Q_INIMASK:	Supports FN+F3,FN+F4,FN+F12
+ * Every HKEY event is timestamped when MHKP hands it over, when the driver
+ * handlers are done with it and when it has been delivered to the input
+ * device, netlink and the event stream.  The latency of each of these
+ * stages, counted from the firmware notification, goes into a per-category
+ * log2 histogram.  Histograms are per-CPU so the fast path takes no locks.
  */
 
-#define	TPACPI_HK_Q_INIMASK	0x0001
+enum tpacpi_hkey_lat_stage {
+	TPACPI_HKEY_LAT_FETCH = 0,	/* MHKP returned the event */
+	TPACPI_HKEY_LAT_HANDLED,	/* driver handlers completed */
+	TPACPI_HKEY_LAT_DELIVERED,	/* input/netlink/event stream issued */
+	TPACPI_HKEY_LAT_NR_STAGES,
+};
 
-static const struct tpacpi_quirk tpacpi_hotkey_qtable[] __initconst = {
-	TPACPI_Q_IBM('I', 'H', TPACPI_HK_Q_INIMASK), /* 600E */
-	TPACPI_Q_IBM('I', 'N', TPACPI_HK_Q_INIMASK), /* 600E */
-	TPACPI_Q_IBM('I', 'D', TPACPI_HK_Q_INIMASK), /* 770, 770E, 770ED */
-	TPACPI_Q_IBM('I', 'W', TPACPI_HK_Q_INIMASK), /* A20m */
-	TPACPI_Q_IBM('I', 'V', TPACPI_HK_Q_INIMASK), /* A20p */
-	TPACPI_Q_IBM('1', '0', TPACPI_HK_Q_INIMASK), /* A21e, A22e */
-	TPACPI_Q_IBM('K', 'U', TPACPI_HK_Q_INIMASK), /* A21e */
-	TPACPI_Q_IBM('K', 'X', TPACPI_HK_Q_INIMASK), /* A21m, A22m */
-	TPACPI_Q_IBM('K', 'Y', TPACPI_HK_Q_INIMASK), /* A21p, A22p */
-	TPACPI_Q_IBM('1', 'B', TPACPI_HK_Q_INIMASK), /* A22e */
-	TPACPI_Q_IBM('1', '3', TPACPI_HK_Q_INIMASK), /* A22m */
-	TPACPI_Q_IBM('1', 'E', TPACPI_HK_Q_INIMASK), /* A30/p (0) */
-	TPACPI_Q_IBM('1', 'C', TPACPI_HK_Q_INIMASK), /* R30 */
-	TPACPI_Q_IBM('1', 'F', TPACPI_HK_Q_INIMASK), /* R31 */
-	TPACPI_Q_IBM('I', 'Y', TPACPI_HK_Q_INIMASK), /* T20 */
-	TPACPI_Q_IBM('K', 'Z', TPACPI_HK_Q_INIMASK), /* T21 */
-	TPACPI_Q_IBM('1', '6', TPACPI_HK_Q_INIMASK), /* T22 */
-	TPACPI_Q_IBM('I', 'Z', TPACPI_HK_Q_INIMASK), /* X20, X21 */
-	TPACPI_Q_IBM('1', 'D', TPACPI_HK_Q_INIMASK), /* X22, X23, X24 */
+#define TPACPI_HKEY_NR_CATEGORIES	(TPACPI_HKEY_CAT_MISC2 + 1)
+#define TPACPI_HKEY_LAT_BUCKETS		32	/* bucket n: [2^(n-1), 2^n) ns,
+						   the last one open-ended */
+
+struct tpacpi_hkey_lat_hist {
+	u64 count[TPACPI_HKEY_LAT_BUCKETS];
+	u64 max_ns;
 };
 
-static int hotkey_init_tablet_mode(void)
-{
-	int in_tablet_mode = 0, res;
-	char *type = NULL;
+struct tpacpi_hkey_lat_stats {
+	unsigned int gen;	/* tpacpi_hkey_lat_gen the counts belong to */
+	struct tpacpi_hkey_lat_hist
+		hist[TPACPI_HKEY_NR_CATEGORIES][TPACPI_HKEY_LAT_NR_STAGES];
+};
 
-	if (acpi_evalf(hkey_handle, &res, "GMMS", "qdd", 0)) {
-		int has_tablet_mode;
+static DEFINE_PER_CPU(struct tpacpi_hkey_lat_stats, tpacpi_hkey_lat);
 
-		in_tablet_mode = hotkey_gmms_get_tablet_mode(res,
-							     &has_tablet_mode);
-		/*
-		 * The Yoga 11e series has 2 accelerometers described by a
-		 * BOSC0200 ACPI node. This setup relies on a Windows service
-		 * which calls special ACPI methods on this node to report
-		 * the laptop/tent/tablet mode to the EC. The bmc150 iio driver
-		 * does not support this, so skip the hotkey on these models.
-		 */
-		if (has_tablet_mode && !dual_accel_detect())
-			tp_features.hotkey_tablet = TP_HOTKEY_TABLET_USES_GMMS;
-		type = "GMMS";
-	} else if (acpi_evalf(hkey_handle, &res, "MHKG", "qd")) {
-		/* For X41t, X60t, X61t Tablets... */
-		tp_features.hotkey_tablet = TP_HOTKEY_TABLET_USES_MHKG;
-		in_tablet_mode = !!(res & TP_HOTKEY_TABLET_MASK);
-		type = "MHKG";
+/*
+ * A reset only bumps the generation; each CPU clears its own histograms
+ * the next time it accounts an event, so nobody writes to another CPU's.
+ */
+static atomic_t tpacpi_hkey_lat_gen = ATOMIC_INIT(0);
+
+static const char * const tpacpi_hkey_category_names[] = {
+	[TPACPI_HKEY_CAT_UNKNOWN]	= "unknown",
+	[TPACPI_HKEY_CAT_HOTKEY]	= "hotkey",
+	[TPACPI_HKEY_CAT_WAKEUP]	= "wakeup",
+	[TPACPI_HKEY_CAT_BAY]		= "bay",
+	[TPACPI_HKEY_CAT_DOCK]		= "dock",
+	[TPACPI_HKEY_CAT_USREVENT]	= "usrevent",
+	[TPACPI_HKEY_CAT_THERMAL]	= "thermal",
+	[TPACPI_HKEY_CAT_MISC]		= "misc",
+	[TPACPI_HKEY_CAT_MISC2]		= "misc2",
+};
+
+static const char * const tpacpi_hkey_lat_stage_names[] = {
+	[TPACPI_HKEY_LAT_FETCH]		= "fetch",
+	[TPACPI_HKEY_LAT_HANDLED]	= "handled",
+	[TPACPI_HKEY_LAT_DELIVERED]	= "delivered",
+};
+
+/* Accounts for a stage of hkey completing now, returns the current time */
+static u64 hotkey_lat_mark(const u32 hkey, const u32 batch,
+			   const enum tpacpi_hkey_lat_stage stage,
+			   const u64 notify_ns)
+{
+	struct tpacpi_hkey_lat_stats *stats;
+	struct tpacpi_hkey_lat_hist *h;
+	u64 now = ktime_get_ns();
+	u64 lat = now - notify_ns;
+
+	stats = get_cpu_ptr(&tpacpi_hkey_lat);
+	if (unlikely(stats->gen != atomic_read(&tpacpi_hkey_lat_gen))) {
+		memset(stats->hist, 0, sizeof(stats->hist));
+		stats->gen = atomic_read(&tpacpi_hkey_lat_gen);
+	}
+	h = &stats->hist[tpacpi_hkey_category(hkey)][stage];
+	h->count[min_t(unsigned int, fls64(lat), TPACPI_HKEY_LAT_BUCKETS - 1)]++;
+	if (lat > h->max_ns)
+		h->max_ns = lat;
+	put_cpu_ptr(&tpacpi_hkey_lat);
+
+	switch (stage) {
+	case TPACPI_HKEY_LAT_FETCH:
+		trace_tpacpi_hkey_fetch(hkey, batch, lat);
+		break;
+	case TPACPI_HKEY_LAT_HANDLED:
+		trace_tpacpi_hkey_handled(hkey, batch, lat);
+		break;
+	default:
+		trace_tpacpi_hkey_delivered(hkey, batch, lat);
+		break;
 	}
 
-	if (!tp_features.hotkey_tablet)
-		return 0;
+	return now;
+}
 
-	pr_info("Tablet mode switch found (type: %s), currently in %s mode\n",
-		type, in_tablet_mode ? "tablet" : "laptop");
+static int hotkey_latency_show(struct seq_file *m, void *v)
+{
+	struct tpacpi_hkey_lat_hist sum;
+	unsigned int cat, stage, b;
+	unsigned int gen = atomic_read(&tpacpi_hkey_lat_gen);
+	u64 total;
+	int cpu;
 
-	return in_tablet_mode;
+	for (cat = 0; cat < TPACPI_HKEY_NR_CATEGORIES; cat++) {
+		for (stage = 0; stage < TPACPI_HKEY_LAT_NR_STAGES; stage++) {
+			memset(&sum, 0, sizeof(sum));
+			for_each_possible_cpu(cpu) {
+				const struct tpacpi_hkey_lat_stats *stats =
+					per_cpu_ptr(&tpacpi_hkey_lat, cpu);
+				const struct tpacpi_hkey_lat_hist *h =
+					&stats->hist[cat][stage];
+
+				/* not cleared since the last reset yet */
+				if (READ_ONCE(stats->gen) != gen)
+					continue;
+				for (b = 0; b < TPACPI_HKEY_LAT_BUCKETS; b++)
+					sum.count[b] += h->count[b];
+				sum.max_ns = max(sum.max_ns, h->max_ns);
+			}
+
+			total = 0;
+			for (b = 0; b < TPACPI_HKEY_LAT_BUCKETS; b++)
+				total += sum.count[b];
+			if (!total)
+				continue;
+
+			seq_printf(m, "%s %s:\tcount %llu, max %llu ns\n",
+				   tpacpi_hkey_category_names[cat],
+				   tpacpi_hkey_lat_stage_names[stage],
+				   total, sum.max_ns);
+			for (b = 0; b < TPACPI_HKEY_LAT_BUCKETS; b++) {
+				if (!sum.count[b])
+					continue;
+				if (b == TPACPI_HKEY_LAT_BUCKETS - 1)
+					seq_printf(m, "\t>= %llu ns:\t%llu\n",
+						   1ULL << (b - 1), sum.count[b]);
+				else
+					seq_printf(m, "\t< %llu ns:\t%llu\n",
+						   1ULL << b, sum.count[b]);
+			}
+		}
+	}
+
+	return 0;
 }
 
-static const struct key_entry keymap_ibm[] __initconst = {
+static int hotkey_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hotkey_latency_show, NULL);
+}
+
+/* Any write resets the histograms and watermarks */
+static ssize_t hotkey_latency_write(struct file *file,
+				    const char __user *userbuf,
+				    size_t count, loff_t *pos)
+{
+	atomic_inc(&tpacpi_hkey_lat_gen);
+
+	return count;
+}
+
+static const struct file_operations hotkey_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = hotkey_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = hotkey_latency_write,
+};
+
+/* HKEY event character device ----------------------------------------- */
+
+/*
+ * /dev/tpacpi_events hands every HKEY event drained from MHKP to userspace
+ * as a fixed-size struct tpacpi_event_record.  Each open file has its own
+ * ring.  The notify path is the only producer and the reader of the file
+ * the only consumer, so the kfifo itself needs no locking:
+ * tpacpi_events_lock just serializes producers against each other and
+ * against open/release, and read_mutex serializes readers of one file.
+ */
+
+#define TPACPI_EVENTS_DEVNAME		TPACPI_DRVR_SHORTNAME "_events"
+#define TPACPI_EVENTS_RING_SIZE		256	/* records per open file */
+
+struct tpacpi_events_client {
+	struct list_head list;
+	DECLARE_KFIFO_PTR(ring, struct tpacpi_event_record);
+	wait_queue_head_t wait;
+	struct mutex read_mutex;
+	u32 overflow;		/* records lost since the last one queued */
+};
+
+static LIST_HEAD(tpacpi_events_clients);
+static DEFINE_SPINLOCK(tpacpi_events_lock);
+static u32 tpacpi_events_batch;
+
+static void tpacpi_events_emit(const u64 timestamp_ns, const u32 hkey,
+			       const u32 batch, const u16 flags)
+{
+	struct tpacpi_event_record rec = {
+		.timestamp_ns = timestamp_ns,
+		.hkey = hkey,
+		.category = tpacpi_hkey_category(hkey),
+		.flags = flags,
+		.batch = batch,
+	};
+	struct tpacpi_events_client *client;
+
+	spin_lock(&tpacpi_events_lock);
+	list_for_each_entry(client, &tpacpi_events_clients, list) {
+		rec.overflow = client->overflow;
+		if (kfifo_put(&client->ring, rec)) {
+			client->overflow = 0;
+			wake_up_interruptible(&client->wait);
+		} else {
+			client->overflow++;
+		}
+	}
+	spin_unlock(&tpacpi_events_lock);
+}
+
+static int tpacpi_events_open(struct inode *inode, struct file *file)
+{
+	struct tpacpi_events_client *client;
+	int rc;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	rc = kfifo_alloc(&client->ring, TPACPI_EVENTS_RING_SIZE, GFP_KERNEL);
+	if (rc) {
+		kfree(client);
+		return rc;
+	}
+	init_waitqueue_head(&client->wait);
+	mutex_init(&client->read_mutex);
+
+	spin_lock(&tpacpi_events_lock);
+	list_add_tail(&client->list, &tpacpi_events_clients);
+	spin_unlock(&tpacpi_events_lock);
+
+	file->private_data = client;
+
+	return stream_open(inode, file);
+}
+
+static int tpacpi_events_release(struct inode *inode, struct file *file)
+{
+	struct tpacpi_events_client *client = file->private_data;
+
+	spin_lock(&tpacpi_events_lock);
+	list_del(&client->list);
+	spin_unlock(&tpacpi_events_lock);
+
+	kfifo_free(&client->ring);
+	kfree(client);
+
+	return 0;
+}
+
+static ssize_t tpacpi_events_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct tpacpi_events_client *client = file->private_data;
+	unsigned int copied;
+	int rc;
+
+	if (count < sizeof(struct tpacpi_event_record))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&client->read_mutex))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&client->ring)) {
+		mutex_unlock(&client->read_mutex);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(client->wait,
+					     !kfifo_is_empty(&client->ring)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&client->read_mutex))
+			return -ERESTARTSYS;
+	}
+
+	/* whole records only, as many as fit */
+	rc = kfifo_to_user(&client->ring, buf, count, &copied);
+
+	mutex_unlock(&client->read_mutex);
+
+	return (rc) ? rc : copied;
+}
+
+static __poll_t tpacpi_events_poll(struct file *file, poll_table *wait)
+{
+	struct tpacpi_events_client *client = file->private_data;
+
+	poll_wait(file, &client->wait, wait);
+
+	return kfifo_is_empty(&client->ring) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static const struct file_operations tpacpi_events_fops = {
+	.owner = THIS_MODULE,
+	.open = tpacpi_events_open,
+	.release = tpacpi_events_release,
+	.read = tpacpi_events_read,
+	.poll = tpacpi_events_poll,
+};
+
+static struct miscdevice tpacpi_events_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = TPACPI_EVENTS_DEVNAME,
+	.fops = &tpacpi_events_fops,
+	.mode = S_IRUSR,
+};
+
+static bool tpacpi_events_registered;
+
+static void hotkey_exit(void)
+{
+	hotkey_autosrc_stop_sync();
+
+	if (tpacpi_events_registered) {
+		misc_deregister(&tpacpi_events_miscdev);
+		tpacpi_events_registered = false;
+	}
+
+	mutex_lock(&hotkey_mutex);
+	hotkey_poll_stop_sync();
+	dbg_printk(TPACPI_DBG_EXIT | TPACPI_DBG_HKEY,
+		   "restoring original HKEY status and mask\n");
+	/* yes, there is a bitwise or below, we want the
+	 * functions to be called even if one of them fail */
+	if (((tp_features.hotkey_mask &&
+	      hotkey_mask_set(hotkey_orig_mask)) |
+	     hotkey_status_set(false)) != 0)
+		pr_err("failed to restore hot key mask to BIOS defaults\n");
+
+	mutex_unlock(&hotkey_mutex);
+}
+
+/*
+ * HKEY quirks:
+ *   TPACPI_HK_Q_INIMASK:	Supports FN+F3,FN+F4,FN+F12
+ */
+
+#define	TPACPI_HK_Q_INIMASK	0x0001
+
+static const struct tpacpi_quirk tpacpi_hotkey_qtable[] __initconst = {
+	TPACPI_Q_IBM('I', 'H', TPACPI_HK_Q_INIMASK), /* 600E */
+	TPACPI_Q_IBM('I', 'N', TPACPI_HK_Q_INIMASK), /* 600E */
+	TPACPI_Q_IBM('I', 'D', TPACPI_HK_Q_INIMASK), /* 770, 770E, 770ED */
+	TPACPI_Q_IBM('I', 'W', TPACPI_HK_Q_INIMASK), /* A20m */
+	TPACPI_Q_IBM('I', 'V', TPACPI_HK_Q_INIMASK), /* A20p */
+	TPACPI_Q_IBM('1', '0', TPACPI_HK_Q_INIMASK), /* A21e, A22e */
+	TPACPI_Q_IBM('K', 'U', TPACPI_HK_Q_INIMASK), /* A21e */
+	TPACPI_Q_IBM('K', 'X', TPACPI_HK_Q_INIMASK), /* A21m, A22m */
+	TPACPI_Q_IBM('K', 'Y', TPACPI_HK_Q_INIMASK), /* A21p, A22p */
+	TPACPI_Q_IBM('1', 'B', TPACPI_HK_Q_INIMASK), /* A22e */
+	TPACPI_Q_IBM('1', '3', TPACPI_HK_Q_INIMASK), /* A22m */
+	TPACPI_Q_IBM('1', 'E', TPACPI_HK_Q_INIMASK), /* A30/p (0) */
+	TPACPI_Q_IBM('1', 'C', TPACPI_HK_Q_INIMASK), /* R30 */
+	TPACPI_Q_IBM('1', 'F', TPACPI_HK_Q_INIMASK), /* R31 */
+	TPACPI_Q_IBM('I', 'Y', TPACPI_HK_Q_INIMASK), /* T20 */
+	TPACPI_Q_IBM('K', 'Z', TPACPI_HK_Q_INIMASK), /* T21 */
+	TPACPI_Q_IBM('1', '6', TPACPI_HK_Q_INIMASK), /* T22 */
+	TPACPI_Q_IBM('I', 'Z', TPACPI_HK_Q_INIMASK), /* X20, X21 */
+	TPACPI_Q_IBM('1', 'D', TPACPI_HK_Q_INIMASK), /* X22, X23, X24 */
+};
+
+static int hotkey_init_tablet_mode(void)
+{
+	int in_tablet_mode = 0, res;
+	char *type = NULL;
+
+	if (acpi_evalf(hkey_handle, &res, "GMMS", "qdd", 0)) {
+		int has_tablet_mode;
+
+		in_tablet_mode = hotkey_gmms_get_tablet_mode(res,
+							     &has_tablet_mode);
+		/*
+		 * The Yoga 11e series has 2 accelerometers described by a
+		 * BOSC0200 ACPI node. This setup relies on a Windows service
+		 * which calls special ACPI methods on this node to report
+		 * the laptop/tent/tablet mode to the EC. The bmc150 iio driver
+		 * does not support this, so skip the hotkey on these models.
+		 */
+		if (has_tablet_mode && !dual_accel_detect())
+			tp_features.hotkey_tablet = TP_HOTKEY_TABLET_USES_GMMS;
+		type = "GMMS";
+	} else if (acpi_evalf(hkey_handle, &res, "MHKG", "qd")) {
+		/* For X41t, X60t, X61t Tablets... */
+		tp_features.hotkey_tablet = TP_HOTKEY_TABLET_USES_MHKG;
+		in_tablet_mode = !!(res & TP_HOTKEY_TABLET_MASK);
+		type = "MHKG";
+	}
+
+	if (!tp_features.hotkey_tablet)
+		return 0;
+
+	pr_info("Tablet mode switch found (type: %s), currently in %s mode\n",
+		type, in_tablet_mode ? "tablet" : "laptop");
+
+	return in_tablet_mode;
+}
+
+static const struct key_entry keymap_ibm[] __initconst = {
 	/* Original hotkey mappings translated scancodes 0x00 - 0x1f */
 	{ KE_KEY, TP_ACPI_HOTKEYSCAN_FNF1, { KEY_FN_F1 } },
 	{ KE_KEY, TP_ACPI_HOTKEYSCAN_FNF2, { KEY_BATTERY } },
@@ -3524,9 +4273,29 @@ static int __init hotkey_init(struct ibm_init_struct *iibm)
 
 	hotkey_poll_setup_safe(true);
 
+#ifdef CONFIG_THINKPAD_ACPI_HOTKEY_POLL
+	if (hotkey_source_auto)
+		hotkey_autosrc_start();
+#endif
+
 	/* Enable doubletap by default */
 	tp_features.trackpoint_doubletap = 1;
 
+	/* The event stream is optional, everything else works without it */
+	res = misc_register(&tpacpi_events_miscdev);
+	if (res)
+		pr_err("unable to register /dev/%s: %d\n",
+		       TPACPI_EVENTS_DEVNAME, res);
+	else
+		tpacpi_events_registered = true;
+
+	debugfs_create_file("hotkey_latency", S_IRUSR | S_IWUSR,
+			    tpacpi_debugfs_dir, NULL, &hotkey_latency_fops);
+#ifdef CONFIG_THINKPAD_ACPI_DEBUGFACILITIES
+	debugfs_create_file("hotkey_inject", S_IRUSR | S_IWUSR,
+			    tpacpi_debugfs_dir, NULL, &hotkey_inject_fops);
+#endif
+
 	return 0;
 }
 
@@ -3634,6 +4403,7 @@ static bool hotkey_notify_hotkey(const u32 hkey, bool *send_acpi_ev)
 
 		/* Original hotkeys may be polled from NVRAM instead */
 		unsigned int scancode = hkey - TP_HKEY_EV_ORIG_KEY_START;
+		hotkey_autosrc_note_acpi(scancode);
 		if (hotkey_source_mask & (1 << scancode))
 			return true;
 	}
@@ -3743,6 +4513,10 @@ static bool hotkey_notify_usrevent(const u32 hkey, bool *send_acpi_ev)
 }
 
 static void thermal_dump_all_sensors(void);
+static void thermal_zones_update(void);
+static void fan_cooling_keepalive(void);
+static struct thermal_cooling_device *fan_cooling_dev;
+static void tpacpi_battery_invalidate(void);
 static void palmsensor_refresh(void);
 
 /* 0x6000-0x6FFF: thermal alarms/notices and keyboard events */
@@ -3767,10 +4541,12 @@ static bool hotkey_notify_6xxx(const u32 hkey, bool *send_acpi_ev)
 	case TP_HKEY_EV_ALARM_BAT_HOT:
 		pr_crit("THERMAL ALARM: battery is too hot!\n");
 		/* recommended action: warn user through gui */
+		tpacpi_battery_invalidate();
 		break;
 	case TP_HKEY_EV_ALARM_BAT_XHOT:
 		pr_alert("THERMAL EMERGENCY: battery is extremely hot!\n");
 		/* recommended action: immediate sleep/hibernate */
+		tpacpi_battery_invalidate();
 		break;
 	case TP_HKEY_EV_ALARM_SENSOR_HOT:
 		pr_crit("THERMAL ALARM: a sensor reports something is too hot!\n");
@@ -3786,6 +4562,9 @@ static bool hotkey_notify_6xxx(const u32 hkey, bool *send_acpi_ev)
 		 * AC status changed; can be triggered by plugging or
 		 * unplugging AC adapter, docking or undocking. */
 
+		/* the EC ends inhibit charge/force discharge on AC changes */
+		tpacpi_battery_invalidate();
+
 		fallthrough;
 
 	case TP_HKEY_EV_KEY_NUMLOCK:
@@ -3819,6 +4598,7 @@ static bool hotkey_notify_6xxx(const u32 hkey, bool *send_acpi_ev)
 	}
 
 	thermal_dump_all_sensors();
+	thermal_zones_update();
 	return true;
 }
 
@@ -3835,9 +4615,165 @@ static bool hotkey_notify_8xxx(const u32 hkey, bool *send_acpi_ev)
 	}
 }
 
-static void hotkey_notify(struct ibm_struct *ibm, u32 event)
+/* In-kernel HKEY event subscribers ------------------------------------ */
+
+/*
+ * Other modules can subscribe to ranges of HKEY codes instead of polling.
+ * The list is sorted by priority and walked under SRCU from the drain path,
+ * so subscribers may sleep and registration never blocks event delivery.
+ */
+
+static LIST_HEAD(tpacpi_hkey_notifiers);
+static DEFINE_MUTEX(tpacpi_hkey_notifiers_mutex);
+DEFINE_STATIC_SRCU(tpacpi_hkey_notifiers_srcu);
+
+int tpacpi_register_hkey_notifier(struct tpacpi_hkey_notifier *notifier)
+{
+	struct tpacpi_hkey_notifier *n;
+
+	if (!notifier || !notifier->nb.notifier_call ||
+	    notifier->hkey_first > notifier->hkey_last)
+		return -EINVAL;
+
+	mutex_lock(&tpacpi_hkey_notifiers_mutex);
+
+	list_for_each_entry(n, &tpacpi_hkey_notifiers, list) {
+		if (n->nb.priority < notifier->nb.priority)
+			break;
+	}
+	list_add_tail_rcu(&notifier->list, &n->list);
+
+	mutex_unlock(&tpacpi_hkey_notifiers_mutex);
+
+	dbg_printk(TPACPI_DBG_HKEY,
+		   "subscriber %ps added for events 0x%04x-0x%04x\n",
+		   notifier->nb.notifier_call,
+		   notifier->hkey_first, notifier->hkey_last);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(tpacpi_register_hkey_notifier);
+
+void tpacpi_unregister_hkey_notifier(struct tpacpi_hkey_notifier *notifier)
+{
+	mutex_lock(&tpacpi_hkey_notifiers_mutex);
+	list_del_rcu(&notifier->list);
+	mutex_unlock(&tpacpi_hkey_notifiers_mutex);
+
+	synchronize_srcu(&tpacpi_hkey_notifiers_srcu);
+}
+EXPORT_SYMBOL_GPL(tpacpi_unregister_hkey_notifier);
+
+/* Returns true if a subscriber handled the event */
+static bool tpacpi_hkey_notifiers_call(const u32 hkey)
+{
+	struct tpacpi_hkey_notifier *n;
+	bool handled = false;
+	int idx, rc;
+
+	if (list_empty(&tpacpi_hkey_notifiers))
+		return false;
+
+	idx = srcu_read_lock(&tpacpi_hkey_notifiers_srcu);
+	list_for_each_entry_srcu(n, &tpacpi_hkey_notifiers, list,
+				 srcu_read_lock_held(&tpacpi_hkey_notifiers_srcu)) {
+		if (hkey < n->hkey_first || hkey > n->hkey_last)
+			continue;
+
+		rc = n->nb.notifier_call(&n->nb, hkey, NULL);
+		if ((rc & ~NOTIFY_STOP_MASK) == NOTIFY_OK)
+			handled = true;
+		if (rc & NOTIFY_STOP_MASK)
+			break;
+	}
+	srcu_read_unlock(&tpacpi_hkey_notifiers_srcu, idx);
+
+	return handled;
+}
+
+/* Synthetic HKEY event injection ------------------------------------- */
+
+#ifdef CONFIG_THINKPAD_ACPI_DEBUGFACILITIES
+/*
+ * debugfs hotkey_inject feeds events through hotkey_notify_at() as if the
+ * firmware had queued them, using a mock MHKP queue.  Only the task
+ * running the injection drains the mock queue, real firmware notifications
+ * arriving meanwhile still go to MHKP.
+ *
+ * Injected events go through the same dispatch as firmware events and
+ * show up in /dev/tpacpi_events flagged TPACPI_EVENT_F_INJECTED.  Nothing
+ * is reported on the input device or sent over netlink for them, so an
+ * injected power or sleep key does not put the machine to sleep.
+ */
+
+#define TPACPI_HKEY_INJECT_QUEUE_SIZE	4096
+
+static DEFINE_MUTEX(hotkey_inject_mutex);
+static DEFINE_KFIFO(hotkey_inject_queue, u32, TPACPI_HKEY_INJECT_QUEUE_SIZE);
+static struct task_struct *hotkey_inject_task;
+
+static struct {
+	u64 events;
+	u64 elapsed_ns;
+	u64 fetch_ns;		/* sum of per-event stage costs */
+	u64 handle_ns;
+	u64 deliver_ns;
+} hotkey_inject_stats;
+
+static inline bool hotkey_injecting(void)
+{
+	return unlikely(hotkey_inject_task == current);
+}
+
+static bool hotkey_fetch_event(u32 *hkey)
+{
+	if (hotkey_injecting()) {
+		if (!kfifo_get(&hotkey_inject_queue, hkey))
+			*hkey = 0;	/* queue empty */
+		return true;
+	}
+
+	return acpi_evalf(hkey_handle, hkey, "MHKP", "d");
+}
+
+static void hotkey_inject_account(const u64 fetch_ns, const u64 handle_ns,
+				  const u64 deliver_ns)
+{
+	if (!hotkey_injecting())
+		return;
+
+	hotkey_inject_stats.events++;
+	hotkey_inject_stats.fetch_ns += fetch_ns;
+	hotkey_inject_stats.handle_ns += handle_ns;
+	hotkey_inject_stats.deliver_ns += deliver_ns;
+}
+#else
+static inline bool hotkey_injecting(void)
+{
+	return false;
+}
+
+static inline bool hotkey_fetch_event(u32 *hkey)
+{
+	return acpi_evalf(hkey_handle, hkey, "MHKP", "d");
+}
+
+static inline void hotkey_inject_account(const u64 fetch_ns,
+					 const u64 handle_ns,
+					 const u64 deliver_ns)
+{
+}
+#endif /* CONFIG_THINKPAD_ACPI_DEBUGFACILITIES */
+
+/* notify_ns: CLOCK_MONOTONIC time of the firmware notification */
+static void hotkey_notify_at(struct ibm_struct *ibm, u32 event,
+			     const u64 notify_ns)
 {
 	u32 hkey;
+	u32 batch;
+	u64 timestamp, t_handled, t_delivered;
+	u64 t_prev = notify_ns;
+	bool injected = hotkey_injecting();
 	bool send_acpi_ev;
 	bool known_ev;
 
@@ -3851,8 +4787,11 @@ static void hotkey_notify(struct ibm_struct *ibm, u32 event)
 		return;
 	}
 
+	batch = ++tpacpi_events_batch;
+	trace_tpacpi_hkey_notify(event, batch);
+
 	while (1) {
-		if (!acpi_evalf(hkey_handle, &hkey, "MHKP", "d")) {
+		if (!hotkey_fetch_event(&hkey)) {
 			pr_err("failed to retrieve HKEY event\n");
 			return;
 		}
@@ -3862,6 +4801,9 @@ static void hotkey_notify(struct ibm_struct *ibm, u32 event)
 			return;
 		}
 
+		timestamp = hotkey_lat_mark(hkey, batch, TPACPI_HKEY_LAT_FETCH,
+					    notify_ns);
+
 		send_acpi_ev = true;
 		known_ev = false;
 
@@ -3916,24 +4858,50 @@ static void hotkey_notify(struct ibm_struct *ibm, u32 event)
 			known_ev = hotkey_notify_8xxx(hkey, &send_acpi_ev);
 			break;
 		}
-		if (!known_ev) {
+
+		if (tpacpi_hkey_notifiers_call(hkey))
+			known_ev = true;
+
+		t_handled = hotkey_lat_mark(hkey, batch, TPACPI_HKEY_LAT_HANDLED,
+					    notify_ns);
+
+		if (!known_ev && !injected) {
 			pr_notice("unhandled HKEY event 0x%04x\n", hkey);
 			pr_notice("please report the conditions when this event happened to %s\n",
 				  TPACPI_MAIL);
 		}
 
-		/* netlink events */
-		if (send_acpi_ev) {
+		tpacpi_events_emit(timestamp, hkey, batch,
+				   (known_ev ? TPACPI_EVENT_F_KNOWN : 0) |
+				   (send_acpi_ev ? TPACPI_EVENT_F_NETLINK : 0) |
+				   (injected ? TPACPI_EVENT_F_INJECTED : 0));
+
+		/* netlink events, none for injected ones */
+		if (send_acpi_ev && !injected) {
 			acpi_bus_generate_netlink_event(
 					ibm->acpi->device->pnp.device_class,
 					dev_name(&ibm->acpi->device->dev),
 					event, hkey);
 		}
+
+		t_delivered = hotkey_lat_mark(hkey, batch,
+					      TPACPI_HKEY_LAT_DELIVERED, notify_ns);
+
+		hotkey_inject_account(timestamp - t_prev, t_handled - timestamp,
+				      t_delivered - t_handled);
+		t_prev = t_delivered;
 	}
 }
 
+static void hotkey_notify(struct ibm_struct *ibm, u32 event)
+{
+	hotkey_notify_at(ibm, event, ktime_get_ns());
+}
+
 static void hotkey_suspend(void)
 {
+	hotkey_autosrc_stop_sync();
+
 	/* Do these on suspend, we get the events on early resume! */
 	hotkey_wakeup_reason = TP_ACPI_WAKEUP_NONE;
 	hotkey_autosleep_ack = 0;
@@ -3964,6 +4932,12 @@ static void hotkey_resume(void)
 	hotkey_wakeup_hotunplug_complete_notify_change();
 	hotkey_poll_setup_safe(false);
 
+#ifdef CONFIG_THINKPAD_ACPI_HOTKEY_POLL
+	/* NVRAM levels may have changed while asleep */
+	if (hotkey_source_auto)
+		hotkey_autosrc_start();
+#endif
+
 	/* restore previous mode of adapive keyboard of X1 Carbon */
 	if (tp_features.has_adaptive_kbd) {
 		if (!acpi_evalf(hkey_handle, NULL, "STRW", "vd",
@@ -4081,15 +5055,165 @@ static struct ibm_struct hotkey_driver_data = {
 	.acpi = &ibm_hotkey_acpidriver,
 };
 
-/*************************************************************************
- * Bluetooth subdriver
- */
+#ifdef CONFIG_THINKPAD_ACPI_DEBUGFACILITIES
+/* debugfs hotkey_inject ----------------------------------------------- */
 
-enum {
-	/* ACPI GBDC/SBDC bits */
-	TP_ACPI_BLUETOOTH_HWPRESENT	= 0x01,	/* Bluetooth hw available */
-	TP_ACPI_BLUETOOTH_RADIOSSW	= 0x02,	/* Bluetooth radio enabled */
-	TP_ACPI_BLUETOOTH_RESUMECTRL	= 0x04,	/* Bluetooth state at resume:
+static void hotkey_inject_notify(void)
+{
+	hotkey_notify_at(&hotkey_driver_data, 0x80, ktime_get_ns());
+}
+
+/* count events of hkey, at rate events/s or as fast as possible if 0 */
+static int hotkey_inject_generate(const unsigned int count, const u32 hkey,
+				  const unsigned int rate)
+{
+	u64 start = ktime_get_ns();
+	u64 deadline, now;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+
+		kfifo_put(&hotkey_inject_queue, hkey);
+		hotkey_inject_notify();
+
+		if (rate) {
+			deadline = start + div_u64((u64)(i + 1) * NSEC_PER_SEC,
+						   rate);
+			now = ktime_get_ns();
+			if (deadline > now)
+				fsleep(div_u64(deadline - now, NSEC_PER_USEC));
+		} else {
+			cond_resched();
+		}
+	}
+
+	return 0;
+}
+
+static int hotkey_inject_show(struct seq_file *m, void *v)
+{
+	u64 events, elapsed;
+
+	mutex_lock(&hotkey_inject_mutex);
+	events = hotkey_inject_stats.events;
+	elapsed = hotkey_inject_stats.elapsed_ns;
+
+	seq_printf(m, "events:\t\t%llu\n", events);
+	seq_printf(m, "elapsed:\t%llu ns\n", elapsed);
+	if (events && elapsed) {
+		seq_printf(m, "rate:\t\t%llu events/s\n",
+			   div64_u64(events * NSEC_PER_SEC, elapsed));
+		seq_printf(m, "fetch:\t\t%llu ns/event\n",
+			   div64_u64(hotkey_inject_stats.fetch_ns, events));
+		seq_printf(m, "handle:\t\t%llu ns/event\n",
+			   div64_u64(hotkey_inject_stats.handle_ns, events));
+		seq_printf(m, "deliver:\t%llu ns/event\n",
+			   div64_u64(hotkey_inject_stats.deliver_ns, events));
+	}
+	mutex_unlock(&hotkey_inject_mutex);
+
+	seq_printf(m, "commands:\t<hkey>[,<hkey>...], gen <count> <hkey> <rate>\n");
+
+	return 0;
+}
+
+static int hotkey_inject_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hotkey_inject_show, NULL);
+}
+
+/*
+ * "<hkey>[,<hkey>...]" queues the codes and drains them in one batch,
+ * "gen <count> <hkey> <rate>" issues count single-event notifications
+ * at rate Hz (0: as fast as possible).
+ */
+static ssize_t hotkey_inject_write(struct file *file,
+				   const char __user *userbuf,
+				   size_t count, loff_t *pos)
+{
+	unsigned int n, rate;
+	char *kernbuf, *buf, *cmd;
+	u32 hkey;
+	u64 start;
+	int rc = 0;
+
+	if (tpacpi_lifecycle != TPACPI_LIFE_RUNNING ||
+	    !ibm_hotkey_acpidriver.device)
+		return -ENODEV;
+	if (count > PAGE_SIZE - 1)
+		return -EINVAL;
+
+	kernbuf = memdup_user_nul(userbuf, count);
+	if (IS_ERR(kernbuf))
+		return PTR_ERR(kernbuf);
+
+	if (mutex_lock_killable(&hotkey_inject_mutex)) {
+		kfree(kernbuf);
+		return -ERESTARTSYS;
+	}
+
+	kfifo_reset(&hotkey_inject_queue);
+	memset(&hotkey_inject_stats, 0, sizeof(hotkey_inject_stats));
+	hotkey_inject_task = current;
+	start = ktime_get_ns();
+
+	buf = strim(kernbuf);
+	if (sscanf(buf, "gen %u %x %u", &n, &hkey, &rate) == 3) {
+		if (hkey)
+			rc = hotkey_inject_generate(n, hkey, rate);
+		else
+			rc = -EINVAL;
+	} else {
+		while ((cmd = strsep(&buf, ", \n"))) {
+			if (!*cmd)
+				continue;
+			if (kstrtou32(cmd, 16, &hkey) || !hkey) {
+				rc = -EINVAL;
+				break;
+			}
+			if (!kfifo_put(&hotkey_inject_queue, hkey)) {
+				rc = -ENOSPC;
+				break;
+			}
+		}
+		if (!rc)
+			hotkey_inject_notify();
+	}
+
+	hotkey_inject_stats.elapsed_ns = ktime_get_ns() - start;
+	hotkey_inject_task = NULL;
+	kfifo_reset(&hotkey_inject_queue);
+
+	tpacpi_disclose_usertask("hotkey_inject", "injected %llu events\n",
+				 hotkey_inject_stats.events);
+
+	mutex_unlock(&hotkey_inject_mutex);
+	kfree(kernbuf);
+
+	return (rc) ? rc : count;
+}
+
+static const struct file_operations hotkey_inject_fops = {
+	.owner = THIS_MODULE,
+	.open = hotkey_inject_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = hotkey_inject_write,
+};
+#endif /* CONFIG_THINKPAD_ACPI_DEBUGFACILITIES */
+
+/*************************************************************************
+ * Bluetooth subdriver
+ */
+
+enum {
+	/* ACPI GBDC/SBDC bits */
+	TP_ACPI_BLUETOOTH_HWPRESENT	= 0x01,	/* Bluetooth hw available */
+	TP_ACPI_BLUETOOTH_RADIOSSW	= 0x02,	/* Bluetooth radio enabled */
+	TP_ACPI_BLUETOOTH_RESUMECTRL	= 0x04,	/* Bluetooth state at resume:
 						   0 = disable, 1 = enable */
 };
 
@@ -6329,157 +7453,701 @@ static const struct attribute_group thermal_attr_group = {
 #undef THERMAL_SENSOR_ATTR_TEMP
 #undef THERMAL_ATTRS
 
-static ssize_t temp1_label_show(struct device *dev, struct device_attribute *attr, char *buf)
+/* Background sampler -------------------------------------------------- */
+
+/*
+ * When enabled through update_interval, a single work item reads all
+ * sensors into a fixed-size ring, from which the rolling lowest, highest
+ * and average temperatures of each sensor are computed.  The raw ring is
+ * available in debugfs as thermal_history, as an array of
+ * struct tpacpi_thermal_sample, oldest first.
+ */
+
+#define TPACPI_THERMAL_HISTORY_LEN	64	/* samples per sensor */
+#define TPACPI_THERMAL_MIN_INTERVAL	100	/* ms */
+#define TPACPI_THERMAL_MAX_INTERVAL	60000	/* ms */
+
+/* struct tpacpi_thermal_sample is in thinkpad_acpi.h, it is ABI */
+static_assert(sizeof_field(struct tpacpi_thermal_sample, temp) ==
+	      TPACPI_MAX_THERMAL_SENSORS * sizeof(s32));
+static_assert(TPACPI_THERMAL_SENSOR_NA == TPACPI_THERMAL_SAMPLE_NA);
+
+static struct {
+	struct tpacpi_thermal_sample ring[TPACPI_THERMAL_HISTORY_LEN];
+	unsigned int head;	/* next slot to write */
+	unsigned int count;	/* valid slots */
+} thermal_history;
+static DEFINE_MUTEX(thermal_history_mutex);
+
+static unsigned int thermal_sample_interval;	/* ms, 0 = disabled */
+
+static void thermal_sampler_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(thermal_sampler_work, thermal_sampler_worker);
+
+static void fan_prespin_sample(int temp, u64 timestamp_ns);
+
+static void thermal_sampler_worker(struct work_struct *work)
 {
-	return sysfs_emit(buf, "CPU\n");
+	const unsigned int interval = READ_ONCE(thermal_sample_interval);
+	struct ibm_thermal_sensors_struct t;
+	struct tpacpi_thermal_sample *smp;
+	int i, hottest = TPACPI_THERMAL_SENSOR_NA;
+	u64 now;
+
+	if (!interval || tpacpi_lifecycle == TPACPI_LIFE_EXITING)
+		return;
+
+	for (i = 0; i < TPACPI_MAX_THERMAL_SENSORS; i++)
+		t.temp[i] = TPACPI_THERMAL_SENSOR_NA;
+
+	if (thermal_get_sensors(&t) > 0) {
+		now = ktime_get_ns();
+
+		mutex_lock(&thermal_history_mutex);
+		smp = &thermal_history.ring[thermal_history.head];
+		smp->timestamp_ns = now;
+		memcpy(smp->temp, t.temp, sizeof(smp->temp));
+		thermal_history.head = (thermal_history.head + 1) %
+					TPACPI_THERMAL_HISTORY_LEN;
+		if (thermal_history.count < TPACPI_THERMAL_HISTORY_LEN)
+			thermal_history.count++;
+		mutex_unlock(&thermal_history_mutex);
+
+		for (i = 0; i < TPACPI_MAX_THERMAL_SENSORS; i++)
+			hottest = max(hottest, t.temp[i]);
+		if (hottest != TPACPI_THERMAL_SENSOR_NA)
+			fan_prespin_sample(hottest, now);
+	}
+
+	queue_delayed_work(tpacpi_wq, &thermal_sampler_work,
+			   msecs_to_jiffies(interval));
 }
-static DEVICE_ATTR_RO(temp1_label);
 
-static ssize_t temp2_label_show(struct device *dev, struct device_attribute *attr, char *buf)
+static void thermal_history_reset(void)
 {
-	return sysfs_emit(buf, "GPU\n");
+	mutex_lock(&thermal_history_mutex);
+	thermal_history.head = 0;
+	thermal_history.count = 0;
+	mutex_unlock(&thermal_history_mutex);
 }
-static DEVICE_ATTR_RO(temp2_label);
 
-static struct attribute *temp_label_attributes[] = {
-	&dev_attr_temp1_label.attr,
-	&dev_attr_temp2_label.attr,
-	NULL
+enum thermal_history_stat {
+	TPACPI_THERMAL_HIST_HIGHEST,
+	TPACPI_THERMAL_HIST_LOWEST,
+	TPACPI_THERMAL_HIST_AVERAGE,
 };
 
-static umode_t temp_label_attr_is_visible(struct kobject *kobj,
-					  struct attribute *attr, int n)
+static int thermal_history_get(const int idx,
+			       const enum thermal_history_stat stat,
+			       s32 *value)
 {
-	return thermal_use_labels ? attr->mode : 0;
-}
+	s32 lowest = S32_MAX, highest = S32_MIN, v;
+	unsigned int i, n = 0;
+	s64 sum = 0;
 
-static const struct attribute_group temp_label_attr_group = {
-	.is_visible = temp_label_attr_is_visible,
-	.attrs = temp_label_attributes,
-};
+	mutex_lock(&thermal_history_mutex);
+	for (i = 0; i < thermal_history.count; i++) {
+		v = thermal_history.ring[i].temp[idx];
+		if (v == TPACPI_THERMAL_SENSOR_NA)
+			continue;
+		lowest = min(lowest, v);
+		highest = max(highest, v);
+		sum += v;
+		n++;
+	}
+	mutex_unlock(&thermal_history_mutex);
 
-/* --------------------------------------------------------------------- */
+	if (!n)
+		return -ENODATA;
 
-static int __init thermal_init(struct ibm_init_struct *iibm)
+	switch (stat) {
+	case TPACPI_THERMAL_HIST_HIGHEST:
+		*value = highest;
+		break;
+	case TPACPI_THERMAL_HIST_LOWEST:
+		*value = lowest;
+		break;
+	default:
+		*value = div_s64(sum, n);
+		break;
+	}
+
+	return 0;
+}
+
+static ssize_t thermal_temp_history_show(struct device_attribute *attr,
+					 const enum thermal_history_stat stat,
+					 char *buf)
 {
-	vdbg_printk(TPACPI_DBG_INIT, "initializing thermal subdriver\n");
+	struct sensor_device_attribute *sensor_attr =
+					to_sensor_dev_attr(attr);
+	s32 value;
+	int res;
 
-	thermal_read_mode = thermal_read_mode_check();
+	res = thermal_history_get(sensor_attr->index, stat, &value);
+	if (res)
+		return res;
 
-	vdbg_printk(TPACPI_DBG_INIT, "thermal is %s, mode %d\n",
-		str_supported(thermal_read_mode != TPACPI_THERMAL_NONE),
-		thermal_read_mode);
+	return sysfs_emit(buf, "%d\n", value);
+}
 
-	return thermal_read_mode != TPACPI_THERMAL_NONE ? 0 : -ENODEV;
+/* sysfs temp##_highest ------------------------------------------------ */
+static ssize_t thermal_temp_highest_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	return thermal_temp_history_show(attr, TPACPI_THERMAL_HIST_HIGHEST, buf);
 }
 
-static int thermal_read(struct seq_file *m)
+/* sysfs temp##_lowest ------------------------------------------------- */
+static ssize_t thermal_temp_lowest_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
 {
-	int n, i;
-	struct ibm_thermal_sensors_struct t;
+	return thermal_temp_history_show(attr, TPACPI_THERMAL_HIST_LOWEST, buf);
+}
 
-	n = thermal_get_sensors(&t);
-	if (unlikely(n < 0))
-		return n;
+/* sysfs temp##_average ------------------------------------------------ */
+static ssize_t thermal_temp_average_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	return thermal_temp_history_show(attr, TPACPI_THERMAL_HIST_AVERAGE, buf);
+}
+
+#define THERMAL_SENSOR_ATTR_HISTORY(_idxA, _idxB) \
+	SENSOR_ATTR(temp##_idxA##_highest, S_IRUGO, \
+		    thermal_temp_highest_show, NULL, _idxB), \
+	SENSOR_ATTR(temp##_idxA##_lowest, S_IRUGO, \
+		    thermal_temp_lowest_show, NULL, _idxB), \
+	SENSOR_ATTR(temp##_idxA##_average, S_IRUGO, \
+		    thermal_temp_average_show, NULL, _idxB)
+
+static struct sensor_device_attribute sensor_dev_attr_thermal_temp_history[] = {
+	THERMAL_SENSOR_ATTR_HISTORY(1, 0),
+	THERMAL_SENSOR_ATTR_HISTORY(2, 1),
+	THERMAL_SENSOR_ATTR_HISTORY(3, 2),
+	THERMAL_SENSOR_ATTR_HISTORY(4, 3),
+	THERMAL_SENSOR_ATTR_HISTORY(5, 4),
+	THERMAL_SENSOR_ATTR_HISTORY(6, 5),
+	THERMAL_SENSOR_ATTR_HISTORY(7, 6),
+	THERMAL_SENSOR_ATTR_HISTORY(8, 7),
+	THERMAL_SENSOR_ATTR_HISTORY(9, 8),
+	THERMAL_SENSOR_ATTR_HISTORY(10, 9),
+	THERMAL_SENSOR_ATTR_HISTORY(11, 10),
+	THERMAL_SENSOR_ATTR_HISTORY(12, 11),
+	THERMAL_SENSOR_ATTR_HISTORY(13, 12),
+	THERMAL_SENSOR_ATTR_HISTORY(14, 13),
+	THERMAL_SENSOR_ATTR_HISTORY(15, 14),
+	THERMAL_SENSOR_ATTR_HISTORY(16, 15),
+};
 
-	seq_printf(m, "temperatures:\t");
+#define THERMAL_HISTORY_ATTRS(X) \
+	&sensor_dev_attr_thermal_temp_history[3 * (X)].dev_attr.attr, \
+	&sensor_dev_attr_thermal_temp_history[3 * (X) + 1].dev_attr.attr, \
+	&sensor_dev_attr_thermal_temp_history[3 * (X) + 2].dev_attr.attr
+
+static struct attribute *thermal_temp_history_attr[] = {
+	THERMAL_HISTORY_ATTRS(0),
+	THERMAL_HISTORY_ATTRS(1),
+	THERMAL_HISTORY_ATTRS(2),
+	THERMAL_HISTORY_ATTRS(3),
+	THERMAL_HISTORY_ATTRS(4),
+	THERMAL_HISTORY_ATTRS(5),
+	THERMAL_HISTORY_ATTRS(6),
+	THERMAL_HISTORY_ATTRS(7),
+	THERMAL_HISTORY_ATTRS(8),
+	THERMAL_HISTORY_ATTRS(9),
+	THERMAL_HISTORY_ATTRS(10),
+	THERMAL_HISTORY_ATTRS(11),
+	THERMAL_HISTORY_ATTRS(12),
+	THERMAL_HISTORY_ATTRS(13),
+	THERMAL_HISTORY_ATTRS(14),
+	THERMAL_HISTORY_ATTRS(15),
+	NULL
+};
 
-	if (n > 0) {
-		for (i = 0; i < (n - 1); i++)
-			seq_printf(m, "%d ", t.temp[i] / 1000);
-		seq_printf(m, "%d\n", t.temp[i] / 1000);
-	} else
-		seq_printf(m, "not supported\n");
+static const struct attribute_group thermal_history_attr_group = {
+	.is_visible = thermal_attr_is_visible,
+	.attrs = thermal_temp_history_attr,
+};
 
-	return 0;
+#undef THERMAL_SENSOR_ATTR_HISTORY
+#undef THERMAL_HISTORY_ATTRS
+
+/* sysfs update_interval ----------------------------------------------- */
+static ssize_t update_interval_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	return sysfs_emit(buf, "%u\n", thermal_sample_interval);
 }
 
-static struct ibm_struct thermal_driver_data = {
-	.name = "thermal",
-	.read = thermal_read,
-};
+static ssize_t update_interval_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	unsigned long t;
 
-/*************************************************************************
- * Backlight/brightness subdriver
- */
+	if (parse_strtoul(buf, TPACPI_THERMAL_MAX_INTERVAL, &t) ||
+	    (t && t < TPACPI_THERMAL_MIN_INTERVAL))
+		return -EINVAL;
 
-#define TPACPI_BACKLIGHT_DEV_NAME "thinkpad_screen"
+	WRITE_ONCE(thermal_sample_interval, t);
+	if (t)
+		mod_delayed_work(tpacpi_wq, &thermal_sampler_work, 0);
+	else
+		cancel_delayed_work_sync(&thermal_sampler_work);
 
-/*
- * ThinkPads can read brightness from two places: EC HBRV (0x31), or
- * CMOS NVRAM byte 0x5E, bits 0-3.
- *
- * EC HBRV (0x31) has the following layout
- *   Bit 7: unknown function
- *   Bit 6: unknown function
- *   Bit 5: Z: honour scale changes, NZ: ignore scale changes
- *   Bit 4: must be set to zero to avoid problems
- *   Bit 3-0: backlight brightness level
- *
- * brightness_get_raw returns status data in the HBRV layout
- *
- * WARNING: The X61 has been verified to use HBRV for something else, so
- * this should be used _only_ on IBM ThinkPads, and maybe with some careful
- * testing on the very early *60 Lenovo models...
- */
+	tpacpi_disclose_usertask("update_interval", "set to %lu\n", t);
 
-enum {
-	TP_EC_BACKLIGHT = 0x31,
+	return count;
+}
+static DEVICE_ATTR_RW(update_interval);
 
-	/* TP_EC_BACKLIGHT bitmasks */
-	TP_EC_BACKLIGHT_LVLMSK = 0x1F,
-	TP_EC_BACKLIGHT_CMDMSK = 0xE0,
-	TP_EC_BACKLIGHT_MAPSW = 0x20,
-};
+/* sysfs reset_history ------------------------------------------------- */
+static ssize_t reset_history_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	unsigned long t;
 
-enum tpacpi_brightness_access_mode {
-	TPACPI_BRGHT_MODE_AUTO = 0,	/* Not implemented yet */
-	TPACPI_BRGHT_MODE_EC,		/* EC control */
-	TPACPI_BRGHT_MODE_UCMS_STEP,	/* UCMS step-based control */
-	TPACPI_BRGHT_MODE_ECNVRAM,	/* EC control w/ NVRAM store */
-	TPACPI_BRGHT_MODE_MAX
+	if (parse_strtoul(buf, 1, &t) || !t)
+		return -EINVAL;
+
+	thermal_history_reset();
+
+	return count;
+}
+static DEVICE_ATTR_WO(reset_history);
+
+static struct attribute *thermal_sampler_attributes[] = {
+	&dev_attr_update_interval.attr,
+	&dev_attr_reset_history.attr,
+	NULL
 };
 
-static struct backlight_device *ibm_backlight_device;
+static umode_t thermal_sampler_attr_is_visible(struct kobject *kobj,
+					       struct attribute *attr, int n)
+{
+	return thermal_read_mode != TPACPI_THERMAL_NONE ? attr->mode : 0;
+}
 
-static enum tpacpi_brightness_access_mode brightness_mode =
-		TPACPI_BRGHT_MODE_MAX;
+static const struct attribute_group thermal_sampler_attr_group = {
+	.is_visible = thermal_sampler_attr_is_visible,
+	.attrs = thermal_sampler_attributes,
+};
 
-static unsigned int brightness_enable = 2; /* 2 = auto, 0 = no, 1 = yes */
+/* debugfs thermal_history --------------------------------------------- */
 
-static struct mutex brightness_mutex;
+struct thermal_history_dump {
+	size_t len;
+	struct tpacpi_thermal_sample samples[TPACPI_THERMAL_HISTORY_LEN];
+};
 
-/* NVRAM brightness access */
-static unsigned int tpacpi_brightness_nvram_get(void)
+static int thermal_history_dump_open(struct inode *inode, struct file *file)
 {
-	u8 lnvram;
+	struct thermal_history_dump *dump;
+	unsigned int i, first;
 
-	lockdep_assert_held(&brightness_mutex);
+	dump = kmalloc(sizeof(*dump), GFP_KERNEL);
+	if (!dump)
+		return -ENOMEM;
 
-	lnvram = (nvram_read_byte(TP_NVRAM_ADDR_BRIGHTNESS)
-		  & TP_NVRAM_MASK_LEVEL_BRIGHTNESS)
-		  >> TP_NVRAM_POS_LEVEL_BRIGHTNESS;
-	lnvram &= bright_maxlvl;
+	mutex_lock(&thermal_history_mutex);
+	first = (thermal_history.head + TPACPI_THERMAL_HISTORY_LEN -
+		 thermal_history.count) % TPACPI_THERMAL_HISTORY_LEN;
+	for (i = 0; i < thermal_history.count; i++)
+		dump->samples[i] = thermal_history.ring[
+				(first + i) % TPACPI_THERMAL_HISTORY_LEN];
+	dump->len = thermal_history.count * sizeof(dump->samples[0]);
+	mutex_unlock(&thermal_history_mutex);
 
-	return lnvram;
+	file->private_data = dump;
+
+	return 0;
 }
 
-static void tpacpi_brightness_checkpoint_nvram(void)
+static ssize_t thermal_history_dump_read(struct file *file, char __user *buf,
+					 size_t count, loff_t *ppos)
 {
-	u8 lec = 0;
-	u8 b_nvram;
+	struct thermal_history_dump *dump = file->private_data;
 
-	if (brightness_mode != TPACPI_BRGHT_MODE_ECNVRAM)
-		return;
+	return simple_read_from_buffer(buf, count, ppos,
+				       dump->samples, dump->len);
+}
 
-	vdbg_printk(TPACPI_DBG_BRGHT,
-		"trying to checkpoint backlight level to NVRAM...\n");
+static int thermal_history_dump_release(struct inode *inode,
+					struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations thermal_history_dump_fops = {
+	.owner = THIS_MODULE,
+	.open = thermal_history_dump_open,
+	.read = thermal_history_dump_read,
+	.llseek = default_llseek,
+	.release = thermal_history_dump_release,
+};
+
+/* --------------------------------------------------------------------- */
+
+static ssize_t temp1_label_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "CPU\n");
+}
+static DEVICE_ATTR_RO(temp1_label);
+
+static ssize_t temp2_label_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "GPU\n");
+}
+static DEVICE_ATTR_RO(temp2_label);
+
+static struct attribute *temp_label_attributes[] = {
+	&dev_attr_temp1_label.attr,
+	&dev_attr_temp2_label.attr,
+	NULL
+};
+
+static umode_t temp_label_attr_is_visible(struct kobject *kobj,
+					  struct attribute *attr, int n)
+{
+	return thermal_use_labels ? attr->mode : 0;
+}
+
+static const struct attribute_group temp_label_attr_group = {
+	.is_visible = temp_label_attr_is_visible,
+	.attrs = temp_label_attributes,
+};
+
+/* Thermal zones ------------------------------------------------------- */
+
+/*
+ * With thermal_zones=1, every sensor that reads a valid temperature at
+ * load time becomes a thermal zone "tpacpi-tempN" (N as in hwmon), with
+ * a passive and a hot trip point that can be changed in sysfs.  The zones
+ * are polled slowly; the firmware thermal alarms force an update.
+ */
+
+#define TPACPI_THERMAL_ZONE_PASSIVE_DELAY	1000	/* ms */
+
+static bool thermal_zones_enable;
+static int thermal_zone_passive = 90000;	/* millidegrees */
+static int thermal_zone_hot = 100000;		/* millidegrees */
+static unsigned int thermal_zone_poll = 30000;	/* ms */
+
+struct tpacpi_thermal_zone {
+	struct thermal_zone_device *tzd;
+	int idx;
+};
+
+static struct tpacpi_thermal_zone thermal_zones[TPACPI_MAX_THERMAL_SENSORS];
+/* the HKEY notify handler outlives the zones on unload */
+static DEFINE_MUTEX(thermal_zones_mutex);
+
+static int thermal_zone_get_temp(struct thermal_zone_device *tzd, int *temp)
+{
+	struct tpacpi_thermal_zone *tz = thermal_zone_device_priv(tzd);
+	s32 value;
+	int res;
+
+	res = thermal_get_sensor(tz->idx, &value);
+	if (res)
+		return res;
+	if (value == TPACPI_THERMAL_SENSOR_NA)
+		return -ENODATA;
+
+	*temp = value;
+	fan_cooling_keepalive();
+
+	return 0;
+}
+
+/* The fan cools the passive trip of every zone */
+static int thermal_zone_bind(struct thermal_zone_device *tzd,
+			     struct thermal_cooling_device *cdev)
+{
+	if (cdev != fan_cooling_dev)
+		return 0;
+
+	return thermal_zone_bind_cooling_device(tzd, 0, cdev,
+						THERMAL_NO_LIMIT,
+						THERMAL_NO_LIMIT,
+						THERMAL_WEIGHT_DEFAULT);
+}
+
+static int thermal_zone_unbind(struct thermal_zone_device *tzd,
+			       struct thermal_cooling_device *cdev)
+{
+	if (cdev != fan_cooling_dev)
+		return 0;
+
+	return thermal_zone_unbind_cooling_device(tzd, 0, cdev);
+}
+
+static void thermal_zone_hot_trip(struct thermal_zone_device *tzd)
+{
+	pr_crit("thermal zone %s crossed its hot trip point\n",
+		thermal_zone_device_type(tzd));
+}
+
+static const struct thermal_zone_device_ops thermal_zone_ops = {
+	.get_temp = thermal_zone_get_temp,
+	.bind = thermal_zone_bind,
+	.unbind = thermal_zone_unbind,
+	.hot = thermal_zone_hot_trip,
+};
+
+static void thermal_zones_update(void)
+{
+	int i;
+
+	mutex_lock(&thermal_zones_mutex);
+	for (i = 0; i < ARRAY_SIZE(thermal_zones); i++)
+		if (thermal_zones[i].tzd)
+			thermal_zone_device_update(thermal_zones[i].tzd,
+						   THERMAL_EVENT_UNSPECIFIED);
+	mutex_unlock(&thermal_zones_mutex);
+}
+
+static void thermal_zones_unregister(void)
+{
+	int i;
+
+	mutex_lock(&thermal_zones_mutex);
+	for (i = 0; i < ARRAY_SIZE(thermal_zones); i++) {
+		if (thermal_zones[i].tzd)
+			thermal_zone_device_unregister(thermal_zones[i].tzd);
+		thermal_zones[i].tzd = NULL;
+	}
+	mutex_unlock(&thermal_zones_mutex);
+}
+
+static void __init thermal_zones_register(void)
+{
+	static const struct thermal_zone_params tzp = {
+		.no_hwmon = true,	/* already covered by our hwmon device */
+	};
+	struct thermal_trip trips[] = {
+		{
+			.type = THERMAL_TRIP_PASSIVE,
+			.temperature = thermal_zone_passive,
+			.hysteresis = 2000,
+			.flags = THERMAL_TRIP_FLAG_RW_TEMP,
+		},
+		{
+			.type = THERMAL_TRIP_HOT,
+			.temperature = thermal_zone_hot,
+			.flags = THERMAL_TRIP_FLAG_RW_TEMP,
+		},
+	};
+	struct ibm_thermal_sensors_struct t;
+	struct thermal_zone_device *tzd;
+	char type[THERMAL_NAME_LENGTH];
+	int i, n, rc;
+
+	n = thermal_get_sensors(&t);
+	for (i = 0; i < n; i++) {
+		if (t.temp[i] == TPACPI_THERMAL_SENSOR_NA)
+			continue;
+
+		snprintf(type, sizeof(type), "tpacpi-temp%d", i + 1);
+		thermal_zones[i].idx = i;
+		tzd = thermal_zone_device_register_with_trips(type,
+				trips, ARRAY_SIZE(trips), &thermal_zones[i],
+				&thermal_zone_ops, &tzp,
+				TPACPI_THERMAL_ZONE_PASSIVE_DELAY,
+				thermal_zone_poll);
+		if (IS_ERR(tzd)) {
+			pr_err("unable to register thermal zone %s: %ld\n",
+			       type, PTR_ERR(tzd));
+			continue;
+		}
+
+		rc = thermal_zone_device_enable(tzd);
+		if (rc) {
+			pr_err("unable to enable thermal zone %s: %d\n",
+			       type, rc);
+			thermal_zone_device_unregister(tzd);
+			continue;
+		}
+
+		mutex_lock(&thermal_zones_mutex);
+		thermal_zones[i].tzd = tzd;
+		mutex_unlock(&thermal_zones_mutex);
+	}
+}
+
+/* --------------------------------------------------------------------- */
+
+static int __init thermal_init(struct ibm_init_struct *iibm)
+{
+	vdbg_printk(TPACPI_DBG_INIT, "initializing thermal subdriver\n");
+
+	thermal_read_mode = thermal_read_mode_check();
+
+	vdbg_printk(TPACPI_DBG_INIT, "thermal is %s, mode %d\n",
+		str_supported(thermal_read_mode != TPACPI_THERMAL_NONE),
+		thermal_read_mode);
+
+	if (thermal_read_mode == TPACPI_THERMAL_NONE)
+		return -ENODEV;
+
+	if (thermal_sample_interval)
+		thermal_sample_interval = clamp_t(unsigned int,
+						  thermal_sample_interval,
+						  TPACPI_THERMAL_MIN_INTERVAL,
+						  TPACPI_THERMAL_MAX_INTERVAL);
+	if (thermal_sample_interval)
+		queue_delayed_work(tpacpi_wq, &thermal_sampler_work, 0);
+
+	debugfs_create_file("thermal_history", S_IRUSR, tpacpi_debugfs_dir,
+			    NULL, &thermal_history_dump_fops);
+
+	if (thermal_zones_enable)
+		thermal_zones_register();
+
+	return 0;
+}
+
+static void thermal_exit(void)
+{
+	thermal_zones_unregister();
+	cancel_delayed_work_sync(&thermal_sampler_work);
+}
+
+static void thermal_suspend(void)
+{
+	cancel_delayed_work_sync(&thermal_sampler_work);
+}
+
+static void thermal_resume(void)
+{
+	if (thermal_sample_interval)
+		queue_delayed_work(tpacpi_wq, &thermal_sampler_work, 0);
+}
+
+static int thermal_read(struct seq_file *m)
+{
+	int n, i;
+	struct ibm_thermal_sensors_struct t;
+
+	n = thermal_get_sensors(&t);
+	if (unlikely(n < 0))
+		return n;
+
+	seq_printf(m, "temperatures:\t");
+
+	if (n > 0) {
+		for (i = 0; i < (n - 1); i++)
+			seq_printf(m, "%d ", t.temp[i] / 1000);
+		seq_printf(m, "%d\n", t.temp[i] / 1000);
+	} else
+		seq_printf(m, "not supported\n");
+
+	return 0;
+}
+
+static struct ibm_struct thermal_driver_data = {
+	.name = "thermal",
+	.read = thermal_read,
+	.exit = thermal_exit,
+	.suspend = thermal_suspend,
+	.resume = thermal_resume,
+};
+
+/*************************************************************************
+ * Backlight/brightness subdriver
+ */
+
+#define TPACPI_BACKLIGHT_DEV_NAME "thinkpad_screen"
+
+/*
+ * ThinkPads can read brightness from two places: EC HBRV (0x31), or
+ * CMOS NVRAM byte 0x5E, bits 0-3.
+ *
+ * EC HBRV (0x31) has the following layout
+ *   Bit 7: unknown function
+ *   Bit 6: unknown function
+ *   Bit 5: Z: honour scale changes, NZ: ignore scale changes
+ *   Bit 4: must be set to zero to avoid problems
+ *   Bit 3-0: backlight brightness level
+ *
+ * brightness_get_raw returns status data in the HBRV layout
+ *
+ * WARNING: The X61 has been verified to use HBRV for something else, so
+ * this should be used _only_ on IBM ThinkPads, and maybe with some careful
+ * testing on the very early *60 Lenovo models...
+ */
+
+enum {
+	TP_EC_BACKLIGHT = 0x31,
+
+	/* TP_EC_BACKLIGHT bitmasks */
+	TP_EC_BACKLIGHT_LVLMSK = 0x1F,
+	TP_EC_BACKLIGHT_CMDMSK = 0xE0,
+	TP_EC_BACKLIGHT_MAPSW = 0x20,
+};
+
+enum tpacpi_brightness_access_mode {
+	TPACPI_BRGHT_MODE_AUTO = 0,	/* Not implemented yet */
+	TPACPI_BRGHT_MODE_EC,		/* EC control */
+	TPACPI_BRGHT_MODE_UCMS_STEP,	/* UCMS step-based control */
+	TPACPI_BRGHT_MODE_ECNVRAM,	/* EC control w/ NVRAM store */
+	TPACPI_BRGHT_MODE_MAX
+};
+
+static struct backlight_device *ibm_backlight_device;
+
+static enum tpacpi_brightness_access_mode brightness_mode =
+		TPACPI_BRGHT_MODE_MAX;
+
+static unsigned int brightness_enable = 2; /* 2 = auto, 0 = no, 1 = yes */
+
+static bool brightness_ucms_direct;
+
+static struct mutex brightness_mutex;
+
+/* NVRAM brightness access */
+static unsigned int tpacpi_brightness_nvram_get(void)
+{
+	u8 lnvram;
+
+	lockdep_assert_held(&brightness_mutex);
+
+	lnvram = (nvram_read_byte(TP_NVRAM_ADDR_BRIGHTNESS)
+		  & TP_NVRAM_MASK_LEVEL_BRIGHTNESS)
+		  >> TP_NVRAM_POS_LEVEL_BRIGHTNESS;
+	lnvram &= bright_maxlvl;
+
+	return lnvram;
+}
+
+static int tpacpi_brightness_checkpoint_nvram(void)
+{
+	u8 lec = 0;
+	u8 b_nvram;
+	int rc = 0;
+
+	if (brightness_mode != TPACPI_BRGHT_MODE_ECNVRAM &&
+	    !tp_features.bright_ucms_direct) {
+		tpacpi_nvram_mark_clean(TPACPI_NVRAM_BRIGHTNESS);
+		return 0;
+	}
+
+	vdbg_printk(TPACPI_DBG_BRGHT,
+		"trying to checkpoint backlight level to NVRAM...\n");
 
 	if (mutex_lock_killable(&brightness_mutex) < 0)
-		return;
+		return -EINTR;
 
-	if (unlikely(!acpi_ec_read(TP_EC_BACKLIGHT, &lec)))
+	if (unlikely(!acpi_ec_read(TP_EC_BACKLIGHT, &lec))) {
+		rc = -EIO;
 		goto unlock;
+	}
 	lec &= TP_EC_BACKLIGHT_LVLMSK;
 	b_nvram = nvram_read_byte(TP_NVRAM_ADDR_BRIGHTNESS);
 
@@ -6489,7 +8157,9 @@ static void tpacpi_brightness_checkpoint_nvram(void)
 		b_nvram &= ~(TP_NVRAM_MASK_LEVEL_BRIGHTNESS <<
 				TP_NVRAM_POS_LEVEL_BRIGHTNESS);
 		b_nvram |= lec;
+		hotkey_nvram_self_write_begin();
 		nvram_write_byte(b_nvram, TP_NVRAM_ADDR_BRIGHTNESS);
+		hotkey_nvram_self_write_end();
 		dbg_printk(TPACPI_DBG_BRGHT,
 			   "updated NVRAM backlight level to %u (0x%02x)\n",
 			   (unsigned int) lec, (unsigned int) b_nvram);
@@ -6497,9 +8167,11 @@ static void tpacpi_brightness_checkpoint_nvram(void)
 		vdbg_printk(TPACPI_DBG_BRGHT,
 			   "NVRAM backlight level already is %u (0x%02x)\n",
 			   (unsigned int) lec, (unsigned int) b_nvram);
+	tpacpi_nvram_mark_clean(TPACPI_NVRAM_BRIGHTNESS);
 
 unlock:
 	mutex_unlock(&brightness_mutex);
+	return rc;
 }
 
 
@@ -6511,8 +8183,12 @@ static int tpacpi_brightness_get_raw(int *status)
 
 	switch (brightness_mode) {
 	case TPACPI_BRGHT_MODE_UCMS_STEP:
-		*status = tpacpi_brightness_nvram_get();
-		return 0;
+		if (!tp_features.bright_ucms_direct) {
+			*status = tpacpi_brightness_nvram_get();
+			return 0;
+		}
+		/* NVRAM lags behind, see tpacpi_brightness_set_ucmsstep() */
+		fallthrough;
 	case TPACPI_BRGHT_MODE_EC:
 	case TPACPI_BRGHT_MODE_ECNVRAM:
 		if (unlikely(!acpi_ec_read(TP_EC_BACKLIGHT, &lec)))
@@ -6539,15 +8215,53 @@ static int tpacpi_brightness_set_ec(unsigned int value)
 				(value & TP_EC_BACKLIGHT_LVLMSK))))
 		return -EIO;
 
+	tpacpi_nvram_mark_dirty(TPACPI_NVRAM_BRIGHTNESS);
+
 	return 0;
 }
 
-static int tpacpi_brightness_set_ucmsstep(unsigned int value)
+/*
+ * Issues the same CMOS command count times, building the ACPI argument
+ * list once instead of going through acpi_evalf() for every step
+ */
+static int issue_thinkpad_cmos_commands(int cmos_cmd, unsigned int count)
 {
-	int cmos_cmd, inc;
-	unsigned int current_value, i;
+	union acpi_object arg = {
+		.integer = { .type = ACPI_TYPE_INTEGER, .value = cmos_cmd },
+	};
+	struct acpi_object_list args = { .count = 1, .pointer = &arg };
 
-	lockdep_assert_held(&brightness_mutex);
+	if (!cmos_handle)
+		return -ENXIO;
+
+	while (count--)
+		if (ACPI_FAILURE(acpi_evaluate_object(cmos_handle, NULL,
+						      &args, NULL)))
+			return -EIO;
+
+	return 0;
+}
+
+/*
+ * On machines where the EC follows the level (tp_features.bright_ucms_direct)
+ * the level is written straight to the EC, as in ECNVRAM mode, and NVRAM
+ * catches up through the write-behind.  Elsewhere the firmware has to be
+ * stepped there one CMOS command per level.
+ */
+static int tpacpi_brightness_set_ucmsstep(unsigned int value)
+{
+	unsigned int current_value;
+	int cmos_cmd, res;
+	ktime_t t0;
+
+	lockdep_assert_held(&brightness_mutex);
+
+	t0 = ktime_get();
+
+	if (tp_features.bright_ucms_direct) {
+		res = tpacpi_brightness_set_ec(value);
+		goto out;
+	}
 
 	current_value = tpacpi_brightness_nvram_get();
 
@@ -6557,13 +8271,50 @@ static int tpacpi_brightness_set_ucmsstep(unsigned int value)
 	cmos_cmd = (value > current_value) ?
 			TP_CMOS_BRIGHTNESS_UP :
 			TP_CMOS_BRIGHTNESS_DOWN;
-	inc = (value > current_value) ? 1 : -1;
 
-	for (i = current_value; i != value; i += inc)
-		if (issue_thinkpad_cmos_command(cmos_cmd))
-			return -EIO;
+	/* the firmware moves the NVRAM level with every step */
+	hotkey_nvram_self_write_begin();
+	res = issue_thinkpad_cmos_commands(cmos_cmd,
+					   abs((int)value - (int)current_value));
+	hotkey_nvram_self_write_end();
+	if (res)
+		res = -EIO;
 
-	return 0;
+out:
+	vdbg_printk(TPACPI_DBG_BRGHT,
+		    "backlight: UCMS %s to %u took %lld us\n",
+		    tp_features.bright_ucms_direct ? "jump" : "steps",
+		    value, ktime_us_delta(ktime_get(), t0));
+
+	return res;
+}
+
+/*
+ * Opt-in through brightness_ucms_direct: the quirk table puts these
+ * machines in UCMS step mode because their EC is not known to act on
+ * TP_EC_BACKLIGHT, and an EC that ignores the register still reads back
+ * whatever was written to it, so there is nothing to probe for.  Only
+ * IBM-era ECs are considered (see the safety check in brightness_init()),
+ * and only when the EC already reports the level that NVRAM holds.
+ */
+static void __init tpacpi_brightness_probe_ucms_direct(unsigned long quirks)
+{
+	u8 lec;
+
+	if (brightness_mode != TPACPI_BRGHT_MODE_UCMS_STEP ||
+	    !brightness_ucms_direct || !tpacpi_is_ibm() ||
+	    (quirks & TPACPI_BRGHT_Q_NOEC))
+		return;
+
+	mutex_lock(&brightness_mutex);
+	if (acpi_ec_read(TP_EC_BACKLIGHT, &lec) &&
+	    (lec & TP_EC_BACKLIGHT_LVLMSK) == tpacpi_brightness_nvram_get())
+		tp_features.bright_ucms_direct = 1;
+	mutex_unlock(&brightness_mutex);
+
+	dbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_BRGHT,
+		   "UCMS brightness direct jump %s\n",
+		   str_enabled_disabled(tp_features.bright_ucms_direct));
 }
 
 /* May return EINTR which can always be mapped to ERESTARTSYS */
@@ -6597,6 +8348,183 @@ static int brightness_set(unsigned int value)
 	return res;
 }
 
+/*
+ * Asynchronous brightness writes: the backlight class only records the
+ * level it wants, and brightness_set_worker() moves the hardware to the
+ * latest one.  Levels requested while a write is in progress overwrite
+ * each other, so a slider dragged across the range costs one write (or
+ * one run of UCMS steps) per worker pass, not one per sysfs store.
+ */
+static bool brightness_sync;
+
+static atomic_t brightness_target = ATOMIC_INIT(-1);	/* -1: none pending */
+
+static void brightness_set_worker(struct work_struct *work)
+{
+	int level, res;
+
+	while ((level = atomic_xchg(&brightness_target, -1)) >= 0) {
+		res = brightness_set(level);
+		if (res < 0)
+			dbg_printk(TPACPI_DBG_BRGHT,
+				   "backlight: failed to set level to %d: %d\n",
+				   level, res);
+	}
+}
+
+static DECLARE_WORK(brightness_set_work, brightness_set_worker);
+
+/* Drops a pending level and waits for one being written to land */
+static void brightness_set_flush(void)
+{
+	atomic_set(&brightness_target, -1);
+	flush_work(&brightness_set_work);
+}
+
+/*
+ * Backlight fades: brightness_fade_worker() steps the level from a delayed
+ * work, one level per step, spacing the steps evenly over the requested
+ * duration.  The EC command bits are read once when the fade starts and
+ * kept in a shadow, so each step in EC mode is a single EC write.
+ */
+#define TPACPI_BRGHT_FADE_MIN_STEP_MS	10
+#define TPACPI_BRGHT_FADE_MAX_MS	60000
+
+static struct {
+	bool active;
+	unsigned int from, to, cur;
+	ktime_t start;
+	unsigned int duration_ms;
+	unsigned int step_ms;
+	u8 ec_cmd;		/* shadow of the TP_EC_BACKLIGHT_CMDMSK bits */
+} brightness_fade;		/* protected by brightness_mutex */
+
+static int brightness_fade_write(unsigned int level)
+{
+	lockdep_assert_held(&brightness_mutex);
+
+	switch (brightness_mode) {
+	case TPACPI_BRGHT_MODE_EC:
+	case TPACPI_BRGHT_MODE_ECNVRAM:
+		if (unlikely(!acpi_ec_write(TP_EC_BACKLIGHT,
+					    brightness_fade.ec_cmd |
+					    (level & TP_EC_BACKLIGHT_LVLMSK))))
+			return -EIO;
+		tpacpi_nvram_mark_dirty(TPACPI_NVRAM_BRIGHTNESS);
+		return 0;
+	case TPACPI_BRGHT_MODE_UCMS_STEP:
+		return tpacpi_brightness_set_ucmsstep(level);
+	default:
+		return -ENXIO;
+	}
+}
+
+static void brightness_fade_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(brightness_fade_work, brightness_fade_worker);
+
+static void brightness_fade_worker(struct work_struct *work)
+{
+	unsigned int level;
+	bool done = false;
+	s64 elapsed;
+
+	if (mutex_lock_killable(&brightness_mutex) < 0)
+		return;
+
+	if (!brightness_fade.active) {
+		mutex_unlock(&brightness_mutex);
+		return;
+	}
+
+	elapsed = ktime_ms_delta(ktime_get(), brightness_fade.start);
+	if (elapsed >= brightness_fade.duration_ms) {
+		level = brightness_fade.to;
+		done = true;
+	} else {
+		level = brightness_fade.from +
+			div_s64(((s64)brightness_fade.to - brightness_fade.from) *
+				elapsed, brightness_fade.duration_ms);
+	}
+
+	if (level != brightness_fade.cur) {
+		if (brightness_fade_write(level) < 0) {
+			pr_err("backlight fade: failed to set level %u\n",
+			       level);
+			done = true;
+		} else {
+			brightness_fade.cur = level;
+		}
+	}
+
+	if (done)
+		brightness_fade.active = false;
+	else
+		queue_delayed_work(tpacpi_wq, &brightness_fade_work,
+				   msecs_to_jiffies(brightness_fade.step_ms));
+
+	mutex_unlock(&brightness_mutex);
+
+	if (done && ibm_backlight_device)
+		backlight_force_update(ibm_backlight_device,
+				       BACKLIGHT_UPDATE_SYSFS);
+}
+
+/* Starts a fade to level, or retargets the one in progress */
+static int brightness_fade_start(unsigned int level, unsigned int ms)
+{
+	unsigned int delta;
+	int status, res;
+
+	if (level > bright_maxlvl || ms > TPACPI_BRGHT_FADE_MAX_MS)
+		return -EINVAL;
+
+	brightness_set_flush();
+
+	res = mutex_lock_killable(&brightness_mutex);
+	if (res < 0)
+		return res;
+
+	res = tpacpi_brightness_get_raw(&status);
+	if (res < 0)
+		goto unlock;
+
+	brightness_fade.from = status & TP_EC_BACKLIGHT_LVLMSK;
+	brightness_fade.cur = brightness_fade.from;
+	brightness_fade.ec_cmd = status & TP_EC_BACKLIGHT_CMDMSK;
+	brightness_fade.to = level;
+	brightness_fade.start = ktime_get();
+	brightness_fade.duration_ms = ms;
+
+	delta = abs((int)level - (int)brightness_fade.from);
+	brightness_fade.step_ms = max(ms / max(delta, 1U),
+				      TPACPI_BRGHT_FADE_MIN_STEP_MS);
+	brightness_fade.active = true;
+
+	dbg_printk(TPACPI_DBG_BRGHT,
+		   "backlight: fading from %u to %u over %u ms\n",
+		   brightness_fade.from, level, ms);
+
+	mod_delayed_work(tpacpi_wq, &brightness_fade_work, 0);
+
+unlock:
+	mutex_unlock(&brightness_mutex);
+	return res;
+}
+
+/*
+ * Once this returns the fade will not write another level.  It does not
+ * wait for the worker, which may be about to call backlight_force_update():
+ * update_status is called with the backlight ops_lock held.
+ */
+static void brightness_fade_cancel(void)
+{
+	mutex_lock(&brightness_mutex);
+	brightness_fade.active = false;
+	mutex_unlock(&brightness_mutex);
+
+	cancel_delayed_work(&brightness_fade_work);
+}
+
 /* sysfs backlight class ----------------------------------------------- */
 
 static int brightness_update_status(struct backlight_device *bd)
@@ -6607,9 +8535,22 @@ static int brightness_update_status(struct backlight_device *bd)
 			"backlight: attempt to set level to %d\n",
 			level);
 
-	/* it is the backlight class's job (caller) to handle
-	 * EINTR and other errors properly */
-	return brightness_set(level);
+	brightness_fade_cancel();
+
+	if (READ_ONCE(brightness_sync)) {
+		brightness_set_flush();
+		/* it is the backlight class's job (caller) to handle
+		 * EINTR and other errors properly */
+		return brightness_set(level);
+	}
+
+	if (level < 0 || level > bright_maxlvl)
+		return -EINVAL;
+
+	atomic_set(&brightness_target, level);
+	queue_work(tpacpi_wq, &brightness_set_work);
+
+	return 0;
 }
 
 static int brightness_get(struct backlight_device *bd)
@@ -6641,6 +8582,63 @@ static const struct backlight_ops ibm_backlight_data = {
 	.update_status  = brightness_update_status,
 };
 
+/* sysfs backlight fade ------------------------------------------------ */
+static ssize_t fade_show(struct device *dev,
+			 struct device_attribute *attr,
+			 char *buf)
+{
+	unsigned int to;
+	s64 left;
+
+	if (mutex_lock_killable(&brightness_mutex) < 0)
+		return -ERESTARTSYS;
+
+	if (!brightness_fade.active) {
+		mutex_unlock(&brightness_mutex);
+		return sysfs_emit(buf, "idle\n");
+	}
+
+	to = brightness_fade.to;
+	left = brightness_fade.duration_ms -
+	       ktime_ms_delta(ktime_get(), brightness_fade.start);
+
+	mutex_unlock(&brightness_mutex);
+
+	return sysfs_emit(buf, "%u %lld\n", to, max_t(s64, left, 0));
+}
+
+/* "<level> <ms>" */
+static ssize_t fade_store(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	unsigned int level, ms;
+	int res;
+
+	if (sscanf(buf, "%u %u", &level, &ms) != 2)
+		return -EINVAL;
+
+	tpacpi_disclose_usertask("backlight fade",
+				 "fade to %u over %u ms\n", level, ms);
+
+	res = brightness_fade_start(level, ms);
+	if (res == -EINTR)
+		return -ERESTARTSYS;
+
+	return (res < 0) ? res : count;
+}
+
+static DEVICE_ATTR_RW(fade);
+
+static struct attribute *brightness_fade_attributes[] = {
+	&dev_attr_fade.attr,
+	NULL
+};
+
+static const struct attribute_group brightness_fade_attr_group = {
+	.attrs = brightness_fade_attributes,
+};
+
 /* --------------------------------------------------------------------- */
 
 static int __init tpacpi_evaluate_bcl(struct acpi_device *adev, void *not_used)
@@ -6834,6 +8832,8 @@ static int __init brightness_init(struct ibm_init_struct *iibm)
 	     brightness_mode == TPACPI_BRGHT_MODE_EC))
 		return -EINVAL;
 
+	tpacpi_brightness_probe_ucms_direct(quirks);
+
 	if (tpacpi_brightness_get_raw(&b) < 0)
 		return -ENODEV;
 
@@ -6854,6 +8854,17 @@ static int __init brightness_init(struct ibm_init_struct *iibm)
 	vdbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_BRGHT,
 			"brightness is supported\n");
 
+	/*
+	 * backlight_device_register() takes no driver groups, so the add
+	 * uevent has gone out without the fade attribute: announce it
+	 * with a change event once it is there.
+	 */
+	if (sysfs_create_group(&ibm_backlight_device->dev.kobj,
+			       &brightness_fade_attr_group))
+		pr_warn("unable to create backlight fade attribute\n");
+	else
+		kobject_uevent(&ibm_backlight_device->dev.kobj, KOBJ_CHANGE);
+
 	if (quirks & TPACPI_BRGHT_Q_ASK) {
 		pr_notice("brightness: will use unverified default: brightness_mode=%d\n",
 			  brightness_mode);
@@ -6872,28 +8883,43 @@ static int __init brightness_init(struct ibm_init_struct *iibm)
 	tpacpi_hotkey_driver_mask_set(hotkey_driver_mask
 				| TP_ACPI_HKEY_BRGHTUP_MASK
 				| TP_ACPI_HKEY_BRGHTDWN_MASK);
+
+	/* NVRAM is not known to match yet */
+	tpacpi_nvram_mark_dirty(TPACPI_NVRAM_BRIGHTNESS);
+
 	return 0;
 }
 
 static void brightness_suspend(void)
 {
-	tpacpi_brightness_checkpoint_nvram();
+	brightness_fade_cancel();
+	cancel_delayed_work_sync(&brightness_fade_work);
+	flush_work(&brightness_set_work);
+	tpacpi_nvram_sync(TPACPI_NVRAM_BRIGHTNESS);
 }
 
 static void brightness_shutdown(void)
 {
-	tpacpi_brightness_checkpoint_nvram();
+	brightness_fade_cancel();
+	cancel_delayed_work_sync(&brightness_fade_work);
+	flush_work(&brightness_set_work);
+	tpacpi_nvram_sync(TPACPI_NVRAM_BRIGHTNESS);
 }
 
 static void brightness_exit(void)
 {
 	if (ibm_backlight_device) {
+		sysfs_remove_group(&ibm_backlight_device->dev.kobj,
+				   &brightness_fade_attr_group);
+		brightness_fade_cancel();
+		cancel_delayed_work_sync(&brightness_fade_work);
 		vdbg_printk(TPACPI_DBG_EXIT | TPACPI_DBG_BRGHT,
 			    "calling backlight_device_unregister()\n");
 		backlight_device_unregister(ibm_backlight_device);
 	}
 
-	tpacpi_brightness_checkpoint_nvram();
+	flush_work(&brightness_set_work);
+	tpacpi_nvram_sync(TPACPI_NVRAM_BRIGHTNESS);
 }
 
 static int brightness_read(struct seq_file *m)
@@ -6944,6 +8970,8 @@ static int brightness_write(char *buf)
 	 * Now we know what the final level should be, so we try to set it.
 	 * Doing it this way makes the syscall restartable in case of EINTR
 	 */
+	brightness_fade_cancel();
+	brightness_set_flush();
 	rc = brightness_set(level);
 	if (!rc && ibm_backlight_device)
 		backlight_force_update(ibm_backlight_device,
@@ -7067,18 +9095,18 @@ static int software_mute_orig_mode;
  */
 static struct mutex volume_mutex;
 
-static void tpacpi_volume_checkpoint_nvram(void)
+static int tpacpi_volume_checkpoint_nvram(void)
 {
 	u8 lec = 0;
 	u8 b_nvram;
 	u8 ec_mask;
+	int rc = 0;
 
-	if (volume_mode != TPACPI_VOL_MODE_ECNVRAM)
-		return;
-	if (!volume_control_allowed)
-		return;
-	if (software_mute_active)
-		return;
+	if (volume_mode != TPACPI_VOL_MODE_ECNVRAM ||
+	    !volume_control_allowed || software_mute_active) {
+		tpacpi_nvram_mark_clean(TPACPI_NVRAM_MIXER);
+		return 0;
+	}
 
 	vdbg_printk(TPACPI_DBG_MIXER,
 		"trying to checkpoint mixer state to NVRAM...\n");
@@ -7089,10 +9117,12 @@ static void tpacpi_volume_checkpoint_nvram(void)
 		ec_mask = TP_EC_AUDIO_MUTESW_MSK | TP_EC_AUDIO_LVL_MSK;
 
 	if (mutex_lock_killable(&volume_mutex) < 0)
-		return;
+		return -EINTR;
 
-	if (unlikely(!acpi_ec_read(TP_EC_AUDIO, &lec)))
+	if (unlikely(!acpi_ec_read(TP_EC_AUDIO, &lec))) {
+		rc = -EIO;
 		goto unlock;
+	}
 	lec &= ec_mask;
 	b_nvram = nvram_read_byte(TP_NVRAM_ADDR_MIXER);
 
@@ -7100,7 +9130,9 @@ static void tpacpi_volume_checkpoint_nvram(void)
 		/* NVRAM needs update */
 		b_nvram &= ~ec_mask;
 		b_nvram |= lec;
+		hotkey_nvram_self_write_begin();
 		nvram_write_byte(b_nvram, TP_NVRAM_ADDR_MIXER);
+		hotkey_nvram_self_write_end();
 		dbg_printk(TPACPI_DBG_MIXER,
 			   "updated NVRAM mixer status to 0x%02x (0x%02x)\n",
 			   (unsigned int) lec, (unsigned int) b_nvram);
@@ -7109,9 +9141,11 @@ static void tpacpi_volume_checkpoint_nvram(void)
 			   "NVRAM mixer status already is 0x%02x (0x%02x)\n",
 			   (unsigned int) lec, (unsigned int) b_nvram);
 	}
+	tpacpi_nvram_mark_clean(TPACPI_NVRAM_MIXER);
 
 unlock:
 	mutex_unlock(&volume_mutex);
+	return rc;
 }
 
 static int volume_get_status_ec(u8 *status)
@@ -7133,6 +9167,58 @@ static int volume_get_status(u8 *status)
 	return volume_get_status_ec(status);
 }
 
+/*
+ * Last known TP_EC_AUDIO value, or -1 when it has to be read again.  The
+ * ALSA controls are served from it; writers store what they wrote, and
+ * volume key events (ACPI or polled), resume and software mute changes
+ * invalidate it.  As with dytc_get_cached(), the generation count keeps
+ * a read racing with a write or an invalidation from caching a stale
+ * value.
+ */
+static DEFINE_SPINLOCK(volume_cache_lock);
+static int volume_cached_status = -1;
+static unsigned int volume_cache_gen;
+
+static void volume_cache_set(int status)
+{
+	spin_lock(&volume_cache_lock);
+	volume_cached_status = status;
+	volume_cache_gen++;
+	spin_unlock(&volume_cache_lock);
+}
+
+static void volume_cache_invalidate(void)
+{
+	volume_cache_set(-1);
+}
+
+static int volume_get_status_cached(u8 *status)
+{
+	unsigned int gen;
+	int c, rc;
+
+	spin_lock(&volume_cache_lock);
+	c = volume_cached_status;
+	gen = volume_cache_gen;
+	spin_unlock(&volume_cache_lock);
+
+	if (c >= 0) {
+		*status = c;
+		return 0;
+	}
+
+	rc = volume_get_status(status);
+	if (rc)
+		return rc;
+
+	spin_lock(&volume_cache_lock);
+	if (gen == volume_cache_gen)
+		volume_cached_status = *status;
+	spin_unlock(&volume_cache_lock);
+
+	return 0;
+}
+
 static int volume_set_status_ec(const u8 status)
 {
 	if (!acpi_ec_write(TP_EC_AUDIO, status))
@@ -7140,6 +9226,9 @@ static int volume_set_status_ec(const u8 status)
 
 	dbg_printk(TPACPI_DBG_MIXER, "set EC mixer to 0x%02x\n", status);
 
+	volume_cache_set(status);
+	tpacpi_nvram_mark_dirty(TPACPI_NVRAM_MIXER);
+
 	/*
 	 * On X200s, and possibly on others, it can take a while for
 	 * reads to become correct.
@@ -7249,6 +9338,9 @@ static int volume_set_software_mute(bool startup)
 			(int)TP_EC_MUTE_BTN_NONE))
 		return -EIO;
 
+	/* the firmware may have changed the mute bit along with the mode */
+	volume_cache_invalidate();
+
 	if (result != TP_EC_MUTE_BTN_NONE)
 		pr_warn("Unexpected SAUM result %d\n",
 			result);
@@ -7277,6 +9369,8 @@ static void volume_exit_software_mute(void)
 	if (!acpi_evalf(ec_handle, &r, "SAUM", "qdd", software_mute_orig_mode)
 	    || r != software_mute_orig_mode)
 		pr_warn("Failed to restore mute mode\n");
+
+	volume_cache_invalidate();
 }
 
 static int volume_alsa_set_volume(const u8 vol)
@@ -7286,21 +9380,56 @@ static int volume_alsa_set_volume(const u8 vol)
 	return __volume_set_volume_ec(vol);
 }
 
-static void volume_alsa_notify_change(void)
+/*
+ * Control notifications are coalesced: the first change in a window of
+ * TPACPI_VOL_NOTIFY_DELAY queues volume_alsa_notify_work, which reads the
+ * mixer once and only notifies the controls whose value changed since
+ * the previous notification.  Holding a volume key down thus costs one
+ * EC read per window instead of one per event and ALSA client.
+ */
+#define TPACPI_VOL_NOTIFY_DELAY		(HZ / 50)
+
+static int volume_notified_status = -1;	/* only used by the worker */
+
+static void volume_alsa_notify_worker(struct work_struct *work)
 {
+	struct snd_card *card = READ_ONCE(alsa_card);
 	struct tpacpi_alsa_data *d;
+	u8 s, changed;
 
-	if (alsa_card && alsa_card->private_data) {
-		d = alsa_card->private_data;
-		if (d->ctl_mute_id)
-			snd_ctl_notify(alsa_card,
-					SNDRV_CTL_EVENT_MASK_VALUE,
-					d->ctl_mute_id);
-		if (d->ctl_vol_id)
-			snd_ctl_notify(alsa_card,
-					SNDRV_CTL_EVENT_MASK_VALUE,
-					d->ctl_vol_id);
-	}
+	if (!card || !card->private_data)
+		return;
+	d = card->private_data;
+
+	if (volume_get_status_cached(&s) < 0)
+		return;
+
+	changed = (volume_notified_status < 0) ?
+			0xff : s ^ volume_notified_status;
+	volume_notified_status = s;
+
+	if (d->ctl_mute_id && (changed & TP_EC_AUDIO_MUTESW_MSK))
+		snd_ctl_notify(card,
+				SNDRV_CTL_EVENT_MASK_VALUE,
+				d->ctl_mute_id);
+	if (d->ctl_vol_id && (changed & TP_EC_AUDIO_LVL_MSK))
+		snd_ctl_notify(card,
+				SNDRV_CTL_EVENT_MASK_VALUE,
+				d->ctl_vol_id);
+}
+
+static DECLARE_DELAYED_WORK(volume_alsa_notify_work,
+			    volume_alsa_notify_worker);
+
+static void volume_alsa_notify_change(void)
+{
+	volume_cache_invalidate();
+
+	if (!READ_ONCE(alsa_card))
+		return;
+
+	queue_delayed_work(tpacpi_wq, &volume_alsa_notify_work,
+			   TPACPI_VOL_NOTIFY_DELAY);
 }
 
 static int volume_alsa_vol_info(struct snd_kcontrol *kcontrol,
@@ -7319,7 +9448,7 @@ static int volume_alsa_vol_get(struct snd_kcontrol *kcontrol,
 	u8 s;
 	int rc;
 
-	rc = volume_get_status(&s);
+	rc = volume_get_status_cached(&s);
 	if (rc < 0)
 		return rc;
 
@@ -7343,7 +9472,7 @@ static int volume_alsa_mute_get(struct snd_kcontrol *kcontrol,
 	u8 s;
 	int rc;
 
-	rc = volume_get_status(&s);
+	rc = volume_get_status_cached(&s);
 	if (rc < 0)
 		return rc;
 
@@ -7381,11 +9510,14 @@ static struct snd_kcontrol_new volume_alsa_control_mute __initdata = {
 
 static void volume_suspend(void)
 {
-	tpacpi_volume_checkpoint_nvram();
+	tpacpi_nvram_sync(TPACPI_NVRAM_MIXER);
 }
 
 static void volume_resume(void)
 {
+	/* the firmware may have reset the mixer */
+	volume_cache_invalidate();
+
 	if (software_mute_active) {
 		if (volume_set_software_mute(false) < 0)
 			pr_warn("Failed to restore software mute\n");
@@ -7396,17 +9528,21 @@ static void volume_resume(void)
 
 static void volume_shutdown(void)
 {
-	tpacpi_volume_checkpoint_nvram();
+	tpacpi_nvram_sync(TPACPI_NVRAM_MIXER);
 }
 
 static void volume_exit(void)
 {
-	if (alsa_card) {
-		snd_card_free(alsa_card);
-		alsa_card = NULL;
+	struct snd_card *card = alsa_card;
+
+	if (card) {
+		/* first, so that nothing queues the notify work again */
+		WRITE_ONCE(alsa_card, NULL);
+		cancel_delayed_work_sync(&volume_alsa_notify_work);
+		snd_card_free(card);
 	}
 
-	tpacpi_volume_checkpoint_nvram();
+	tpacpi_nvram_sync(TPACPI_NVRAM_MIXER);
 
 	if (software_mute_active)
 		volume_exit_software_mute();
@@ -7615,6 +9751,9 @@ static int __init volume_init(struct ibm_init_struct *iibm)
 			| TP_ACPI_HKEY_VOLDWN_MASK
 			| TP_ACPI_HKEY_MUTE_MASK);
 
+	/* NVRAM is not known to match yet */
+	tpacpi_nvram_mark_dirty(TPACPI_NVRAM_MIXER);
+
 	return 0;
 }
 
@@ -7735,6 +9874,12 @@ static inline void volume_alsa_notify_change(void)
 {
 }
 
+static inline int tpacpi_volume_checkpoint_nvram(void)
+{
+	tpacpi_nvram_mark_clean(TPACPI_NVRAM_MIXER);
+	return 0;
+}
+
 static int __init volume_init(struct ibm_init_struct *iibm)
 {
 	pr_info("volume: disabled as there is no ALSA support in this kernel\n");
@@ -7748,6 +9893,36 @@ static struct ibm_struct volume_driver_data = {
 
 #endif /* CONFIG_THINKPAD_ACPI_ALSA_SUPPORT */
 
+/* NVRAM write-behind ------------------------------------------------- */
+
+/* The checkpoints clear the bit themselves, once they went through */
+static void tpacpi_nvram_writeback(unsigned int what)
+{
+	int rc = 0;
+
+	if (!test_bit(what, &tpacpi_nvram_dirty))
+		return;
+
+	switch (what) {
+	case TPACPI_NVRAM_BRIGHTNESS:
+		rc = tpacpi_brightness_checkpoint_nvram();
+		break;
+	case TPACPI_NVRAM_MIXER:
+		rc = tpacpi_volume_checkpoint_nvram();
+		break;
+	}
+
+	/* still dirty: try again later */
+	if (rc)
+		tpacpi_nvram_mark_dirty(what);
+}
+
+static void tpacpi_nvram_worker(struct work_struct *work)
+{
+	tpacpi_nvram_writeback(TPACPI_NVRAM_BRIGHTNESS);
+	tpacpi_nvram_writeback(TPACPI_NVRAM_MIXER);
+}
+
 /*************************************************************************
  * Fan subdriver
  */
@@ -7936,6 +10111,12 @@ static struct mutex fan_mutex;
 static void fan_watchdog_fire(struct work_struct *ignored);
 static DECLARE_DELAYED_WORK(fan_watchdog_task, fan_watchdog_fire);
 
+/* watchdog timeout (s) while the cooling device holds a manual state */
+#define TPACPI_FAN_COOLING_WATCHDOG	120
+
+static unsigned long fan_cooling_state;	/* protected by fan_mutex */
+static u8 fan_cooling_status;		/* status it left the fan in */
+
 TPACPI_HANDLE(fans, ec, "FANS");	/* X31, X40, X41 */
 TPACPI_HANDLE(gfan, ec, "GFAN",	/* 570 */
 	   "\\FSPD",		/* 600e/x, 770e, 770x */
@@ -8016,13 +10197,103 @@ static bool fan_select_fan2(void)
 	return true;
 }
 
-static void fan_update_desired_level(u8 status)
-{
-	lockdep_assert_held(&fan_mutex);
+/*
+ * Fan telemetry
+ *
+ * Time spent in each mode, mode transitions and per-fan RPM histograms,
+ * accumulated for the life of the driver from every status and speed
+ * read anyone does, plus a slow background tick so that idle machines
+ * are covered too.  Like the modes, the RPM buckets count the time until
+ * the next reading, so that bursts of reads do not skew them.  debugfs
+ * fan_telemetry is the raw struct tpacpi_fan_telemetry,
+ * fan_telemetry_summary the same for humans.
+ */
 
-	if ((status &
-	     (TP_EC_FAN_AUTO | TP_EC_FAN_FULLSPEED)) == 0) {
-		if (status > 7)
+#define TPACPI_FAN_TELEMETRY_TICK	60	/* s */
+
+static struct tpacpi_fan_telemetry fan_telemetry;
+static int fan_telemetry_mode = -1;	/* last observed, -1: none yet */
+static u64 fan_telemetry_last_ns;
+static int fan_telemetry_bucket[2] = { -1, -1 };	/* same, per fan */
+static u64 fan_telemetry_rpm_last_ns[2];
+static DEFINE_SPINLOCK(fan_telemetry_lock);
+
+static unsigned int fan_telemetry_decode(u8 status)
+{
+	switch (fan_status_access_mode) {
+	case TPACPI_FAN_RD_ACPI_GFAN:
+		return status & 0x07;
+	case TPACPI_FAN_RD_TPEC_NS:
+		return (status & FAN_NS_CTRL) ? TPACPI_FAN_MODE_UNKNOWN :
+						TPACPI_FAN_MODE_AUTO;
+	default:
+		/* disengaged takes precedence, as in fan_read() */
+		if (status & TP_EC_FAN_FULLSPEED)
+			return TPACPI_FAN_MODE_DISENGAGED;
+		if (status & TP_EC_FAN_AUTO)
+			return TPACPI_FAN_MODE_AUTO;
+		return min_t(unsigned int, status, 7);
+	}
+}
+
+/* charges the time since the last observation to the previous mode */
+static void fan_telemetry_account(u64 now)
+{
+	lockdep_assert_held(&fan_telemetry_lock);
+
+	if (fan_telemetry_mode >= 0)
+		fan_telemetry.mode_ns[fan_telemetry_mode] +=
+					now - fan_telemetry_last_ns;
+	fan_telemetry_last_ns = now;
+}
+
+static void fan_telemetry_status(u8 status)
+{
+	unsigned int mode = fan_telemetry_decode(status);
+
+	spin_lock(&fan_telemetry_lock);
+	fan_telemetry_account(ktime_get_ns());
+	if (fan_telemetry_mode >= 0 && fan_telemetry_mode != mode) {
+		fan_telemetry.transitions++;
+		fan_telemetry.transition[fan_telemetry_mode][mode]++;
+	}
+	fan_telemetry_mode = mode;
+	fan_telemetry.samples++;
+	spin_unlock(&fan_telemetry_lock);
+}
+
+/* charges the time since the last reading of a fan to its RPM bucket */
+static void fan_telemetry_rpm_account(unsigned int fan, u64 now)
+{
+	const int bucket = fan_telemetry_bucket[fan];
+
+	lockdep_assert_held(&fan_telemetry_lock);
+
+	if (bucket >= 0)
+		fan_telemetry.rpm_hist[fan][bucket] +=
+					now - fan_telemetry_rpm_last_ns[fan];
+	fan_telemetry_rpm_last_ns[fan] = now;
+}
+
+static void fan_telemetry_rpm(unsigned int fan, unsigned int rpm)
+{
+	unsigned int bucket = min_t(unsigned int,
+				    rpm / TPACPI_FAN_RPM_BUCKET_WIDTH,
+				    TPACPI_FAN_RPM_BUCKETS - 1);
+
+	spin_lock(&fan_telemetry_lock);
+	fan_telemetry_rpm_account(fan, ktime_get_ns());
+	fan_telemetry_bucket[fan] = bucket;
+	spin_unlock(&fan_telemetry_lock);
+}
+
+static void fan_update_desired_level(u8 status)
+{
+	lockdep_assert_held(&fan_mutex);
+
+	if ((status &
+	     (TP_EC_FAN_AUTO | TP_EC_FAN_FULLSPEED)) == 0) {
+		if (status > 7)
 			fan_control_desired_level = 7;
 		else
 			fan_control_desired_level = status;
@@ -8092,6 +10363,7 @@ static int fan_get_status_safe(u8 *status)
 
 	if (rc)
 		return rc;
+	fan_telemetry_status(s);
 	if (status)
 		*status = s;
 
@@ -8100,8 +10372,12 @@ static int fan_get_status_safe(u8 *status)
 
 static int fan_get_speed(unsigned int *speed)
 {
+	unsigned int rpm;
 	u8 hi, lo;
 
+	/* the select register is shared with every other fan access */
+	lockdep_assert_held(&fan_mutex);
+
 	switch (fan_status_access_mode) {
 	case TPACPI_FAN_RD_TPEC:
 		/* all except 570, 600e/x, 770e, 770x */
@@ -8111,29 +10387,34 @@ static int fan_get_speed(unsigned int *speed)
 			     !acpi_ec_read(fan_rpm_offset + 1, &hi)))
 			return -EIO;
 
-		if (likely(speed))
-			*speed = (hi << 8) | lo;
+		rpm = (hi << 8) | lo;
 		break;
 	case TPACPI_FAN_RD_TPEC_NS:
 		if (!acpi_ec_read(fan_rpm_status_ns, &lo))
 			return -EIO;
 
-		if (speed)
-			*speed = lo ? FAN_RPM_CAL_CONST / lo : 0;
+		rpm = lo ? FAN_RPM_CAL_CONST / lo : 0;
 		break;
 
 	default:
 		return -ENXIO;
 	}
 
+	fan_telemetry_rpm(0, rpm);
+	if (likely(speed))
+		*speed = rpm;
+
 	return 0;
 }
 
 static int fan2_get_speed(unsigned int *speed)
 {
+	unsigned int rpm;
 	u8 hi, lo, status;
 	bool rc;
 
+	lockdep_assert_held(&fan_mutex);
+
 	switch (fan_status_access_mode) {
 	case TPACPI_FAN_RD_TPEC:
 		/* all except 570, 600e/x, 770e, 770x */
@@ -8145,8 +10426,7 @@ static int fan2_get_speed(unsigned int *speed)
 		if (rc)
 			return -EIO;
 
-		if (likely(speed))
-			*speed = (hi << 8) | lo;
+		rpm = (hi << 8) | lo;
 		break;
 
 	case TPACPI_FAN_RD_TPEC_NS:
@@ -8160,16 +10440,239 @@ static int fan2_get_speed(unsigned int *speed)
 		rc = !acpi_ec_read(fan2_rpm_status_ns, &lo);
 		if (rc)
 			return -EIO;
-		if (speed)
-			*speed = lo ? FAN_RPM_CAL_CONST / lo : 0;
+		rpm = lo ? FAN_RPM_CAL_CONST / lo : 0;
 		break;
 
 	default:
 		return -ENXIO;
 	}
 
+	fan_telemetry_rpm(1, rpm);
+	if (likely(speed))
+		*speed = rpm;
+
+	return 0;
+}
+
+/*
+ * Reads both fans in one go under fan_mutex, so that no other reader of
+ * ours can find the wrong fan selected halfway through.  Fan 2 is read
+ * first: selecting fan 1 for its own read then also restores the
+ * default, two select writes instead of the three of fan2_get_speed()
+ * followed by fan_get_speed().  Returns the number of fans read, i.e. 1
+ * when there is no second fan or it could not be read, or a negative
+ * error.
+ */
+static int fan_get_speeds(unsigned int speeds[2])
+{
+	u8 hi, lo;
+	bool ok2;
+	int rc;
+
+	lockdep_assert_held(&fan_mutex);
+
+	switch (fan_status_access_mode) {
+	case TPACPI_FAN_RD_TPEC:
+		ok2 = tp_features.second_fan && fan_select_fan2() &&
+		      acpi_ec_read(fan_rpm_offset, &lo) &&
+		      acpi_ec_read(fan_rpm_offset + 1, &hi);
+		if (ok2)
+			speeds[1] = (hi << 8) | lo;
+
+		if (unlikely(!fan_select_fan1()))
+			return -EIO;
+		if (unlikely(!acpi_ec_read(fan_rpm_offset, &lo) ||
+			     !acpi_ec_read(fan_rpm_offset + 1, &hi)))
+			return -EIO;
+		speeds[0] = (hi << 8) | lo;
+		fan_telemetry_rpm(0, speeds[0]);
+
+		if (!ok2)
+			return 1;
+		fan_telemetry_rpm(1, speeds[1]);
+
+		return 2;
+
+	case TPACPI_FAN_RD_TPEC_NS:
+		/* separate registers per fan, nothing to select */
+		rc = fan_get_speed(&speeds[0]);
+		if (rc)
+			return rc;
+		if (!tp_features.second_fan || fan2_get_speed(&speeds[1]))
+			return 1;
+
+		return 2;
+
+	default:
+		return -ENXIO;
+	}
+}
+
+/*
+ * Snapshot of both fan speeds for the hwmon attributes, so that reading
+ * fan1_input and fan2_input back to back costs a single fan_get_speeds()
+ */
+#define TPACPI_FAN_SPEEDS_MAX_AGE	(HZ / 10)
+
+static struct {
+	unsigned int rpm[2];
+	int n;			/* fans in rpm[], 0: no snapshot */
+	unsigned long stamp;	/* jiffies */
+} fan_speeds_cache;		/* protected by fan_mutex */
+
+static int fan_get_speed_cached(unsigned int fan, unsigned int *speed)
+{
+	int rc;
+
+	if (mutex_lock_killable(&fan_mutex))
+		return -ERESTARTSYS;
+
+	if (!fan_speeds_cache.n ||
+	    time_after(jiffies,
+		       fan_speeds_cache.stamp + TPACPI_FAN_SPEEDS_MAX_AGE)) {
+		rc = fan_get_speeds(fan_speeds_cache.rpm);
+		fan_speeds_cache.n = max(rc, 0);
+		fan_speeds_cache.stamp = jiffies;
+		if (rc < 0) {
+			mutex_unlock(&fan_mutex);
+			return rc;
+		}
+	}
+
+	rc = (fan < fan_speeds_cache.n) ? 0 : -EIO;
+	if (!rc)
+		*speed = fan_speeds_cache.rpm[fan];
+
+	mutex_unlock(&fan_mutex);
+
+	return rc;
+}
+
+static void fan_telemetry_tick(struct work_struct *work);
+static DECLARE_DELAYED_WORK(fan_telemetry_work, fan_telemetry_tick);
+
+static void fan_telemetry_tick(struct work_struct *work)
+{
+	unsigned int speeds[2];
+
+	if (tpacpi_lifecycle == TPACPI_LIFE_EXITING)
+		return;
+
+	/* the telemetry hooks in these do the work */
+	fan_get_status_safe(NULL);
+	mutex_lock(&fan_mutex);
+	fan_get_speeds(speeds);
+	mutex_unlock(&fan_mutex);
+
+	queue_delayed_work(tpacpi_wq, &fan_telemetry_work,
+			   TPACPI_FAN_TELEMETRY_TICK * HZ);
+}
+
+static void fan_telemetry_snapshot(struct tpacpi_fan_telemetry *t)
+{
+	u64 now = ktime_get_ns();
+
+	spin_lock(&fan_telemetry_lock);
+	fan_telemetry_account(now);
+	fan_telemetry_rpm_account(0, now);
+	fan_telemetry_rpm_account(1, now);
+	*t = fan_telemetry;
+	spin_unlock(&fan_telemetry_lock);
+}
+
+/* debugfs fan_telemetry ----------------------------------------------- */
+static int fan_telemetry_open(struct inode *inode, struct file *file)
+{
+	struct tpacpi_fan_telemetry *t;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	fan_telemetry_snapshot(t);
+	file->private_data = t;
+
+	return 0;
+}
+
+static ssize_t fan_telemetry_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	return simple_read_from_buffer(buf, count, ppos, file->private_data,
+				       sizeof(struct tpacpi_fan_telemetry));
+}
+
+static int fan_telemetry_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations fan_telemetry_fops = {
+	.owner = THIS_MODULE,
+	.open = fan_telemetry_open,
+	.read = fan_telemetry_read,
+	.llseek = default_llseek,
+	.release = fan_telemetry_release,
+};
+
+/* debugfs fan_telemetry_summary --------------------------------------- */
+static int fan_telemetry_summary_show(struct seq_file *m, void *v)
+{
+	static const char * const names[TPACPI_FAN_MODE_MAX] = {
+		"level 0", "level 1", "level 2", "level 3",
+		"level 4", "level 5", "level 6", "level 7",
+		"auto", "disengaged", "unknown",
+	};
+	struct tpacpi_fan_telemetry *t;
+	unsigned int i, j, fan;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+	fan_telemetry_snapshot(t);
+
+	seq_printf(m, "samples:\t%llu\n", t->samples);
+	seq_printf(m, "transitions:\t%llu\n", t->transitions);
+
+	seq_puts(m, "\ntime in mode:\n");
+	for (i = 0; i < TPACPI_FAN_MODE_MAX; i++)
+		if (t->mode_ns[i])
+			seq_printf(m, "  %-12s%llu s\n", names[i],
+				   div_u64(t->mode_ns[i], NSEC_PER_SEC));
+
+	seq_puts(m, "\ntransitions (from -> to: count):\n");
+	for (i = 0; i < TPACPI_FAN_MODE_MAX; i++)
+		for (j = 0; j < TPACPI_FAN_MODE_MAX; j++)
+			if (t->transition[i][j])
+				seq_printf(m, "  %s -> %s: %u\n",
+					   names[i], names[j],
+					   t->transition[i][j]);
+
+	for (fan = 0; fan < 2; fan++) {
+		if (fan && !tp_features.second_fan)
+			break;
+		seq_printf(m, "\nfan%u time at RPM:\n", fan + 1);
+		for (i = 0; i < TPACPI_FAN_RPM_BUCKETS; i++) {
+			if (!t->rpm_hist[fan][i])
+				continue;
+			if (i == TPACPI_FAN_RPM_BUCKETS - 1)
+				seq_printf(m, "  %5u+     ",
+					   i * TPACPI_FAN_RPM_BUCKET_WIDTH);
+			else
+				seq_printf(m, "  %5u-%-5u",
+					   i * TPACPI_FAN_RPM_BUCKET_WIDTH,
+					   (i + 1) * TPACPI_FAN_RPM_BUCKET_WIDTH - 1);
+			seq_printf(m, "%llu s\n",
+				   div_u64(t->rpm_hist[fan][i], NSEC_PER_SEC));
+		}
+	}
+
+	kfree(t);
+
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(fan_telemetry_summary);
 
 static int fan_set_level(int level)
 {
@@ -8383,26 +10886,68 @@ static int fan_set_speed(int speed)
 	return rc;
 }
 
+/*
+ * The cooling device arms the watchdog even when fan_watchdog is off,
+ * so that a manual state cannot outlive the thermal loop that set it.
+ */
+static unsigned int fan_watchdog_interval(void)
+{
+	if (fan_watchdog_maxinterval > 0)
+		return fan_watchdog_maxinterval;
+
+	return READ_ONCE(fan_cooling_state) ? TPACPI_FAN_COOLING_WATCHDOG : 0;
+}
+
+/*
+ * Is the fan still at the manual level the cooling device set?  Assume
+ * so when the status cannot be read.
+ */
+static bool fan_cooling_owns_fan(void)
+{
+	u8 s;
+
+	lockdep_assert_held(&fan_mutex);
+
+	if (!fan_cooling_state)
+		return false;
+
+	return fan_get_status(&s) || s == fan_cooling_status;
+}
+
 static void fan_watchdog_reset(void)
 {
+	unsigned int interval = fan_watchdog_interval();
+
 	if (fan_control_access_mode == TPACPI_FAN_WR_NONE)
 		return;
 
-	if (fan_watchdog_maxinterval > 0 &&
+	if (interval > 0 &&
 	    tpacpi_lifecycle != TPACPI_LIFE_EXITING)
 		mod_delayed_work(tpacpi_wq, &fan_watchdog_task,
-			msecs_to_jiffies(fan_watchdog_maxinterval * 1000));
+			msecs_to_jiffies(interval * 1000));
 	else
 		cancel_delayed_work(&fan_watchdog_task);
 }
 
 static void fan_watchdog_fire(struct work_struct *ignored)
 {
+	bool owned;
 	int rc;
 
 	if (tpacpi_lifecycle != TPACPI_LIFE_RUNNING)
 		return;
 
+	/* armed only for the cooling device: leave other levels alone */
+	if (!fan_watchdog_maxinterval) {
+		mutex_lock(&fan_mutex);
+		owned = fan_cooling_owns_fan();
+		if (!owned)
+			fan_cooling_state = 0;
+		mutex_unlock(&fan_mutex);
+		if (!owned)
+			return;
+	}
+
 	pr_notice("fan watchdog: enabling fan\n");
 	rc = fan_set_enable();
 	if (rc < 0) {
@@ -8410,2115 +10955,5408 @@ static void fan_watchdog_fire(struct work_struct *ignored)
 		       rc);
 		/* reschedule for later */
 		fan_watchdog_reset();
+		return;
 	}
+
+	/* the EC is in charge again */
+	mutex_lock(&fan_mutex);
+	fan_cooling_state = 0;
+	mutex_unlock(&fan_mutex);
 }
 
 /*
- * SYSFS fan layout: hwmon compatible (device)
- *
- * pwm*_enable:
- * 	0: "disengaged" mode
- * 	1: manual mode
- * 	2: native EC "auto" mode (recommended, hardware default)
+ * Fan curve controller
  *
- * pwm*: set speed in manual mode, ignored otherwise.
- * 	0 is level 0; 255 is level 7. Intermediate points done with linear
- * 	interpolation.
- *
- * fan*_input: tachometer reading, RPM
- *
- *
- * SYSFS fan layout: extensions
+ * Closed loop in the kernel, selected by pwm1_enable = 3.  Every
+ * fan_curve_interval ms the temperature of the fan_curve_sensors set is
+ * looked up in the fan_curve table; the fan level is only written when
+ * the table entry changes.  A point is left downwards only once the
+ * temperature has dropped hyst below it.  Any error hands the fan back
+ * to the EC.
  *
- * fan_watchdog (driver):
- * 	fan watchdog interval in seconds, 0 disables (default), max 120
+ * fan_curve:		"<temp>:<level>[:<hyst>] ...", degrees Celsius,
+ *			temperatures ascending, hyst defaults to 2
+ * fan_curve_sensors:	"<n>[:<weight>] ..." (hwmon tempN numbering),
+ *			hottest of the set, or the weighted average when
+ *			weights are given; empty means all sensors
  */
 
-/* sysfs fan pwm1_enable ----------------------------------------------- */
-static ssize_t fan_pwm1_enable_show(struct device *dev,
-				    struct device_attribute *attr,
-				    char *buf)
-{
-	int res, mode;
-	u8 status;
-
-	res = fan_get_status_safe(&status);
-	if (res)
-		return res;
+#define TPACPI_FAN_CURVE_MAX_POINTS	16
+#define TPACPI_FAN_CURVE_DEF_HYST	2	/* degrees */
+#define TPACPI_FAN_CURVE_MIN_TEMP	-128	/* degrees */
+#define TPACPI_FAN_CURVE_MAX_TEMP	255	/* degrees, also max hyst */
+#define TPACPI_FAN_CURVE_MIN_INTERVAL	100	/* ms */
+#define TPACPI_FAN_CURVE_MAX_INTERVAL	60000	/* ms */
+
+struct fan_curve_point {
+	int temp;	/* millidegrees */
+	int hyst;	/* millidegrees */
+	u8 level;
+};
 
-	if (status & TP_EC_FAN_FULLSPEED) {
-		mode = 0;
-	} else if (status & TP_EC_FAN_AUTO) {
-		mode = 2;
-	} else
-		mode = 1;
+static struct {
+	struct fan_curve_point pts[TPACPI_FAN_CURVE_MAX_POINTS];
+	unsigned int npts;
+	u8 weight[TPACPI_MAX_THERMAL_SENSORS];	/* 0: not in the set */
+	bool weighted;
+	unsigned int interval;			/* ms */
+	bool enabled;
+	int cur;				/* active point, -1: none */
+} fan_curve = {
+	.weight = { [0 ... TPACPI_MAX_THERMAL_SENSORS - 1] = 1 },
+	.interval = 2000,
+	.cur = -1,
+};
+static DEFINE_MUTEX(fan_curve_mutex);
 
-	return sysfs_emit(buf, "%d\n", mode);
-}
+static void fan_curve_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(fan_curve_work, fan_curve_worker);
 
-static ssize_t fan_pwm1_enable_store(struct device *dev,
-				     struct device_attribute *attr,
-				     const char *buf, size_t count)
+static int fan_curve_temp(const struct ibm_thermal_sensors_struct *t, int n,
+			  int *temp)
 {
-	unsigned long t;
-	int res, level;
-
-	if (parse_strtoul(buf, 2, &t))
-		return -EINVAL;
+	int i, hottest = INT_MIN;
+	unsigned int wsum = 0;
+	s64 sum = 0;
 
-	tpacpi_disclose_usertask("hwmon pwm1_enable",
-			"set fan mode to %lu\n", t);
+	lockdep_assert_held(&fan_curve_mutex);
 
-	switch (t) {
-	case 0:
-		level = TP_EC_FAN_FULLSPEED;
-		break;
-	case 1:
-		level = TPACPI_FAN_LAST_LEVEL;
-		break;
-	case 2:
-		level = TP_EC_FAN_AUTO;
-		break;
-	case 3:
-		/* reserved for software-controlled auto mode */
-		return -ENOSYS;
-	default:
-		return -EINVAL;
+	for (i = 0; i < n; i++) {
+		if (!fan_curve.weight[i] ||
+		    t->temp[i] == TPACPI_THERMAL_SENSOR_NA)
+			continue;
+		hottest = max(hottest, t->temp[i]);
+		sum += (s64)t->temp[i] * fan_curve.weight[i];
+		wsum += fan_curve.weight[i];
 	}
 
-	res = fan_set_level_safe(level);
-	if (res == -ENXIO)
-		return -EINVAL;
-	else if (res < 0)
-		return res;
+	if (!wsum)
+		return -ENODATA;
 
-	fan_watchdog_reset();
+	*temp = fan_curve.weighted ? div_s64(sum, wsum) : hottest;
 
-	return count;
+	return 0;
 }
 
-static DEVICE_ATTR(pwm1_enable, S_IWUSR | S_IRUGO,
-		   fan_pwm1_enable_show, fan_pwm1_enable_store);
-
-/* sysfs fan pwm1 ------------------------------------------------------ */
-static ssize_t fan_pwm1_show(struct device *dev,
-			     struct device_attribute *attr,
-			     char *buf)
+static int fan_curve_lookup(int temp)
 {
-	int res;
-	u8 status;
-
-	res = fan_get_status_safe(&status);
-	if (res)
-		return res;
+	const struct fan_curve_point *pts = fan_curve.pts;
+	int cur = max(fan_curve.cur, 0);
 
-	if ((status &
-	     (TP_EC_FAN_AUTO | TP_EC_FAN_FULLSPEED)) != 0)
-		status = fan_control_desired_level;
+	lockdep_assert_held(&fan_curve_mutex);
 
-	if (status > 7)
-		status = 7;
+	while (cur + 1 < fan_curve.npts && temp >= pts[cur + 1].temp)
+		cur++;
+	while (cur > 0 && temp < pts[cur].temp - pts[cur].hyst)
+		cur--;
 
-	return sysfs_emit(buf, "%u\n", (status * 255) / 7);
+	return cur;
 }
 
-static ssize_t fan_pwm1_store(struct device *dev,
-			      struct device_attribute *attr,
-			      const char *buf, size_t count)
+static void fan_curve_worker(struct work_struct *work)
 {
-	unsigned long s;
-	int rc;
-	u8 status, newlevel;
-
-	if (parse_strtoul(buf, 255, &s))
-		return -EINVAL;
+	struct ibm_thermal_sensors_struct t;
+	int n, next, temp, rc;
 
-	tpacpi_disclose_usertask("hwmon pwm1",
-			"set fan speed to %lu\n", s);
+	mutex_lock(&fan_curve_mutex);
 
-	/* scale down from 0-255 to 0-7 */
-	newlevel = (s >> 5) & 0x07;
+	if (!fan_curve.enabled || tpacpi_lifecycle != TPACPI_LIFE_RUNNING)
+		goto out;
 
-	if (mutex_lock_killable(&fan_mutex))
-		return -ERESTARTSYS;
+	n = thermal_get_sensors(&t);
+	rc = (n > 0) ? fan_curve_temp(&t, n, &temp) : n;
+	if (rc)
+		goto fail;
 
-	rc = fan_get_status(&status);
-	if (!rc && (status &
-		    (TP_EC_FAN_AUTO | TP_EC_FAN_FULLSPEED)) == 0) {
-		rc = fan_set_level(newlevel);
-		if (rc == -ENXIO)
-			rc = -EINVAL;
-		else if (!rc) {
-			fan_update_desired_level(newlevel);
-			fan_watchdog_reset();
-		}
+	next = fan_curve_lookup(temp);
+	if (next != fan_curve.cur) {
+		rc = fan_set_level_safe(fan_curve.pts[next].level);
+		if (rc)
+			goto fail;
+		dbg_printk(TPACPI_DBG_FAN,
+			   "fan curve: %d mC, level %u\n",
+			   temp, fan_curve.pts[next].level);
+		fan_curve.cur = next;
 	}
 
-	mutex_unlock(&fan_mutex);
-	return (rc) ? rc : count;
+	fan_watchdog_reset();
+	queue_delayed_work(tpacpi_wq, &fan_curve_work,
+			   msecs_to_jiffies(fan_curve.interval));
+	goto out;
+
+fail:
+	pr_err("fan curve: error %d, returning fan control to the EC\n", rc);
+	fan_curve.enabled = false;
+	fan_set_enable();
+out:
+	mutex_unlock(&fan_curve_mutex);
 }
 
-static DEVICE_ATTR(pwm1, S_IWUSR | S_IRUGO, fan_pwm1_show, fan_pwm1_store);
+static void fan_target_disable(void);
+static void fan_prespin_forget(void);
 
-/* sysfs fan fan1_input ------------------------------------------------ */
-static ssize_t fan_fan1_input_show(struct device *dev,
-			   struct device_attribute *attr,
-			   char *buf)
+static int fan_curve_enable(void)
 {
-	int res;
-	unsigned int speed;
+	if (!fan_control_allowed)
+		return -EPERM;
+	if (!(fan_control_commands & TPACPI_FAN_CMD_LEVEL))
+		return -ENXIO;
 
-	res = fan_get_speed(&speed);
-	if (res < 0)
-		return res;
+	fan_target_disable();
 
-	return sysfs_emit(buf, "%u\n", speed);
-}
+	mutex_lock(&fan_curve_mutex);
+	if (!fan_curve.npts) {
+		mutex_unlock(&fan_curve_mutex);
+		return -EINVAL;
+	}
+	fan_curve.enabled = true;
+	fan_curve.cur = -1;
+	mod_delayed_work(tpacpi_wq, &fan_curve_work, 0);
+	mutex_unlock(&fan_curve_mutex);
 
-static DEVICE_ATTR(fan1_input, S_IRUGO, fan_fan1_input_show, NULL);
+	fan_prespin_forget();
 
-/* sysfs fan fan2_input ------------------------------------------------ */
-static ssize_t fan_fan2_input_show(struct device *dev,
-			   struct device_attribute *attr,
-			   char *buf)
+	return 0;
+}
+
+/* anything that takes manual control of the fan stops the curve first */
+static void fan_curve_disable(void)
 {
-	int res;
-	unsigned int speed;
+	mutex_lock(&fan_curve_mutex);
+	fan_curve.enabled = false;
+	mutex_unlock(&fan_curve_mutex);
 
-	res = fan2_get_speed(&speed);
-	if (res < 0)
-		return res;
+	/* may not be called with fan_curve_mutex held */
+	cancel_delayed_work_sync(&fan_curve_work);
+}
 
-	return sysfs_emit(buf, "%u\n", speed);
+static bool fan_curve_is_enabled(void)
+{
+	return READ_ONCE(fan_curve.enabled);
 }
 
-static DEVICE_ATTR(fan2_input, S_IRUGO, fan_fan2_input_show, NULL);
+/*
+ * Target RPM controller
+ *
+ * Writing a speed to fanN_target makes a PI controller hold that fan at
+ * the given RPM.  Its output is a fractional level, realised by spending
+ * the fraction of every dither period at the next higher EC level.  Each
+ * fan is written on its own, so dual-fan models are regulated
+ * independently.  Tunables and controller state live in debugfs
+ * thinkpad_acpi/fan_target/:
+ *
+ *   interval	loop period, ms
+ *   kp		proportional gain, milli-levels per RPM of error
+ *   ki		integral gain, milli-levels per RPM of error per second
+ *   dither	dither period, ms
+ *   state	per fan target, speed, error, integral, output and level
+ */
 
-/* sysfs fan fan_watchdog (hwmon driver) ------------------------------- */
-static ssize_t fan_watchdog_show(struct device_driver *drv, char *buf)
+#define TPACPI_FAN_TARGET_MAX_RPM	10000
+#define TPACPI_FAN_TARGET_MAX_OUT	7000	/* milli-levels */
+
+static struct {
+	u32 interval;
+	u32 kp;
+	u32 ki;
+	u32 dither;
+} fan_target_params = {
+	.interval = 500,
+	.kp = 2,
+	.ki = 1,
+	.dither = 2000,
+};
+
+struct fan_target_state {
+	unsigned int target;	/* RPM, 0: not regulated */
+	unsigned int rpm;
+	int err;
+	int integ;		/* milli-levels */
+	int out;		/* milli-levels */
+	int level;		/* last level written, -1: none */
+	unsigned long period_start;
+};
+
+static struct fan_target_state fan_target[2];
+static unsigned long fan_target_last;
+static DEFINE_MUTEX(fan_target_mutex);
+
+static void fan_target_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(fan_target_work, fan_target_worker);
+
+static bool fan_target_supported(unsigned int fan)
 {
-	return sysfs_emit(buf, "%u\n", fan_watchdog_maxinterval);
+	if (!fan_control_allowed ||
+	    fan_status_access_mode == TPACPI_FAN_NONE ||
+	    fan_status_access_mode == TPACPI_FAN_RD_ACPI_GFAN)
+		return false;
+
+	switch (fan_control_access_mode) {
+	case TPACPI_FAN_WR_ACPI_SFAN:
+	case TPACPI_FAN_WR_TPEC:
+		break;
+	default:
+		return false;
+	}
+
+	return fan == 0 || tp_features.second_fan_ctl;
 }
 
-static ssize_t fan_watchdog_store(struct device_driver *drv, const char *buf,
-				  size_t count)
+static bool fan_target_is_enabled(void)
 {
-	unsigned long t;
+	return READ_ONCE(fan_target[0].target) ||
+	       READ_ONCE(fan_target[1].target);
+}
 
-	if (parse_strtoul(buf, 120, &t))
-		return -EINVAL;
+/* Writes the level of one fan only, unlike fan_set_level() */
+static int fan_set_level_fan(unsigned int fan, int level)
+{
+	bool ok;
 
-	if (!fan_control_allowed)
-		return -EPERM;
+	lockdep_assert_held(&fan_mutex);
 
-	fan_watchdog_maxinterval = t;
-	fan_watchdog_reset();
+	if (!(fan ? fan_select_fan2() : fan_select_fan1()))
+		return -EIO;
 
-	tpacpi_disclose_usertask("fan_watchdog", "set to %lu\n", t);
+	switch (fan_control_access_mode) {
+	case TPACPI_FAN_WR_ACPI_SFAN:
+		ok = acpi_evalf(sfan_handle, NULL, NULL, "vd", level);
+		break;
+	case TPACPI_FAN_WR_TPEC:
+		ok = acpi_ec_write(fan_status_offset, level);
+		break;
+	default:
+		ok = false;
+		break;
+	}
 
-	return count;
-}
-static DRIVER_ATTR_RW(fan_watchdog);
+	fan_select_fan1();
 
-/* --------------------------------------------------------------------- */
+	if (!ok)
+		return -EIO;
 
-static struct attribute *fan_attributes[] = {
-	&dev_attr_pwm1_enable.attr,
-	&dev_attr_pwm1.attr,
-	&dev_attr_fan1_input.attr,
-	&dev_attr_fan2_input.attr,
-	NULL
-};
+	tp_features.fan_ctrl_status_undef = 0;
 
-static umode_t fan_attr_is_visible(struct kobject *kobj, struct attribute *attr,
-				   int n)
+	return 0;
+}
+
+static int fan_target_step(unsigned int fan, unsigned int dt_ms)
 {
-	if (fan_status_access_mode == TPACPI_FAN_NONE &&
-	    fan_control_access_mode == TPACPI_FAN_WR_NONE)
-		return 0;
+	struct fan_target_state *st = &fan_target[fan];
+	unsigned int speed, phase, hi_ms;
+	int level, rc;
 
-	if (attr == &dev_attr_fan2_input.attr) {
-		if (!tp_features.second_fan)
-			return 0;
-	}
+	lockdep_assert_held(&fan_target_mutex);
+	lockdep_assert_held(&fan_mutex);
 
-	return attr->mode;
-}
+	rc = fan ? fan2_get_speed(&speed) : fan_get_speed(&speed);
+	if (rc)
+		return rc;
 
-static const struct attribute_group fan_attr_group = {
-	.is_visible = fan_attr_is_visible,
-	.attrs = fan_attributes,
-};
+	st->rpm = speed;
+	st->err = (int)st->target - (int)speed;
 
-static struct attribute *fan_driver_attributes[] = {
-	&driver_attr_fan_watchdog.attr,
-	NULL
-};
+	/* clamping the integral is all the anti-windup we need */
+	st->integ += div_s64((s64)fan_target_params.ki * st->err * dt_ms,
+			     MSEC_PER_SEC);
+	st->integ = clamp(st->integ, 0, TPACPI_FAN_TARGET_MAX_OUT);
+	st->out = clamp((int)fan_target_params.kp * st->err + st->integ,
+			0, TPACPI_FAN_TARGET_MAX_OUT);
 
-static const struct attribute_group fan_driver_attr_group = {
-	.is_visible = fan_attr_is_visible,
-	.attrs = fan_driver_attributes,
-};
+	phase = jiffies_to_msecs(jiffies - st->period_start);
+	if (phase >= fan_target_params.dither) {
+		st->period_start = jiffies;
+		phase = 0;
+	}
+	hi_ms = (st->out % 1000) * fan_target_params.dither / 1000;
+	level = st->out / 1000 + (phase < hi_ms ? 1 : 0);
 
-#define TPACPI_FAN_Q1		0x0001		/* Uninitialized HFSP */
-#define TPACPI_FAN_2FAN		0x0002		/* EC 0x31 bit 0 selects fan2 */
-#define TPACPI_FAN_2CTL		0x0004		/* selects fan2 control */
-#define TPACPI_FAN_NOFAN	0x0008		/* no fan available */
-#define TPACPI_FAN_NS		0x0010		/* For EC with non-Standard register addresses */
+	if (level == st->level)
+		return 0;
 
-static const struct tpacpi_quirk fan_quirk_table[] __initconst = {
-	TPACPI_QEC_IBM('1', 'Y', TPACPI_FAN_Q1),
-	TPACPI_QEC_IBM('7', '8', TPACPI_FAN_Q1),
-	TPACPI_QEC_IBM('7', '6', TPACPI_FAN_Q1),
-	TPACPI_QEC_IBM('7', '0', TPACPI_FAN_Q1),
-	TPACPI_QEC_LNV('7', 'M', TPACPI_FAN_2FAN),
-	TPACPI_Q_LNV('N', '1', TPACPI_FAN_2FAN),
-	TPACPI_Q_LNV3('N', '1', 'D', TPACPI_FAN_2CTL),	/* P70 */
-	TPACPI_Q_LNV3('N', '1', 'E', TPACPI_FAN_2CTL),	/* P50 */
-	TPACPI_Q_LNV3('N', '1', 'T', TPACPI_FAN_2CTL),	/* P71 */
-	TPACPI_Q_LNV3('N', '1', 'U', TPACPI_FAN_2CTL),	/* P51 */
-	TPACPI_Q_LNV3('N', '2', 'C', TPACPI_FAN_2CTL),	/* P52 / P72 */
-	TPACPI_Q_LNV3('N', '2', 'N', TPACPI_FAN_2CTL),	/* P53 / P73 */
-	TPACPI_Q_LNV3('N', '2', 'E', TPACPI_FAN_2CTL),	/* P1 / X1 Extreme (1st gen) */
-	TPACPI_Q_LNV3('N', '2', 'O', TPACPI_FAN_2CTL),	/* P1 / X1 Extreme (2nd gen) */
-	TPACPI_Q_LNV3('N', '3', '0', TPACPI_FAN_2CTL),	/* P15 (1st gen) / P15v (1st gen) */
-	TPACPI_Q_LNV3('N', '3', '7', TPACPI_FAN_2CTL),  /* T15g (2nd gen) */
-	TPACPI_Q_LNV3('R', '1', 'F', TPACPI_FAN_NS),	/* L13 Yoga Gen 2 */
-	TPACPI_Q_LNV3('N', '2', 'U', TPACPI_FAN_NS),	/* X13 Yoga Gen 2*/
-	TPACPI_Q_LNV3('R', '0', 'R', TPACPI_FAN_NS),	/* L380 */
-	TPACPI_Q_LNV3('R', '1', '5', TPACPI_FAN_NS),	/* L13 Yoga Gen 1 */
-	TPACPI_Q_LNV3('R', '1', '0', TPACPI_FAN_NS),	/* L390 */
-	TPACPI_Q_LNV3('N', '2', 'L', TPACPI_FAN_NS),	/* X13 Yoga Gen 1 */
-	TPACPI_Q_LNV3('R', '0', 'T', TPACPI_FAN_NS),	/* 11e Gen5 GL */
-	TPACPI_Q_LNV3('R', '1', 'D', TPACPI_FAN_NS),	/* 11e Gen5 GL-R */
-	TPACPI_Q_LNV3('R', '0', 'V', TPACPI_FAN_NS),	/* 11e Gen5 KL-Y */
-	TPACPI_Q_LNV3('N', '1', 'O', TPACPI_FAN_NOFAN),	/* X1 Tablet (2nd gen) */
-};
+	rc = fan_set_level_fan(fan, level);
+	if (!rc)
+		st->level = level;
 
-static int __init fan_init(struct ibm_init_struct *iibm)
+	return rc;
+}
+
+static void fan_target_worker(struct work_struct *work)
 {
-	unsigned long quirks;
+	unsigned int dt_ms, fan;
+	int rc = 0;
 
-	vdbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_FAN,
-			"initializing fan subdriver\n");
+	mutex_lock(&fan_target_mutex);
 
-	mutex_init(&fan_mutex);
-	fan_status_access_mode = TPACPI_FAN_NONE;
-	fan_control_access_mode = TPACPI_FAN_WR_NONE;
-	fan_control_commands = 0;
-	fan_watchdog_maxinterval = 0;
-	tp_features.fan_ctrl_status_undef = 0;
-	tp_features.second_fan = 0;
-	tp_features.second_fan_ctl = 0;
-	fan_control_desired_level = 7;
+	if (!fan_target_is_enabled() ||
+	    tpacpi_lifecycle != TPACPI_LIFE_RUNNING)
+		goto out;
 
-	if (tpacpi_is_ibm()) {
-		TPACPI_ACPIHANDLE_INIT(fans);
-		TPACPI_ACPIHANDLE_INIT(gfan);
-		TPACPI_ACPIHANDLE_INIT(sfan);
+	dt_ms = jiffies_to_msecs(jiffies - fan_target_last);
+	fan_target_last = jiffies;
+
+	mutex_lock(&fan_mutex);
+	for (fan = 0; fan < ARRAY_SIZE(fan_target) && !rc; fan++)
+		if (fan_target[fan].target)
+			rc = fan_target_step(fan, dt_ms);
+	mutex_unlock(&fan_mutex);
+
+	if (rc) {
+		pr_err("fan target: error %d, returning fan control to the EC\n",
+		       rc);
+		for (fan = 0; fan < ARRAY_SIZE(fan_target); fan++)
+			WRITE_ONCE(fan_target[fan].target, 0);
+		fan_set_enable();
+		goto out;
 	}
 
-	quirks = tpacpi_check_quirks(fan_quirk_table,
-				     ARRAY_SIZE(fan_quirk_table));
+	fan_watchdog_reset();
+	queue_delayed_work(tpacpi_wq, &fan_target_work,
+		msecs_to_jiffies(max(fan_target_params.interval, 10U)));
+out:
+	mutex_unlock(&fan_target_mutex);
+}
 
-	if (quirks & TPACPI_FAN_NOFAN) {
-		pr_info("No integrated ThinkPad fan available\n");
-		return -ENODEV;
+static int fan_target_set(unsigned int fan, unsigned int rpm)
+{
+	struct fan_target_state *st = &fan_target[fan];
+
+	if (!fan_target_supported(fan))
+		return -ENXIO;
+
+	if (rpm)
+		fan_curve_disable();
+
+	mutex_lock(&fan_target_mutex);
+
+	if (!rpm) {
+		WRITE_ONCE(st->target, 0);
+		if (!fan_target_is_enabled())
+			fan_set_enable();
+		mutex_unlock(&fan_target_mutex);
+		return 0;
 	}
 
-	if (quirks & TPACPI_FAN_NS) {
-		pr_info("ECFW with non-standard fan reg control found\n");
-		fan_with_ns_addr = 1;
-		/* Fan ctrl support from host is undefined for now */
-		tp_features.fan_ctrl_status_undef = 1;
+	if (!st->target) {
+		st->integ = 0;
+		st->level = -1;
+		st->period_start = jiffies;
 	}
+	if (!fan_target_is_enabled())
+		fan_target_last = jiffies;
+	WRITE_ONCE(st->target, rpm);
+	mod_delayed_work(tpacpi_wq, &fan_target_work, 0);
 
-	if (gfan_handle) {
-		/* 570, 600e/x, 770e, 770x */
-		fan_status_access_mode = TPACPI_FAN_RD_ACPI_GFAN;
-	} else {
-		/* all other ThinkPads: note that even old-style
-		 * ThinkPad ECs supports the fan control register */
-		if (fan_with_ns_addr ||
-		    likely(acpi_ec_read(fan_status_offset, &fan_control_initial_status))) {
-			int res;
-			unsigned int speed;
+	mutex_unlock(&fan_target_mutex);
 
-			fan_status_access_mode = fan_with_ns_addr ?
-				TPACPI_FAN_RD_TPEC_NS : TPACPI_FAN_RD_TPEC;
+	fan_prespin_forget();
 
-			if (quirks & TPACPI_FAN_Q1)
-				fan_quirk1_setup();
-			/* Try and probe the 2nd fan */
-			tp_features.second_fan = 1; /* needed for get_speed to work */
-			res = fan2_get_speed(&speed);
-			if (res >= 0 && speed != FAN_NOT_PRESENT) {
-				/* It responded - so let's assume it's there */
-				tp_features.second_fan = 1;
-				/* fan control not currently available for ns ECFW */
-				tp_features.second_fan_ctl = !fan_with_ns_addr;
-				pr_info("secondary fan control detected & enabled\n");
-			} else {
-				/* Fan not auto-detected */
-				tp_features.second_fan = 0;
-				if (quirks & TPACPI_FAN_2FAN) {
-					tp_features.second_fan = 1;
-					pr_info("secondary fan support enabled\n");
-				}
-				if (quirks & TPACPI_FAN_2CTL) {
-					tp_features.second_fan = 1;
-					tp_features.second_fan_ctl = 1;
-					pr_info("secondary fan control enabled\n");
-				}
-			}
-		} else {
-			pr_err("ThinkPad ACPI EC access misbehaving, fan status and control unavailable\n");
-			return -ENODEV;
-		}
-	}
+	return 0;
+}
 
-	if (sfan_handle) {
-		/* 570, 770x-JL */
-		fan_control_access_mode = TPACPI_FAN_WR_ACPI_SFAN;
-		fan_control_commands |=
-		    TPACPI_FAN_CMD_LEVEL | TPACPI_FAN_CMD_ENABLE;
-	} else {
-		if (!gfan_handle) {
-			/* gfan without sfan means no fan control */
-			/* all other models implement TP EC 0x2f control */
+/* anything that takes manual control of the fan stops regulation first */
+static void fan_target_disable(void)
+{
+	mutex_lock(&fan_target_mutex);
+	WRITE_ONCE(fan_target[0].target, 0);
+	WRITE_ONCE(fan_target[1].target, 0);
+	mutex_unlock(&fan_target_mutex);
 
-			if (fans_handle) {
-				/* X31, X40, X41 */
-				fan_control_access_mode =
-				    TPACPI_FAN_WR_ACPI_FANS;
-				fan_control_commands |=
-				    TPACPI_FAN_CMD_SPEED |
-				    TPACPI_FAN_CMD_LEVEL |
-				    TPACPI_FAN_CMD_ENABLE;
-			} else {
-				fan_control_access_mode = TPACPI_FAN_WR_TPEC;
-				fan_control_commands |=
-				    TPACPI_FAN_CMD_LEVEL |
-				    TPACPI_FAN_CMD_ENABLE;
-			}
-		}
-	}
+	cancel_delayed_work_sync(&fan_target_work);
+}
 
-	vdbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_FAN,
-		"fan is %s, modes %d, %d\n",
-		str_supported(fan_status_access_mode != TPACPI_FAN_NONE ||
-		  fan_control_access_mode != TPACPI_FAN_WR_NONE),
-		fan_status_access_mode, fan_control_access_mode);
+static int fan_target_state_show(struct seq_file *m, void *v)
+{
+	const struct fan_target_state *st;
+	unsigned int fan;
 
-	/* fan control master switch */
-	if (!fan_control_allowed) {
-		fan_control_access_mode = TPACPI_FAN_WR_NONE;
-		fan_control_commands = 0;
-		dbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_FAN,
-			   "fan control features disabled by parameter\n");
+	mutex_lock(&fan_target_mutex);
+	for (fan = 0; fan < ARRAY_SIZE(fan_target); fan++) {
+		if (!fan_target_supported(fan))
+			continue;
+		st = &fan_target[fan];
+		seq_printf(m, "fan%u:\ttarget %u rpm %u error %d integral %d output %d level %d\n",
+			   fan + 1, st->target, st->rpm, st->err, st->integ,
+			   st->out, st->level);
 	}
-
-	/* update fan_control_desired_level */
-	if (fan_status_access_mode != TPACPI_FAN_NONE)
-		fan_get_status_safe(NULL);
-
-	if (fan_status_access_mode == TPACPI_FAN_NONE &&
-	    fan_control_access_mode == TPACPI_FAN_WR_NONE)
-		return -ENODEV;
+	mutex_unlock(&fan_target_mutex);
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(fan_target_state);
 
-static void fan_exit(void)
+static void __init fan_target_debugfs_init(void)
 {
-	vdbg_printk(TPACPI_DBG_EXIT | TPACPI_DBG_FAN,
-		    "cancelling any pending fan watchdog tasks\n");
+	struct dentry *dir;
 
-	cancel_delayed_work(&fan_watchdog_task);
-	flush_workqueue(tpacpi_wq);
+	if (!fan_target_supported(0))
+		return;
+
+	dir = debugfs_create_dir("fan_target", tpacpi_debugfs_dir);
+	debugfs_create_u32("interval", 0600, dir, &fan_target_params.interval);
+	debugfs_create_u32("kp", 0600, dir, &fan_target_params.kp);
+	debugfs_create_u32("ki", 0600, dir, &fan_target_params.ki);
+	debugfs_create_u32("dither", 0600, dir, &fan_target_params.dither);
+	debugfs_create_file("state", 0400, dir, NULL,
+			    &fan_target_state_fops);
 }
 
-static void fan_suspend(void)
-{
-	int rc;
+/*
+ * Predictive pre-spin
+ *
+ * EC auto mode only reacts to a temperature, so the CPU may throttle for
+ * a moment on a load spike before the fan catches up.  Fed by the
+ * thermal sampler (see thermal_sample_interval), this tracks the smoothed
+ * slope of the hottest sensor.  Once it rises above fan_prespin_slope
+ * (millidegrees per second, 0 disables) a fan in EC auto mode is raised
+ * to fan_prespin_level, and handed back to the EC when the slope has
+ * flattened and the minimum hold time has passed.
+ *
+ * The throttle time avoided is estimated per episode as the time the
+ * fan spent pre-spun beyond the point where the slope at trigger time
+ * would have crossed fan_prespin_throttle, provided that temperature
+ * was then never reached.  Counters are in debugfs fan_prespin.
+ */
 
-	if (!fan_control_allowed)
-		return;
+#define TPACPI_FAN_PRESPIN_HOLD_MS	5000
 
-	/* Store fan status in cache */
-	fan_control_resume_level = 0;
-	rc = fan_get_status_safe(&fan_control_resume_level);
-	if (rc)
-		pr_notice("failed to read fan level for later restore during resume: %d\n",
-			  rc);
+static struct {
+	unsigned int slope;	/* trigger, millidegrees/s; 0: off */
+	unsigned int level;
+	int throttle;		/* millidegrees */
+
+	/* sampler state */
+	int prev_temp;
+	u64 prev_ns;
+	int cur_slope;		/* smoothed, millidegrees/s */
+	bool active;
+	u64 start_ns;
+	u64 est_cross_ns;	/* projected throttle time, 0: none */
+	int peak;
+	bool stopped;		/* suspended or exiting */
+
+	/* statistics */
+	unsigned int fired;
+	u64 active_ms;
+	u64 avoided_ms;
+} fan_prespin = {
+	.level = 7,
+	.throttle = 95000,
+};
+static DEFINE_MUTEX(fan_prespin_mutex);
 
-	/* if it is undefined, don't attempt to restore it.
-	 * KEEP THIS LAST */
-	if (tp_features.fan_ctrl_status_undef)
-		fan_control_resume_level = 0;
+static bool fan_prespin_supported(void)
+{
+	return fan_control_allowed &&
+	       (fan_control_commands & TPACPI_FAN_CMD_LEVEL) &&
+	       fan_status_access_mode != TPACPI_FAN_NONE;
 }
 
-static void fan_resume(void)
+static void fan_prespin_release(u64 now)
 {
-	u8 current_level = 7;
-	bool do_set = false;
-	int rc;
+	u64 held_ms = div_u64(now - fan_prespin.start_ns, NSEC_PER_MSEC);
 
-	/* DSDT *always* updates status on resume */
-	tp_features.fan_ctrl_status_undef = 0;
+	lockdep_assert_held(&fan_prespin_mutex);
 
-	if (!fan_control_allowed ||
-	    !fan_control_resume_level ||
-	    fan_get_status_safe(&current_level))
-		return;
+	fan_prespin.active = false;
+	fan_prespin.active_ms += held_ms;
+	if (fan_prespin.est_cross_ns && now > fan_prespin.est_cross_ns &&
+	    fan_prespin.peak < fan_prespin.throttle)
+		fan_prespin.avoided_ms += div_u64(now - fan_prespin.est_cross_ns,
+						  NSEC_PER_MSEC);
+}
 
-	switch (fan_control_access_mode) {
-	case TPACPI_FAN_WR_ACPI_SFAN:
-		/* never decrease fan level */
-		do_set = (fan_control_resume_level > current_level);
-		break;
-	case TPACPI_FAN_WR_ACPI_FANS:
-	case TPACPI_FAN_WR_TPEC:
-		/* never decrease fan level, scale is:
-		 * TP_EC_FAN_FULLSPEED > 7 >= TP_EC_FAN_AUTO
-		 *
-		 * We expect the firmware to set either 7 or AUTO, but we
-		 * handle FULLSPEED out of paranoia.
-		 *
-		 * So, we can safely only restore FULLSPEED or 7, anything
-		 * else could slow the fan.  Restoring AUTO is useless, at
-		 * best that's exactly what the DSDT already set (it is the
-		 * slower it uses).
-		 *
-		 * Always keep in mind that the DSDT *will* have set the
-		 * fans to what the vendor supposes is the best level.  We
-		 * muck with it only to speed the fan up.
-		 */
-		if (fan_control_resume_level != 7 &&
-		    !(fan_control_resume_level & TP_EC_FAN_FULLSPEED))
-			return;
-		else
-			do_set = !(current_level & TP_EC_FAN_FULLSPEED) &&
-				 (current_level != fan_control_resume_level);
-		break;
-	default:
-		return;
-	}
-	if (do_set) {
-		pr_notice("restoring fan level to 0x%02x\n",
-			  fan_control_resume_level);
-		rc = fan_set_level_safe(fan_control_resume_level);
-		if (rc < 0)
-			pr_notice("failed to restore fan level: %d\n", rc);
-	}
+static bool fan_prespin_other_controller(void)
+{
+	return fan_curve_is_enabled() || fan_target_is_enabled() ||
+	       READ_ONCE(fan_cooling_state);
 }
 
-static int fan_read(struct seq_file *m)
+static void fan_prespin_sample(int temp, u64 timestamp_ns)
 {
-	int rc;
+	u64 dt_ns;
+	int slope;
 	u8 status;
-	unsigned int speed = 0;
 
-	switch (fan_status_access_mode) {
-	case TPACPI_FAN_RD_ACPI_GFAN:
-		/* 570, 600e/x, 770e, 770x */
-		rc = fan_get_status_safe(&status);
-		if (rc)
-			return rc;
+	if (!fan_prespin_supported())
+		return;
 
-		seq_printf(m, "status:\t\t%s\n"
-			       "level:\t\t%d\n",
-			       str_enabled_disabled(status), status);
-		break;
+	mutex_lock(&fan_prespin_mutex);
 
-	case TPACPI_FAN_RD_TPEC_NS:
-	case TPACPI_FAN_RD_TPEC:
-		/* all except 570, 600e/x, 770e, 770x */
-		rc = fan_get_status_safe(&status);
-		if (rc)
-			return rc;
+	if (fan_prespin.stopped)
+		goto out_unlock;
 
-		seq_printf(m, "status:\t\t%s\n", str_enabled_disabled(status));
+	if (!fan_prespin.prev_ns || timestamp_ns <= fan_prespin.prev_ns)
+		goto out_update;
 
-		rc = fan_get_speed(&speed);
-		if (rc < 0)
-			return rc;
+	dt_ns = timestamp_ns - fan_prespin.prev_ns;
+	slope = div64_s64((s64)(temp - fan_prespin.prev_temp) * NSEC_PER_SEC,
+			  dt_ns);
+	/* EMA, alpha = 1/2: the EC reports whole degrees only */
+	fan_prespin.cur_slope = (fan_prespin.cur_slope + slope) / 2;
 
-		seq_printf(m, "speed:\t\t%d\n", speed);
+	if (fan_prespin.active) {
+		fan_prespin.peak = max(fan_prespin.peak, temp);
 
-		if (fan_status_access_mode == TPACPI_FAN_RD_TPEC_NS) {
-			/*
-			 * No full speed bit in NS EC
-			 * EC Auto mode is set by default.
-			 * No other levels settings available
-			 */
-			seq_printf(m, "level:\t\t%s\n", status & FAN_NS_CTRL ? "unknown" : "auto");
-		} else {
-			if (status & TP_EC_FAN_FULLSPEED)
-				/* Disengaged mode takes precedence */
-				seq_printf(m, "level:\t\tdisengaged\n");
-			else if (status & TP_EC_FAN_AUTO)
-				seq_printf(m, "level:\t\tauto\n");
-			else
-				seq_printf(m, "level:\t\t%d\n", status);
+		/* back in EC auto mode already, nothing to hand back */
+		if (fan_get_status_safe(&status) ||
+		    (status & TP_EC_FAN_AUTO)) {
+			fan_prespin_release(timestamp_ns);
+			goto out_update;
 		}
-		break;
-
-	case TPACPI_FAN_NONE:
-	default:
-		seq_printf(m, "status:\t\tnot supported\n");
-	}
 
-	if (fan_control_commands & TPACPI_FAN_CMD_LEVEL) {
-		seq_printf(m, "commands:\tlevel <level>");
+		if (fan_prespin.cur_slope <= (int)fan_prespin.slope / 4 &&
+		    timestamp_ns - fan_prespin.start_ns >=
+				TPACPI_FAN_PRESPIN_HOLD_MS * NSEC_PER_MSEC) {
+			fan_prespin_release(timestamp_ns);
+			if (fan_set_level_safe(TP_EC_FAN_AUTO))
+				pr_err("fan pre-spin: unable to return the fan to the EC\n");
+		}
+	} else if (fan_prespin.slope &&
+		   fan_prespin.cur_slope >= (int)fan_prespin.slope) {
+		/* never fight another controller */
+		if (fan_prespin_other_controller() ||
+		    fan_get_status_safe(&status) ||
+		    !(status & TP_EC_FAN_AUTO))
+			goto out_update;
+
+		if (fan_set_level_safe(fan_prespin.level))
+			goto out_update;
+
+		fan_prespin.active = true;
+		fan_prespin.fired++;
+		fan_prespin.start_ns = timestamp_ns;
+		fan_prespin.peak = temp;
+		fan_prespin.est_cross_ns = 0;
+		if (temp < fan_prespin.throttle)
+			fan_prespin.est_cross_ns = timestamp_ns +
+				div_u64((u64)(fan_prespin.throttle - temp) *
+					NSEC_PER_SEC, fan_prespin.cur_slope);
+
+		dbg_printk(TPACPI_DBG_FAN,
+			   "fan pre-spin: %d mC/s at %d mC, level %u\n",
+			   fan_prespin.cur_slope, temp, fan_prespin.level);
+	}
+
+out_update:
+	fan_prespin.prev_temp = temp;
+	fan_prespin.prev_ns = timestamp_ns;
+out_unlock:
+	mutex_unlock(&fan_prespin_mutex);
+}
 
-		switch (fan_control_access_mode) {
-		case TPACPI_FAN_WR_ACPI_SFAN:
-			seq_printf(m, " (<level> is 0-7)\n");
-			break;
+/*
+ * Called by every other fan controller once it has taken the fan: ends
+ * an episode without touching the fan, which is no longer ours.
+ */
+static void fan_prespin_forget(void)
+{
+	mutex_lock(&fan_prespin_mutex);
+	if (fan_prespin.active)
+		fan_prespin_release(ktime_get_ns());
+	mutex_unlock(&fan_prespin_mutex);
+}
 
-		default:
-			seq_printf(m, " (<level> is 0-7, auto, disengaged, full-speed)\n");
-			break;
-		}
+/* Hands a pre-spun fan back to the EC, for suspend and exit */
+static void fan_prespin_stop(void)
+{
+	mutex_lock(&fan_prespin_mutex);
+	fan_prespin.stopped = true;
+	if (fan_prespin.active) {
+		fan_prespin_release(ktime_get_ns());
+		if (fan_set_level_safe(TP_EC_FAN_AUTO))
+			pr_err("fan pre-spin: unable to return the fan to the EC\n");
 	}
+	/* the slope across a suspend means nothing */
+	fan_prespin.prev_ns = 0;
+	mutex_unlock(&fan_prespin_mutex);
+}
 
-	if (fan_control_commands & TPACPI_FAN_CMD_ENABLE)
-		seq_printf(m, "commands:\tenable, disable\n"
-			       "commands:\twatchdog <timeout> (<timeout> is 0 (off), 1-120 (seconds))\n");
+static void fan_prespin_restart(void)
+{
+	mutex_lock(&fan_prespin_mutex);
+	fan_prespin.stopped = false;
+	mutex_unlock(&fan_prespin_mutex);
+}
 
-	if (fan_control_commands & TPACPI_FAN_CMD_SPEED)
-		seq_printf(m, "commands:\tspeed <speed> (<speed> is 0-65535)\n");
+static int fan_prespin_stats_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&fan_prespin_mutex);
+	seq_printf(m, "slope:\t\t\t%d mC/s\n", fan_prespin.cur_slope);
+	seq_printf(m, "active:\t\t\t%d\n", fan_prespin.active);
+	seq_printf(m, "fired:\t\t\t%u\n", fan_prespin.fired);
+	seq_printf(m, "active time:\t\t%llu ms\n", fan_prespin.active_ms);
+	seq_printf(m, "throttle avoided (est):\t%llu ms\n",
+		   fan_prespin.avoided_ms);
+	mutex_unlock(&fan_prespin_mutex);
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(fan_prespin_stats);
 
-static int fan_write_cmd_level(const char *cmd, int *rc)
-{
-	int level;
+/*
+ * Thermal cooling device
+ *
+ * Registered when fan control is enabled, so that thermal governors can
+ * drive the fan from thermal zones.  Cooling states:
+ *
+ *   0		EC automatic control
+ *   1-7	manual fan level 1-7 (both fans on dual-fan models)
+ *   8		full speed ("disengaged"; level 7 with SFAN)
+ *
+ * Level 0 (fan off) is deliberately not reachable from a governor.
+ *
+ * A manual state is armed by fan_watchdog, or by a fixed
+ * TPACPI_FAN_COOLING_WATCHDOG timeout when that is off: our thermal
+ * zones keep it alive on every poll, so the EC takes the fan back should
+ * the thermal loop stop running.  State 0 hands the fan back to the EC
+ * only while it is still at the level the cooling device left it at; a
+ * level set through another interface since then is kept.
+ */
 
-	if (strstarts(cmd, "level auto"))
-		level = TP_EC_FAN_AUTO;
-	else if (strstarts(cmd, "level disengaged") || strstarts(cmd, "level full-speed"))
-		level = TP_EC_FAN_FULLSPEED;
-	else if (sscanf(cmd, "level %d", &level) != 1)
-		return 0;
+#define TPACPI_FAN_COOLING_MAX_STATE	8
 
-	*rc = fan_set_level_safe(level);
-	if (*rc == -ENXIO)
-		pr_err("level command accepted for unsupported access mode %d\n",
-		       fan_control_access_mode);
-	else if (!*rc)
-		tpacpi_disclose_usertask("procfs fan",
-			"set level to %d\n", level);
+static int fan_cooling_get_max_state(struct thermal_cooling_device *cdev,
+				     unsigned long *state)
+{
+	*state = TPACPI_FAN_COOLING_MAX_STATE;
+	return 0;
+}
 
-	return 1;
+static int fan_cooling_get_cur_state(struct thermal_cooling_device *cdev,
+				     unsigned long *state)
+{
+	*state = READ_ONCE(fan_cooling_state);
+	return 0;
 }
 
-static int fan_write_cmd_enable(const char *cmd, int *rc)
+static int fan_cooling_set_cur_state(struct thermal_cooling_device *cdev,
+				     unsigned long state)
 {
-	if (!strstarts(cmd, "enable"))
-		return 0;
+	bool owned;
+	int level = 0, rc;
 
-	*rc = fan_set_enable();
-	if (*rc == -ENXIO)
-		pr_err("enable command accepted for unsupported access mode %d\n",
-		       fan_control_access_mode);
-	else if (!*rc)
-		tpacpi_disclose_usertask("procfs fan", "enable\n");
-
-	return 1;
-}
+	if (state > TPACPI_FAN_COOLING_MAX_STATE)
+		return -EINVAL;
+	if (fan_curve_is_enabled() || fan_target_is_enabled())
+		return -EBUSY;
 
-static int fan_write_cmd_disable(const char *cmd, int *rc)
-{
-	if (!strstarts(cmd, "disable"))
-		return 0;
+	if (state == 0) {
+		mutex_lock(&fan_mutex);
+		owned = fan_cooling_owns_fan();
+		if (!owned)
+			fan_cooling_state = 0;
+		mutex_unlock(&fan_mutex);
+		if (!owned) {
+			fan_watchdog_reset();
+			return 0;
+		}
 
-	*rc = fan_set_disable();
-	if (*rc == -ENXIO)
-		pr_err("disable command accepted for unsupported access mode %d\n",
-		       fan_control_access_mode);
-	else if (!*rc)
-		tpacpi_disclose_usertask("procfs fan", "disable\n");
+		if (fan_control_access_mode == TPACPI_FAN_WR_ACPI_SFAN)
+			rc = fan_set_enable();
+		else
+			rc = fan_set_level_safe(TP_EC_FAN_AUTO);
+	} else {
+		if (state < TPACPI_FAN_COOLING_MAX_STATE)
+			level = state;
+		else if (fan_control_access_mode == TPACPI_FAN_WR_ACPI_SFAN)
+			level = 7;
+		else
+			level = TP_EC_FAN_FULLSPEED;
 
-	return 1;
-}
+		rc = fan_set_level_safe(level);
+	}
+	if (rc)
+		return rc;
 
-static int fan_write_cmd_speed(const char *cmd, int *rc)
-{
-	int speed;
+	mutex_lock(&fan_mutex);
+	fan_cooling_state = state;
+	if (state && fan_get_status(&fan_cooling_status))
+		fan_cooling_status = level;
+	mutex_unlock(&fan_mutex);
 
-	/* TODO:
-	 * Support speed <low> <medium> <high> ? */
+	if (state)
+		fan_prespin_forget();
+	fan_watchdog_reset();
 
-	if (sscanf(cmd, "speed %d", &speed) != 1)
-		return 0;
+	return 0;
+}
 
-	*rc = fan_set_speed(speed);
-	if (*rc == -ENXIO)
-		pr_err("speed command accepted for unsupported access mode %d\n",
-		       fan_control_access_mode);
-	else if (!*rc)
-		tpacpi_disclose_usertask("procfs fan",
-			"set speed to %d\n", speed);
+static const struct thermal_cooling_device_ops fan_cooling_ops = {
+	.get_max_state = fan_cooling_get_max_state,
+	.get_cur_state = fan_cooling_get_cur_state,
+	.set_cur_state = fan_cooling_set_cur_state,
+};
 
-	return 1;
+/* called on every thermal zone poll */
+static void fan_cooling_keepalive(void)
+{
+	if (fan_cooling_dev && READ_ONCE(fan_cooling_state))
+		fan_watchdog_reset();
 }
 
-static int fan_write_cmd_watchdog(const char *cmd, int *rc)
+static void __init fan_cooling_register(void)
 {
-	int interval;
+	struct thermal_cooling_device *cdev;
 
-	if (sscanf(cmd, "watchdog %d", &interval) != 1)
-		return 0;
+	if (!fan_control_allowed ||
+	    !(fan_control_commands & TPACPI_FAN_CMD_LEVEL))
+		return;
 
-	if (interval < 0 || interval > 120)
-		*rc = -EINVAL;
-	else {
-		fan_watchdog_maxinterval = interval;
-		tpacpi_disclose_usertask("procfs fan",
-			"set watchdog timer to %d\n",
-			interval);
+	cdev = thermal_cooling_device_register("tpacpi-fan", NULL,
+					       &fan_cooling_ops);
+	if (IS_ERR(cdev)) {
+		pr_err("unable to register fan cooling device: %ld\n",
+		       PTR_ERR(cdev));
+		return;
 	}
 
-	return 1;
+	fan_cooling_dev = cdev;
 }
 
-static int fan_write(char *buf)
+static void fan_cooling_unregister(void)
 {
-	char *cmd;
-	int rc = 0;
-
-	while (!rc && (cmd = strsep(&buf, ","))) {
-		if (!((fan_control_commands & TPACPI_FAN_CMD_LEVEL) &&
-		      fan_write_cmd_level(cmd, &rc)) &&
-		    !((fan_control_commands & TPACPI_FAN_CMD_ENABLE) &&
-		      (fan_write_cmd_enable(cmd, &rc) ||
-		       fan_write_cmd_disable(cmd, &rc) ||
-		       fan_write_cmd_watchdog(cmd, &rc))) &&
-		    !((fan_control_commands & TPACPI_FAN_CMD_SPEED) &&
-		      fan_write_cmd_speed(cmd, &rc))
-		    )
-			rc = -EINVAL;
-		else if (!rc)
-			fan_watchdog_reset();
-	}
-
-	return rc;
+	if (fan_cooling_dev)
+		thermal_cooling_device_unregister(fan_cooling_dev);
+	fan_cooling_dev = NULL;
 }
 
-static struct ibm_struct fan_driver_data = {
-	.name = "fan",
-	.read = fan_read,
-	.write = fan_write,
-	.exit = fan_exit,
-	.suspend = fan_suspend,
-	.resume = fan_resume,
-};
-
-/*************************************************************************
- * Mute LED subdriver
+/*
+ * SYSFS fan layout: hwmon compatible (device)
+ *
+ * pwm*_enable:
+ * 	0: "disengaged" mode
+ * 	1: manual mode
+ * 	2: native EC "auto" mode (recommended, hardware default)
+ *
+ * pwm*: set speed in manual mode, ignored otherwise.
+ * 	0 is level 0; 255 is level 7. Intermediate points done with linear
+ * 	interpolation.
+ *
+ * fan*_input: tachometer reading, RPM
+ *
+ *
+ * SYSFS fan layout: extensions
+ *
+ * fan_watchdog (driver):
+ * 	fan watchdog interval in seconds, 0 disables (default), max 120
  */
 
-#define TPACPI_LED_MAX		2
-
-struct tp_led_table {
-	acpi_string name;
-	int on_value;
-	int off_value;
-	int state;
-};
-
-static struct tp_led_table led_tables[TPACPI_LED_MAX] = {
-	[LED_AUDIO_MUTE] = {
-		.name = "SSMS",
-		.on_value = 1,
-		.off_value = 0,
-	},
-	[LED_AUDIO_MICMUTE] = {
-		.name = "MMTS",
-		.on_value = 2,
-		.off_value = 0,
-	},
-};
-
-static int mute_led_on_off(struct tp_led_table *t, bool state)
+/* sysfs fan pwm1_enable ----------------------------------------------- */
+static ssize_t fan_pwm1_enable_show(struct device *dev,
+				    struct device_attribute *attr,
+				    char *buf)
 {
-	acpi_handle temp;
-	int output;
-
-	if (ACPI_FAILURE(acpi_get_handle(hkey_handle, t->name, &temp))) {
-		pr_warn("Thinkpad ACPI has no %s interface.\n", t->name);
-		return -EIO;
-	}
-
-	if (!acpi_evalf(hkey_handle, &output, t->name, "dd",
-			state ? t->on_value : t->off_value))
-		return -EIO;
+	int res, mode;
+	u8 status;
 
-	t->state = state;
-	return state;
-}
+	if (fan_curve_is_enabled())
+		return sysfs_emit(buf, "3\n");
 
-static int tpacpi_led_set(int whichled, bool on)
-{
-	struct tp_led_table *t;
+	res = fan_get_status_safe(&status);
+	if (res)
+		return res;
 
-	t = &led_tables[whichled];
-	if (t->state < 0 || t->state == on)
-		return t->state;
-	return mute_led_on_off(t, on);
-}
+	if (status & TP_EC_FAN_FULLSPEED) {
+		mode = 0;
+	} else if (status & TP_EC_FAN_AUTO) {
+		mode = 2;
+	} else
+		mode = 1;
 
-static int tpacpi_led_mute_set(struct led_classdev *led_cdev,
-			       enum led_brightness brightness)
-{
-	return tpacpi_led_set(LED_AUDIO_MUTE, brightness != LED_OFF);
+	return sysfs_emit(buf, "%d\n", mode);
 }
 
-static int tpacpi_led_micmute_set(struct led_classdev *led_cdev,
-				  enum led_brightness brightness)
+static ssize_t fan_pwm1_enable_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
 {
-	return tpacpi_led_set(LED_AUDIO_MICMUTE, brightness != LED_OFF);
-}
+	unsigned long t;
+	int res, level;
 
-static struct led_classdev mute_led_cdev[TPACPI_LED_MAX] = {
-	[LED_AUDIO_MUTE] = {
-		.name		= "platform::mute",
-		.max_brightness = 1,
-		.brightness_set_blocking = tpacpi_led_mute_set,
-		.default_trigger = "audio-mute",
-	},
-	[LED_AUDIO_MICMUTE] = {
-		.name		= "platform::micmute",
-		.max_brightness = 1,
-		.brightness_set_blocking = tpacpi_led_micmute_set,
-		.default_trigger = "audio-micmute",
-	},
-};
+	if (parse_strtoul(buf, 3, &t))
+		return -EINVAL;
 
-static int mute_led_init(struct ibm_init_struct *iibm)
-{
-	acpi_handle temp;
-	int i, err;
+	tpacpi_disclose_usertask("hwmon pwm1_enable",
+			"set fan mode to %lu\n", t);
 
-	for (i = 0; i < TPACPI_LED_MAX; i++) {
-		struct tp_led_table *t = &led_tables[i];
-		if (ACPI_FAILURE(acpi_get_handle(hkey_handle, t->name, &temp))) {
-			t->state = -ENODEV;
-			continue;
-		}
+	if (t == 3) {
+		res = fan_curve_enable();
+		return res ? res : count;
+	}
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_forget();
 
-		err = led_classdev_register(&tpacpi_pdev->dev, &mute_led_cdev[i]);
-		if (err < 0) {
-			while (i--)
-				led_classdev_unregister(&mute_led_cdev[i]);
-			return err;
-		}
+	switch (t) {
+	case 0:
+		level = TP_EC_FAN_FULLSPEED;
+		break;
+	case 1:
+		level = TPACPI_FAN_LAST_LEVEL;
+		break;
+	case 2:
+		level = TP_EC_FAN_AUTO;
+		break;
+	default:
+		return -EINVAL;
 	}
-	return 0;
-}
 
-static void mute_led_exit(void)
-{
-	int i;
+	res = fan_set_level_safe(level);
+	if (res == -ENXIO)
+		return -EINVAL;
+	else if (res < 0)
+		return res;
 
-	for (i = 0; i < TPACPI_LED_MAX; i++) {
-		led_classdev_unregister(&mute_led_cdev[i]);
-		tpacpi_led_set(i, false);
-	}
+	fan_watchdog_reset();
+
+	return count;
 }
 
-static void mute_led_resume(void)
-{
-	int i;
+static DEVICE_ATTR(pwm1_enable, S_IWUSR | S_IRUGO,
+		   fan_pwm1_enable_show, fan_pwm1_enable_store);
 
-	for (i = 0; i < TPACPI_LED_MAX; i++) {
-		struct tp_led_table *t = &led_tables[i];
-		if (t->state >= 0)
-			mute_led_on_off(t, t->state);
-	}
-}
-
-static struct ibm_struct mute_led_driver_data = {
-	.name = "mute_led",
-	.exit = mute_led_exit,
-	.resume = mute_led_resume,
-};
-
-/*
- * Battery Wear Control Driver
- * Contact: Ognjen Galic <smclt30p@gmail.com>
- */
+/* sysfs fan pwm1 ------------------------------------------------------ */
+static ssize_t fan_pwm1_show(struct device *dev,
+			     struct device_attribute *attr,
+			     char *buf)
+{
+	int res;
+	u8 status;
 
-/* Metadata */
+	res = fan_get_status_safe(&status);
+	if (res)
+		return res;
 
-#define GET_START	"BCTG"
-#define SET_START	"BCCS"
-#define GET_STOP	"BCSG"
-#define SET_STOP	"BCSS"
-#define GET_DISCHARGE	"BDSG"
-#define SET_DISCHARGE	"BDSS"
-#define GET_INHIBIT	"BICG"
-#define SET_INHIBIT	"BICS"
+	if ((status &
+	     (TP_EC_FAN_AUTO | TP_EC_FAN_FULLSPEED)) != 0)
+		status = fan_control_desired_level;
 
-enum {
-	BAT_ANY = 0,
-	BAT_PRIMARY = 1,
-	BAT_SECONDARY = 2
-};
+	if (status > 7)
+		status = 7;
 
-enum {
-	/* Error condition bit */
-	METHOD_ERR = BIT(31),
-};
+	return sysfs_emit(buf, "%u\n", (status * 255) / 7);
+}
 
-enum {
-	/* This is used in the get/set helpers */
-	THRESHOLD_START,
-	THRESHOLD_STOP,
-	FORCE_DISCHARGE,
-	INHIBIT_CHARGE,
-};
+static ssize_t fan_pwm1_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	unsigned long s;
+	int rc;
+	u8 status, newlevel;
 
-struct tpacpi_battery_data {
-	int charge_start;
-	int start_support;
-	int charge_stop;
-	int stop_support;
-	unsigned int charge_behaviours;
-};
+	if (parse_strtoul(buf, 255, &s))
+		return -EINVAL;
 
-struct tpacpi_battery_driver_data {
-	struct tpacpi_battery_data batteries[3];
-	int individual_addressing;
-};
+	tpacpi_disclose_usertask("hwmon pwm1",
+			"set fan speed to %lu\n", s);
 
-static struct tpacpi_battery_driver_data battery_info;
+	/* scale down from 0-255 to 0-7 */
+	newlevel = (s >> 5) & 0x07;
 
-/* ACPI helpers/functions/probes */
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_forget();
 
-/*
- * This evaluates a ACPI method call specific to the battery
- * ACPI extension. The specifics are that an error is marked
- * in the 32rd bit of the response, so we just check that here.
- */
-static acpi_status tpacpi_battery_acpi_eval(char *method, int *ret, int param)
-{
-	int response;
+	if (mutex_lock_killable(&fan_mutex))
+		return -ERESTARTSYS;
 
-	if (!acpi_evalf(hkey_handle, &response, method, "dd", param)) {
-		acpi_handle_err(hkey_handle, "%s: evaluate failed", method);
-		return AE_ERROR;
-	}
-	if (response & METHOD_ERR) {
-		acpi_handle_err(hkey_handle,
-				"%s evaluated but flagged as error", method);
-		return AE_ERROR;
+	rc = fan_get_status(&status);
+	if (!rc && (status &
+		    (TP_EC_FAN_AUTO | TP_EC_FAN_FULLSPEED)) == 0) {
+		rc = fan_set_level(newlevel);
+		if (rc == -ENXIO)
+			rc = -EINVAL;
+		else if (!rc) {
+			fan_update_desired_level(newlevel);
+			fan_watchdog_reset();
+		}
 	}
-	*ret = response;
-	return AE_OK;
+
+	mutex_unlock(&fan_mutex);
+	return (rc) ? rc : count;
 }
 
-static int tpacpi_battery_get(int what, int battery, int *ret)
+static DEVICE_ATTR(pwm1, S_IWUSR | S_IRUGO, fan_pwm1_show, fan_pwm1_store);
+
+/* sysfs fan fan_curve ------------------------------------------------- */
+static ssize_t fan_curve_show(struct device *dev,
+			      struct device_attribute *attr,
+			      char *buf)
 {
-	switch (what) {
-	case THRESHOLD_START:
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_START, ret, battery))
-			return -ENODEV;
+	const struct fan_curve_point *p;
+	int i, len = 0;
 
-		/* The value is in the low 8 bits of the response */
-		*ret = *ret & 0xFF;
-		return 0;
-	case THRESHOLD_STOP:
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_STOP, ret, battery))
-			return -ENODEV;
-		/* Value is in lower 8 bits */
-		*ret = *ret & 0xFF;
-		/*
-		 * On the stop value, if we return 0 that
-		 * does not make any sense. 0 means Default, which
-		 * means that charging stops at 100%, so we return
-		 * that.
-		 */
-		if (*ret == 0)
-			*ret = 100;
-		return 0;
-	case FORCE_DISCHARGE:
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_DISCHARGE, ret, battery))
-			return -ENODEV;
-		/* The force discharge status is in bit 0 */
-		*ret = *ret & 0x01;
-		return 0;
-	case INHIBIT_CHARGE:
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_INHIBIT, ret, battery))
-			return -ENODEV;
-		/* The inhibit charge status is in bit 0 */
-		*ret = *ret & 0x01;
-		return 0;
-	default:
-		pr_crit("wrong parameter: %d", what);
-		return -EINVAL;
+	mutex_lock(&fan_curve_mutex);
+	for (i = 0; i < fan_curve.npts; i++) {
+		p = &fan_curve.pts[i];
+		len += sysfs_emit_at(buf, len, "%s%d:%u:%d", i ? " " : "",
+				     p->temp / 1000, p->level, p->hyst / 1000);
 	}
+	mutex_unlock(&fan_curve_mutex);
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
 }
 
-static int tpacpi_battery_set(int what, int battery, int value)
+static ssize_t fan_curve_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
 {
-	int param, ret;
-	/* The first 8 bits are the value of the threshold */
-	param = value;
-	/* The battery ID is in bits 8-9, 2 bits */
-	param |= battery << 8;
+	struct fan_curve_point pts[TPACPI_FAN_CURVE_MAX_POINTS];
+	unsigned int npts = 0, level;
+	char *list, *p, *tok;
+	int temp, hyst, n;
+	int rc = 0;
 
-	switch (what) {
-	case THRESHOLD_START:
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_START, &ret, param)) {
-			pr_err("failed to set charge threshold on battery %d",
-					battery);
-			return -ENODEV;
-		}
-		return 0;
-	case THRESHOLD_STOP:
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_STOP, &ret, param)) {
-			pr_err("failed to set stop threshold: %d", battery);
-			return -ENODEV;
-		}
-		return 0;
-	case FORCE_DISCHARGE:
-		/* Force discharge is in bit 0,
-		 * break on AC attach is in bit 1 (won't work on some ThinkPads),
-		 * battery ID is in bits 8-9, 2 bits.
-		 */
-		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_DISCHARGE, &ret, param))) {
-			pr_err("failed to set force discharge on %d", battery);
-			return -ENODEV;
-		}
-		return 0;
-	case INHIBIT_CHARGE:
-		/* When setting inhibit charge, we set a default value of
-		 * always breaking on AC detach and the effective time is set to
-		 * be permanent.
-		 * The battery ID is in bits 4-5, 2 bits,
-		 * the effective time is in bits 8-23, 2 bytes.
-		 * A time of FFFF indicates forever.
-		 */
-		param = value;
-		param |= battery << 4;
-		param |= 0xFFFF << 8;
-		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_INHIBIT, &ret, param))) {
-			pr_err("failed to set inhibit charge on %d", battery);
-			return -ENODEV;
+	list = kstrndup(buf, count, GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+
+	p = list;
+	while ((tok = strsep(&p, " ,\t\n"))) {
+		if (!*tok)
+			continue;
+
+		hyst = TPACPI_FAN_CURVE_DEF_HYST;
+		n = sscanf(tok, "%d:%u:%d", &temp, &level, &hyst);
+		if (n < 2 || level > 7 ||
+		    temp < TPACPI_FAN_CURVE_MIN_TEMP ||
+		    temp > TPACPI_FAN_CURVE_MAX_TEMP ||
+		    hyst < 0 || hyst > TPACPI_FAN_CURVE_MAX_TEMP ||
+		    npts >= TPACPI_FAN_CURVE_MAX_POINTS ||
+		    (npts && temp * 1000 <= pts[npts - 1].temp)) {
+			rc = -EINVAL;
+			break;
 		}
-		return 0;
-	default:
-		pr_crit("wrong parameter: %d", what);
-		return -EINVAL;
+
+		pts[npts].temp = temp * 1000;
+		pts[npts].hyst = hyst * 1000;
+		pts[npts].level = level;
+		npts++;
 	}
-}
+	kfree(list);
 
-static int tpacpi_battery_set_validate(int what, int battery, int value)
-{
-	int ret, v;
+	if (rc)
+		return rc;
 
-	ret = tpacpi_battery_set(what, battery, value);
-	if (ret < 0)
-		return ret;
+	tpacpi_disclose_usertask("hwmon fan_curve",
+			"set a %u point curve\n", npts);
 
-	ret = tpacpi_battery_get(what, battery, &v);
-	if (ret < 0)
-		return ret;
+	mutex_lock(&fan_curve_mutex);
+	memcpy(fan_curve.pts, pts, npts * sizeof(pts[0]));
+	fan_curve.npts = npts;
+	fan_curve.cur = -1;
+	if (fan_curve.enabled) {
+		if (npts) {
+			mod_delayed_work(tpacpi_wq, &fan_curve_work, 0);
+		} else {
+			/* nothing left to follow */
+			fan_curve.enabled = false;
+			fan_set_enable();
+		}
+	}
+	mutex_unlock(&fan_curve_mutex);
 
-	if (v == value)
-		return 0;
+	return count;
+}
 
-	msleep(500);
+static DEVICE_ATTR_RW(fan_curve);
 
-	ret = tpacpi_battery_get(what, battery, &v);
-	if (ret < 0)
-		return ret;
+/* sysfs fan fan_curve_sensors ----------------------------------------- */
+static ssize_t fan_curve_sensors_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	int i, len = 0;
 
-	if (v == value)
-		return 0;
+	mutex_lock(&fan_curve_mutex);
+	for (i = 0; i < TPACPI_MAX_THERMAL_SENSORS; i++) {
+		if (!fan_curve.weight[i])
+			continue;
+		len += sysfs_emit_at(buf, len, len ? " %d" : "%d", i + 1);
+		if (fan_curve.weighted)
+			len += sysfs_emit_at(buf, len, ":%u",
+					     fan_curve.weight[i]);
+	}
+	mutex_unlock(&fan_curve_mutex);
+	len += sysfs_emit_at(buf, len, "\n");
 
-	return -EIO;
+	return len;
 }
 
-static int tpacpi_battery_probe(int battery)
+static ssize_t fan_curve_sensors_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
 {
-	int ret = 0;
+	u8 weight[TPACPI_MAX_THERMAL_SENSORS] = { };
+	unsigned int idx, w;
+	bool weighted = false, any = false;
+	char *list, *p, *tok;
+	int n, rc = 0;
 
-	memset(&battery_info.batteries[battery], 0,
-		sizeof(battery_info.batteries[battery]));
+	list = kstrndup(buf, count, GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
 
-	/*
-	 * 1) Get the current start threshold
-	 * 2) Check for support
-	 * 3) Get the current stop threshold
-	 * 4) Check for support
-	 * 5) Get the current force discharge status
-	 * 6) Check for support
-	 * 7) Get the current inhibit charge status
-	 * 8) Check for support
-	 */
-	if (acpi_has_method(hkey_handle, GET_START)) {
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_START, &ret, battery)) {
-			pr_err("Error probing battery %d\n", battery);
-			return -ENODEV;
-		}
-		/* Individual addressing is in bit 9 */
-		if (ret & BIT(9))
-			battery_info.individual_addressing = true;
-		/* Support is marked in bit 8 */
-		if (ret & BIT(8))
-			battery_info.batteries[battery].start_support = 1;
-		else
-			return -ENODEV;
-		if (tpacpi_battery_get(THRESHOLD_START, battery,
-			&battery_info.batteries[battery].charge_start)) {
-			pr_err("Error probing battery %d\n", battery);
-			return -ENODEV;
-		}
-	}
-	if (acpi_has_method(hkey_handle, GET_STOP)) {
-		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_STOP, &ret, battery)) {
-			pr_err("Error probing battery stop; %d\n", battery);
-			return -ENODEV;
-		}
-		/* Support is marked in bit 8 */
-		if (ret & BIT(8))
-			battery_info.batteries[battery].stop_support = 1;
-		else
-			return -ENODEV;
-		if (tpacpi_battery_get(THRESHOLD_STOP, battery,
-			&battery_info.batteries[battery].charge_stop)) {
-			pr_err("Error probing battery stop: %d\n", battery);
-			return -ENODEV;
-		}
-	}
-	if (acpi_has_method(hkey_handle, GET_DISCHARGE)) {
-		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_DISCHARGE, &ret, battery))) {
-			pr_err("Error probing battery discharge; %d\n", battery);
-			return -ENODEV;
-		}
-		/* Support is marked in bit 8 */
-		if (ret & BIT(8))
-			battery_info.batteries[battery].charge_behaviours |=
-				BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE);
-	}
-	if (acpi_has_method(hkey_handle, GET_INHIBIT)) {
-		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_INHIBIT, &ret, battery))) {
-			pr_err("Error probing battery inhibit charge; %d\n", battery);
-			return -ENODEV;
+	p = list;
+	while ((tok = strsep(&p, " ,\t\n"))) {
+		if (!*tok)
+			continue;
+
+		w = 1;
+		n = sscanf(tok, "%u:%u", &idx, &w);
+		if (n < 1 || idx < 1 || idx > TPACPI_MAX_THERMAL_SENSORS ||
+		    !w || w > U8_MAX) {
+			rc = -EINVAL;
+			break;
 		}
-		/* Support is marked in bit 5 */
-		if (ret & BIT(5))
-			battery_info.batteries[battery].charge_behaviours |=
-				BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE);
+		weighted |= (n == 2);
+		weight[idx - 1] = w;
+		any = true;
 	}
+	kfree(list);
 
-	battery_info.batteries[battery].charge_behaviours |=
-		BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_AUTO);
+	if (rc)
+		return rc;
+	if (!any)
+		memset(weight, 1, sizeof(weight));
 
-	pr_info("battery %d registered (start %d, stop %d, behaviours: 0x%x)\n",
-		battery,
-		battery_info.batteries[battery].charge_start,
-		battery_info.batteries[battery].charge_stop,
-		battery_info.batteries[battery].charge_behaviours);
+	mutex_lock(&fan_curve_mutex);
+	memcpy(fan_curve.weight, weight, sizeof(weight));
+	fan_curve.weighted = weighted;
+	mutex_unlock(&fan_curve_mutex);
 
-	return 0;
+	return count;
 }
 
-/* General helper functions */
+static DEVICE_ATTR_RW(fan_curve_sensors);
 
-static int tpacpi_battery_get_id(const char *battery_name)
+/* sysfs fan fan_curve_interval ---------------------------------------- */
+static ssize_t fan_curve_interval_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
 {
+	return sysfs_emit(buf, "%u\n", READ_ONCE(fan_curve.interval));
+}
 
-	if (strcmp(battery_name, "BAT0") == 0 ||
-	    tp_features.battery_force_primary)
-		return BAT_PRIMARY;
-	if (strcmp(battery_name, "BAT1") == 0)
-		return BAT_SECONDARY;
-	/*
-	 * If for some reason the battery is not BAT0 nor is it
-	 * BAT1, we will assume it's the default, first battery,
-	 * AKA primary.
-	 */
-	pr_warn("unknown battery %s, assuming primary", battery_name);
-	return BAT_PRIMARY;
+static ssize_t fan_curve_interval_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned long t;
+
+	if (parse_strtoul(buf, TPACPI_FAN_CURVE_MAX_INTERVAL, &t) ||
+	    t < TPACPI_FAN_CURVE_MIN_INTERVAL)
+		return -EINVAL;
+
+	mutex_lock(&fan_curve_mutex);
+	fan_curve.interval = t;
+	mutex_unlock(&fan_curve_mutex);
+
+	return count;
 }
 
-/* sysfs interface */
+static DEVICE_ATTR_RW(fan_curve_interval);
 
-static ssize_t tpacpi_battery_store(int what,
-				    struct device *dev,
-				    const char *buf, size_t count)
+/* sysfs fan fan1_target, fan2_target --------------------------------- */
+static ssize_t fan_target_show(struct device *dev,
+			       struct device_attribute *attr,
+			       char *buf)
 {
-	struct power_supply *supply = to_power_supply(dev);
-	unsigned long value;
-	int battery, rval;
-	/*
-	 * Some systems have support for more than
-	 * one battery. If that is the case,
-	 * tpacpi_battery_probe marked that addressing
-	 * them individually is supported, so we do that
-	 * based on the device struct.
-	 *
-	 * On systems that are not supported, we assume
-	 * the primary as most of the ACPI calls fail
-	 * with "Any Battery" as the parameter.
-	 */
-	if (battery_info.individual_addressing)
-		/* BAT_PRIMARY or BAT_SECONDARY */
-		battery = tpacpi_battery_get_id(supply->desc->name);
-	else
-		battery = BAT_PRIMARY;
+	unsigned int fan = to_sensor_dev_attr(attr)->index;
 
-	rval = kstrtoul(buf, 10, &value);
-	if (rval)
-		return rval;
+	return sysfs_emit(buf, "%u\n", READ_ONCE(fan_target[fan].target));
+}
 
-	switch (what) {
-	case THRESHOLD_START:
-		if (!battery_info.batteries[battery].start_support)
-			return -ENODEV;
-		/* valid values are [0, 99] */
-		if (value > 99)
-			return -EINVAL;
-		if (value > battery_info.batteries[battery].charge_stop)
-			return -EINVAL;
-		if (tpacpi_battery_set(THRESHOLD_START, battery, value))
-			return -ENODEV;
-		battery_info.batteries[battery].charge_start = value;
-		return count;
+static ssize_t fan_target_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned int fan = to_sensor_dev_attr(attr)->index;
+	unsigned long t;
+	int rc;
 
-	case THRESHOLD_STOP:
-		if (!battery_info.batteries[battery].stop_support)
-			return -ENODEV;
-		/* valid values are [1, 100] */
-		if (value < 1 || value > 100)
-			return -EINVAL;
-		if (value < battery_info.batteries[battery].charge_start)
-			return -EINVAL;
-		battery_info.batteries[battery].charge_stop = value;
-		/*
-		 * When 100 is passed to stop, we need to flip
-		 * it to 0 as that the EC understands that as
-		 * "Default", which will charge to 100%
-		 */
-		if (value == 100)
-			value = 0;
-		if (tpacpi_battery_set(THRESHOLD_STOP, battery, value))
-			return -EINVAL;
-		return count;
-	default:
-		pr_crit("Wrong parameter: %d", what);
+	if (parse_strtoul(buf, TPACPI_FAN_TARGET_MAX_RPM, &t))
+		return -EINVAL;
+
+	tpacpi_disclose_usertask("hwmon fan_target",
+			"set fan%u target to %lu RPM\n", fan + 1, t);
+
+	rc = fan_target_set(fan, t);
+
+	return rc ? rc : count;
+}
+
+static SENSOR_DEVICE_ATTR(fan1_target, S_IWUSR | S_IRUGO,
+			  fan_target_show, fan_target_store, 0);
+static SENSOR_DEVICE_ATTR(fan2_target, S_IWUSR | S_IRUGO,
+			  fan_target_show, fan_target_store, 1);
+
+/* sysfs fan fan_prespin_slope ----------------------------------------- */
+static ssize_t fan_prespin_slope_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(fan_prespin.slope));
+}
+
+static ssize_t fan_prespin_slope_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	unsigned long t;
+	u64 now = ktime_get_ns();
+
+	if (parse_strtoul(buf, 100000, &t))
 		return -EINVAL;
+
+	tpacpi_disclose_usertask("hwmon fan_prespin_slope",
+			"set to %lu\n", t);
+
+	mutex_lock(&fan_prespin_mutex);
+	fan_prespin.slope = t;
+	if (!t && fan_prespin.active) {
+		fan_prespin_release(now);
+		fan_set_level_safe(TP_EC_FAN_AUTO);
 	}
+	mutex_unlock(&fan_prespin_mutex);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(fan_prespin_slope);
+
+/* sysfs fan fan_prespin_level ----------------------------------------- */
+static ssize_t fan_prespin_level_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(fan_prespin.level));
+}
+
+static ssize_t fan_prespin_level_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	unsigned long t;
+
+	if (parse_strtoul(buf, 7, &t) || !t)
+		return -EINVAL;
+
+	mutex_lock(&fan_prespin_mutex);
+	fan_prespin.level = t;
+	mutex_unlock(&fan_prespin_mutex);
+
 	return count;
 }
 
-static ssize_t tpacpi_battery_show(int what,
-				   struct device *dev,
-				   char *buf)
+static DEVICE_ATTR_RW(fan_prespin_level);
+
+/* sysfs fan fan_prespin_throttle -------------------------------------- */
+static ssize_t fan_prespin_throttle_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	return sysfs_emit(buf, "%d\n", READ_ONCE(fan_prespin.throttle));
+}
+
+static ssize_t fan_prespin_throttle_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	unsigned long t;
+
+	if (parse_strtoul(buf, 127000, &t))
+		return -EINVAL;
+
+	mutex_lock(&fan_prespin_mutex);
+	fan_prespin.throttle = t;
+	mutex_unlock(&fan_prespin_mutex);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(fan_prespin_throttle);
+
+/* sysfs fan fan1_input ------------------------------------------------ */
+static ssize_t fan_fan1_input_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	int res;
+	unsigned int speed;
+
+	res = fan_get_speed_cached(0, &speed);
+	if (res < 0)
+		return res;
+
+	return sysfs_emit(buf, "%u\n", speed);
+}
+
+static DEVICE_ATTR(fan1_input, S_IRUGO, fan_fan1_input_show, NULL);
+
+/* sysfs fan fan2_input ------------------------------------------------ */
+static ssize_t fan_fan2_input_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	int res;
+	unsigned int speed;
+
+	res = fan_get_speed_cached(1, &speed);
+	if (res < 0)
+		return res;
+
+	return sysfs_emit(buf, "%u\n", speed);
+}
+
+static DEVICE_ATTR(fan2_input, S_IRUGO, fan_fan2_input_show, NULL);
+
+/* sysfs fan fan_watchdog (hwmon driver) ------------------------------- */
+static ssize_t fan_watchdog_show(struct device_driver *drv, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", fan_watchdog_maxinterval);
+}
+
+static ssize_t fan_watchdog_store(struct device_driver *drv, const char *buf,
+				  size_t count)
+{
+	unsigned long t;
+
+	if (parse_strtoul(buf, 120, &t))
+		return -EINVAL;
+
+	if (!fan_control_allowed)
+		return -EPERM;
+
+	fan_watchdog_maxinterval = t;
+	fan_watchdog_reset();
+
+	tpacpi_disclose_usertask("fan_watchdog", "set to %lu\n", t);
+
+	return count;
+}
+static DRIVER_ATTR_RW(fan_watchdog);
+
+/* --------------------------------------------------------------------- */
+
+static struct attribute *fan_attributes[] = {
+	&dev_attr_pwm1_enable.attr,
+	&dev_attr_pwm1.attr,
+	&dev_attr_fan1_input.attr,
+	&dev_attr_fan2_input.attr,
+	&dev_attr_fan_curve.attr,
+	&dev_attr_fan_curve_sensors.attr,
+	&dev_attr_fan_curve_interval.attr,
+	&sensor_dev_attr_fan1_target.dev_attr.attr,
+	&sensor_dev_attr_fan2_target.dev_attr.attr,
+	&dev_attr_fan_prespin_slope.attr,
+	&dev_attr_fan_prespin_level.attr,
+	&dev_attr_fan_prespin_throttle.attr,
+	NULL
+};
+
+static umode_t fan_attr_is_visible(struct kobject *kobj, struct attribute *attr,
+				   int n)
+{
+	if (fan_status_access_mode == TPACPI_FAN_NONE &&
+	    fan_control_access_mode == TPACPI_FAN_WR_NONE)
+		return 0;
+
+	if (attr == &dev_attr_fan2_input.attr) {
+		if (!tp_features.second_fan)
+			return 0;
+	}
+
+	if (attr == &dev_attr_fan_curve.attr ||
+	    attr == &dev_attr_fan_curve_sensors.attr ||
+	    attr == &dev_attr_fan_curve_interval.attr) {
+		if (!fan_control_allowed ||
+		    !(fan_control_commands & TPACPI_FAN_CMD_LEVEL))
+			return 0;
+	}
+
+	if (attr == &sensor_dev_attr_fan1_target.dev_attr.attr &&
+	    !fan_target_supported(0))
+		return 0;
+	if (attr == &sensor_dev_attr_fan2_target.dev_attr.attr &&
+	    !fan_target_supported(1))
+		return 0;
+
+	if ((attr == &dev_attr_fan_prespin_slope.attr ||
+	     attr == &dev_attr_fan_prespin_level.attr ||
+	     attr == &dev_attr_fan_prespin_throttle.attr) &&
+	    !fan_prespin_supported())
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group fan_attr_group = {
+	.is_visible = fan_attr_is_visible,
+	.attrs = fan_attributes,
+};
+
+static struct attribute *fan_driver_attributes[] = {
+	&driver_attr_fan_watchdog.attr,
+	NULL
+};
+
+static const struct attribute_group fan_driver_attr_group = {
+	.is_visible = fan_attr_is_visible,
+	.attrs = fan_driver_attributes,
+};
+
+#define TPACPI_FAN_Q1		0x0001		/* Uninitialized HFSP */
+#define TPACPI_FAN_2FAN		0x0002		/* EC 0x31 bit 0 selects fan2 */
+#define TPACPI_FAN_2CTL		0x0004		/* selects fan2 control */
+#define TPACPI_FAN_NOFAN	0x0008		/* no fan available */
+#define TPACPI_FAN_NS		0x0010		/* For EC with non-Standard register addresses */
+
+static const struct tpacpi_quirk fan_quirk_table[] __initconst = {
+	TPACPI_QEC_IBM('1', 'Y', TPACPI_FAN_Q1),
+	TPACPI_QEC_IBM('7', '8', TPACPI_FAN_Q1),
+	TPACPI_QEC_IBM('7', '6', TPACPI_FAN_Q1),
+	TPACPI_QEC_IBM('7', '0', TPACPI_FAN_Q1),
+	TPACPI_QEC_LNV('7', 'M', TPACPI_FAN_2FAN),
+	TPACPI_Q_LNV('N', '1', TPACPI_FAN_2FAN),
+	TPACPI_Q_LNV3('N', '1', 'D', TPACPI_FAN_2CTL),	/* P70 */
+	TPACPI_Q_LNV3('N', '1', 'E', TPACPI_FAN_2CTL),	/* P50 */
+	TPACPI_Q_LNV3('N', '1', 'T', TPACPI_FAN_2CTL),	/* P71 */
+	TPACPI_Q_LNV3('N', '1', 'U', TPACPI_FAN_2CTL),	/* P51 */
+	TPACPI_Q_LNV3('N', '2', 'C', TPACPI_FAN_2CTL),	/* P52 / P72 */
+	TPACPI_Q_LNV3('N', '2', 'N', TPACPI_FAN_2CTL),	/* P53 / P73 */
+	TPACPI_Q_LNV3('N', '2', 'E', TPACPI_FAN_2CTL),	/* P1 / X1 Extreme (1st gen) */
+	TPACPI_Q_LNV3('N', '2', 'O', TPACPI_FAN_2CTL),	/* P1 / X1 Extreme (2nd gen) */
+	TPACPI_Q_LNV3('N', '3', '0', TPACPI_FAN_2CTL),	/* P15 (1st gen) / P15v (1st gen) */
+	TPACPI_Q_LNV3('N', '3', '7', TPACPI_FAN_2CTL),  /* T15g (2nd gen) */
+	TPACPI_Q_LNV3('R', '1', 'F', TPACPI_FAN_NS),	/* L13 Yoga Gen 2 */
+	TPACPI_Q_LNV3('N', '2', 'U', TPACPI_FAN_NS),	/* X13 Yoga Gen 2*/
+	TPACPI_Q_LNV3('R', '0', 'R', TPACPI_FAN_NS),	/* L380 */
+	TPACPI_Q_LNV3('R', '1', '5', TPACPI_FAN_NS),	/* L13 Yoga Gen 1 */
+	TPACPI_Q_LNV3('R', '1', '0', TPACPI_FAN_NS),	/* L390 */
+	TPACPI_Q_LNV3('N', '2', 'L', TPACPI_FAN_NS),	/* X13 Yoga Gen 1 */
+	TPACPI_Q_LNV3('R', '0', 'T', TPACPI_FAN_NS),	/* 11e Gen5 GL */
+	TPACPI_Q_LNV3('R', '1', 'D', TPACPI_FAN_NS),	/* 11e Gen5 GL-R */
+	TPACPI_Q_LNV3('R', '0', 'V', TPACPI_FAN_NS),	/* 11e Gen5 KL-Y */
+	TPACPI_Q_LNV3('N', '1', 'O', TPACPI_FAN_NOFAN),	/* X1 Tablet (2nd gen) */
+};
+
+static int __init fan_init(struct ibm_init_struct *iibm)
+{
+	unsigned long quirks;
+
+	vdbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_FAN,
+			"initializing fan subdriver\n");
+
+	mutex_init(&fan_mutex);
+	fan_status_access_mode = TPACPI_FAN_NONE;
+	fan_control_access_mode = TPACPI_FAN_WR_NONE;
+	fan_control_commands = 0;
+	fan_watchdog_maxinterval = 0;
+	tp_features.fan_ctrl_status_undef = 0;
+	tp_features.second_fan = 0;
+	tp_features.second_fan_ctl = 0;
+	fan_control_desired_level = 7;
+
+	if (tpacpi_is_ibm()) {
+		TPACPI_ACPIHANDLE_INIT(fans);
+		TPACPI_ACPIHANDLE_INIT(gfan);
+		TPACPI_ACPIHANDLE_INIT(sfan);
+	}
+
+	quirks = tpacpi_check_quirks(fan_quirk_table,
+				     ARRAY_SIZE(fan_quirk_table));
+
+	if (quirks & TPACPI_FAN_NOFAN) {
+		pr_info("No integrated ThinkPad fan available\n");
+		return -ENODEV;
+	}
+
+	if (quirks & TPACPI_FAN_NS) {
+		pr_info("ECFW with non-standard fan reg control found\n");
+		fan_with_ns_addr = 1;
+		/* Fan ctrl support from host is undefined for now */
+		tp_features.fan_ctrl_status_undef = 1;
+	}
+
+	if (gfan_handle) {
+		/* 570, 600e/x, 770e, 770x */
+		fan_status_access_mode = TPACPI_FAN_RD_ACPI_GFAN;
+	} else {
+		/* all other ThinkPads: note that even old-style
+		 * ThinkPad ECs supports the fan control register */
+		if (fan_with_ns_addr ||
+		    likely(acpi_ec_read(fan_status_offset, &fan_control_initial_status))) {
+			int res;
+			unsigned int speed;
+
+			fan_status_access_mode = fan_with_ns_addr ?
+				TPACPI_FAN_RD_TPEC_NS : TPACPI_FAN_RD_TPEC;
+
+			if (quirks & TPACPI_FAN_Q1)
+				fan_quirk1_setup();
+			/* Try and probe the 2nd fan */
+			tp_features.second_fan = 1; /* needed for get_speed to work */
+			mutex_lock(&fan_mutex);
+			res = fan2_get_speed(&speed);
+			mutex_unlock(&fan_mutex);
+			if (res >= 0 && speed != FAN_NOT_PRESENT) {
+				/* It responded - so let's assume it's there */
+				tp_features.second_fan = 1;
+				/* fan control not currently available for ns ECFW */
+				tp_features.second_fan_ctl = !fan_with_ns_addr;
+				pr_info("secondary fan control detected & enabled\n");
+			} else {
+				/* Fan not auto-detected */
+				tp_features.second_fan = 0;
+				if (quirks & TPACPI_FAN_2FAN) {
+					tp_features.second_fan = 1;
+					pr_info("secondary fan support enabled\n");
+				}
+				if (quirks & TPACPI_FAN_2CTL) {
+					tp_features.second_fan = 1;
+					tp_features.second_fan_ctl = 1;
+					pr_info("secondary fan control enabled\n");
+				}
+			}
+		} else {
+			pr_err("ThinkPad ACPI EC access misbehaving, fan status and control unavailable\n");
+			return -ENODEV;
+		}
+	}
+
+	if (sfan_handle) {
+		/* 570, 770x-JL */
+		fan_control_access_mode = TPACPI_FAN_WR_ACPI_SFAN;
+		fan_control_commands |=
+		    TPACPI_FAN_CMD_LEVEL | TPACPI_FAN_CMD_ENABLE;
+	} else {
+		if (!gfan_handle) {
+			/* gfan without sfan means no fan control */
+			/* all other models implement TP EC 0x2f control */
+
+			if (fans_handle) {
+				/* X31, X40, X41 */
+				fan_control_access_mode =
+				    TPACPI_FAN_WR_ACPI_FANS;
+				fan_control_commands |=
+				    TPACPI_FAN_CMD_SPEED |
+				    TPACPI_FAN_CMD_LEVEL |
+				    TPACPI_FAN_CMD_ENABLE;
+			} else {
+				fan_control_access_mode = TPACPI_FAN_WR_TPEC;
+				fan_control_commands |=
+				    TPACPI_FAN_CMD_LEVEL |
+				    TPACPI_FAN_CMD_ENABLE;
+			}
+		}
+	}
+
+	vdbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_FAN,
+		"fan is %s, modes %d, %d\n",
+		str_supported(fan_status_access_mode != TPACPI_FAN_NONE ||
+		  fan_control_access_mode != TPACPI_FAN_WR_NONE),
+		fan_status_access_mode, fan_control_access_mode);
+
+	/* fan control master switch */
+	if (!fan_control_allowed) {
+		fan_control_access_mode = TPACPI_FAN_WR_NONE;
+		fan_control_commands = 0;
+		dbg_printk(TPACPI_DBG_INIT | TPACPI_DBG_FAN,
+			   "fan control features disabled by parameter\n");
+	}
+
+	/* update fan_control_desired_level */
+	if (fan_status_access_mode != TPACPI_FAN_NONE)
+		fan_get_status_safe(NULL);
+
+	if (fan_status_access_mode == TPACPI_FAN_NONE &&
+	    fan_control_access_mode == TPACPI_FAN_WR_NONE)
+		return -ENODEV;
+
+	fan_cooling_register();
+	fan_target_debugfs_init();
+
+	if (fan_status_access_mode != TPACPI_FAN_NONE) {
+		debugfs_create_file("fan_telemetry", 0400, tpacpi_debugfs_dir,
+				    NULL, &fan_telemetry_fops);
+		debugfs_create_file("fan_telemetry_summary", 0400,
+				    tpacpi_debugfs_dir, NULL,
+				    &fan_telemetry_summary_fops);
+		queue_delayed_work(tpacpi_wq, &fan_telemetry_work, 0);
+	}
+	if (fan_prespin_supported())
+		debugfs_create_file("fan_prespin", 0400, tpacpi_debugfs_dir,
+				    NULL, &fan_prespin_stats_fops);
+
+	return 0;
+}
+
+static void fan_exit(void)
+{
+	fan_cooling_unregister();
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_stop();
+	cancel_delayed_work_sync(&fan_telemetry_work);
+
+	vdbg_printk(TPACPI_DBG_EXIT | TPACPI_DBG_FAN,
+		    "cancelling any pending fan watchdog tasks\n");
+
+	cancel_delayed_work(&fan_watchdog_task);
+	flush_workqueue(tpacpi_wq);
+}
+
+static void boost_stop(void);
+
+static void fan_suspend(void)
+{
+	int rc;
+
+	/*
+	 * A boost pinning the fan ends on suspend anyway; end it before
+	 * the level is saved below, or resume would restore full speed.
+	 */
+	boost_stop();
+
+	/* the controllers stay enabled, fan_resume restarts their loops */
+	cancel_delayed_work_sync(&fan_curve_work);
+	cancel_delayed_work_sync(&fan_target_work);
+	cancel_delayed_work_sync(&fan_telemetry_work);
+
+	/* before the level is saved, so that resume does not restore it */
+	fan_prespin_stop();
+
+	if (!fan_control_allowed)
+		return;
+
+	/* Store fan status in cache */
+	fan_control_resume_level = 0;
+	rc = fan_get_status_safe(&fan_control_resume_level);
+	if (rc)
+		pr_notice("failed to read fan level for later restore during resume: %d\n",
+			  rc);
+
+	/* if it is undefined, don't attempt to restore it.
+	 * KEEP THIS LAST */
+	if (tp_features.fan_ctrl_status_undef)
+		fan_control_resume_level = 0;
+}
+
+static void fan_resume(void)
+{
+	u8 current_level = 7;
+	bool do_set = false;
+	int rc;
+
+	/* DSDT *always* updates status on resume */
+	tp_features.fan_ctrl_status_undef = 0;
+
+	fan_prespin_restart();
+
+	if (fan_status_access_mode != TPACPI_FAN_NONE)
+		queue_delayed_work(tpacpi_wq, &fan_telemetry_work, 0);
+
+	mutex_lock(&fan_curve_mutex);
+	if (fan_curve.enabled) {
+		fan_curve.cur = -1;
+		queue_delayed_work(tpacpi_wq, &fan_curve_work, 0);
+	}
+	mutex_unlock(&fan_curve_mutex);
+
+	mutex_lock(&fan_target_mutex);
+	if (fan_target_is_enabled()) {
+		fan_target[0].level = -1;
+		fan_target[1].level = -1;
+		fan_target_last = jiffies;
+		queue_delayed_work(tpacpi_wq, &fan_target_work, 0);
+	}
+	mutex_unlock(&fan_target_mutex);
+
+	if (!fan_control_allowed ||
+	    !fan_control_resume_level ||
+	    fan_get_status_safe(&current_level))
+		return;
+
+	switch (fan_control_access_mode) {
+	case TPACPI_FAN_WR_ACPI_SFAN:
+		/* never decrease fan level */
+		do_set = (fan_control_resume_level > current_level);
+		break;
+	case TPACPI_FAN_WR_ACPI_FANS:
+	case TPACPI_FAN_WR_TPEC:
+		/* never decrease fan level, scale is:
+		 * TP_EC_FAN_FULLSPEED > 7 >= TP_EC_FAN_AUTO
+		 *
+		 * We expect the firmware to set either 7 or AUTO, but we
+		 * handle FULLSPEED out of paranoia.
+		 *
+		 * So, we can safely only restore FULLSPEED or 7, anything
+		 * else could slow the fan.  Restoring AUTO is useless, at
+		 * best that's exactly what the DSDT already set (it is the
+		 * slower it uses).
+		 *
+		 * Always keep in mind that the DSDT *will* have set the
+		 * fans to what the vendor supposes is the best level.  We
+		 * muck with it only to speed the fan up.
+		 */
+		if (fan_control_resume_level != 7 &&
+		    !(fan_control_resume_level & TP_EC_FAN_FULLSPEED))
+			return;
+		else
+			do_set = !(current_level & TP_EC_FAN_FULLSPEED) &&
+				 (current_level != fan_control_resume_level);
+		break;
+	default:
+		return;
+	}
+	if (do_set) {
+		pr_notice("restoring fan level to 0x%02x\n",
+			  fan_control_resume_level);
+		rc = fan_set_level_safe(fan_control_resume_level);
+		if (rc < 0)
+			pr_notice("failed to restore fan level: %d\n", rc);
+	}
+}
+
+static int fan_read(struct seq_file *m)
+{
+	int rc;
+	u8 status;
+	unsigned int speed = 0;
+
+	switch (fan_status_access_mode) {
+	case TPACPI_FAN_RD_ACPI_GFAN:
+		/* 570, 600e/x, 770e, 770x */
+		rc = fan_get_status_safe(&status);
+		if (rc)
+			return rc;
+
+		seq_printf(m, "status:\t\t%s\n"
+			       "level:\t\t%d\n",
+			       str_enabled_disabled(status), status);
+		break;
+
+	case TPACPI_FAN_RD_TPEC_NS:
+	case TPACPI_FAN_RD_TPEC:
+		/* all except 570, 600e/x, 770e, 770x */
+		rc = fan_get_status_safe(&status);
+		if (rc)
+			return rc;
+
+		seq_printf(m, "status:\t\t%s\n", str_enabled_disabled(status));
+
+		rc = fan_get_speed_cached(0, &speed);
+		if (rc < 0)
+			return rc;
+
+		seq_printf(m, "speed:\t\t%d\n", speed);
+
+		if (fan_status_access_mode == TPACPI_FAN_RD_TPEC_NS) {
+			/*
+			 * No full speed bit in NS EC
+			 * EC Auto mode is set by default.
+			 * No other levels settings available
+			 */
+			seq_printf(m, "level:\t\t%s\n", status & FAN_NS_CTRL ? "unknown" : "auto");
+		} else {
+			if (status & TP_EC_FAN_FULLSPEED)
+				/* Disengaged mode takes precedence */
+				seq_printf(m, "level:\t\tdisengaged\n");
+			else if (status & TP_EC_FAN_AUTO)
+				seq_printf(m, "level:\t\tauto\n");
+			else
+				seq_printf(m, "level:\t\t%d\n", status);
+		}
+		break;
+
+	case TPACPI_FAN_NONE:
+	default:
+		seq_printf(m, "status:\t\tnot supported\n");
+	}
+
+	if (fan_control_commands & TPACPI_FAN_CMD_LEVEL) {
+		seq_printf(m, "commands:\tlevel <level>");
+
+		switch (fan_control_access_mode) {
+		case TPACPI_FAN_WR_ACPI_SFAN:
+			seq_printf(m, " (<level> is 0-7)\n");
+			break;
+
+		default:
+			seq_printf(m, " (<level> is 0-7, auto, disengaged, full-speed)\n");
+			break;
+		}
+	}
+
+	if (fan_control_commands & TPACPI_FAN_CMD_ENABLE)
+		seq_printf(m, "commands:\tenable, disable\n"
+			       "commands:\twatchdog <timeout> (<timeout> is 0 (off), 1-120 (seconds))\n");
+
+	if (fan_control_commands & TPACPI_FAN_CMD_SPEED)
+		seq_printf(m, "commands:\tspeed <speed> (<speed> is 0-65535)\n");
+
+	return 0;
+}
+
+static int fan_write_cmd_level(const char *cmd, int *rc)
+{
+	int level;
+
+	if (strstarts(cmd, "level auto"))
+		level = TP_EC_FAN_AUTO;
+	else if (strstarts(cmd, "level disengaged") || strstarts(cmd, "level full-speed"))
+		level = TP_EC_FAN_FULLSPEED;
+	else if (sscanf(cmd, "level %d", &level) != 1)
+		return 0;
+
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_forget();
+	*rc = fan_set_level_safe(level);
+	if (*rc == -ENXIO)
+		pr_err("level command accepted for unsupported access mode %d\n",
+		       fan_control_access_mode);
+	else if (!*rc)
+		tpacpi_disclose_usertask("procfs fan",
+			"set level to %d\n", level);
+
+	return 1;
+}
+
+static int fan_write_cmd_enable(const char *cmd, int *rc)
+{
+	if (!strstarts(cmd, "enable"))
+		return 0;
+
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_forget();
+	*rc = fan_set_enable();
+	if (*rc == -ENXIO)
+		pr_err("enable command accepted for unsupported access mode %d\n",
+		       fan_control_access_mode);
+	else if (!*rc)
+		tpacpi_disclose_usertask("procfs fan", "enable\n");
+
+	return 1;
+}
+
+static int fan_write_cmd_disable(const char *cmd, int *rc)
+{
+	if (!strstarts(cmd, "disable"))
+		return 0;
+
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_forget();
+	*rc = fan_set_disable();
+	if (*rc == -ENXIO)
+		pr_err("disable command accepted for unsupported access mode %d\n",
+		       fan_control_access_mode);
+	else if (!*rc)
+		tpacpi_disclose_usertask("procfs fan", "disable\n");
+
+	return 1;
+}
+
+static int fan_write_cmd_speed(const char *cmd, int *rc)
+{
+	int speed;
+
+	/* TODO:
+	 * Support speed <low> <medium> <high> ? */
+
+	if (sscanf(cmd, "speed %d", &speed) != 1)
+		return 0;
+
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_forget();
+	*rc = fan_set_speed(speed);
+	if (*rc == -ENXIO)
+		pr_err("speed command accepted for unsupported access mode %d\n",
+		       fan_control_access_mode);
+	else if (!*rc)
+		tpacpi_disclose_usertask("procfs fan",
+			"set speed to %d\n", speed);
+
+	return 1;
+}
+
+static int fan_write_cmd_watchdog(const char *cmd, int *rc)
+{
+	int interval;
+
+	if (sscanf(cmd, "watchdog %d", &interval) != 1)
+		return 0;
+
+	if (interval < 0 || interval > 120)
+		*rc = -EINVAL;
+	else {
+		fan_watchdog_maxinterval = interval;
+		tpacpi_disclose_usertask("procfs fan",
+			"set watchdog timer to %d\n",
+			interval);
+	}
+
+	return 1;
+}
+
+static int fan_write(char *buf)
+{
+	char *cmd;
+	int rc = 0;
+
+	while (!rc && (cmd = strsep(&buf, ","))) {
+		if (!((fan_control_commands & TPACPI_FAN_CMD_LEVEL) &&
+		      fan_write_cmd_level(cmd, &rc)) &&
+		    !((fan_control_commands & TPACPI_FAN_CMD_ENABLE) &&
+		      (fan_write_cmd_enable(cmd, &rc) ||
+		       fan_write_cmd_disable(cmd, &rc) ||
+		       fan_write_cmd_watchdog(cmd, &rc))) &&
+		    !((fan_control_commands & TPACPI_FAN_CMD_SPEED) &&
+		      fan_write_cmd_speed(cmd, &rc))
+		    )
+			rc = -EINVAL;
+		else if (!rc)
+			fan_watchdog_reset();
+	}
+
+	return rc;
+}
+
+static struct ibm_struct fan_driver_data = {
+	.name = "fan",
+	.read = fan_read,
+	.write = fan_write,
+	.exit = fan_exit,
+	.suspend = fan_suspend,
+	.resume = fan_resume,
+};
+
+/*************************************************************************
+ * Thermal/fan trace subdriver
+ *
+ * Samples all temperature sensors and the fan state at a fixed rate from
+ * an hrtimer, for benchmark runs that need traces finer than sysfs
+ * polling can give.  Records are struct tpacpi_trace_record, streamed
+ * through per-CPU relay files in debugfs:
+ *
+ *   thinkpad_acpi/thermal_trace/control   "start [<hz>]", "stop", status
+ *   thinkpad_acpi/thermal_trace/trace<N>  records sampled on CPU N
+ *
+ * A sample is dropped when the worker is still busy with the previous
+ * one at the next tick, or when the relay buffer is full.  The worker
+ * runs on its own workqueue, so that it neither delays nor is delayed
+ * by the rest of the driver's work on ktpacpid.
+ */
+
+#define TPACPI_TRACE_DEF_RATE		100	/* Hz */
+#define TPACPI_TRACE_MAX_RATE		1000	/* Hz */
+#define TPACPI_TRACE_SUBBUF_SIZE	(64 * sizeof(struct tpacpi_trace_record))
+#define TPACPI_TRACE_N_SUBBUFS		16
+
+static DEFINE_MUTEX(tptrace_mutex);	/* start/stop, tptrace_chan */
+static struct workqueue_struct *tptrace_wq;
+static struct dentry *tptrace_dir;
+static struct rchan *tptrace_chan;
+static struct hrtimer tptrace_timer;
+static ktime_t tptrace_period;
+static unsigned int tptrace_rate;
+static bool tptrace_running;
+static u32 tptrace_seq;			/* worker only */
+static atomic_t tptrace_overruns;	/* worker still busy at tick */
+static atomic_t tptrace_full;		/* relay buffer full */
+
+static void tptrace_worker(struct work_struct *work)
+{
+	struct ibm_thermal_sensors_struct t;
+	struct tpacpi_trace_record rec = {
+		.timestamp_ns = ktime_get_ns(),
+	};
+	int i, n;
+	u8 status;
+
+	n = thermal_get_sensors(&t);
+	if (n > 0) {
+		rec.flags |= TPACPI_TRACE_F_THERMAL;
+		rec.nsensors = n;
+	}
+	for (i = 0; i < ARRAY_SIZE(rec.temp); i++) {
+		if (i < rec.nsensors && t.temp[i] != TPACPI_THERMAL_SENSOR_NA)
+			rec.temp[i] = clamp_val(t.temp[i] / 100,
+						S16_MIN + 1, S16_MAX);
+		else
+			rec.temp[i] = TPACPI_TRACE_TEMP_NA;
+	}
+
+	mutex_lock(&fan_mutex);
+	if (!fan_get_status(&status)) {
+		rec.flags |= TPACPI_TRACE_F_STATUS;
+		rec.fan_status = status;
+	}
+	n = fan_get_speeds(rec.fan_rpm);
+	if (n >= 1)
+		rec.flags |= TPACPI_TRACE_F_FAN1;
+	if (n >= 2)
+		rec.flags |= TPACPI_TRACE_F_FAN2;
+	mutex_unlock(&fan_mutex);
+
+	rec.seq = tptrace_seq++;
+	rec.dropped = atomic_read(&tptrace_overruns) +
+		      atomic_read(&tptrace_full);
+
+	relay_write(tptrace_chan, &rec, sizeof(rec));
+}
+
+static DECLARE_WORK(tptrace_work, tptrace_worker);
+
+static enum hrtimer_restart tptrace_timer_fn(struct hrtimer *timer)
+{
+	if (!queue_work(tptrace_wq, &tptrace_work))
+		atomic_inc(&tptrace_overruns);
+
+	hrtimer_forward_now(timer, tptrace_period);
+
+	return HRTIMER_RESTART;
+}
+
+static struct dentry *tptrace_create_buf_file(const char *filename,
+					      struct dentry *parent,
+					      umode_t mode,
+					      struct rchan_buf *buf,
+					      int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int tptrace_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static int tptrace_subbuf_start(struct rchan_buf *buf, void *subbuf,
+				void *prev_subbuf, size_t prev_padding)
+{
+	/* never overwrite samples userspace has not consumed yet */
+	if (relay_buf_full(buf)) {
+		atomic_inc(&tptrace_full);
+		return 0;
+	}
+
+	return 1;
+}
+
+static const struct rchan_callbacks tptrace_relay_callbacks = {
+	.subbuf_start = tptrace_subbuf_start,
+	.create_buf_file = tptrace_create_buf_file,
+	.remove_buf_file = tptrace_remove_buf_file,
+};
+
+static void tptrace_timer_start(void)
+{
+	tptrace_period = ns_to_ktime(NSEC_PER_SEC / tptrace_rate);
+	hrtimer_start(&tptrace_timer, tptrace_period, HRTIMER_MODE_REL);
+}
+
+static void tptrace_timer_stop(void)
+{
+	hrtimer_cancel(&tptrace_timer);
+	cancel_work_sync(&tptrace_work);
+}
+
+static int tptrace_start(unsigned int rate)
+{
+	lockdep_assert_held(&tptrace_mutex);
+
+	if (tptrace_running)
+		return -EBUSY;
+
+	/* The channel is kept around after stop so the trace can be read */
+	if (!tptrace_chan) {
+		tptrace_chan = relay_open("trace", tptrace_dir,
+					  TPACPI_TRACE_SUBBUF_SIZE,
+					  TPACPI_TRACE_N_SUBBUFS,
+					  &tptrace_relay_callbacks, NULL);
+		if (!tptrace_chan)
+			return -ENOMEM;
+	} else {
+		relay_reset(tptrace_chan);
+	}
+
+	tptrace_seq = 0;
+	atomic_set(&tptrace_overruns, 0);
+	atomic_set(&tptrace_full, 0);
+	tptrace_rate = rate;
+	tptrace_running = true;
+	tptrace_timer_start();
+
+	return 0;
+}
+
+static void tptrace_stop(void)
+{
+	lockdep_assert_held(&tptrace_mutex);
+
+	if (!tptrace_running)
+		return;
+
+	tptrace_timer_stop();
+	tptrace_running = false;
+	relay_flush(tptrace_chan);
+}
+
+/* debugfs thermal_trace/control --------------------------------------- */
+static int tptrace_control_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&tptrace_mutex);
+	seq_printf(m, "status:\t\t%s\n",
+		   tptrace_running ? "running" : "stopped");
+	seq_printf(m, "rate:\t\t%u Hz\n", tptrace_rate);
+	seq_printf(m, "samples:\t%u\n", READ_ONCE(tptrace_seq));
+	seq_printf(m, "overruns:\t%d\n", atomic_read(&tptrace_overruns));
+	seq_printf(m, "buffer full:\t%d\n", atomic_read(&tptrace_full));
+	seq_puts(m, "commands:\tstart [<rate in Hz, 1-"
+		 __stringify(TPACPI_TRACE_MAX_RATE) ">], stop\n");
+	mutex_unlock(&tptrace_mutex);
+
+	return 0;
+}
+
+static int tptrace_control_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tptrace_control_show, NULL);
+}
+
+static ssize_t tptrace_control_write(struct file *file,
+				     const char __user *ubuf,
+				     size_t count, loff_t *ppos)
+{
+	unsigned int rate = TPACPI_TRACE_DEF_RATE;
+	char buf[32], *cmd;
+	int rc;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	cmd = strim(buf);
+
+	if (strstarts(cmd, "start")) {
+		cmd = skip_spaces(cmd + 5);
+		if (*cmd && (kstrtouint(cmd, 0, &rate) || !rate ||
+			     rate > TPACPI_TRACE_MAX_RATE))
+			return -EINVAL;
+
+		mutex_lock(&tptrace_mutex);
+		rc = tptrace_start(rate);
+		mutex_unlock(&tptrace_mutex);
+		if (rc)
+			return rc;
+
+		tpacpi_disclose_usertask("thermal_trace",
+					 "started at %u Hz\n", rate);
+	} else if (!strcmp(cmd, "stop")) {
+		mutex_lock(&tptrace_mutex);
+		tptrace_stop();
+		mutex_unlock(&tptrace_mutex);
+
+		tpacpi_disclose_usertask("thermal_trace", "stopped\n");
+	} else {
+		return -EINVAL;
+	}
+
+	return count;
+}
+
+static const struct file_operations tptrace_control_fops = {
+	.owner = THIS_MODULE,
+	.open = tptrace_control_open,
+	.read = seq_read,
+	.write = tptrace_control_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init tptrace_init(struct ibm_init_struct *iibm)
+{
+	vdbg_printk(TPACPI_DBG_INIT, "initializing thermal trace subdriver\n");
+
+	if (thermal_read_mode == TPACPI_THERMAL_NONE &&
+	    fan_status_access_mode == TPACPI_FAN_NONE)
+		return -ENODEV;
+
+	if (IS_ERR_OR_NULL(tpacpi_debugfs_dir))
+		return -ENODEV;
+
+	tptrace_wq = alloc_ordered_workqueue(TPACPI_WORKQUEUE_NAME "_trace",
+					     WQ_HIGHPRI);
+	if (!tptrace_wq)
+		return -ENOMEM;
+
+	hrtimer_init(&tptrace_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tptrace_timer.function = tptrace_timer_fn;
+	tptrace_rate = TPACPI_TRACE_DEF_RATE;
+
+	tptrace_dir = debugfs_create_dir("thermal_trace", tpacpi_debugfs_dir);
+	debugfs_create_file("control", S_IRUSR | S_IWUSR, tptrace_dir, NULL,
+			    &tptrace_control_fops);
+
+	return 0;
+}
+
+/*
+ * The relay files live in debugfs, so the channel must be closed before
+ * the driver's debugfs directory is removed.  Called from module exit
+ * ahead of that, and again from tptrace_exit().
+ */
+static void tptrace_close(void)
+{
+	mutex_lock(&tptrace_mutex);
+	tptrace_stop();
+	if (tptrace_chan)
+		relay_close(tptrace_chan);
+	tptrace_chan = NULL;
+	mutex_unlock(&tptrace_mutex);
+}
+
+static void tptrace_exit(void)
+{
+	tptrace_close();
+	destroy_workqueue(tptrace_wq);
+	tptrace_wq = NULL;
+}
+
+static void tptrace_suspend(void)
+{
+	mutex_lock(&tptrace_mutex);
+	if (tptrace_running)
+		tptrace_timer_stop();
+	mutex_unlock(&tptrace_mutex);
+}
+
+static void tptrace_resume(void)
+{
+	mutex_lock(&tptrace_mutex);
+	if (tptrace_running)
+		tptrace_timer_start();
+	mutex_unlock(&tptrace_mutex);
+}
+
+static struct ibm_struct tptrace_driver_data = {
+	.name = "thermal_trace",
+	.exit = tptrace_exit,
+	.suspend = tptrace_suspend,
+	.resume = tptrace_resume,
+};
+
+/*************************************************************************
+ * perf PMU subdriver
+ *
+ * Exposes the thermal sensors and fan state as the "tpacpi" perf PMU, so
+ * that platform thermals can be counted next to CPU events:
+ *
+ *   perf stat -e tpacpi/temp0/,tpacpi/fan1_rpm/ -- make -j
+ *   perf record -e '{cycles,tpacpi/temp0/}:S' ...
+ *
+ * The EC cannot be read from the atomic context perf reads counters in,
+ * so all events are served from one snapshot of every sensor, which a
+ * worker refreshes in a single EC burst while any event exists.  The
+ * count of an event is the latest reading: millidegrees Celsius for
+ * tempN, RPM for fanN_rpm and the raw fan status byte for fan_level.
+ *
+ * Events are bound to a single CPU, advertised through "cpumask"; when
+ * that CPU goes offline they are migrated to another online one.
+ */
+
+#ifdef CONFIG_PERF_EVENTS
+
+#define TPACPI_PMU_REFRESH_MS	100
+
+enum {
+	TPACPI_PMU_EV_TEMP0 = 0,	/* ... TEMP15 */
+	TPACPI_PMU_EV_FAN1_RPM = TPACPI_MAX_THERMAL_SENSORS,
+	TPACPI_PMU_EV_FAN2_RPM,
+	TPACPI_PMU_EV_FAN_LEVEL,
+	TPACPI_PMU_EV_MAX
+};
+
+static s32 tpacpi_pmu_values[TPACPI_PMU_EV_MAX];
+static atomic_t tpacpi_pmu_nr_events;
+static unsigned int tpacpi_pmu_cpu;
+static enum cpuhp_state tpacpi_pmu_hp_state;
+
+static int tpacpi_pmu_nsensors(void)
+{
+	switch (thermal_read_mode) {
+	case TPACPI_THERMAL_NONE:
+		return 0;
+	case TPACPI_THERMAL_TPEC_16:
+		return 16;
+	case TPACPI_THERMAL_TPEC_12:
+		return 12;
+	default:
+		return 8;
+	}
+}
+
+static bool tpacpi_pmu_event_supported(unsigned int id)
+{
+	if (id < TPACPI_PMU_EV_FAN1_RPM)
+		return id < tpacpi_pmu_nsensors();
+	if (fan_status_access_mode == TPACPI_FAN_NONE)
+		return false;
+	if (id == TPACPI_PMU_EV_FAN2_RPM)
+		return tp_features.second_fan;
+
+	return id < TPACPI_PMU_EV_MAX;
+}
+
+/* One EC burst for all events; values are read locklessly by perf */
+static void tpacpi_pmu_refresh(void)
+{
+	struct ibm_thermal_sensors_struct t;
+	unsigned int speeds[2];
+	int i, n;
+	u8 status;
+
+	n = thermal_get_sensors(&t);
+	for (i = 0; i < n; i++) {
+		/* keep the last good reading rather than publish 0 C */
+		if (t.temp[i] == TPACPI_THERMAL_SENSOR_NA || t.temp[i] < 0)
+			continue;
+		WRITE_ONCE(tpacpi_pmu_values[TPACPI_PMU_EV_TEMP0 + i],
+			   t.temp[i]);
+	}
+
+	if (fan_status_access_mode == TPACPI_FAN_NONE)
+		return;
+
+	mutex_lock(&fan_mutex);
+	n = fan_get_speeds(speeds);
+	for (i = 0; i < n; i++)
+		WRITE_ONCE(tpacpi_pmu_values[TPACPI_PMU_EV_FAN1_RPM + i],
+			   speeds[i]);
+	if (!fan_get_status(&status))
+		WRITE_ONCE(tpacpi_pmu_values[TPACPI_PMU_EV_FAN_LEVEL], status);
+	mutex_unlock(&fan_mutex);
+}
+
+static void tpacpi_pmu_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(tpacpi_pmu_work, tpacpi_pmu_worker);
+
+static void tpacpi_pmu_worker(struct work_struct *work)
+{
+	if (!atomic_read(&tpacpi_pmu_nr_events) ||
+	    tpacpi_lifecycle == TPACPI_LIFE_EXITING)
+		return;
+
+	tpacpi_pmu_refresh();
+	queue_delayed_work(tpacpi_wq, &tpacpi_pmu_work,
+			   msecs_to_jiffies(TPACPI_PMU_REFRESH_MS));
+}
+
+static void tpacpi_pmu_event_update(struct perf_event *event)
+{
+	local64_set(&event->count,
+		    READ_ONCE(tpacpi_pmu_values[event->hw.config]));
+}
+
+static void tpacpi_pmu_event_destroy(struct perf_event *event)
+{
+	/* the worker stops by itself once the last event is gone */
+	atomic_dec(&tpacpi_pmu_nr_events);
+}
+
+static int tpacpi_pmu_event_init(struct perf_event *event)
+{
+	u64 id = event->attr.config;
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	/* there is no overflow interrupt to sample on */
+	if (is_sampling_event(event))
+		return -EINVAL;
+	if (event->cpu < 0)
+		return -EINVAL;
+	if (id >= TPACPI_PMU_EV_MAX || !tpacpi_pmu_event_supported(id))
+		return -EINVAL;
+
+	event->cpu = READ_ONCE(tpacpi_pmu_cpu);
+	event->hw.config = id;
+	event->destroy = tpacpi_pmu_event_destroy;
+
+	/* process context: the first event primes the snapshot */
+	if (atomic_inc_return(&tpacpi_pmu_nr_events) == 1) {
+		tpacpi_pmu_refresh();
+		queue_delayed_work(tpacpi_wq, &tpacpi_pmu_work,
+				   msecs_to_jiffies(TPACPI_PMU_REFRESH_MS));
+	}
+
+	return 0;
+}
+
+static void tpacpi_pmu_event_start(struct perf_event *event, int flags)
+{
+	event->hw.state = 0;
+	tpacpi_pmu_event_update(event);
+}
+
+static void tpacpi_pmu_event_stop(struct perf_event *event, int flags)
+{
+	if (!(event->hw.state & PERF_HES_STOPPED) && (flags & PERF_EF_UPDATE))
+		tpacpi_pmu_event_update(event);
+
+	event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int tpacpi_pmu_event_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+
+	if (flags & PERF_EF_START)
+		tpacpi_pmu_event_start(event, flags);
+
+	return 0;
+}
+
+static void tpacpi_pmu_event_del(struct perf_event *event, int flags)
+{
+	tpacpi_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+/* sysfs events/ ------------------------------------------------------- */
+
+struct tpacpi_pmu_event_attr {
+	struct device_attribute attr;
+	unsigned int id;
+	const char *str;	/* .unit/.scale value, NULL for the event */
+};
+
+static ssize_t tpacpi_pmu_event_show(struct device *dev,
+				     struct device_attribute *attr,
+				     char *buf)
+{
+	struct tpacpi_pmu_event_attr *ea =
+			container_of(attr, struct tpacpi_pmu_event_attr, attr);
+
+	if (ea->str)
+		return sysfs_emit(buf, "%s\n", ea->str);
+
+	return sysfs_emit(buf, "event=0x%02x\n", ea->id);
+}
+
+#define TPACPI_PMU_ATTR(_var, _name, _id, _str) \
+static struct tpacpi_pmu_event_attr tpacpi_pmu_attr_##_var = { \
+	.attr = { \
+		.attr = { .name = _name, .mode = 0444 }, \
+		.show = tpacpi_pmu_event_show, \
+	}, \
+	.id = _id, \
+	.str = _str, \
+}
+
+#define TPACPI_PMU_TEMP_ATTRS(_n) \
+	TPACPI_PMU_ATTR(temp##_n, "temp" #_n, _n, NULL); \
+	TPACPI_PMU_ATTR(temp##_n##_unit, "temp" #_n ".unit", _n, "C"); \
+	TPACPI_PMU_ATTR(temp##_n##_scale, "temp" #_n ".scale", _n, "0.001")
+
+#define TPACPI_PMU_TEMP_LIST(_n) \
+	&tpacpi_pmu_attr_temp##_n.attr.attr, \
+	&tpacpi_pmu_attr_temp##_n##_unit.attr.attr, \
+	&tpacpi_pmu_attr_temp##_n##_scale.attr.attr
+
+TPACPI_PMU_TEMP_ATTRS(0);
+TPACPI_PMU_TEMP_ATTRS(1);
+TPACPI_PMU_TEMP_ATTRS(2);
+TPACPI_PMU_TEMP_ATTRS(3);
+TPACPI_PMU_TEMP_ATTRS(4);
+TPACPI_PMU_TEMP_ATTRS(5);
+TPACPI_PMU_TEMP_ATTRS(6);
+TPACPI_PMU_TEMP_ATTRS(7);
+TPACPI_PMU_TEMP_ATTRS(8);
+TPACPI_PMU_TEMP_ATTRS(9);
+TPACPI_PMU_TEMP_ATTRS(10);
+TPACPI_PMU_TEMP_ATTRS(11);
+TPACPI_PMU_TEMP_ATTRS(12);
+TPACPI_PMU_TEMP_ATTRS(13);
+TPACPI_PMU_TEMP_ATTRS(14);
+TPACPI_PMU_TEMP_ATTRS(15);
+TPACPI_PMU_ATTR(fan1_rpm, "fan1_rpm", TPACPI_PMU_EV_FAN1_RPM, NULL);
+TPACPI_PMU_ATTR(fan1_rpm_unit, "fan1_rpm.unit", TPACPI_PMU_EV_FAN1_RPM, "RPM");
+TPACPI_PMU_ATTR(fan2_rpm, "fan2_rpm", TPACPI_PMU_EV_FAN2_RPM, NULL);
+TPACPI_PMU_ATTR(fan2_rpm_unit, "fan2_rpm.unit", TPACPI_PMU_EV_FAN2_RPM, "RPM");
+TPACPI_PMU_ATTR(fan_level, "fan_level", TPACPI_PMU_EV_FAN_LEVEL, NULL);
+
+static struct attribute *tpacpi_pmu_event_attrs[] = {
+	TPACPI_PMU_TEMP_LIST(0),
+	TPACPI_PMU_TEMP_LIST(1),
+	TPACPI_PMU_TEMP_LIST(2),
+	TPACPI_PMU_TEMP_LIST(3),
+	TPACPI_PMU_TEMP_LIST(4),
+	TPACPI_PMU_TEMP_LIST(5),
+	TPACPI_PMU_TEMP_LIST(6),
+	TPACPI_PMU_TEMP_LIST(7),
+	TPACPI_PMU_TEMP_LIST(8),
+	TPACPI_PMU_TEMP_LIST(9),
+	TPACPI_PMU_TEMP_LIST(10),
+	TPACPI_PMU_TEMP_LIST(11),
+	TPACPI_PMU_TEMP_LIST(12),
+	TPACPI_PMU_TEMP_LIST(13),
+	TPACPI_PMU_TEMP_LIST(14),
+	TPACPI_PMU_TEMP_LIST(15),
+	&tpacpi_pmu_attr_fan1_rpm.attr.attr,
+	&tpacpi_pmu_attr_fan1_rpm_unit.attr.attr,
+	&tpacpi_pmu_attr_fan2_rpm.attr.attr,
+	&tpacpi_pmu_attr_fan2_rpm_unit.attr.attr,
+	&tpacpi_pmu_attr_fan_level.attr.attr,
+	NULL
+};
+
+#undef TPACPI_PMU_ATTR
+#undef TPACPI_PMU_TEMP_ATTRS
+#undef TPACPI_PMU_TEMP_LIST
+
+static umode_t tpacpi_pmu_event_is_visible(struct kobject *kobj,
+					   struct attribute *attr, int n)
+{
+	struct tpacpi_pmu_event_attr *ea =
+		container_of(attr, struct tpacpi_pmu_event_attr, attr.attr);
+
+	return tpacpi_pmu_event_supported(ea->id) ? attr->mode : 0;
+}
+
+static const struct attribute_group tpacpi_pmu_events_group = {
+	.name = "events",
+	.attrs = tpacpi_pmu_event_attrs,
+	.is_visible = tpacpi_pmu_event_is_visible,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *tpacpi_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL
+};
+
+static const struct attribute_group tpacpi_pmu_format_group = {
+	.name = "format",
+	.attrs = tpacpi_pmu_format_attrs,
+};
+
+/* The readings are platform-wide; have perf open each event only once */
+static ssize_t cpumask_show(struct device *dev,
+			    struct device_attribute *attr,
+			    char *buf)
+{
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(tpacpi_pmu_cpu));
+}
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *tpacpi_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL
+};
+
+static const struct attribute_group tpacpi_pmu_cpumask_group = {
+	.attrs = tpacpi_pmu_cpumask_attrs,
+};
+
+static const struct attribute_group *tpacpi_pmu_attr_groups[] = {
+	&tpacpi_pmu_events_group,
+	&tpacpi_pmu_format_group,
+	&tpacpi_pmu_cpumask_group,
+	NULL
+};
+
+static struct pmu tpacpi_pmu = {
+	.module		= THIS_MODULE,
+	.task_ctx_nr	= perf_invalid_context,
+	.attr_groups	= tpacpi_pmu_attr_groups,
+	.event_init	= tpacpi_pmu_event_init,
+	.add		= tpacpi_pmu_event_add,
+	.del		= tpacpi_pmu_event_del,
+	.start		= tpacpi_pmu_event_start,
+	.stop		= tpacpi_pmu_event_stop,
+	.read		= tpacpi_pmu_event_update,
+	.capabilities	= PERF_PMU_CAP_NO_INTERRUPT | PERF_PMU_CAP_NO_EXCLUDE,
+};
+
+static int tpacpi_pmu_offline_cpu(unsigned int cpu)
+{
+	unsigned int target;
+
+	if (cpu != tpacpi_pmu_cpu)
+		return 0;
+
+	target = cpumask_any_but(cpu_online_mask, cpu);
+	if (target >= nr_cpu_ids)
+		return 0;
+
+	perf_pmu_migrate_context(&tpacpi_pmu, cpu, target);
+	WRITE_ONCE(tpacpi_pmu_cpu, target);
+
+	return 0;
+}
+
+static int __init tpacpi_pmu_init(struct ibm_init_struct *iibm)
+{
+	int rc;
+
+	vdbg_printk(TPACPI_DBG_INIT, "initializing perf PMU subdriver\n");
+
+	if (!tpacpi_pmu_nsensors() &&
+	    fan_status_access_mode == TPACPI_FAN_NONE)
+		return -ENODEV;
+
+	/* pick the CPU and hook hotplug without one going away in between */
+	cpus_read_lock();
+	rc = cpuhp_setup_state_nocalls_cpuslocked(CPUHP_AP_ONLINE_DYN,
+						  "platform/x86/thinkpad_acpi/pmu:online",
+						  NULL, tpacpi_pmu_offline_cpu);
+	if (rc >= 0) {
+		tpacpi_pmu_hp_state = rc;
+		tpacpi_pmu_cpu = cpumask_first(cpu_online_mask);
+	}
+	cpus_read_unlock();
+	if (rc < 0) {
+		pr_err("unable to set up CPU hotplug for perf PMU: %d\n", rc);
+		return -ENODEV;
+	}
+
+	/* not worth failing the whole driver over */
+	rc = perf_pmu_register(&tpacpi_pmu, "tpacpi", -1);
+	if (rc) {
+		pr_err("unable to register perf PMU: %d\n", rc);
+		cpuhp_remove_state_nocalls(tpacpi_pmu_hp_state);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static void tpacpi_pmu_exit(void)
+{
+	perf_pmu_unregister(&tpacpi_pmu);
+	cpuhp_remove_state_nocalls(tpacpi_pmu_hp_state);
+	cancel_delayed_work_sync(&tpacpi_pmu_work);
+}
+
+static struct ibm_struct tpacpi_pmu_driver_data = {
+	.name = "pmu",
+	.exit = tpacpi_pmu_exit,
+};
+
+#endif /* CONFIG_PERF_EVENTS */
+
+/*************************************************************************
+ * Mute LED subdriver
+ */
+
+#define TPACPI_LED_MAX		2
+
+struct tp_led_table {
+	acpi_string name;
+	int on_value;
+	int off_value;
+	int state;
+};
+
+static struct tp_led_table led_tables[TPACPI_LED_MAX] = {
+	[LED_AUDIO_MUTE] = {
+		.name = "SSMS",
+		.on_value = 1,
+		.off_value = 0,
+	},
+	[LED_AUDIO_MICMUTE] = {
+		.name = "MMTS",
+		.on_value = 2,
+		.off_value = 0,
+	},
+};
+
+static int mute_led_on_off(struct tp_led_table *t, bool state)
+{
+	acpi_handle temp;
+	int output;
+
+	if (ACPI_FAILURE(acpi_get_handle(hkey_handle, t->name, &temp))) {
+		pr_warn("Thinkpad ACPI has no %s interface.\n", t->name);
+		return -EIO;
+	}
+
+	if (!acpi_evalf(hkey_handle, &output, t->name, "dd",
+			state ? t->on_value : t->off_value))
+		return -EIO;
+
+	t->state = state;
+	return state;
+}
+
+static int tpacpi_led_set(int whichled, bool on)
+{
+	struct tp_led_table *t;
+
+	t = &led_tables[whichled];
+	if (t->state < 0 || t->state == on)
+		return t->state;
+	return mute_led_on_off(t, on);
+}
+
+static int tpacpi_led_mute_set(struct led_classdev *led_cdev,
+			       enum led_brightness brightness)
+{
+	return tpacpi_led_set(LED_AUDIO_MUTE, brightness != LED_OFF);
+}
+
+static int tpacpi_led_micmute_set(struct led_classdev *led_cdev,
+				  enum led_brightness brightness)
+{
+	return tpacpi_led_set(LED_AUDIO_MICMUTE, brightness != LED_OFF);
+}
+
+static struct led_classdev mute_led_cdev[TPACPI_LED_MAX] = {
+	[LED_AUDIO_MUTE] = {
+		.name		= "platform::mute",
+		.max_brightness = 1,
+		.brightness_set_blocking = tpacpi_led_mute_set,
+		.default_trigger = "audio-mute",
+	},
+	[LED_AUDIO_MICMUTE] = {
+		.name		= "platform::micmute",
+		.max_brightness = 1,
+		.brightness_set_blocking = tpacpi_led_micmute_set,
+		.default_trigger = "audio-micmute",
+	},
+};
+
+static int mute_led_init(struct ibm_init_struct *iibm)
+{
+	acpi_handle temp;
+	int i, err;
+
+	for (i = 0; i < TPACPI_LED_MAX; i++) {
+		struct tp_led_table *t = &led_tables[i];
+		if (ACPI_FAILURE(acpi_get_handle(hkey_handle, t->name, &temp))) {
+			t->state = -ENODEV;
+			continue;
+		}
+
+		err = led_classdev_register(&tpacpi_pdev->dev, &mute_led_cdev[i]);
+		if (err < 0) {
+			while (i--)
+				led_classdev_unregister(&mute_led_cdev[i]);
+			return err;
+		}
+	}
+	return 0;
+}
+
+static void mute_led_exit(void)
+{
+	int i;
+
+	for (i = 0; i < TPACPI_LED_MAX; i++) {
+		led_classdev_unregister(&mute_led_cdev[i]);
+		tpacpi_led_set(i, false);
+	}
+}
+
+static void mute_led_resume(void)
+{
+	int i;
+
+	for (i = 0; i < TPACPI_LED_MAX; i++) {
+		struct tp_led_table *t = &led_tables[i];
+		if (t->state >= 0)
+			mute_led_on_off(t, t->state);
+	}
+}
+
+static struct ibm_struct mute_led_driver_data = {
+	.name = "mute_led",
+	.exit = mute_led_exit,
+	.resume = mute_led_resume,
+};
+
+/*
+ * Battery Wear Control Driver
+ * Contact: Ognjen Galic <smclt30p@gmail.com>
+ */
+
+/* Metadata */
+
+#define GET_START	"BCTG"
+#define SET_START	"BCCS"
+#define GET_STOP	"BCSG"
+#define SET_STOP	"BCSS"
+#define GET_DISCHARGE	"BDSG"
+#define SET_DISCHARGE	"BDSS"
+#define GET_INHIBIT	"BICG"
+#define SET_INHIBIT	"BICS"
+
+enum {
+	BAT_ANY = 0,
+	BAT_PRIMARY = 1,
+	BAT_SECONDARY = 2
+};
+
+enum {
+	/* Error condition bit */
+	METHOD_ERR = BIT(31),
+};
+
+enum {
+	/* This is used in the get/set helpers */
+	THRESHOLD_START,
+	THRESHOLD_STOP,
+	FORCE_DISCHARGE,
+	INHIBIT_CHARGE,
+};
+
+struct tpacpi_battery_data {
+	int charge_start;
+	int start_support;
+	int charge_stop;
+	int stop_support;
+	unsigned int charge_behaviours;
+	/* cached firmware state, see tpacpi_battery_cache_refresh() */
+	int force_discharge;
+	int inhibit_charge;
+	bool cache_valid;
+};
+
+struct tpacpi_battery_driver_data {
+	struct tpacpi_battery_data batteries[3];
+	int individual_addressing;
+};
+
+static struct tpacpi_battery_driver_data battery_info;
+
+/* Protects the cached state in battery_info.batteries[] */
+static DEFINE_MUTEX(battery_mutex);
+
+/* ACPI helpers/functions/probes */
+
+/*
+ * This evaluates a ACPI method call specific to the battery
+ * ACPI extension. The specifics are that an error is marked
+ * in the 32rd bit of the response, so we just check that here.
+ */
+static acpi_status tpacpi_battery_acpi_eval(char *method, int *ret, int param)
+{
+	int response;
+
+	if (!acpi_evalf(hkey_handle, &response, method, "dd", param)) {
+		acpi_handle_err(hkey_handle, "%s: evaluate failed", method);
+		return AE_ERROR;
+	}
+	if (response & METHOD_ERR) {
+		acpi_handle_err(hkey_handle,
+				"%s evaluated but flagged as error", method);
+		return AE_ERROR;
+	}
+	*ret = response;
+	return AE_OK;
+}
+
+static int tpacpi_battery_get(int what, int battery, int *ret)
+{
+	switch (what) {
+	case THRESHOLD_START:
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_START, ret, battery))
+			return -ENODEV;
+
+		/* The value is in the low 8 bits of the response */
+		*ret = *ret & 0xFF;
+		return 0;
+	case THRESHOLD_STOP:
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_STOP, ret, battery))
+			return -ENODEV;
+		/* Value is in lower 8 bits */
+		*ret = *ret & 0xFF;
+		/*
+		 * On the stop value, if we return 0 that
+		 * does not make any sense. 0 means Default, which
+		 * means that charging stops at 100%, so we return
+		 * that.
+		 */
+		if (*ret == 0)
+			*ret = 100;
+		return 0;
+	case FORCE_DISCHARGE:
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_DISCHARGE, ret, battery))
+			return -ENODEV;
+		/* The force discharge status is in bit 0 */
+		*ret = *ret & 0x01;
+		return 0;
+	case INHIBIT_CHARGE:
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_INHIBIT, ret, battery))
+			return -ENODEV;
+		/* The inhibit charge status is in bit 0 */
+		*ret = *ret & 0x01;
+		return 0;
+	default:
+		pr_crit("wrong parameter: %d", what);
+		return -EINVAL;
+	}
+}
+
+static int tpacpi_battery_set(int what, int battery, int value)
+{
+	int param, ret;
+	/* The first 8 bits are the value of the threshold */
+	param = value;
+	/* The battery ID is in bits 8-9, 2 bits */
+	param |= battery << 8;
+
+	switch (what) {
+	case THRESHOLD_START:
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_START, &ret, param)) {
+			pr_err("failed to set charge threshold on battery %d",
+					battery);
+			return -ENODEV;
+		}
+		return 0;
+	case THRESHOLD_STOP:
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_STOP, &ret, param)) {
+			pr_err("failed to set stop threshold: %d", battery);
+			return -ENODEV;
+		}
+		return 0;
+	case FORCE_DISCHARGE:
+		/* Force discharge is in bit 0,
+		 * break on AC attach is in bit 1 (won't work on some ThinkPads),
+		 * battery ID is in bits 8-9, 2 bits.
+		 */
+		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_DISCHARGE, &ret, param))) {
+			pr_err("failed to set force discharge on %d", battery);
+			return -ENODEV;
+		}
+		return 0;
+	case INHIBIT_CHARGE:
+		/* When setting inhibit charge, we set a default value of
+		 * always breaking on AC detach and the effective time is set to
+		 * be permanent.
+		 * The battery ID is in bits 4-5, 2 bits,
+		 * the effective time is in bits 8-23, 2 bytes.
+		 * A time of FFFF indicates forever.
+		 */
+		param = value;
+		param |= battery << 4;
+		param |= 0xFFFF << 8;
+		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(SET_INHIBIT, &ret, param))) {
+			pr_err("failed to set inhibit charge on %d", battery);
+			return -ENODEV;
+		}
+		return 0;
+	default:
+		pr_crit("wrong parameter: %d", what);
+		return -EINVAL;
+	}
+}
+
+/* Keeps the cache in line with a value just written to the firmware */
+static void tpacpi_battery_cache_update(int what, int battery, int value)
+{
+	struct tpacpi_battery_data *b = &battery_info.batteries[battery];
+
+	lockdep_assert_held(&battery_mutex);
+
+	switch (what) {
+	case FORCE_DISCHARGE:
+		b->force_discharge = value;
+		break;
+	case INHIBIT_CHARGE:
+		b->inhibit_charge = value;
+		break;
+	}
+}
+
+static int tpacpi_battery_set_validate(int what, int battery, int value)
+{
+	bool was_valid = battery_info.batteries[battery].cache_valid;
+	int ret, v;
+
+	lockdep_assert_held(&battery_mutex);
+
+	/* on failure, the cached state is unknown too */
+	battery_info.batteries[battery].cache_valid = false;
+
+	ret = tpacpi_battery_set(what, battery, value);
+	if (ret < 0)
+		return ret;
+
+	ret = tpacpi_battery_get(what, battery, &v);
+	if (ret < 0)
+		return ret;
+
+	if (v == value)
+		goto out;
+
+	msleep(500);
+
+	ret = tpacpi_battery_get(what, battery, &v);
+	if (ret < 0)
+		return ret;
+
+	if (v != value)
+		return -EIO;
+
+out:
+	/* the other values have not changed */
+	battery_info.batteries[battery].cache_valid = was_valid;
+	tpacpi_battery_cache_update(what, battery, value);
+	return 0;
+}
+
+/*
+ * Thresholds and charge behaviour are read from the firmware once and then
+ * served from battery_info.batteries[].  Our own writes update the cache;
+ * resume and the battery/AC HKEY events, after which the EC may have
+ * changed them on its own, invalidate it.
+ */
+static int tpacpi_battery_cache_refresh(int battery)
+{
+	struct tpacpi_battery_data *b = &battery_info.batteries[battery];
+	int ret, v;
+
+	lockdep_assert_held(&battery_mutex);
+
+	if (b->cache_valid)
+		return 0;
+
+	if (b->start_support) {
+		ret = tpacpi_battery_get(THRESHOLD_START, battery, &v);
+		if (ret)
+			return ret;
+		b->charge_start = v;
+	}
+	if (b->stop_support) {
+		ret = tpacpi_battery_get(THRESHOLD_STOP, battery, &v);
+		if (ret)
+			return ret;
+		b->charge_stop = v;
+	}
+	if (b->charge_behaviours & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE)) {
+		ret = tpacpi_battery_get(FORCE_DISCHARGE, battery, &v);
+		if (ret)
+			return ret;
+		b->force_discharge = v;
+	}
+	if (b->charge_behaviours & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE)) {
+		ret = tpacpi_battery_get(INHIBIT_CHARGE, battery, &v);
+		if (ret)
+			return ret;
+		b->inhibit_charge = v;
+	}
+
+	b->cache_valid = true;
+	return 0;
+}
+
+static int tpacpi_battery_get_cached(int what, int battery, int *ret)
+{
+	struct tpacpi_battery_data *b = &battery_info.batteries[battery];
+	int err;
+
+	mutex_lock(&battery_mutex);
+
+	err = tpacpi_battery_cache_refresh(battery);
+	if (err)
+		goto unlock;
+
+	switch (what) {
+	case THRESHOLD_START:
+		*ret = b->charge_start;
+		break;
+	case THRESHOLD_STOP:
+		*ret = b->charge_stop;
+		break;
+	case FORCE_DISCHARGE:
+		*ret = b->force_discharge;
+		break;
+	case INHIBIT_CHARGE:
+		*ret = b->inhibit_charge;
+		break;
+	default:
+		err = -EINVAL;
+	}
+
+unlock:
+	mutex_unlock(&battery_mutex);
+	return err;
+}
+
+static void tpacpi_battery_invalidate(void)
+{
+	unsigned int i;
+
+	mutex_lock(&battery_mutex);
+	for (i = 0; i < ARRAY_SIZE(battery_info.batteries); i++)
+		battery_info.batteries[i].cache_valid = false;
+	mutex_unlock(&battery_mutex);
+}
+
+static int tpacpi_battery_probe(int battery)
+{
+	int ret = 0;
+
+	memset(&battery_info.batteries[battery], 0,
+		sizeof(battery_info.batteries[battery]));
+
+	/*
+	 * 1) Get the current start threshold
+	 * 2) Check for support
+	 * 3) Get the current stop threshold
+	 * 4) Check for support
+	 * 5) Get the current force discharge status
+	 * 6) Check for support
+	 * 7) Get the current inhibit charge status
+	 * 8) Check for support
+	 */
+	if (acpi_has_method(hkey_handle, GET_START)) {
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_START, &ret, battery)) {
+			pr_err("Error probing battery %d\n", battery);
+			return -ENODEV;
+		}
+		/* Individual addressing is in bit 9 */
+		if (ret & BIT(9))
+			battery_info.individual_addressing = true;
+		/* Support is marked in bit 8 */
+		if (ret & BIT(8))
+			battery_info.batteries[battery].start_support = 1;
+		else
+			return -ENODEV;
+		if (tpacpi_battery_get(THRESHOLD_START, battery,
+			&battery_info.batteries[battery].charge_start)) {
+			pr_err("Error probing battery %d\n", battery);
+			return -ENODEV;
+		}
+	}
+	if (acpi_has_method(hkey_handle, GET_STOP)) {
+		if ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_STOP, &ret, battery)) {
+			pr_err("Error probing battery stop; %d\n", battery);
+			return -ENODEV;
+		}
+		/* Support is marked in bit 8 */
+		if (ret & BIT(8))
+			battery_info.batteries[battery].stop_support = 1;
+		else
+			return -ENODEV;
+		if (tpacpi_battery_get(THRESHOLD_STOP, battery,
+			&battery_info.batteries[battery].charge_stop)) {
+			pr_err("Error probing battery stop: %d\n", battery);
+			return -ENODEV;
+		}
+	}
+	if (acpi_has_method(hkey_handle, GET_DISCHARGE)) {
+		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_DISCHARGE, &ret, battery))) {
+			pr_err("Error probing battery discharge; %d\n", battery);
+			return -ENODEV;
+		}
+		/* Support is marked in bit 8 */
+		if (ret & BIT(8))
+			battery_info.batteries[battery].charge_behaviours |=
+				BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE);
+	}
+	if (acpi_has_method(hkey_handle, GET_INHIBIT)) {
+		if (ACPI_FAILURE(tpacpi_battery_acpi_eval(GET_INHIBIT, &ret, battery))) {
+			pr_err("Error probing battery inhibit charge; %d\n", battery);
+			return -ENODEV;
+		}
+		/* Support is marked in bit 5 */
+		if (ret & BIT(5))
+			battery_info.batteries[battery].charge_behaviours |=
+				BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE);
+	}
+
+	battery_info.batteries[battery].charge_behaviours |=
+		BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_AUTO);
+
+	mutex_lock(&battery_mutex);
+	if (tpacpi_battery_cache_refresh(battery))
+		pr_warn("battery %d: could not read the charge state\n",
+			battery);
+	mutex_unlock(&battery_mutex);
+
+	pr_info("battery %d registered (start %d, stop %d, behaviours: 0x%x)\n",
+		battery,
+		battery_info.batteries[battery].charge_start,
+		battery_info.batteries[battery].charge_stop,
+		battery_info.batteries[battery].charge_behaviours);
+
+	return 0;
+}
+
+/* General helper functions */
+
+static int tpacpi_battery_get_id(const char *battery_name)
+{
+
+	if (strcmp(battery_name, "BAT0") == 0 ||
+	    tp_features.battery_force_primary)
+		return BAT_PRIMARY;
+	if (strcmp(battery_name, "BAT1") == 0)
+		return BAT_SECONDARY;
+	/*
+	 * If for some reason the battery is not BAT0 nor is it
+	 * BAT1, we will assume it's the default, first battery,
+	 * AKA primary.
+	 */
+	pr_warn("unknown battery %s, assuming primary", battery_name);
+	return BAT_PRIMARY;
+}
+
+/* sysfs interface */
+
+static int tpacpi_battery_store_locked(int what, int battery,
+				       unsigned long value)
+{
+	lockdep_assert_held(&battery_mutex);
+
+	/* validate against what the firmware has now */
+	if (tpacpi_battery_cache_refresh(battery))
+		return -ENODEV;
+
+	switch (what) {
+	case THRESHOLD_START:
+		if (!battery_info.batteries[battery].start_support)
+			return -ENODEV;
+		/* valid values are [0, 99] */
+		if (value > 99)
+			return -EINVAL;
+		if (value > battery_info.batteries[battery].charge_stop)
+			return -EINVAL;
+		if (tpacpi_battery_set(THRESHOLD_START, battery, value))
+			return -ENODEV;
+		battery_info.batteries[battery].charge_start = value;
+		return 0;
+
+	case THRESHOLD_STOP:
+		if (!battery_info.batteries[battery].stop_support)
+			return -ENODEV;
+		/* valid values are [1, 100] */
+		if (value < 1 || value > 100)
+			return -EINVAL;
+		if (value < battery_info.batteries[battery].charge_start)
+			return -EINVAL;
+		/*
+		 * When 100 is passed to stop, we need to flip
+		 * it to 0 as that the EC understands that as
+		 * "Default", which will charge to 100%
+		 */
+		if (tpacpi_battery_set(THRESHOLD_STOP, battery,
+				       value == 100 ? 0 : value))
+			return -EINVAL;
+		battery_info.batteries[battery].charge_stop = value;
+		return 0;
+	default:
+		pr_crit("Wrong parameter: %d", what);
+		return -EINVAL;
+	}
+}
+
+static ssize_t tpacpi_battery_store(int what,
+				    struct device *dev,
+				    const char *buf, size_t count)
+{
+	struct power_supply *supply = to_power_supply(dev);
+	unsigned long value;
+	int battery, rval;
+	/*
+	 * Some systems have support for more than
+	 * one battery. If that is the case,
+	 * tpacpi_battery_probe marked that addressing
+	 * them individually is supported, so we do that
+	 * based on the device struct.
+	 *
+	 * On systems that are not supported, we assume
+	 * the primary as most of the ACPI calls fail
+	 * with "Any Battery" as the parameter.
+	 */
+	if (battery_info.individual_addressing)
+		/* BAT_PRIMARY or BAT_SECONDARY */
+		battery = tpacpi_battery_get_id(supply->desc->name);
+	else
+		battery = BAT_PRIMARY;
+
+	rval = kstrtoul(buf, 10, &value);
+	if (rval)
+		return rval;
+
+	mutex_lock(&battery_mutex);
+	rval = tpacpi_battery_store_locked(what, battery, value);
+	mutex_unlock(&battery_mutex);
+
+	return rval ? rval : count;
+}
+
+static ssize_t tpacpi_battery_show(int what,
+				   struct device *dev,
+				   char *buf)
+{
+	struct power_supply *supply = to_power_supply(dev);
+	int ret, battery;
+	/*
+	 * Some systems have support for more than
+	 * one battery. If that is the case,
+	 * tpacpi_battery_probe marked that addressing
+	 * them individually is supported, so we;
+	 * based on the device struct.
+	 *
+	 * On systems that are not supported, we assume
+	 * the primary as most of the ACPI calls fail
+	 * with "Any Battery" as the parameter.
+	 */
+	if (battery_info.individual_addressing)
+		/* BAT_PRIMARY or BAT_SECONDARY */
+		battery = tpacpi_battery_get_id(supply->desc->name);
+	else
+		battery = BAT_PRIMARY;
+	if (tpacpi_battery_get_cached(what, battery, &ret))
+		return -ENODEV;
+	return sysfs_emit(buf, "%d\n", ret);
+}
+
+static ssize_t charge_control_start_threshold_show(struct device *device,
+				struct device_attribute *attr,
+				char *buf)
+{
+	return tpacpi_battery_show(THRESHOLD_START, device, buf);
+}
+
+static ssize_t charge_control_end_threshold_show(struct device *device,
+				struct device_attribute *attr,
+				char *buf)
+{
+	return tpacpi_battery_show(THRESHOLD_STOP, device, buf);
+}
+
+static ssize_t charge_behaviour_show(struct device *dev,
+				     struct device_attribute *attr,
+				     char *buf)
+{
+	enum power_supply_charge_behaviour active = POWER_SUPPLY_CHARGE_BEHAVIOUR_AUTO;
+	struct power_supply *supply = to_power_supply(dev);
+	unsigned int available;
+	int ret, battery;
+
+	battery = tpacpi_battery_get_id(supply->desc->name);
+	available = battery_info.batteries[battery].charge_behaviours;
+
+	if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE)) {
+		if (tpacpi_battery_get_cached(FORCE_DISCHARGE, battery, &ret))
+			return -ENODEV;
+		if (ret) {
+			active = POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE;
+			goto out;
+		}
+	}
+
+	if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE)) {
+		if (tpacpi_battery_get_cached(INHIBIT_CHARGE, battery, &ret))
+			return -ENODEV;
+		if (ret) {
+			active = POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE;
+			goto out;
+		}
+	}
+
+out:
+	return power_supply_charge_behaviour_show(dev, available, active, buf);
+}
+
+static ssize_t charge_control_start_threshold_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	return tpacpi_battery_store(THRESHOLD_START, dev, buf, count);
+}
+
+static ssize_t charge_control_end_threshold_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	return tpacpi_battery_store(THRESHOLD_STOP, dev, buf, count);
+}
+
+static ssize_t charge_behaviour_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct power_supply *supply = to_power_supply(dev);
+	int selected, battery, ret = 0;
+	unsigned int available;
+
+	battery = tpacpi_battery_get_id(supply->desc->name);
+	available = battery_info.batteries[battery].charge_behaviours;
+	selected = power_supply_charge_behaviour_parse(available, buf);
+
+	if (selected < 0)
+		return selected;
+
+	mutex_lock(&battery_mutex);
+
+	switch (selected) {
+	case POWER_SUPPLY_CHARGE_BEHAVIOUR_AUTO:
+		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE))
+			ret = tpacpi_battery_set_validate(FORCE_DISCHARGE, battery, 0);
+		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE))
+			ret = min(ret, tpacpi_battery_set_validate(INHIBIT_CHARGE, battery, 0));
+		break;
+	case POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE:
+		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE))
+			ret = tpacpi_battery_set_validate(INHIBIT_CHARGE, battery, 0);
+		ret = min(ret, tpacpi_battery_set_validate(FORCE_DISCHARGE, battery, 1));
+		break;
+	case POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE:
+		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE))
+			ret = tpacpi_battery_set_validate(FORCE_DISCHARGE, battery, 0);
+		ret = min(ret, tpacpi_battery_set_validate(INHIBIT_CHARGE, battery, 1));
+		break;
+	default:
+		dev_err(dev, "Unexpected charge behaviour: %d\n", selected);
+		ret = -EINVAL;
+	}
+
+	mutex_unlock(&battery_mutex);
+
+	return (ret < 0) ? ret : count;
+}
+
+static DEVICE_ATTR_RW(charge_control_start_threshold);
+static DEVICE_ATTR_RW(charge_control_end_threshold);
+static DEVICE_ATTR_RW(charge_behaviour);
+static struct device_attribute dev_attr_charge_start_threshold = __ATTR(
+	charge_start_threshold,
+	0644,
+	charge_control_start_threshold_show,
+	charge_control_start_threshold_store
+);
+static struct device_attribute dev_attr_charge_stop_threshold = __ATTR(
+	charge_stop_threshold,
+	0644,
+	charge_control_end_threshold_show,
+	charge_control_end_threshold_store
+);
+
+static struct attribute *tpacpi_battery_attrs[] = {
+	&dev_attr_charge_control_start_threshold.attr,
+	&dev_attr_charge_control_end_threshold.attr,
+	&dev_attr_charge_start_threshold.attr,
+	&dev_attr_charge_stop_threshold.attr,
+	&dev_attr_charge_behaviour.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(tpacpi_battery);
+
+/* ACPI battery hooking */
+
+static int tpacpi_battery_add(struct power_supply *battery, struct acpi_battery_hook *hook)
+{
+	int batteryid = tpacpi_battery_get_id(battery->desc->name);
+
+	if (tpacpi_battery_probe(batteryid))
+		return -ENODEV;
+	if (device_add_groups(&battery->dev, tpacpi_battery_groups))
+		return -ENODEV;
+	return 0;
+}
+
+static int tpacpi_battery_remove(struct power_supply *battery, struct acpi_battery_hook *hook)
+{
+	device_remove_groups(&battery->dev, tpacpi_battery_groups);
+	return 0;
+}
+
+static struct acpi_battery_hook battery_hook = {
+	.add_battery = tpacpi_battery_add,
+	.remove_battery = tpacpi_battery_remove,
+	.name = "ThinkPad Battery Extension",
+};
+
+/* Subdriver init/exit */
+
+static const struct tpacpi_quirk battery_quirk_table[] __initconst = {
+	/*
+	 * Individual addressing is broken on models that expose the
+	 * primary battery as BAT1.
+	 */
+	TPACPI_Q_LNV('8', 'F', true),       /* Thinkpad X120e */
+	TPACPI_Q_LNV('J', '7', true),       /* B5400 */
+	TPACPI_Q_LNV('J', 'I', true),       /* Thinkpad 11e */
+	TPACPI_Q_LNV3('R', '0', 'B', true), /* Thinkpad 11e gen 3 */
+	TPACPI_Q_LNV3('R', '0', 'C', true), /* Thinkpad 13 */
+	TPACPI_Q_LNV3('R', '0', 'J', true), /* Thinkpad 13 gen 2 */
+	TPACPI_Q_LNV3('R', '0', 'K', true), /* Thinkpad 11e gen 4 celeron BIOS */
+};
+
+static int __init tpacpi_battery_init(struct ibm_init_struct *ibm)
+{
+	memset(&battery_info, 0, sizeof(battery_info));
+
+	tp_features.battery_force_primary = tpacpi_check_quirks(
+					battery_quirk_table,
+					ARRAY_SIZE(battery_quirk_table));
+
+	battery_hook_register(&battery_hook);
+	return 0;
+}
+
+static void tpacpi_battery_resume(void)
+{
+	tpacpi_battery_invalidate();
+}
+
+static void tpacpi_battery_exit(void)
+{
+	battery_hook_unregister(&battery_hook);
+}
+
+static struct ibm_struct battery_driver_data = {
+	.name = "battery",
+	.resume = tpacpi_battery_resume,
+	.exit = tpacpi_battery_exit,
+};
+
+/*************************************************************************
+ * LCD Shadow subdriver, for the Lenovo PrivacyGuard feature
+ */
+
+static struct drm_privacy_screen *lcdshadow_dev;
+static acpi_handle lcdshadow_get_handle;
+static acpi_handle lcdshadow_set_handle;
+
+static int lcdshadow_set_sw_state(struct drm_privacy_screen *priv,
+				  enum drm_privacy_screen_status state)
+{
+	int output;
+
+	if (WARN_ON(!mutex_is_locked(&priv->lock)))
+		return -EIO;
+
+	if (!acpi_evalf(lcdshadow_set_handle, &output, NULL, "dd", (int)state))
+		return -EIO;
+
+	priv->hw_state = priv->sw_state = state;
+	return 0;
+}
+
+static void lcdshadow_get_hw_state(struct drm_privacy_screen *priv)
+{
+	int output;
+
+	if (!acpi_evalf(lcdshadow_get_handle, &output, NULL, "dd", 0))
+		return;
+
+	priv->hw_state = priv->sw_state = output & 0x1;
+}
+
+static const struct drm_privacy_screen_ops lcdshadow_ops = {
+	.set_sw_state = lcdshadow_set_sw_state,
+	.get_hw_state = lcdshadow_get_hw_state,
+};
+
+static int tpacpi_lcdshadow_init(struct ibm_init_struct *iibm)
+{
+	acpi_status status1, status2;
+	int output;
+
+	status1 = acpi_get_handle(hkey_handle, "GSSS", &lcdshadow_get_handle);
+	status2 = acpi_get_handle(hkey_handle, "SSSS", &lcdshadow_set_handle);
+	if (ACPI_FAILURE(status1) || ACPI_FAILURE(status2))
+		return 0;
+
+	if (!acpi_evalf(lcdshadow_get_handle, &output, NULL, "dd", 0))
+		return -EIO;
+
+	if (!(output & 0x10000))
+		return 0;
+
+	lcdshadow_dev = drm_privacy_screen_register(&tpacpi_pdev->dev,
+						    &lcdshadow_ops, NULL);
+	if (IS_ERR(lcdshadow_dev))
+		return PTR_ERR(lcdshadow_dev);
+
+	return 0;
+}
+
+static void lcdshadow_exit(void)
+{
+	drm_privacy_screen_unregister(lcdshadow_dev);
+}
+
+static void lcdshadow_resume(void)
+{
+	if (!lcdshadow_dev)
+		return;
+
+	mutex_lock(&lcdshadow_dev->lock);
+	lcdshadow_set_sw_state(lcdshadow_dev, lcdshadow_dev->sw_state);
+	mutex_unlock(&lcdshadow_dev->lock);
+}
+
+static int lcdshadow_read(struct seq_file *m)
+{
+	if (!lcdshadow_dev) {
+		seq_puts(m, "status:\t\tnot supported\n");
+	} else {
+		seq_printf(m, "status:\t\t%d\n", lcdshadow_dev->hw_state);
+		seq_puts(m, "commands:\t0, 1\n");
+	}
+
+	return 0;
+}
+
+static int lcdshadow_write(char *buf)
+{
+	char *cmd;
+	int res, state = -EINVAL;
+
+	if (!lcdshadow_dev)
+		return -ENODEV;
+
+	while ((cmd = strsep(&buf, ","))) {
+		res = kstrtoint(cmd, 10, &state);
+		if (res < 0)
+			return res;
+	}
+
+	if (state >= 2 || state < 0)
+		return -EINVAL;
+
+	mutex_lock(&lcdshadow_dev->lock);
+	res = lcdshadow_set_sw_state(lcdshadow_dev, state);
+	mutex_unlock(&lcdshadow_dev->lock);
+
+	drm_privacy_screen_call_notifier_chain(lcdshadow_dev);
+
+	return res;
+}
+
+static struct ibm_struct lcdshadow_driver_data = {
+	.name = "lcdshadow",
+	.exit = lcdshadow_exit,
+	.resume = lcdshadow_resume,
+	.read = lcdshadow_read,
+	.write = lcdshadow_write,
+};
+
+/*************************************************************************
+ * Thinkpad sensor interfaces
+ */
+
+#define DYTC_CMD_QUERY        0 /* To get DYTC status - enable/revision */
+#define DYTC_QUERY_ENABLE_BIT 8  /* Bit        8 - 0 = disabled, 1 = enabled */
+#define DYTC_QUERY_SUBREV_BIT 16 /* Bits 16 - 27 - sub revision */
+#define DYTC_QUERY_REV_BIT    28 /* Bits 28 - 31 - revision */
+
+#define DYTC_CMD_GET          2 /* To get current IC function and mode */
+#define DYTC_GET_LAPMODE_BIT 17 /* Set when in lapmode */
+
+#define PALMSENSOR_PRESENT_BIT 0 /* Determine if psensor present */
+#define PALMSENSOR_ON_BIT      1 /* psensor status */
+
+static bool has_palmsensor;
+static bool has_lapsensor;
+static bool palm_state;
+static bool lap_state;
+static int dytc_version;
+
+static acpi_handle dytc_handle;
+static bool dytc_handle_probed;
+
+/* Looks DYTC up once, for the proximity sensor and profile subdrivers */
+static void dytc_handle_init(void)
+{
+	if (dytc_handle_probed)
+		return;
+	dytc_handle_probed = true;
+
+	if (ACPI_FAILURE(acpi_get_handle(hkey_handle, "DYTC", &dytc_handle)))
+		dytc_handle = NULL;
+}
+
+static int dytc_command(int command, int *output)
+{
+	if (!dytc_handle) {
+		/* Platform doesn't support DYTC */
+		return -ENODEV;
+	}
+	if (!acpi_evalf(dytc_handle, output, NULL, "dd", command))
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Cached DYTC_CMD_GET result.  What it returns only changes when the
+ * firmware completes a thermal control command (TP_HKEY_EV_THM_CSM_COMPLETED),
+ * on AMT toggles and on our own set commands, all of which invalidate it.
+ * The generation count keeps a read racing with an invalidation from
+ * caching the old value.
+ */
+static DEFINE_SPINLOCK(dytc_get_lock);
+static int dytc_get_output;
+static bool dytc_get_valid;
+static unsigned int dytc_get_gen;
+
+static void dytc_get_invalidate(void)
+{
+	spin_lock(&dytc_get_lock);
+	dytc_get_valid = false;
+	dytc_get_gen++;
+	spin_unlock(&dytc_get_lock);
+}
+
+static int dytc_get_cached(int *output)
+{
+	unsigned int gen;
+	int err;
+
+	spin_lock(&dytc_get_lock);
+	if (dytc_get_valid) {
+		*output = dytc_get_output;
+		spin_unlock(&dytc_get_lock);
+		return 0;
+	}
+	gen = dytc_get_gen;
+	spin_unlock(&dytc_get_lock);
+
+	err = dytc_command(DYTC_CMD_GET, output);
+	if (err)
+		return err;
+
+	spin_lock(&dytc_get_lock);
+	if (gen == dytc_get_gen) {
+		dytc_get_output = *output;
+		dytc_get_valid = true;
+	}
+	spin_unlock(&dytc_get_lock);
+
+	return 0;
+}
+
+static int lapsensor_get(bool *present, bool *state)
+{
+	int output, err;
+
+	*present = false;
+	err = dytc_get_cached(&output);
+	if (err)
+		return err;
+
+	*present = true; /*If we get his far, we have lapmode support*/
+	*state = output & BIT(DYTC_GET_LAPMODE_BIT) ? true : false;
+	return 0;
+}
+
+static int palmsensor_get(bool *present, bool *state)
+{
+	acpi_handle psensor_handle;
+	int output;
+
+	*present = false;
+	if (ACPI_FAILURE(acpi_get_handle(hkey_handle, "GPSS", &psensor_handle)))
+		return -ENODEV;
+	if (!acpi_evalf(psensor_handle, &output, NULL, "d"))
+		return -EIO;
+
+	*present = output & BIT(PALMSENSOR_PRESENT_BIT) ? true : false;
+	*state = output & BIT(PALMSENSOR_ON_BIT) ? true : false;
+	return 0;
+}
+
+static void lapsensor_refresh(void)
+{
+	bool state;
+	int err;
+
+	if (has_lapsensor) {
+		err = lapsensor_get(&has_lapsensor, &state);
+		if (err)
+			return;
+		if (lap_state != state) {
+			lap_state = state;
+			sysfs_notify(&tpacpi_pdev->dev.kobj, NULL, "dytc_lapmode");
+		}
+	}
+}
+
+static void palmsensor_refresh(void)
+{
+	bool state;
+	int err;
+
+	if (has_palmsensor) {
+		err = palmsensor_get(&has_palmsensor, &state);
+		if (err)
+			return;
+		if (palm_state != state) {
+			palm_state = state;
+			sysfs_notify(&tpacpi_pdev->dev.kobj, NULL, "palmsensor");
+		}
+	}
+}
+
+static ssize_t dytc_lapmode_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	if (has_lapsensor)
+		return sysfs_emit(buf, "%d\n", lap_state);
+	return sysfs_emit(buf, "\n");
+}
+static DEVICE_ATTR_RO(dytc_lapmode);
+
+static ssize_t palmsensor_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	if (has_palmsensor)
+		return sysfs_emit(buf, "%d\n", palm_state);
+	return sysfs_emit(buf, "\n");
+}
+static DEVICE_ATTR_RO(palmsensor);
+
+static struct attribute *proxsensor_attributes[] = {
+	&dev_attr_dytc_lapmode.attr,
+	&dev_attr_palmsensor.attr,
+	NULL
+};
+
+static umode_t proxsensor_attr_is_visible(struct kobject *kobj,
+					  struct attribute *attr, int n)
+{
+	if (attr == &dev_attr_dytc_lapmode.attr) {
+		/*
+		 * Platforms before DYTC version 5 claim to have a lap sensor,
+		 * but it doesn't work, so we ignore them.
+		 */
+		if (!has_lapsensor || dytc_version < 5)
+			return 0;
+	} else if (attr == &dev_attr_palmsensor.attr) {
+		if (!has_palmsensor)
+			return 0;
+	}
+
+	return attr->mode;
+}
+
+static const struct attribute_group proxsensor_attr_group = {
+	.is_visible = proxsensor_attr_is_visible,
+	.attrs = proxsensor_attributes,
+};
+
+static int tpacpi_proxsensor_init(struct ibm_init_struct *iibm)
+{
+	int palm_err, lap_err;
+
+	dytc_handle_init();
+
+	palm_err = palmsensor_get(&has_palmsensor, &palm_state);
+	lap_err = lapsensor_get(&has_lapsensor, &lap_state);
+	/* If support isn't available for both devices return -ENODEV */
+	if ((palm_err == -ENODEV) && (lap_err == -ENODEV))
+		return -ENODEV;
+	/* Otherwise, if there was an error return it */
+	if (palm_err && (palm_err != -ENODEV))
+		return palm_err;
+	if (lap_err && (lap_err != -ENODEV))
+		return lap_err;
+
+	return 0;
+}
+
+static void proxsensor_resume(void)
+{
+	/* the sensors kept changing while we were asleep */
+	dytc_get_invalidate();
+	lapsensor_refresh();
+	palmsensor_refresh();
+}
+
+static struct ibm_struct proxsensor_driver_data = {
+	.name = "proximity-sensor",
+	.resume = proxsensor_resume,
+};
+
+/*************************************************************************
+ * DYTC Platform Profile interface
+ */
+
+#define DYTC_CMD_SET          1 /* To enable/disable IC function mode */
+#define DYTC_CMD_MMC_GET      8 /* To get current MMC function and mode */
+#define DYTC_CMD_RESET    0x1ff /* To reset back to default */
+
+#define DYTC_CMD_FUNC_CAP     3 /* To get DYTC capabilities */
+#define DYTC_FC_MMC           27 /* MMC Mode supported */
+#define DYTC_FC_PSC           29 /* PSC Mode supported */
+#define DYTC_FC_AMT           31 /* AMT mode supported */
+
+#define DYTC_GET_FUNCTION_BIT 8  /* Bits  8-11 - function setting */
+#define DYTC_GET_MODE_BIT     12 /* Bits 12-15 - mode setting */
+
+#define DYTC_SET_FUNCTION_BIT 12 /* Bits 12-15 - function setting */
+#define DYTC_SET_MODE_BIT     16 /* Bits 16-19 - mode setting */
+#define DYTC_SET_VALID_BIT    20 /* Bit     20 - 1 = on, 0 = off */
+
+#define DYTC_FUNCTION_STD     0  /* Function = 0, standard mode */
+#define DYTC_FUNCTION_CQL     1  /* Function = 1, lap mode */
+#define DYTC_FUNCTION_MMC     11 /* Function = 11, MMC mode */
+#define DYTC_FUNCTION_PSC     13 /* Function = 13, PSC mode */
+#define DYTC_FUNCTION_AMT     15 /* Function = 15, AMT mode */
+
+#define DYTC_MODE_AMT_ENABLE   0x1 /* Enable AMT (in balanced mode) */
+#define DYTC_MODE_AMT_DISABLE  0xF /* Disable AMT (in other modes) */
+
+#define DYTC_MODE_MMC_PERFORM  2  /* High power mode aka performance */
+#define DYTC_MODE_MMC_LOWPOWER 3  /* Low power mode */
+#define DYTC_MODE_MMC_BALANCE  0xF  /* Default mode aka balanced */
+#define DYTC_MODE_MMC_DEFAULT  0  /* Default mode from MMC_GET, aka balanced */
+
+#define DYTC_MODE_PSC_LOWPOWER 3  /* Low power mode */
+#define DYTC_MODE_PSC_BALANCE  5  /* Default mode aka balanced */
+#define DYTC_MODE_PSC_PERFORM  7  /* High power mode aka performance */
+
+#define DYTC_ERR_MASK       0xF  /* Bits 0-3 in cmd result are the error result */
+#define DYTC_ERR_SUCCESS      1  /* CMD completed successful */
+
+#define DYTC_SET_COMMAND(function, mode, on) \
+	(DYTC_CMD_SET | (function) << DYTC_SET_FUNCTION_BIT | \
+	 (mode) << DYTC_SET_MODE_BIT | \
+	 (on) << DYTC_SET_VALID_BIT)
+
+#define DYTC_DISABLE_CQL DYTC_SET_COMMAND(DYTC_FUNCTION_CQL, DYTC_MODE_MMC_BALANCE, 0)
+#define DYTC_ENABLE_CQL DYTC_SET_COMMAND(DYTC_FUNCTION_CQL, DYTC_MODE_MMC_BALANCE, 1)
+static int dytc_control_amt(bool enable);
+static bool dytc_amt_active;
+
+static enum platform_profile_option dytc_current_profile;
+static atomic_t dytc_ignore_event = ATOMIC_INIT(0);
+static DEFINE_MUTEX(dytc_mutex);
+static int dytc_capabilities;
+static bool dytc_mmc_get_available;
+static int profile_force;
+
+static void profile_gov_user_override(void);
+static bool dytc_profile_available;
+static bool boost_active;
+
+static int convert_dytc_to_profile(int funcmode, int dytcmode,
+		enum platform_profile_option *profile)
+{
+	switch (funcmode) {
+	case DYTC_FUNCTION_MMC:
+		switch (dytcmode) {
+		case DYTC_MODE_MMC_LOWPOWER:
+			*profile = PLATFORM_PROFILE_LOW_POWER;
+			break;
+		case DYTC_MODE_MMC_DEFAULT:
+		case DYTC_MODE_MMC_BALANCE:
+			*profile =  PLATFORM_PROFILE_BALANCED;
+			break;
+		case DYTC_MODE_MMC_PERFORM:
+			*profile =  PLATFORM_PROFILE_PERFORMANCE;
+			break;
+		default: /* Unknown mode */
+			return -EINVAL;
+		}
+		return 0;
+	case DYTC_FUNCTION_PSC:
+		switch (dytcmode) {
+		case DYTC_MODE_PSC_LOWPOWER:
+			*profile = PLATFORM_PROFILE_LOW_POWER;
+			break;
+		case DYTC_MODE_PSC_BALANCE:
+			*profile =  PLATFORM_PROFILE_BALANCED;
+			break;
+		case DYTC_MODE_PSC_PERFORM:
+			*profile =  PLATFORM_PROFILE_PERFORMANCE;
+			break;
+		default: /* Unknown mode */
+			return -EINVAL;
+		}
+		return 0;
+	case DYTC_FUNCTION_AMT:
+		/* For now return balanced. It's the closest we have to 'auto' */
+		*profile =  PLATFORM_PROFILE_BALANCED;
+		return 0;
+	default:
+		/* Unknown function */
+		pr_debug("unknown function 0x%x\n", funcmode);
+		return -EOPNOTSUPP;
+	}
+	return 0;
+}
+
+static int convert_profile_to_dytc(enum platform_profile_option profile, int *perfmode)
+{
+	switch (profile) {
+	case PLATFORM_PROFILE_LOW_POWER:
+		if (dytc_capabilities & BIT(DYTC_FC_MMC))
+			*perfmode = DYTC_MODE_MMC_LOWPOWER;
+		else if (dytc_capabilities & BIT(DYTC_FC_PSC))
+			*perfmode = DYTC_MODE_PSC_LOWPOWER;
+		break;
+	case PLATFORM_PROFILE_BALANCED:
+		if (dytc_capabilities & BIT(DYTC_FC_MMC))
+			*perfmode = DYTC_MODE_MMC_BALANCE;
+		else if (dytc_capabilities & BIT(DYTC_FC_PSC))
+			*perfmode = DYTC_MODE_PSC_BALANCE;
+		break;
+	case PLATFORM_PROFILE_PERFORMANCE:
+		if (dytc_capabilities & BIT(DYTC_FC_MMC))
+			*perfmode = DYTC_MODE_MMC_PERFORM;
+		else if (dytc_capabilities & BIT(DYTC_FC_PSC))
+			*perfmode = DYTC_MODE_PSC_PERFORM;
+		break;
+	default: /* Unknown profile */
+		return -EOPNOTSUPP;
+	}
+	return 0;
+}
+
+/*
+ * dytc_profile_get: Function to register with platform_profile
+ * handler. Returns current platform profile.
+ */
+static int dytc_profile_get(struct platform_profile_handler *pprof,
+			    enum platform_profile_option *profile)
+{
+	*profile = dytc_current_profile;
+	return 0;
+}
+
+static int dytc_control_amt(bool enable)
+{
+	int dummy;
+	int err;
+	int cmd;
+
+	if (!(dytc_capabilities & BIT(DYTC_FC_AMT))) {
+		pr_warn("Attempting to toggle AMT on a system that doesn't advertise support\n");
+		return -ENODEV;
+	}
+
+	if (enable)
+		cmd = DYTC_SET_COMMAND(DYTC_FUNCTION_AMT, DYTC_MODE_AMT_ENABLE, enable);
+	else
+		cmd = DYTC_SET_COMMAND(DYTC_FUNCTION_AMT, DYTC_MODE_AMT_DISABLE, enable);
+
+	pr_debug("%sabling AMT (cmd 0x%x)", enable ? "en":"dis", cmd);
+	err = dytc_command(cmd, &dummy);
+	dytc_get_invalidate();
+	if (err)
+		return err;
+	dytc_amt_active = enable;
+	return 0;
+}
+
+/*
+ * Helper function - check if we are in CQL mode and if we are
+ *  -  disable CQL,
+ *  - run the command
+ *  - enable CQL
+ *  If not in CQL mode, just run the command
+ */
+static int dytc_cql_command(int command, int *output)
+{
+	int err, cmd_err, dummy;
+	int cur_funcmode;
+
+	/* Determine if we are in CQL mode. This alters the commands we do */
+	err = dytc_get_cached(output);
+	if (err)
+		return err;
+
+	cur_funcmode = (*output >> DYTC_GET_FUNCTION_BIT) & 0xF;
+	/* Check if we're OK to return immediately */
+	if ((command == DYTC_CMD_GET) && (cur_funcmode != DYTC_FUNCTION_CQL))
+		return 0;
+
+	/* whatever happens below, the cached GET result is stale after it */
+	dytc_get_invalidate();
+
+	if (cur_funcmode == DYTC_FUNCTION_CQL) {
+		atomic_inc(&dytc_ignore_event);
+		err = dytc_command(DYTC_DISABLE_CQL, &dummy);
+		if (err)
+			return err;
+	}
+
+	cmd_err = dytc_command(command,	output);
+	/* Check return condition after we've restored CQL state */
+
+	if (cur_funcmode == DYTC_FUNCTION_CQL) {
+		err = dytc_command(DYTC_ENABLE_CQL, &dummy);
+		if (err)
+			return err;
+	}
+	return cmd_err;
+}
+
+/*
+ * dytc_profile_set: Function to register with platform_profile
+ * handler. Sets current platform profile.
+ */
+static int dytc_profile_set(struct platform_profile_handler *pprof,
+			    enum platform_profile_option profile)
+{
+	int perfmode;
+	int output;
+	int err;
+
+	/* pprof is NULL for the driver's own changes */
+	if (pprof)
+		profile_gov_user_override();
+
+	err = mutex_lock_interruptible(&dytc_mutex);
+	if (err)
+		return err;
+
+	err = convert_profile_to_dytc(profile, &perfmode);
+	if (err)
+		goto unlock;
+
+	if (dytc_capabilities & BIT(DYTC_FC_MMC)) {
+		if (profile == PLATFORM_PROFILE_BALANCED) {
+			/*
+			 * To get back to balanced mode we need to issue a reset command.
+			 * Note we still need to disable CQL mode before hand and re-enable
+			 * it afterwards, otherwise dytc_lapmode gets reset to 0 and stays
+			 * stuck at 0 for aprox. 30 minutes.
+			 */
+			err = dytc_cql_command(DYTC_CMD_RESET, &output);
+			if (err)
+				goto unlock;
+		} else {
+			/* Determine if we are in CQL mode. This alters the commands we do */
+			err = dytc_cql_command(DYTC_SET_COMMAND(DYTC_FUNCTION_MMC, perfmode, 1),
+						&output);
+			if (err)
+				goto unlock;
+		}
+	} else if (dytc_capabilities & BIT(DYTC_FC_PSC)) {
+		err = dytc_command(DYTC_SET_COMMAND(DYTC_FUNCTION_PSC, perfmode, 1), &output);
+		dytc_get_invalidate();
+		if (err)
+			goto unlock;
+
+		/* system supports AMT, activate it when on balanced */
+		if (dytc_capabilities & BIT(DYTC_FC_AMT))
+			dytc_control_amt(profile == PLATFORM_PROFILE_BALANCED);
+	}
+	/* Success - update current profile */
+	dytc_current_profile = profile;
+unlock:
+	mutex_unlock(&dytc_mutex);
+	return err;
+}
+
+static void dytc_profile_refresh(void)
+{
+	enum platform_profile_option profile;
+	int output = 0, err = 0;
+	int perfmode, funcmode = 0;
+
+	mutex_lock(&dytc_mutex);
+	if (dytc_capabilities & BIT(DYTC_FC_MMC)) {
+		if (dytc_mmc_get_available)
+			err = dytc_command(DYTC_CMD_MMC_GET, &output);
+		else
+			err = dytc_cql_command(DYTC_CMD_GET, &output);
+		funcmode = DYTC_FUNCTION_MMC;
+	} else if (dytc_capabilities & BIT(DYTC_FC_PSC)) {
+		err = dytc_get_cached(&output);
+		/* Check if we are PSC mode, or have AMT enabled */
+		funcmode = (output >> DYTC_GET_FUNCTION_BIT) & 0xF;
+	} else { /* Unknown profile mode */
+		err = -ENODEV;
+	}
+	mutex_unlock(&dytc_mutex);
+	if (err)
+		return;
+
+	perfmode = (output >> DYTC_GET_MODE_BIT) & 0xF;
+	err = convert_dytc_to_profile(funcmode, perfmode, &profile);
+	if (!err && profile != dytc_current_profile) {
+		/* changed by the firmware, e.g. through Fn+L/M/H */
+		profile_gov_user_override();
+		dytc_current_profile = profile;
+		platform_profile_notify();
+	}
+}
+
+static struct platform_profile_handler dytc_profile = {
+	.profile_get = dytc_profile_get,
+	.profile_set = dytc_profile_set,
+};
+
+/*
+ * Profile governor
+ *
+ * Optionally picks the platform profile from CPU utilization, measured as
+ * the share of non-idle time over all online CPUs since the previous
+ * sample, and from the hottest thermal sensor: performance under load,
+ * low-power when idle and balanced in between.  Each profile has its own
+ * enter and exit threshold, and the governor holds a profile for at least
+ * dwell ms.  A profile chosen by the user, through platform_profile or the
+ * firmware hotkeys, suspends it for override_hold ms.
+ */
+static struct {
+	u32 interval;		/* ms */
+	u32 perf_enter;		/* % utilization */
+	u32 perf_exit;
+	u32 lowpower_enter;
+	u32 lowpower_exit;
+	u32 temp_limit;		/* millidegrees, no performance at or above */
+	u32 dwell;		/* ms */
+	u32 override_hold;	/* ms */
+} profile_gov_params = {
+	.interval = 1000,
+	.perf_enter = 70,
+	.perf_exit = 50,
+	.lowpower_enter = 10,
+	.lowpower_exit = 25,
+	.temp_limit = 85000,
+	.dwell = 5000,
+	.override_hold = 300000,
+};
+
+static bool profile_governor;
+
+enum profile_gov_reason {
+	PROFILE_GOV_LOAD,
+	PROFILE_GOV_IDLE,
+	PROFILE_GOV_THERMAL,
+};
+
+static const char * const profile_gov_reason_names[] = {
+	[PROFILE_GOV_LOAD] = "load",
+	[PROFILE_GOV_IDLE] = "idle",
+	[PROFILE_GOV_THERMAL] = "thermal",
+};
+
+#define TPACPI_PROFILE_GOV_LOG	32
+
+struct profile_gov_log_entry {
+	u64 timestamp_ns;
+	enum platform_profile_option from, to;
+	enum profile_gov_reason reason;
+	unsigned int util;
+	int temp;
+};
+
+static struct {
+	bool running;
+	bool suspended;		/* worker must not requeue itself */
+	u64 idle_us;
+	ktime_t stamp;
+	unsigned long last_switch;	/* jiffies */
+	struct profile_gov_log_entry log[TPACPI_PROFILE_GOV_LOG];
+	unsigned int log_next, log_count;
+} profile_gov;				/* protected by profile_gov_mutex */
+
+static DEFINE_MUTEX(profile_gov_mutex);
+static unsigned long profile_gov_override_until;	/* jiffies */
+
+static void profile_gov_user_override(void)
+{
+	WRITE_ONCE(profile_gov_override_until,
+		   jiffies + msecs_to_jiffies(profile_gov_params.override_hold));
+}
+
+static u64 profile_gov_idle_us(void)
 {
-	struct power_supply *supply = to_power_supply(dev);
-	int ret, battery;
-	/*
-	 * Some systems have support for more than
-	 * one battery. If that is the case,
-	 * tpacpi_battery_probe marked that addressing
-	 * them individually is supported, so we;
-	 * based on the device struct.
-	 *
-	 * On systems that are not supported, we assume
-	 * the primary as most of the ACPI calls fail
-	 * with "Any Battery" as the parameter.
-	 */
-	if (battery_info.individual_addressing)
-		/* BAT_PRIMARY or BAT_SECONDARY */
-		battery = tpacpi_battery_get_id(supply->desc->name);
-	else
-		battery = BAT_PRIMARY;
-	if (tpacpi_battery_get(what, battery, &ret))
-		return -ENODEV;
-	return sysfs_emit(buf, "%d\n", ret);
+	u64 idle, sum = 0;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		idle = get_cpu_idle_time_us(cpu, NULL);
+		if (idle == -1ULL)	/* NOHZ inactive */
+			idle = div_u64(kcpustat_cpu(cpu).cpustat[CPUTIME_IDLE],
+				       NSEC_PER_USEC);
+		sum += idle;
+	}
+
+	return sum;
 }
 
-static ssize_t charge_control_start_threshold_show(struct device *device,
-				struct device_attribute *attr,
-				char *buf)
+static void profile_gov_reset(void)
 {
-	return tpacpi_battery_show(THRESHOLD_START, device, buf);
+	lockdep_assert_held(&profile_gov_mutex);
+
+	profile_gov.idle_us = profile_gov_idle_us();
+	profile_gov.stamp = ktime_get();
 }
 
-static ssize_t charge_control_end_threshold_show(struct device *device,
-				struct device_attribute *attr,
-				char *buf)
+/* Utilization in percent since the previous call */
+static unsigned int profile_gov_util(void)
 {
-	return tpacpi_battery_show(THRESHOLD_STOP, device, buf);
+	u64 idle_us = profile_gov_idle_us();
+	ktime_t now = ktime_get();
+	u64 busy, wall;
+
+	lockdep_assert_held(&profile_gov_mutex);
+
+	wall = ktime_us_delta(now, profile_gov.stamp) * num_online_cpus();
+	busy = wall - min(wall, idle_us - profile_gov.idle_us);
+
+	profile_gov.idle_us = idle_us;
+	profile_gov.stamp = now;
+
+	return wall ? div64_u64(busy * 100, wall) : 0;
 }
 
-static ssize_t charge_behaviour_show(struct device *dev,
-				     struct device_attribute *attr,
-				     char *buf)
+static int profile_gov_hottest(void)
 {
-	enum power_supply_charge_behaviour active = POWER_SUPPLY_CHARGE_BEHAVIOUR_AUTO;
-	struct power_supply *supply = to_power_supply(dev);
-	unsigned int available;
-	int ret, battery;
+	struct ibm_thermal_sensors_struct t;
+	int i, n, hottest = INT_MIN;
 
-	battery = tpacpi_battery_get_id(supply->desc->name);
-	available = battery_info.batteries[battery].charge_behaviours;
+	n = thermal_get_sensors(&t);
+	for (i = 0; i < n; i++)
+		if (t.temp[i] > 0 && t.temp[i] > hottest)
+			hottest = t.temp[i];
 
-	if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE)) {
-		if (tpacpi_battery_get(FORCE_DISCHARGE, battery, &ret))
-			return -ENODEV;
-		if (ret) {
-			active = POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE;
-			goto out;
-		}
+	return hottest;
+}
+
+static enum platform_profile_option
+profile_gov_pick(enum platform_profile_option cur, unsigned int util,
+		 int temp, enum profile_gov_reason *reason)
+{
+	const typeof(profile_gov_params) *p = &profile_gov_params;
+	enum platform_profile_option next = cur;
+
+	switch (cur) {
+	case PLATFORM_PROFILE_LOW_POWER:
+		if (util >= p->perf_enter)
+			next = PLATFORM_PROFILE_PERFORMANCE;
+		else if (util >= p->lowpower_exit)
+			next = PLATFORM_PROFILE_BALANCED;
+		break;
+	case PLATFORM_PROFILE_PERFORMANCE:
+		if (util <= p->lowpower_enter)
+			next = PLATFORM_PROFILE_LOW_POWER;
+		else if (util < p->perf_exit)
+			next = PLATFORM_PROFILE_BALANCED;
+		break;
+	default:
+		if (util >= p->perf_enter)
+			next = PLATFORM_PROFILE_PERFORMANCE;
+		else if (util <= p->lowpower_enter)
+			next = PLATFORM_PROFILE_LOW_POWER;
+		else
+			next = PLATFORM_PROFILE_BALANCED;
+		break;
 	}
 
-	if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE)) {
-		if (tpacpi_battery_get(INHIBIT_CHARGE, battery, &ret))
-			return -ENODEV;
-		if (ret) {
-			active = POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE;
-			goto out;
-		}
+	*reason = (next > cur) ? PROFILE_GOV_LOAD : PROFILE_GOV_IDLE;
+
+	if (next == PLATFORM_PROFILE_PERFORMANCE && temp >= (int)p->temp_limit) {
+		next = PLATFORM_PROFILE_BALANCED;
+		*reason = PROFILE_GOV_THERMAL;
 	}
 
-out:
-	return power_supply_charge_behaviour_show(dev, available, active, buf);
+	return next;
 }
 
-static ssize_t charge_control_start_threshold_store(struct device *dev,
-				struct device_attribute *attr,
-				const char *buf, size_t count)
+static const char *profile_gov_profile_name(enum platform_profile_option p)
 {
-	return tpacpi_battery_store(THRESHOLD_START, dev, buf, count);
+	switch (p) {
+	case PLATFORM_PROFILE_LOW_POWER:
+		return "low-power";
+	case PLATFORM_PROFILE_BALANCED:
+		return "balanced";
+	case PLATFORM_PROFILE_PERFORMANCE:
+		return "performance";
+	default:
+		return "other";
+	}
 }
 
-static ssize_t charge_control_end_threshold_store(struct device *dev,
-				struct device_attribute *attr,
-				const char *buf, size_t count)
-{
-	return tpacpi_battery_store(THRESHOLD_STOP, dev, buf, count);
-}
+static void profile_gov_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(profile_gov_work, profile_gov_worker);
 
-static ssize_t charge_behaviour_store(struct device *dev,
-				      struct device_attribute *attr,
-				      const char *buf, size_t count)
+static void profile_gov_worker(struct work_struct *work)
 {
-	struct power_supply *supply = to_power_supply(dev);
-	int selected, battery, ret = 0;
-	unsigned int available;
+	enum platform_profile_option cur, next;
+	struct profile_gov_log_entry *e;
+	enum profile_gov_reason reason;
+	unsigned int util;
+	int temp;
 
-	battery = tpacpi_battery_get_id(supply->desc->name);
-	available = battery_info.batteries[battery].charge_behaviours;
-	selected = power_supply_charge_behaviour_parse(available, buf);
+	mutex_lock(&profile_gov_mutex);
+	if (!profile_gov.running || profile_gov.suspended)
+		goto unlock;
 
-	if (selected < 0)
-		return selected;
+	util = profile_gov_util();
+
+	if (READ_ONCE(boost_active) ||
+	    time_before(jiffies, READ_ONCE(profile_gov_override_until)) ||
+	    time_before(jiffies, profile_gov.last_switch +
+			msecs_to_jiffies(profile_gov_params.dwell)))
+		goto requeue;
+
+	temp = profile_gov_hottest();
+	cur = READ_ONCE(dytc_current_profile);
+	next = profile_gov_pick(cur, util, temp, &reason);
+	if (next == cur)
+		goto requeue;
+
+	if (dytc_profile_set(NULL, next))
+		goto requeue;
+	platform_profile_notify();
+
+	profile_gov.last_switch = jiffies;
+
+	e = &profile_gov.log[profile_gov.log_next];
+	*e = (struct profile_gov_log_entry) {
+		.timestamp_ns = ktime_get_ns(),
+		.from = cur,
+		.to = next,
+		.reason = reason,
+		.util = util,
+		.temp = temp,
+	};
+	profile_gov.log_next = (profile_gov.log_next + 1) % TPACPI_PROFILE_GOV_LOG;
+	if (profile_gov.log_count < TPACPI_PROFILE_GOV_LOG)
+		profile_gov.log_count++;
 
-	switch (selected) {
-	case POWER_SUPPLY_CHARGE_BEHAVIOUR_AUTO:
-		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE))
-			ret = tpacpi_battery_set_validate(FORCE_DISCHARGE, battery, 0);
-		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE))
-			ret = min(ret, tpacpi_battery_set_validate(INHIBIT_CHARGE, battery, 0));
-		if (ret < 0)
-			return ret;
-		break;
-	case POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE:
-		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE))
-			ret = tpacpi_battery_set_validate(INHIBIT_CHARGE, battery, 0);
-		ret = min(ret, tpacpi_battery_set_validate(FORCE_DISCHARGE, battery, 1));
-		if (ret < 0)
-			return ret;
-		break;
-	case POWER_SUPPLY_CHARGE_BEHAVIOUR_INHIBIT_CHARGE:
-		if (available & BIT(POWER_SUPPLY_CHARGE_BEHAVIOUR_FORCE_DISCHARGE))
-			ret = tpacpi_battery_set_validate(FORCE_DISCHARGE, battery, 0);
-		ret = min(ret, tpacpi_battery_set_validate(INHIBIT_CHARGE, battery, 1));
-		if (ret < 0)
-			return ret;
-		break;
-	default:
-		dev_err(dev, "Unexpected charge behaviour: %d\n", selected);
-		return -EINVAL;
+	pr_debug("profile governor: %s -> %s (%s, %u%%)\n",
+		 profile_gov_profile_name(cur), profile_gov_profile_name(next),
+		 profile_gov_reason_names[reason], util);
+
+requeue:
+	queue_delayed_work(tpacpi_wq, &profile_gov_work,
+			   msecs_to_jiffies(max(profile_gov_params.interval, 100U)));
+unlock:
+	mutex_unlock(&profile_gov_mutex);
+}
+
+static void profile_gov_start(void)
+{
+	mutex_lock(&profile_gov_mutex);
+	if (!profile_gov.running) {
+		profile_gov.running = true;
+		profile_gov.last_switch = jiffies -
+				msecs_to_jiffies(profile_gov_params.dwell);
+		WRITE_ONCE(profile_gov_override_until, jiffies);
+		profile_gov_reset();
+		queue_delayed_work(tpacpi_wq, &profile_gov_work,
+				   msecs_to_jiffies(profile_gov_params.interval));
 	}
+	mutex_unlock(&profile_gov_mutex);
+}
 
-	return count;
+static void profile_gov_stop(void)
+{
+	mutex_lock(&profile_gov_mutex);
+	profile_gov.running = false;
+	mutex_unlock(&profile_gov_mutex);
+
+	cancel_delayed_work_sync(&profile_gov_work);
 }
 
-static DEVICE_ATTR_RW(charge_control_start_threshold);
-static DEVICE_ATTR_RW(charge_control_end_threshold);
-static DEVICE_ATTR_RW(charge_behaviour);
-static struct device_attribute dev_attr_charge_start_threshold = __ATTR(
-	charge_start_threshold,
-	0644,
-	charge_control_start_threshold_show,
-	charge_control_start_threshold_store
-);
-static struct device_attribute dev_attr_charge_stop_threshold = __ATTR(
-	charge_stop_threshold,
-	0644,
-	charge_control_end_threshold_show,
-	charge_control_end_threshold_store
-);
+static int profile_gov_log_show(struct seq_file *m, void *v)
+{
+	const struct profile_gov_log_entry *e;
+	unsigned int i, idx;
 
-static struct attribute *tpacpi_battery_attrs[] = {
-	&dev_attr_charge_control_start_threshold.attr,
-	&dev_attr_charge_control_end_threshold.attr,
-	&dev_attr_charge_start_threshold.attr,
-	&dev_attr_charge_stop_threshold.attr,
-	&dev_attr_charge_behaviour.attr,
-	NULL,
-};
+	mutex_lock(&profile_gov_mutex);
+	for (i = 0; i < profile_gov.log_count; i++) {
+		idx = (profile_gov.log_next + TPACPI_PROFILE_GOV_LOG -
+		       profile_gov.log_count + i) % TPACPI_PROFILE_GOV_LOG;
+		e = &profile_gov.log[idx];
+		seq_printf(m, "%llu: %s -> %s (%s) util %u%%",
+			   e->timestamp_ns,
+			   profile_gov_profile_name(e->from),
+			   profile_gov_profile_name(e->to),
+			   profile_gov_reason_names[e->reason], e->util);
+		if (e->temp != INT_MIN)
+			seq_printf(m, " temp %d", e->temp);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&profile_gov_mutex);
 
-ATTRIBUTE_GROUPS(tpacpi_battery);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(profile_gov_log);
 
-/* ACPI battery hooking */
+static int profile_gov_enable_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(profile_gov.running);
+	return 0;
+}
 
-static int tpacpi_battery_add(struct power_supply *battery, struct acpi_battery_hook *hook)
+static int profile_gov_enable_set(void *data, u64 val)
 {
-	int batteryid = tpacpi_battery_get_id(battery->desc->name);
+	if (val)
+		profile_gov_start();
+	else
+		profile_gov_stop();
+
+	tpacpi_disclose_usertask("profile governor", "%s\n",
+				 val ? "enabled" : "disabled");
 
-	if (tpacpi_battery_probe(batteryid))
-		return -ENODEV;
-	if (device_add_groups(&battery->dev, tpacpi_battery_groups))
-		return -ENODEV;
 	return 0;
 }
+DEFINE_DEBUGFS_ATTRIBUTE(profile_gov_enable_fops, profile_gov_enable_get,
+			 profile_gov_enable_set, "%llu\n");
+
+static void profile_gov_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("profile_governor", tpacpi_debugfs_dir);
+	debugfs_create_file_unsafe("enable", 0600, dir, NULL,
+				   &profile_gov_enable_fops);
+	debugfs_create_u32("interval", 0600, dir, &profile_gov_params.interval);
+	debugfs_create_u32("perf_enter", 0600, dir,
+			   &profile_gov_params.perf_enter);
+	debugfs_create_u32("perf_exit", 0600, dir,
+			   &profile_gov_params.perf_exit);
+	debugfs_create_u32("lowpower_enter", 0600, dir,
+			   &profile_gov_params.lowpower_enter);
+	debugfs_create_u32("lowpower_exit", 0600, dir,
+			   &profile_gov_params.lowpower_exit);
+	debugfs_create_u32("temp_limit", 0600, dir,
+			   &profile_gov_params.temp_limit);
+	debugfs_create_u32("dwell", 0600, dir, &profile_gov_params.dwell);
+	debugfs_create_u32("override_hold", 0600, dir,
+			   &profile_gov_params.override_hold);
+	debugfs_create_file("log", 0400, dir, NULL, &profile_gov_log_fops);
+}
 
-static int tpacpi_battery_remove(struct power_supply *battery, struct acpi_battery_hook *hook)
+/*
+ * Boost: "go flat out for N seconds" in one write.  Switches to the
+ * performance profile, optionally pins the fan to full speed, and puts
+ * both back when the deadline passes, on suspend and on unload.  Writing
+ * again while boosted pushes the deadline out.  The profile is only
+ * restored if nobody changed it meanwhile.
+ */
+#define TPACPI_BOOST_MAX_SECS	(4 * 60 * 60)
+
+static struct {
+	bool fan;			/* fan pinned to full speed */
+	enum platform_profile_option saved_profile;
+	u8 saved_fan_status;
+	bool saved_fan_curve;		/* pwm1_enable = 3 before the boost */
+	unsigned int saved_fan_target[2];	/* RPM targets, 0: none */
+	ktime_t deadline;
+} boost;				/* protected by boost_mutex */
+
+static DEFINE_MUTEX(boost_mutex);
+static struct hrtimer boost_timer;
+static bool boost_timer_ready;		/* boost_timer set up */
+
+static void boost_expire_worker(struct work_struct *work);
+static DECLARE_WORK(boost_expire_work, boost_expire_worker);
+
+static enum hrtimer_restart boost_timer_fn(struct hrtimer *timer)
 {
-	device_remove_groups(&battery->dev, tpacpi_battery_groups);
-	return 0;
+	queue_work(tpacpi_wq, &boost_expire_work);
+	return HRTIMER_NORESTART;
 }
 
-static struct acpi_battery_hook battery_hook = {
-	.add_battery = tpacpi_battery_add,
-	.remove_battery = tpacpi_battery_remove,
-	.name = "ThinkPad Battery Extension",
-};
+static int tpacpi_dytc_profile_init(struct ibm_init_struct *iibm)
+{
+	int err, output;
+
+	/* Setup supported modes */
+	set_bit(PLATFORM_PROFILE_LOW_POWER, dytc_profile.choices);
+	set_bit(PLATFORM_PROFILE_BALANCED, dytc_profile.choices);
+	set_bit(PLATFORM_PROFILE_PERFORMANCE, dytc_profile.choices);
+
+	dytc_handle_init();
+
+	err = dytc_command(DYTC_CMD_QUERY, &output);
+	if (err)
+		return err;
+
+	if (output & BIT(DYTC_QUERY_ENABLE_BIT))
+		dytc_version = (output >> DYTC_QUERY_REV_BIT) & 0xF;
+
+	/* Check DYTC is enabled and supports mode setting */
+	if (dytc_version < 5)
+		return -ENODEV;
+
+	/* Check what capabilities are supported */
+	err = dytc_command(DYTC_CMD_FUNC_CAP, &dytc_capabilities);
+	if (err)
+		return err;
+
+	/* Check if user wants to override the profile selection */
+	if (profile_force) {
+		switch (profile_force) {
+		case -1:
+			dytc_capabilities = 0;
+			break;
+		case 1:
+			dytc_capabilities = BIT(DYTC_FC_MMC);
+			break;
+		case 2:
+			dytc_capabilities = BIT(DYTC_FC_PSC);
+			break;
+		}
+		pr_debug("Profile selection forced: 0x%x\n", dytc_capabilities);
+	}
+	if (dytc_capabilities & BIT(DYTC_FC_MMC)) { /* MMC MODE */
+		pr_debug("MMC is supported\n");
+		/*
+		 * Check if MMC_GET functionality available
+		 * Version > 6 and return success from MMC_GET command
+		 */
+		dytc_mmc_get_available = false;
+		if (dytc_version >= 6) {
+			err = dytc_command(DYTC_CMD_MMC_GET, &output);
+			if (!err && ((output & DYTC_ERR_MASK) == DYTC_ERR_SUCCESS))
+				dytc_mmc_get_available = true;
+		}
+	} else if (dytc_capabilities & BIT(DYTC_FC_PSC)) { /* PSC MODE */
+		pr_debug("PSC is supported\n");
+	} else {
+		dbg_printk(TPACPI_DBG_INIT, "No DYTC support available\n");
+		return -ENODEV;
+	}
 
-/* Subdriver init/exit */
+	dbg_printk(TPACPI_DBG_INIT,
+			"DYTC version %d: thermal mode available\n", dytc_version);
 
-static const struct tpacpi_quirk battery_quirk_table[] __initconst = {
+	/* Create platform_profile structure and register */
+	err = platform_profile_register(&dytc_profile);
 	/*
-	 * Individual addressing is broken on models that expose the
-	 * primary battery as BAT1.
+	 * If for some reason platform_profiles aren't enabled
+	 * don't quit terminally.
 	 */
-	TPACPI_Q_LNV('8', 'F', true),       /* Thinkpad X120e */
-	TPACPI_Q_LNV('J', '7', true),       /* B5400 */
-	TPACPI_Q_LNV('J', 'I', true),       /* Thinkpad 11e */
-	TPACPI_Q_LNV3('R', '0', 'B', true), /* Thinkpad 11e gen 3 */
-	TPACPI_Q_LNV3('R', '0', 'C', true), /* Thinkpad 13 */
-	TPACPI_Q_LNV3('R', '0', 'J', true), /* Thinkpad 13 gen 2 */
-	TPACPI_Q_LNV3('R', '0', 'K', true), /* Thinkpad 11e gen 4 celeron BIOS */
-};
+	if (err)
+		return -ENODEV;
 
-static int __init tpacpi_battery_init(struct ibm_init_struct *ibm)
-{
-	memset(&battery_info, 0, sizeof(battery_info));
+	/* Ensure initial values are correct */
+	dytc_profile_refresh();
 
-	tp_features.battery_force_primary = tpacpi_check_quirks(
-					battery_quirk_table,
-					ARRAY_SIZE(battery_quirk_table));
+	/* Workaround for https://bugzilla.kernel.org/show_bug.cgi?id=216347 */
+	if (dytc_capabilities & BIT(DYTC_FC_PSC))
+		dytc_profile_set(NULL, PLATFORM_PROFILE_BALANCED);
+
+	profile_gov_debugfs_init();
+	if (profile_governor)
+		profile_gov_start();
+
+	hrtimer_init(&boost_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	boost_timer.function = boost_timer_fn;
+	boost_timer_ready = true;
+	dytc_profile_available = true;
 
-	battery_hook_register(&battery_hook);
 	return 0;
 }
 
-static void tpacpi_battery_exit(void)
+static void dytc_profile_suspend(void)
 {
-	battery_hook_unregister(&battery_hook);
-}
-
-static struct ibm_struct battery_driver_data = {
-	.name = "battery",
-	.exit = tpacpi_battery_exit,
-};
+	boost_stop();
 
-/*************************************************************************
- * LCD Shadow subdriver, for the Lenovo PrivacyGuard feature
- */
+	/* as in profile_gov_stop(), the worker takes profile_gov_mutex */
+	mutex_lock(&profile_gov_mutex);
+	profile_gov.suspended = true;
+	mutex_unlock(&profile_gov_mutex);
 
-static struct drm_privacy_screen *lcdshadow_dev;
-static acpi_handle lcdshadow_get_handle;
-static acpi_handle lcdshadow_set_handle;
+	cancel_delayed_work_sync(&profile_gov_work);
+}
 
-static int lcdshadow_set_sw_state(struct drm_privacy_screen *priv,
-				  enum drm_privacy_screen_status state)
+static void dytc_profile_resume(void)
 {
-	int output;
-
-	if (WARN_ON(!mutex_is_locked(&priv->lock)))
-		return -EIO;
+	/* the firmware may have changed the mode across suspend */
+	dytc_get_invalidate();
 
-	if (!acpi_evalf(lcdshadow_set_handle, &output, NULL, "dd", (int)state))
-		return -EIO;
-
-	priv->hw_state = priv->sw_state = state;
-	return 0;
+	mutex_lock(&profile_gov_mutex);
+	profile_gov.suspended = false;
+	if (profile_gov.running) {
+		profile_gov_reset();
+		queue_delayed_work(tpacpi_wq, &profile_gov_work,
+				   msecs_to_jiffies(profile_gov_params.interval));
+	}
+	mutex_unlock(&profile_gov_mutex);
 }
 
-static void lcdshadow_get_hw_state(struct drm_privacy_screen *priv)
+static void dytc_profile_exit(void)
 {
-	int output;
-
-	if (!acpi_evalf(lcdshadow_get_handle, &output, NULL, "dd", 0))
-		return;
+	/* the boost attribute outlives us, refuse new boosts from now on */
+	mutex_lock(&boost_mutex);
+	dytc_profile_available = false;
+	mutex_unlock(&boost_mutex);
 
-	priv->hw_state = priv->sw_state = output & 0x1;
+	boost_stop();
+	profile_gov_stop();
+	platform_profile_remove();
 }
 
-static const struct drm_privacy_screen_ops lcdshadow_ops = {
-	.set_sw_state = lcdshadow_set_sw_state,
-	.get_hw_state = lcdshadow_get_hw_state,
+static struct ibm_struct  dytc_profile_driver_data = {
+	.name = "dytc-profile",
+	.suspend = dytc_profile_suspend,
+	.resume = dytc_profile_resume,
+	.exit = dytc_profile_exit,
 };
 
-static int tpacpi_lcdshadow_init(struct ibm_init_struct *iibm)
+static bool boost_fan_supported(void)
 {
-	acpi_status status1, status2;
-	int output;
+	return fan_control_allowed &&
+	       fan_control_access_mode != TPACPI_FAN_WR_NONE;
+}
 
-	status1 = acpi_get_handle(hkey_handle, "GSSS", &lcdshadow_get_handle);
-	status2 = acpi_get_handle(hkey_handle, "SSSS", &lcdshadow_set_handle);
-	if (ACPI_FAILURE(status1) || ACPI_FAILURE(status2))
-		return 0;
+static int boost_pin_fan(void)
+{
+	int rc;
 
-	if (!acpi_evalf(lcdshadow_get_handle, &output, NULL, "dd", 0))
-		return -EIO;
+	lockdep_assert_held(&boost_mutex);
 
-	if (!(output & 0x10000))
-		return 0;
+	rc = fan_get_status_safe(&boost.saved_fan_status);
+	if (rc)
+		return rc;
 
-	lcdshadow_dev = drm_privacy_screen_register(&tpacpi_pdev->dev,
-						    &lcdshadow_ops, NULL);
-	if (IS_ERR(lcdshadow_dev))
-		return PTR_ERR(lcdshadow_dev);
+	boost.saved_fan_curve = fan_curve_is_enabled();
+	boost.saved_fan_target[0] = READ_ONCE(fan_target[0].target);
+	boost.saved_fan_target[1] = READ_ONCE(fan_target[1].target);
+	fan_curve_disable();
+	fan_target_disable();
+	fan_prespin_forget();
+
+	/* SFAN has no full speed mode, 7 is as fast as it goes */
+	rc = fan_set_level_safe(fan_control_access_mode ==
+					TPACPI_FAN_WR_ACPI_SFAN ?
+				7 : TP_EC_FAN_FULLSPEED);
+	if (!rc)
+		boost.fan = true;
 
-	return 0;
+	return rc;
 }
 
-static void lcdshadow_exit(void)
+/* Hands the fan back to the curve or RPM controller the boost stopped */
+static void boost_restore_fan_control(void)
 {
-	drm_privacy_screen_unregister(lcdshadow_dev);
-}
+	unsigned int fan;
+	int rc;
 
-static void lcdshadow_resume(void)
-{
-	if (!lcdshadow_dev)
-		return;
+	lockdep_assert_held(&boost_mutex);
 
-	mutex_lock(&lcdshadow_dev->lock);
-	lcdshadow_set_sw_state(lcdshadow_dev, lcdshadow_dev->sw_state);
-	mutex_unlock(&lcdshadow_dev->lock);
-}
+	if (boost.saved_fan_curve) {
+		rc = fan_curve_enable();
+		if (rc)
+			pr_warn("boost: failed to re-enable the fan curve: %d\n",
+				rc);
+	}
 
-static int lcdshadow_read(struct seq_file *m)
-{
-	if (!lcdshadow_dev) {
-		seq_puts(m, "status:\t\tnot supported\n");
-	} else {
-		seq_printf(m, "status:\t\t%d\n", lcdshadow_dev->hw_state);
-		seq_puts(m, "commands:\t0, 1\n");
+	for (fan = 0; fan < ARRAY_SIZE(boost.saved_fan_target); fan++) {
+		if (!boost.saved_fan_target[fan])
+			continue;
+		rc = fan_target_set(fan, boost.saved_fan_target[fan]);
+		if (rc)
+			pr_warn("boost: failed to restore the fan%u target: %d\n",
+				fan + 1, rc);
 	}
 
-	return 0;
+	boost.saved_fan_curve = false;
+	boost.saved_fan_target[0] = 0;
+	boost.saved_fan_target[1] = 0;
 }
 
-static int lcdshadow_write(char *buf)
+static void boost_end(void)
 {
-	char *cmd;
-	int res, state = -EINVAL;
+	lockdep_assert_held(&boost_mutex);
 
-	if (!lcdshadow_dev)
-		return -ENODEV;
+	if (!boost_active)
+		return;
 
-	while ((cmd = strsep(&buf, ","))) {
-		res = kstrtoint(cmd, 10, &state);
-		if (res < 0)
-			return res;
+	if (READ_ONCE(dytc_current_profile) == PLATFORM_PROFILE_PERFORMANCE &&
+	    boost.saved_profile != PLATFORM_PROFILE_PERFORMANCE) {
+		if (!dytc_profile_set(NULL, boost.saved_profile))
+			platform_profile_notify();
 	}
 
-	if (state >= 2 || state < 0)
-		return -EINVAL;
-
-	mutex_lock(&lcdshadow_dev->lock);
-	res = lcdshadow_set_sw_state(lcdshadow_dev, state);
-	mutex_unlock(&lcdshadow_dev->lock);
-
-	drm_privacy_screen_call_notifier_chain(lcdshadow_dev);
+	if (boost.fan) {
+		if (fan_set_level_safe(boost.saved_fan_status))
+			pr_warn("boost: failed to restore the fan mode\n");
+		boost_restore_fan_control();
+	}
 
-	return res;
+	boost.fan = false;
+	WRITE_ONCE(boost_active, false);
 }
 
-static struct ibm_struct lcdshadow_driver_data = {
-	.name = "lcdshadow",
-	.exit = lcdshadow_exit,
-	.resume = lcdshadow_resume,
-	.read = lcdshadow_read,
-	.write = lcdshadow_write,
-};
-
-/*************************************************************************
- * Thinkpad sensor interfaces
- */
-
-#define DYTC_CMD_QUERY        0 /* To get DYTC status - enable/revision */
-#define DYTC_QUERY_ENABLE_BIT 8  /* Bit        8 - 0 = disabled, 1 = enabled */
-#define DYTC_QUERY_SUBREV_BIT 16 /* Bits 16 - 27 - sub revision */
-#define DYTC_QUERY_REV_BIT    28 /* Bits 28 - 31 - revision */
+static void boost_expire_worker(struct work_struct *work)
+{
+	mutex_lock(&boost_mutex);
+	/* not re-armed in the meantime? */
+	if (!ktime_before(ktime_get(), boost.deadline))
+		boost_end();
+	mutex_unlock(&boost_mutex);
+}
 
-#define DYTC_CMD_GET          2 /* To get current IC function and mode */
-#define DYTC_GET_LAPMODE_BIT 17 /* Set when in lapmode */
+static int boost_start(unsigned int secs, bool fan)
+{
+	ktime_t deadline = ktime_add_ms(ktime_get(), secs * MSEC_PER_SEC);
+	ktime_t old_deadline;
+	bool started = false;
+	int rc = 0;
 
-#define PALMSENSOR_PRESENT_BIT 0 /* Determine if psensor present */
-#define PALMSENSOR_ON_BIT      1 /* psensor status */
+	mutex_lock(&boost_mutex);
 
-static bool has_palmsensor;
-static bool has_lapsensor;
-static bool palm_state;
-static bool lap_state;
-static int dytc_version;
+	if (!dytc_profile_available) {
+		rc = -ENODEV;
+		goto unlock;
+	}
 
-static int dytc_command(int command, int *output)
-{
-	acpi_handle dytc_handle;
+	old_deadline = boost.deadline;
+	if (!boost_active) {
+		boost.saved_profile = READ_ONCE(dytc_current_profile);
+		rc = dytc_profile_set(NULL, PLATFORM_PROFILE_PERFORMANCE);
+		if (rc)
+			goto unlock;
+		platform_profile_notify();
 
-	if (ACPI_FAILURE(acpi_get_handle(hkey_handle, "DYTC", &dytc_handle))) {
-		/* Platform doesn't support DYTC */
-		return -ENODEV;
+		boost.deadline = deadline;
+		WRITE_ONCE(boost_active, true);
+		started = true;
+	} else if (ktime_after(deadline, boost.deadline)) {
+		boost.deadline = deadline;
 	}
-	if (!acpi_evalf(dytc_handle, output, NULL, "dd", command))
-		return -EIO;
-	return 0;
-}
 
-static int lapsensor_get(bool *present, bool *state)
-{
-	int output, err;
+	if (fan && !boost.fan) {
+		rc = boost_pin_fan();
+		if (rc) {
+			pr_warn("boost: could not pin the fan: %d\n", rc);
+			/* all or nothing: undo what this write did */
+			if (started)
+				boost_end();
+			else
+				boost.deadline = old_deadline;
+			goto unlock;
+		}
+	}
 
-	*present = false;
-	err = dytc_command(DYTC_CMD_GET, &output);
-	if (err)
-		return err;
+	hrtimer_start(&boost_timer, boost.deadline, HRTIMER_MODE_ABS);
 
-	*present = true; /*If we get his far, we have lapmode support*/
-	*state = output & BIT(DYTC_GET_LAPMODE_BIT) ? true : false;
-	return 0;
+unlock:
+	mutex_unlock(&boost_mutex);
+	return rc;
 }
 
-static int palmsensor_get(bool *present, bool *state)
+static void boost_stop(void)
 {
-	acpi_handle psensor_handle;
-	int output;
+	/* boost_timer is set up along with the platform profile */
+	if (!boost_timer_ready)
+		return;
 
-	*present = false;
-	if (ACPI_FAILURE(acpi_get_handle(hkey_handle, "GPSS", &psensor_handle)))
-		return -ENODEV;
-	if (!acpi_evalf(psensor_handle, &output, NULL, "d"))
-		return -EIO;
+	hrtimer_cancel(&boost_timer);
+	cancel_work_sync(&boost_expire_work);
 
-	*present = output & BIT(PALMSENSOR_PRESENT_BIT) ? true : false;
-	*state = output & BIT(PALMSENSOR_ON_BIT) ? true : false;
-	return 0;
+	mutex_lock(&boost_mutex);
+	boost_end();
+	mutex_unlock(&boost_mutex);
 }
 
-static void lapsensor_refresh(void)
+/* sysfs boost --------------------------------------------------------- */
+static ssize_t boost_show(struct device *dev,
+			  struct device_attribute *attr,
+			  char *buf)
 {
-	bool state;
-	int err;
+	s64 left;
+	ssize_t len;
 
-	if (has_lapsensor) {
-		err = lapsensor_get(&has_lapsensor, &state);
-		if (err)
-			return;
-		if (lap_state != state) {
-			lap_state = state;
-			sysfs_notify(&tpacpi_pdev->dev.kobj, NULL, "dytc_lapmode");
-		}
+	mutex_lock(&boost_mutex);
+	if (!boost_active) {
+		len = sysfs_emit(buf, "off\n");
+	} else {
+		left = ktime_ms_delta(boost.deadline, ktime_get());
+		len = sysfs_emit(buf, "%lld%s\n",
+				 div_s64(max_t(s64, left, 0) + MSEC_PER_SEC - 1,
+					 MSEC_PER_SEC),
+				 boost.fan ? " fan" : "");
 	}
+	mutex_unlock(&boost_mutex);
+
+	return len;
 }
 
-static void palmsensor_refresh(void)
+/* "<seconds> [fan]", "0" or "off" */
+static ssize_t boost_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
 {
-	bool state;
-	int err;
+	char opt[8] = "";
+	unsigned int secs;
+	bool fan = false;
+	int rc;
 
-	if (has_palmsensor) {
-		err = palmsensor_get(&has_palmsensor, &state);
-		if (err)
-			return;
-		if (palm_state != state) {
-			palm_state = state;
-			sysfs_notify(&tpacpi_pdev->dev.kobj, NULL, "palmsensor");
+	if (sysfs_streq(buf, "off")) {
+		secs = 0;
+	} else {
+		rc = sscanf(buf, "%u %7s", &secs, opt);
+		if (rc < 1 || secs > TPACPI_BOOST_MAX_SECS)
+			return -EINVAL;
+		if (rc == 2) {
+			if (strcmp(opt, "fan"))
+				return -EINVAL;
+			if (!boost_fan_supported())
+				return -EPERM;
+			fan = true;
 		}
 	}
-}
-
-static ssize_t dytc_lapmode_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
-{
-	if (has_lapsensor)
-		return sysfs_emit(buf, "%d\n", lap_state);
-	return sysfs_emit(buf, "\n");
-}
-static DEVICE_ATTR_RO(dytc_lapmode);
 
-static ssize_t palmsensor_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
-{
-	if (has_palmsensor)
-		return sysfs_emit(buf, "%d\n", palm_state);
-	return sysfs_emit(buf, "\n");
+	if (!secs) {
+		tpacpi_disclose_usertask("boost", "stop\n");
+		boost_stop();
+		return count;
+	}
+
+	tpacpi_disclose_usertask("boost", "%u s%s\n", secs,
+				 fan ? " with fan" : "");
+
+	rc = boost_start(secs, fan);
+
+	return rc ? rc : count;
 }
-static DEVICE_ATTR_RO(palmsensor);
 
-static struct attribute *proxsensor_attributes[] = {
-	&dev_attr_dytc_lapmode.attr,
-	&dev_attr_palmsensor.attr,
+static DEVICE_ATTR_RW(boost);
+
+static struct attribute *boost_attributes[] = {
+	&dev_attr_boost.attr,
 	NULL
 };
 
-static umode_t proxsensor_attr_is_visible(struct kobject *kobj,
-					  struct attribute *attr, int n)
+static umode_t boost_attr_is_visible(struct kobject *kobj,
+				     struct attribute *attr, int n)
 {
-	if (attr == &dev_attr_dytc_lapmode.attr) {
-		/*
-		 * Platforms before DYTC version 5 claim to have a lap sensor,
-		 * but it doesn't work, so we ignore them.
-		 */
-		if (!has_lapsensor || dytc_version < 5)
-			return 0;
-	} else if (attr == &dev_attr_palmsensor.attr) {
-		if (!has_palmsensor)
-			return 0;
-	}
-
-	return attr->mode;
+	return dytc_profile_available ? attr->mode : 0;
 }
 
-static const struct attribute_group proxsensor_attr_group = {
-	.is_visible = proxsensor_attr_is_visible,
-	.attrs = proxsensor_attributes,
+static const struct attribute_group boost_attr_group = {
+	.is_visible = boost_attr_is_visible,
+	.attrs = boost_attributes,
 };
 
-static int tpacpi_proxsensor_init(struct ibm_init_struct *iibm)
-{
-	int palm_err, lap_err;
+/*************************************************************************
+ * Scene interface
+ *
+ * A scene is a batch of settings for several subdrivers written to the
+ * "scene" attribute in one go, e.g.
+ *
+ *	profile=low-power fan=auto brightness=3 kbdlight=0 led0=on
+ *	charge_start=75 charge_stop=80
+ *
+ * All of it is parsed and validated, and the current state of everything
+ * it touches saved, before the first setting is applied.  The settings
+ * then go out in a fixed order: the EC register writes back to back, the
+ * HKEY method calls, and the DYTC profile last.  Should a step fail, the
+ * steps done so far are put back from the saved state and the write fails
+ * with that step's error.  Change notifications are sent once, at the end.
+ *
+ * charge_start/charge_stop (or charge_start0/charge_stop0) address BAT0,
+ * charge_start1/charge_stop1 address BAT1.
+ */
 
-	palm_err = palmsensor_get(&has_palmsensor, &palm_state);
-	lap_err = lapsensor_get(&has_lapsensor, &lap_state);
-	/* If support isn't available for both devices return -ENODEV */
-	if ((palm_err == -ENODEV) && (lap_err == -ENODEV))
-		return -ENODEV;
-	/* Otherwise, if there was an error return it */
-	if (palm_err && (palm_err != -ENODEV))
-		return palm_err;
-	if (lap_err && (lap_err != -ENODEV))
-		return lap_err;
+enum tpacpi_scene_step {
+	TPACPI_SCENE_FAN,
+	TPACPI_SCENE_BRIGHTNESS,
+	TPACPI_SCENE_LEDS,
+	TPACPI_SCENE_KBDLIGHT,
+	TPACPI_SCENE_CHARGE,
+	TPACPI_SCENE_PROFILE,
+	TPACPI_SCENE_NR_STEPS
+};
 
-	return 0;
-}
+static const char * const tpacpi_scene_step_names[TPACPI_SCENE_NR_STEPS] = {
+	[TPACPI_SCENE_FAN]		= "fan",
+	[TPACPI_SCENE_BRIGHTNESS]	= "brightness",
+	[TPACPI_SCENE_LEDS]		= "leds",
+	[TPACPI_SCENE_KBDLIGHT]		= "kbdlight",
+	[TPACPI_SCENE_CHARGE]		= "charge",
+	[TPACPI_SCENE_PROFILE]		= "profile",
+};
 
-static struct ibm_struct proxsensor_driver_data = {
-	.name = "proximity-sensor",
+/* the names platform_profile uses for the profiles DYTC offers */
+static const char * const tpacpi_scene_profile_names[] = {
+	[PLATFORM_PROFILE_LOW_POWER]	= "low-power",
+	[PLATFORM_PROFILE_BALANCED]	= "balanced",
+	[PLATFORM_PROFILE_PERFORMANCE]	= "performance",
 };
 
-/*************************************************************************
- * DYTC Platform Profile interface
- */
+/* indexed by enum led_status_t */
+static const char * const tpacpi_scene_led_states[] = {
+	"off", "on", "blink",
+};
 
-#define DYTC_CMD_SET          1 /* To enable/disable IC function mode */
-#define DYTC_CMD_MMC_GET      8 /* To get current MMC function and mode */
-#define DYTC_CMD_RESET    0x1ff /* To reset back to default */
+struct tpacpi_scene {
+	unsigned long steps;			/* BIT(TPACPI_SCENE_*) */
+	unsigned int nr;			/* settings given */
+	int fan;				/* a fan_set_level() level */
+	unsigned int brightness;
+	unsigned int kbdlight;
+	unsigned long leds;			/* BIT(led) */
+	enum led_status_t led[TPACPI_LED_NUMLEDS];
+	unsigned long charge_start;		/* BIT(battery) */
+	unsigned long charge_stop;
+	int start[3];				/* by battery */
+	int stop[3];
+	enum platform_profile_option profile;
+};
 
-#define DYTC_CMD_FUNC_CAP     3 /* To get DYTC capabilities */
-#define DYTC_FC_MMC           27 /* MMC Mode supported */
-#define DYTC_FC_PSC           29 /* PSC Mode supported */
-#define DYTC_FC_AMT           31 /* AMT mode supported */
+static DEFINE_MUTEX(scene_mutex);
 
-#define DYTC_GET_FUNCTION_BIT 8  /* Bits  8-11 - function setting */
-#define DYTC_GET_MODE_BIT     12 /* Bits 12-15 - mode setting */
+static struct {
+	bool valid;
+	int rc;
+	const char *step;
+} scene_last;				/* protected by scene_mutex */
 
-#define DYTC_SET_FUNCTION_BIT 12 /* Bits 12-15 - function setting */
-#define DYTC_SET_MODE_BIT     16 /* Bits 16-19 - mode setting */
-#define DYTC_SET_VALID_BIT    20 /* Bit     20 - 1 = on, 0 = off */
+static int tpacpi_scene_parse_battery(const char *suffix)
+{
+	if (!*suffix || !strcmp(suffix, "0"))
+		return BAT_PRIMARY;
+	if (!strcmp(suffix, "1") && battery_info.individual_addressing)
+		return BAT_SECONDARY;
+	return -EINVAL;
+}
 
-#define DYTC_FUNCTION_STD     0  /* Function = 0, standard mode */
-#define DYTC_FUNCTION_CQL     1  /* Function = 1, lap mode */
-#define DYTC_FUNCTION_MMC     11 /* Function = 11, MMC mode */
-#define DYTC_FUNCTION_PSC     13 /* Function = 13, PSC mode */
-#define DYTC_FUNCTION_AMT     15 /* Function = 15, AMT mode */
+static int tpacpi_scene_parse(struct tpacpi_scene *s, char *key, char *val)
+{
+	unsigned int n;
+	int i, bat, v;
 
-#define DYTC_MODE_AMT_ENABLE   0x1 /* Enable AMT (in balanced mode) */
-#define DYTC_MODE_AMT_DISABLE  0xF /* Disable AMT (in other modes) */
+	if (!strcmp(key, "profile")) {
+		if (!dytc_profile_available)
+			return -ENODEV;
+		if (s->steps & BIT(TPACPI_SCENE_PROFILE))
+			return -EINVAL;
+		for (i = 0; i < ARRAY_SIZE(tpacpi_scene_profile_names); i++)
+			if (tpacpi_scene_profile_names[i] &&
+			    !strcmp(val, tpacpi_scene_profile_names[i]))
+				break;
+		if (i == ARRAY_SIZE(tpacpi_scene_profile_names))
+			return -EINVAL;
+		s->profile = i;
+		s->steps |= BIT(TPACPI_SCENE_PROFILE);
+	} else if (!strcmp(key, "fan")) {
+		if (!fan_control_allowed ||
+		    fan_control_access_mode == TPACPI_FAN_WR_NONE)
+			return -EPERM;
+		if (s->steps & BIT(TPACPI_SCENE_FAN))
+			return -EINVAL;
+		if (!strcmp(val, "auto")) {
+			/* SFAN only knows levels */
+			if (fan_control_access_mode == TPACPI_FAN_WR_ACPI_SFAN)
+				return -EINVAL;
+			s->fan = TP_EC_FAN_AUTO;
+		} else if (!strcmp(val, "full")) {
+			/* as for boost: 7 is as fast as SFAN goes */
+			s->fan = fan_control_access_mode ==
+					TPACPI_FAN_WR_ACPI_SFAN ?
+				 7 : TP_EC_FAN_FULLSPEED;
+		} else if (!kstrtouint(val, 10, &n) && n <= 7) {
+			s->fan = n;
+		} else {
+			return -EINVAL;
+		}
+		s->steps |= BIT(TPACPI_SCENE_FAN);
+	} else if (!strcmp(key, "brightness")) {
+		if (!ibm_backlight_device)
+			return -ENODEV;
+		if (s->steps & BIT(TPACPI_SCENE_BRIGHTNESS))
+			return -EINVAL;
+		if (kstrtouint(val, 10, &n) || n > bright_maxlvl)
+			return -EINVAL;
+		s->brightness = n;
+		s->steps |= BIT(TPACPI_SCENE_BRIGHTNESS);
+	} else if (!strcmp(key, "kbdlight")) {
+		if (!tp_features.kbdlight)
+			return -ENODEV;
+		if (s->steps & BIT(TPACPI_SCENE_KBDLIGHT))
+			return -EINVAL;
+		if (kstrtouint(val, 10, &n) ||
+		    n > tpacpi_led_kbdlight.led_classdev.max_brightness)
+			return -EINVAL;
+		s->kbdlight = n;
+		s->steps |= BIT(TPACPI_SCENE_KBDLIGHT);
+	} else if (strstarts(key, "led")) {
+		if (kstrtouint(key + 3, 10, &n) || n >= TPACPI_LED_NUMLEDS)
+			return -EINVAL;
+		/* only the LEDs we registered, i.e. the safe and useful ones */
+		if (led_supported == TPACPI_LED_NONE || !tpacpi_leds ||
+		    tpacpi_leds[n].led < 0)
+			return -ENODEV;
+		if (s->leds & BIT(n))
+			return -EINVAL;
+		i = match_string(tpacpi_scene_led_states,
+				 ARRAY_SIZE(tpacpi_scene_led_states), val);
+		if (i < 0)
+			return -EINVAL;
+		s->led[n] = i;
+		s->leds |= BIT(n);
+		s->steps |= BIT(TPACPI_SCENE_LEDS);
+	} else if (strstarts(key, "charge_start")) {
+		bat = tpacpi_scene_parse_battery(key + strlen("charge_start"));
+		if (bat < 0)
+			return bat;
+		if ((s->charge_start & BIT(bat)) || kstrtoint(val, 10, &v))
+			return -EINVAL;
+		s->start[bat] = v;
+		s->charge_start |= BIT(bat);
+		s->steps |= BIT(TPACPI_SCENE_CHARGE);
+	} else if (strstarts(key, "charge_stop")) {
+		bat = tpacpi_scene_parse_battery(key + strlen("charge_stop"));
+		if (bat < 0)
+			return bat;
+		if ((s->charge_stop & BIT(bat)) || kstrtoint(val, 10, &v))
+			return -EINVAL;
+		s->stop[bat] = v;
+		s->charge_stop |= BIT(bat);
+		s->steps |= BIT(TPACPI_SCENE_CHARGE);
+	} else {
+		return -EINVAL;
+	}
 
-#define DYTC_MODE_MMC_PERFORM  2  /* High power mode aka performance */
-#define DYTC_MODE_MMC_LOWPOWER 3  /* Low power mode */
-#define DYTC_MODE_MMC_BALANCE  0xF  /* Default mode aka balanced */
-#define DYTC_MODE_MMC_DEFAULT  0  /* Default mode from MMC_GET, aka balanced */
+	s->nr++;
+	return 0;
+}
 
-#define DYTC_MODE_PSC_LOWPOWER 3  /* Low power mode */
-#define DYTC_MODE_PSC_BALANCE  5  /* Default mode aka balanced */
-#define DYTC_MODE_PSC_PERFORM  7  /* High power mode aka performance */
+/* Checks the thresholds as they will end up and saves the current ones */
+static int tpacpi_scene_save_charge(const struct tpacpi_scene *s,
+				    struct tpacpi_scene *old, int bat)
+{
+	struct tpacpi_battery_data *b = &battery_info.batteries[bat];
+	bool has_start = s->charge_start & BIT(bat);
+	bool has_stop = s->charge_stop & BIT(bat);
+	int start, stop;
 
-#define DYTC_ERR_MASK       0xF  /* Bits 0-3 in cmd result are the error result */
-#define DYTC_ERR_SUCCESS      1  /* CMD completed successful */
+	lockdep_assert_held(&battery_mutex);
 
-#define DYTC_SET_COMMAND(function, mode, on) \
-	(DYTC_CMD_SET | (function) << DYTC_SET_FUNCTION_BIT | \
-	 (mode) << DYTC_SET_MODE_BIT | \
-	 (on) << DYTC_SET_VALID_BIT)
+	if (tpacpi_battery_cache_refresh(bat))
+		return -ENODEV;
 
-#define DYTC_DISABLE_CQL DYTC_SET_COMMAND(DYTC_FUNCTION_CQL, DYTC_MODE_MMC_BALANCE, 0)
-#define DYTC_ENABLE_CQL DYTC_SET_COMMAND(DYTC_FUNCTION_CQL, DYTC_MODE_MMC_BALANCE, 1)
-static int dytc_control_amt(bool enable);
-static bool dytc_amt_active;
+	if ((has_start && !b->start_support) || (has_stop && !b->stop_support))
+		return -ENODEV;
 
-static enum platform_profile_option dytc_current_profile;
-static atomic_t dytc_ignore_event = ATOMIC_INIT(0);
-static DEFINE_MUTEX(dytc_mutex);
-static int dytc_capabilities;
-static bool dytc_mmc_get_available;
-static int profile_force;
+	start = has_start ? s->start[bat] : b->charge_start;
+	stop = has_stop ? s->stop[bat] : b->charge_stop;
 
-static int convert_dytc_to_profile(int funcmode, int dytcmode,
-		enum platform_profile_option *profile)
+	/* the same limits as the power_supply attributes */
+	if (start < 0 || start > 99 || stop < 1 || stop > 100 || start > stop)
+		return -EINVAL;
+
+	old->start[bat] = b->charge_start;
+	old->stop[bat] = b->charge_stop;
+	return 0;
+}
+
+/*
+ * Validates what can only be checked against the current state, and
+ * saves the state of everything the scene changes into old.  Nothing
+ * has been touched when this fails; *failed is the step that did.
+ */
+static int tpacpi_scene_save(const struct tpacpi_scene *s,
+			     struct tpacpi_scene *old, int *failed)
 {
-	switch (funcmode) {
-	case DYTC_FUNCTION_MMC:
-		switch (dytcmode) {
-		case DYTC_MODE_MMC_LOWPOWER:
-			*profile = PLATFORM_PROFILE_LOW_POWER;
+	unsigned long mask;
+	unsigned int n;
+	int step, rc, bat;
+	u8 status;
+
+	*old = *s;
+
+	for_each_set_bit(step, &s->steps, TPACPI_SCENE_NR_STEPS) {
+		rc = 0;
+		switch (step) {
+		case TPACPI_SCENE_FAN:
+			rc = fan_get_status_safe(&status);
+			if (rc)
+				break;
+			if (fan_control_access_mode == TPACPI_FAN_WR_ACPI_SFAN)
+				status &= 0x07;
+			old->fan = status;
 			break;
-		case DYTC_MODE_MMC_DEFAULT:
-		case DYTC_MODE_MMC_BALANCE:
-			*profile =  PLATFORM_PROFILE_BALANCED;
+		case TPACPI_SCENE_BRIGHTNESS:
+			old->brightness = brightness_get(NULL);
 			break;
-		case DYTC_MODE_MMC_PERFORM:
-			*profile =  PLATFORM_PROFILE_PERFORMANCE;
+		case TPACPI_SCENE_LEDS:
+			/* only the 570 can tell, elsewhere use what we last set */
+			for_each_set_bit(n, &s->leds, TPACPI_LED_NUMLEDS) {
+				if (led_supported == TPACPI_LED_570) {
+					rc = led_get_status(n);
+					if (rc < 0)
+						break;
+					old->led[n] = rc;
+					rc = 0;
+				} else {
+					old->led[n] = tpacpi_led_state_cache[n];
+				}
+			}
 			break;
-		default: /* Unknown mode */
-			return -EINVAL;
-		}
-		return 0;
-	case DYTC_FUNCTION_PSC:
-		switch (dytcmode) {
-		case DYTC_MODE_PSC_LOWPOWER:
-			*profile = PLATFORM_PROFILE_LOW_POWER;
+		case TPACPI_SCENE_KBDLIGHT:
+			rc = kbdlight_get_level();
+			if (rc < 0)
+				break;
+			old->kbdlight = rc;
+			rc = 0;
 			break;
-		case DYTC_MODE_PSC_BALANCE:
-			*profile =  PLATFORM_PROFILE_BALANCED;
+		case TPACPI_SCENE_CHARGE:
+			mask = s->charge_start | s->charge_stop;
+			mutex_lock(&battery_mutex);
+			for_each_set_bit(bat, &mask,
+					 ARRAY_SIZE(battery_info.batteries)) {
+				rc = tpacpi_scene_save_charge(s, old, bat);
+				if (rc)
+					break;
+			}
+			mutex_unlock(&battery_mutex);
 			break;
-		case DYTC_MODE_PSC_PERFORM:
-			*profile =  PLATFORM_PROFILE_PERFORMANCE;
+		case TPACPI_SCENE_PROFILE:
+			old->profile = READ_ONCE(dytc_current_profile);
 			break;
-		default: /* Unknown mode */
-			return -EINVAL;
 		}
-		return 0;
-	case DYTC_FUNCTION_AMT:
-		/* For now return balanced. It's the closest we have to 'auto' */
-		*profile =  PLATFORM_PROFILE_BALANCED;
-		return 0;
-	default:
-		/* Unknown function */
-		pr_debug("unknown function 0x%x\n", funcmode);
-		return -EOPNOTSUPP;
-	}
-	return 0;
-}
 
-static int convert_profile_to_dytc(enum platform_profile_option profile, int *perfmode)
-{
-	switch (profile) {
-	case PLATFORM_PROFILE_LOW_POWER:
-		if (dytc_capabilities & BIT(DYTC_FC_MMC))
-			*perfmode = DYTC_MODE_MMC_LOWPOWER;
-		else if (dytc_capabilities & BIT(DYTC_FC_PSC))
-			*perfmode = DYTC_MODE_PSC_LOWPOWER;
-		break;
-	case PLATFORM_PROFILE_BALANCED:
-		if (dytc_capabilities & BIT(DYTC_FC_MMC))
-			*perfmode = DYTC_MODE_MMC_BALANCE;
-		else if (dytc_capabilities & BIT(DYTC_FC_PSC))
-			*perfmode = DYTC_MODE_PSC_BALANCE;
-		break;
-	case PLATFORM_PROFILE_PERFORMANCE:
-		if (dytc_capabilities & BIT(DYTC_FC_MMC))
-			*perfmode = DYTC_MODE_MMC_PERFORM;
-		else if (dytc_capabilities & BIT(DYTC_FC_PSC))
-			*perfmode = DYTC_MODE_PSC_PERFORM;
-		break;
-	default: /* Unknown profile */
-		return -EOPNOTSUPP;
+		if (rc) {
+			*failed = step;
+			return rc;
+		}
 	}
-	return 0;
-}
 
-/*
- * dytc_profile_get: Function to register with platform_profile
- * handler. Returns current platform profile.
- */
-static int dytc_profile_get(struct platform_profile_handler *pprof,
-			    enum platform_profile_option *profile)
-{
-	*profile = dytc_current_profile;
 	return 0;
 }
 
-static int dytc_control_amt(bool enable)
+static int tpacpi_scene_set_charge(const struct tpacpi_scene *s, int bat)
 {
-	int dummy;
-	int err;
-	int cmd;
+	bool has_start = s->charge_start & BIT(bat);
+	bool has_stop = s->charge_stop & BIT(bat);
+	int rc;
 
-	if (!(dytc_capabilities & BIT(DYTC_FC_AMT))) {
-		pr_warn("Attempting to toggle AMT on a system that doesn't advertise support\n");
-		return -ENODEV;
+	lockdep_assert_held(&battery_mutex);
+
+	/* order the writes so that start <= stop holds in between as well */
+	if (has_stop &&
+	    (!has_start ||
+	     s->start[bat] > battery_info.batteries[bat].charge_stop)) {
+		rc = tpacpi_battery_store_locked(THRESHOLD_STOP, bat,
+						 s->stop[bat]);
+		if (rc)
+			return rc;
+		has_stop = false;
 	}
 
-	if (enable)
-		cmd = DYTC_SET_COMMAND(DYTC_FUNCTION_AMT, DYTC_MODE_AMT_ENABLE, enable);
-	else
-		cmd = DYTC_SET_COMMAND(DYTC_FUNCTION_AMT, DYTC_MODE_AMT_DISABLE, enable);
+	if (has_start) {
+		rc = tpacpi_battery_store_locked(THRESHOLD_START, bat,
+						 s->start[bat]);
+		if (rc)
+			return rc;
+	}
+
+	if (has_stop)
+		return tpacpi_battery_store_locked(THRESHOLD_STOP, bat,
+						   s->stop[bat]);
 
-	pr_debug("%sabling AMT (cmd 0x%x)", enable ? "en":"dis", cmd);
-	err = dytc_command(cmd, &dummy);
-	if (err)
-		return err;
-	dytc_amt_active = enable;
 	return 0;
 }
 
-/*
- * Helper function - check if we are in CQL mode and if we are
- *  -  disable CQL,
- *  - run the command
- *  - enable CQL
- *  If not in CQL mode, just run the command
- */
-static int dytc_cql_command(int command, int *output)
+static int tpacpi_scene_set_leds(const struct tpacpi_scene *s)
 {
-	int err, cmd_err, dummy;
-	int cur_funcmode;
-
-	/* Determine if we are in CQL mode. This alters the commands we do */
-	err = dytc_command(DYTC_CMD_GET, output);
-	if (err)
-		return err;
+	struct led_classdev *led_cdev;
+	unsigned int n;
+	int rc;
 
-	cur_funcmode = (*output >> DYTC_GET_FUNCTION_BIT) & 0xF;
-	/* Check if we're OK to return immediately */
-	if ((command == DYTC_CMD_GET) && (cur_funcmode != DYTC_FUNCTION_CQL))
-		return 0;
+	for_each_set_bit(n, &s->leds, TPACPI_LED_NUMLEDS) {
+		rc = led_set_status(n, s->led[n]);
+		if (rc)
+			return rc;
 
-	if (cur_funcmode == DYTC_FUNCTION_CQL) {
-		atomic_inc(&dytc_ignore_event);
-		err = dytc_command(DYTC_DISABLE_CQL, &dummy);
-		if (err)
-			return err;
+		led_cdev = &tpacpi_leds[n].led_classdev;
+		if (!(led_cdev->flags & LED_SUSPENDED))
+			led_cdev->brightness = s->led[n] == TPACPI_LED_OFF ?
+					       LED_OFF : led_cdev->max_brightness;
 	}
 
-	cmd_err = dytc_command(command,	output);
-	/* Check return condition after we've restored CQL state */
+	return 0;
+}
 
-	if (cur_funcmode == DYTC_FUNCTION_CQL) {
-		err = dytc_command(DYTC_ENABLE_CQL, &dummy);
-		if (err)
-			return err;
+static int tpacpi_scene_apply(int step, const struct tpacpi_scene *s)
+{
+	unsigned long mask;
+	int rc = 0, bat;
+
+	pr_debug("scene: setting %s\n", tpacpi_scene_step_names[step]);
+
+	switch (step) {
+	case TPACPI_SCENE_FAN:
+		fan_curve_disable();
+		fan_target_disable();
+		fan_prespin_forget();
+		rc = fan_set_level_safe(s->fan);
+		if (!rc)
+			fan_watchdog_reset();
+		break;
+	case TPACPI_SCENE_BRIGHTNESS:
+		brightness_fade_cancel();
+		brightness_set_flush();
+		rc = brightness_set(s->brightness);
+		break;
+	case TPACPI_SCENE_LEDS:
+		rc = tpacpi_scene_set_leds(s);
+		break;
+	case TPACPI_SCENE_KBDLIGHT:
+		rc = kbdlight_set_level_and_update(s->kbdlight);
+		break;
+	case TPACPI_SCENE_CHARGE:
+		mask = s->charge_start | s->charge_stop;
+		mutex_lock(&battery_mutex);
+		for_each_set_bit(bat, &mask,
+				 ARRAY_SIZE(battery_info.batteries)) {
+			rc = tpacpi_scene_set_charge(s, bat);
+			if (rc)
+				break;
+		}
+		mutex_unlock(&battery_mutex);
+		break;
+	case TPACPI_SCENE_PROFILE:
+		/* a user choice: the profile governor backs off */
+		rc = dytc_profile_set(&dytc_profile, s->profile);
+		break;
 	}
-	return cmd_err;
+
+	return rc;
 }
 
-/*
- * dytc_profile_set: Function to register with platform_profile
- * handler. Sets current platform profile.
- */
-static int dytc_profile_set(struct platform_profile_handler *pprof,
-			    enum platform_profile_option profile)
+static int tpacpi_scene_commit(const struct tpacpi_scene *s)
 {
-	int perfmode;
-	int output;
-	int err;
+	struct tpacpi_scene old;
+	int step = 0, rc;
 
-	err = mutex_lock_interruptible(&dytc_mutex);
-	if (err)
-		return err;
+	lockdep_assert_held(&scene_mutex);
 
-	err = convert_profile_to_dytc(profile, &perfmode);
-	if (err)
-		goto unlock;
+	/* a boost ending later would undo the scene's profile and fan */
+	if (READ_ONCE(boost_active) &&
+	    (s->steps & (BIT(TPACPI_SCENE_FAN) | BIT(TPACPI_SCENE_PROFILE))))
+		boost_stop();
 
-	if (dytc_capabilities & BIT(DYTC_FC_MMC)) {
-		if (profile == PLATFORM_PROFILE_BALANCED) {
-			/*
-			 * To get back to balanced mode we need to issue a reset command.
-			 * Note we still need to disable CQL mode before hand and re-enable
-			 * it afterwards, otherwise dytc_lapmode gets reset to 0 and stays
-			 * stuck at 0 for aprox. 30 minutes.
-			 */
-			err = dytc_cql_command(DYTC_CMD_RESET, &output);
-			if (err)
-				goto unlock;
-		} else {
-			/* Determine if we are in CQL mode. This alters the commands we do */
-			err = dytc_cql_command(DYTC_SET_COMMAND(DYTC_FUNCTION_MMC, perfmode, 1),
-						&output);
-			if (err)
-				goto unlock;
-		}
-	} else if (dytc_capabilities & BIT(DYTC_FC_PSC)) {
-		err = dytc_command(DYTC_SET_COMMAND(DYTC_FUNCTION_PSC, perfmode, 1), &output);
-		if (err)
-			goto unlock;
+	rc = tpacpi_scene_save(s, &old, &step);
+	if (rc)
+		goto out;
 
-		/* system supports AMT, activate it when on balanced */
-		if (dytc_capabilities & BIT(DYTC_FC_AMT))
-			dytc_control_amt(profile == PLATFORM_PROFILE_BALANCED);
+	for_each_set_bit(step, &s->steps, TPACPI_SCENE_NR_STEPS) {
+		rc = tpacpi_scene_apply(step, s);
+		if (rc)
+			break;
 	}
-	/* Success - update current profile */
-	dytc_current_profile = profile;
-unlock:
-	mutex_unlock(&dytc_mutex);
-	return err;
-}
 
-static void dytc_profile_refresh(void)
-{
-	enum platform_profile_option profile;
-	int output = 0, err = 0;
-	int perfmode, funcmode = 0;
+	if (rc) {
+		pr_warn("scene: setting %s failed (%d), rolling back\n",
+			tpacpi_scene_step_names[step], rc);
 
-	mutex_lock(&dytc_mutex);
-	if (dytc_capabilities & BIT(DYTC_FC_MMC)) {
-		if (dytc_mmc_get_available)
-			err = dytc_command(DYTC_CMD_MMC_GET, &output);
-		else
-			err = dytc_cql_command(DYTC_CMD_GET, &output);
-		funcmode = DYTC_FUNCTION_MMC;
-	} else if (dytc_capabilities & BIT(DYTC_FC_PSC)) {
-		err = dytc_command(DYTC_CMD_GET, &output);
-		/* Check if we are PSC mode, or have AMT enabled */
-		funcmode = (output >> DYTC_GET_FUNCTION_BIT) & 0xF;
-	} else { /* Unknown profile mode */
-		err = -ENODEV;
+		/* the failed step may have been done in part, undo it too */
+		for (; step >= 0; step--) {
+			if (!(old.steps & BIT(step)))
+				continue;
+			if (tpacpi_scene_apply(step, &old))
+				pr_warn("scene: could not restore %s\n",
+					tpacpi_scene_step_names[step]);
+		}
 	}
-	mutex_unlock(&dytc_mutex);
-	if (err)
-		return;
 
-	perfmode = (output >> DYTC_GET_MODE_BIT) & 0xF;
-	err = convert_dytc_to_profile(funcmode, perfmode, &profile);
-	if (!err && profile != dytc_current_profile) {
-		dytc_current_profile = profile;
+	if (s->steps & BIT(TPACPI_SCENE_BRIGHTNESS))
+		backlight_force_update(ibm_backlight_device,
+				       BACKLIGHT_UPDATE_SYSFS);
+	if (s->steps & BIT(TPACPI_SCENE_PROFILE))
 		platform_profile_notify();
-	}
-}
 
-static struct platform_profile_handler dytc_profile = {
-	.profile_get = dytc_profile_get,
-	.profile_set = dytc_profile_set,
-};
+out:
+	scene_last.valid = true;
+	scene_last.rc = rc;
+	scene_last.step = rc ? tpacpi_scene_step_names[step] : NULL;
+	return rc;
+}
 
-static int tpacpi_dytc_profile_init(struct ibm_init_struct *iibm)
+/* sysfs scene --------------------------------------------------------- */
+static ssize_t scene_show(struct device *dev,
+			  struct device_attribute *attr,
+			  char *buf)
 {
-	int err, output;
-
-	/* Setup supported modes */
-	set_bit(PLATFORM_PROFILE_LOW_POWER, dytc_profile.choices);
-	set_bit(PLATFORM_PROFILE_BALANCED, dytc_profile.choices);
-	set_bit(PLATFORM_PROFILE_PERFORMANCE, dytc_profile.choices);
+	ssize_t len;
 
-	err = dytc_command(DYTC_CMD_QUERY, &output);
-	if (err)
-		return err;
+	mutex_lock(&scene_mutex);
+	if (!scene_last.valid)
+		len = sysfs_emit(buf, "none\n");
+	else if (!scene_last.rc)
+		len = sysfs_emit(buf, "ok\n");
+	else
+		len = sysfs_emit(buf, "%s %d\n", scene_last.step,
+				 scene_last.rc);
+	mutex_unlock(&scene_mutex);
 
-	if (output & BIT(DYTC_QUERY_ENABLE_BIT))
-		dytc_version = (output >> DYTC_QUERY_REV_BIT) & 0xF;
+	return len;
+}
 
-	/* Check DYTC is enabled and supports mode setting */
-	if (dytc_version < 5)
-		return -ENODEV;
+/* whitespace, comma or semicolon separated "<setting>=<value>" pairs */
+static ssize_t scene_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct tpacpi_scene s = { };
+	char *copy, *p, *key, *val;
+	int rc = 0;
 
-	/* Check what capabilities are supported */
-	err = dytc_command(DYTC_CMD_FUNC_CAP, &dytc_capabilities);
-	if (err)
-		return err;
+	copy = kstrndup(buf, count, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
 
-	/* Check if user wants to override the profile selection */
-	if (profile_force) {
-		switch (profile_force) {
-		case -1:
-			dytc_capabilities = 0;
-			break;
-		case 1:
-			dytc_capabilities = BIT(DYTC_FC_MMC);
-			break;
-		case 2:
-			dytc_capabilities = BIT(DYTC_FC_PSC);
+	p = copy;
+	while ((key = strsep(&p, " \t\n,;"))) {
+		if (!*key)
+			continue;
+		val = strchr(key, '=');
+		if (!val) {
+			rc = -EINVAL;
 			break;
 		}
-		pr_debug("Profile selection forced: 0x%x\n", dytc_capabilities);
-	}
-	if (dytc_capabilities & BIT(DYTC_FC_MMC)) { /* MMC MODE */
-		pr_debug("MMC is supported\n");
-		/*
-		 * Check if MMC_GET functionality available
-		 * Version > 6 and return success from MMC_GET command
-		 */
-		dytc_mmc_get_available = false;
-		if (dytc_version >= 6) {
-			err = dytc_command(DYTC_CMD_MMC_GET, &output);
-			if (!err && ((output & DYTC_ERR_MASK) == DYTC_ERR_SUCCESS))
-				dytc_mmc_get_available = true;
-		}
-	} else if (dytc_capabilities & BIT(DYTC_FC_PSC)) { /* PSC MODE */
-		pr_debug("PSC is supported\n");
-	} else {
-		dbg_printk(TPACPI_DBG_INIT, "No DYTC support available\n");
-		return -ENODEV;
+		*val++ = '\0';
+		rc = tpacpi_scene_parse(&s, key, val);
+		if (rc)
+			break;
 	}
 
-	dbg_printk(TPACPI_DBG_INIT,
-			"DYTC version %d: thermal mode available\n", dytc_version);
+	kfree(copy);
 
-	/* Create platform_profile structure and register */
-	err = platform_profile_register(&dytc_profile);
-	/*
-	 * If for some reason platform_profiles aren't enabled
-	 * don't quit terminally.
-	 */
-	if (err)
-		return -ENODEV;
+	if (rc)
+		return rc;
+	if (!s.nr)
+		return -EINVAL;
 
-	/* Ensure initial values are correct */
-	dytc_profile_refresh();
+	tpacpi_disclose_usertask("scene", "applying %u settings\n", s.nr);
 
-	/* Workaround for https://bugzilla.kernel.org/show_bug.cgi?id=216347 */
-	if (dytc_capabilities & BIT(DYTC_FC_PSC))
-		dytc_profile_set(NULL, PLATFORM_PROFILE_BALANCED);
+	mutex_lock(&scene_mutex);
+	rc = tpacpi_scene_commit(&s);
+	mutex_unlock(&scene_mutex);
 
-	return 0;
-}
+	if (rc == -EINTR)
+		return -ERESTARTSYS;
 
-static void dytc_profile_exit(void)
-{
-	platform_profile_remove();
+	return rc ? rc : count;
 }
 
-static struct ibm_struct  dytc_profile_driver_data = {
-	.name = "dytc-profile",
-	.exit = dytc_profile_exit,
+static DEVICE_ATTR_RW(scene);
+
+static struct attribute *scene_attributes[] = {
+	&dev_attr_scene.attr,
+	NULL
+};
+
+static const struct attribute_group scene_attr_group = {
+	.attrs = scene_attributes,
 };
 
 /*************************************************************************
@@ -10918,6 +16756,8 @@ static const struct attribute_group *tpacpi_groups[] = {
 	&wan_attr_group,
 	&cmos_attr_group,
 	&proxsensor_attr_group,
+	&boost_attr_group,
+	&scene_attr_group,
 	&kbdlang_attr_group,
 	&dprc_attr_group,
 	&auxmac_attr_group,
@@ -10926,6 +16766,8 @@ static const struct attribute_group *tpacpi_groups[] = {
 
 static const struct attribute_group *tpacpi_hwmon_groups[] = {
 	&thermal_attr_group,
+	&thermal_history_attr_group,
+	&thermal_sampler_attr_group,
 	&temp_label_attr_group,
 	&fan_attr_group,
 	NULL,
@@ -10978,8 +16820,10 @@ static bool tpacpi_driver_event(const unsigned int hkey_event)
 	switch (hkey_event) {
 	case TP_HKEY_EV_BRGHT_UP:
 	case TP_HKEY_EV_BRGHT_DOWN:
-		if (ibm_backlight_device)
+		if (ibm_backlight_device) {
+			tpacpi_nvram_mark_dirty(TPACPI_NVRAM_BRIGHTNESS);
 			tpacpi_brightness_notify_change();
+		}
 		/*
 		 * Key press events are suppressed by default hotkey_user_mask
 		 * and should still be reported if explicitly requested.
@@ -10988,8 +16832,10 @@ static bool tpacpi_driver_event(const unsigned int hkey_event)
 	case TP_HKEY_EV_VOL_UP:
 	case TP_HKEY_EV_VOL_DOWN:
 	case TP_HKEY_EV_VOL_MUTE:
-		if (alsa_card)
+		if (alsa_card) {
+			tpacpi_nvram_mark_dirty(TPACPI_NVRAM_MIXER);
 			volume_alsa_notify_change();
+		}
 
 		/* Key events are suppressed by default hotkey_user_mask */
 		return false;
@@ -11021,6 +16867,7 @@ static bool tpacpi_driver_event(const unsigned int hkey_event)
 		adaptive_keyboard_s_quickview_row();
 		return true;
 	case TP_HKEY_EV_THM_CSM_COMPLETED:
+		dytc_get_invalidate();
 		lapsensor_refresh();
 		/* If we are already accessing DYTC then skip dytc update */
 		if (!atomic_add_unless(&dytc_ignore_event, -1, 0))
@@ -11043,6 +16890,7 @@ static bool tpacpi_driver_event(const unsigned int hkey_event)
 		}
 		return true;
 	case TP_HKEY_EV_AMT_TOGGLE:
+		dytc_get_invalidate();
 		/* If we're enabling AMT we need to force balanced mode */
 		if (!dytc_amt_active)
 			/* This will also set AMT mode enabled */
@@ -11484,6 +17332,16 @@ static struct ibm_init_struct ibms_init[] __initdata = {
 		.init = fan_init,
 		.data = &fan_driver_data,
 	},
+	{
+		.init = tptrace_init,
+		.data = &tptrace_driver_data,
+	},
+#ifdef CONFIG_PERF_EVENTS
+	{
+		.init = tpacpi_pmu_init,
+		.data = &tpacpi_pmu_driver_data,
+	},
+#endif
 	{
 		.init = mute_led_init,
 		.data = &mute_led_driver_data,
@@ -11557,10 +17415,48 @@ module_param_named(fan_control, fan_control_allowed, bool, 0444);
 MODULE_PARM_DESC(fan_control,
 		 "Enables setting fan parameters features when true");
 
+#ifdef CONFIG_THINKPAD_ACPI_HOTKEY_POLL
+module_param(hotkey_source_auto, bool, 0444);
+MODULE_PARM_DESC(hotkey_source_auto,
+		 "Stops polling NVRAM for volume and brightness keys the firmware reports when true");
+#endif
+
+module_param_named(thermal_sample_interval, thermal_sample_interval, uint, 0444);
+MODULE_PARM_DESC(thermal_sample_interval,
+		 "Interval in ms (100-60000) at which the thermal sensor history is sampled, 0 disables");
+
+module_param_named(thermal_zones, thermal_zones_enable, bool, 0444);
+MODULE_PARM_DESC(thermal_zones,
+		 "Register the thermal sensors as thermal zones");
+
+module_param(thermal_zone_passive, int, 0444);
+MODULE_PARM_DESC(thermal_zone_passive,
+		 "Initial passive trip point of the thermal zones, in millidegrees Celsius");
+
+module_param(thermal_zone_hot, int, 0444);
+MODULE_PARM_DESC(thermal_zone_hot,
+		 "Initial hot trip point of the thermal zones, in millidegrees Celsius");
+
+module_param(thermal_zone_poll, uint, 0444);
+MODULE_PARM_DESC(thermal_zone_poll,
+		 "Polling interval of the thermal zones in ms (firmware alarms force an update)");
+
 module_param_named(brightness_mode, brightness_mode, uint, 0444);
 MODULE_PARM_DESC(brightness_mode,
 		 "Selects brightness control strategy: 0=auto, 1=EC, 2=UCMS, 3=EC+NVRAM");
 
+module_param(brightness_sync, bool, 0644);
+MODULE_PARM_DESC(brightness_sync,
+		 "Apply backlight class brightness writes before returning");
+
+module_param(brightness_ucms_direct, bool, 0444);
+MODULE_PARM_DESC(brightness_ucms_direct,
+		 "Writes the backlight level straight to the EC on UCMS step machines (unverified, only if the EC is known to act on it)");
+
+module_param(nvram_writeback_delay, uint, 0644);
+MODULE_PARM_DESC(nvram_writeback_delay,
+		 "Quiet period in ms before brightness and mixer changes are written back to NVRAM");
+
 module_param(brightness_enable, uint, 0444);
 MODULE_PARM_DESC(brightness_enable,
 		 "Enables backlight control when 1, disables when 0");
@@ -11636,12 +17532,20 @@ MODULE_PARM_DESC(uwb_state,
 module_param(profile_force, int, 0444);
 MODULE_PARM_DESC(profile_force, "Force profile mode. -1=off, 1=MMC, 2=PSC");
 
+module_param(profile_governor, bool, 0444);
+MODULE_PARM_DESC(profile_governor,
+		 "Switches the platform profile with CPU load and temperature when true");
+
 static void thinkpad_acpi_module_exit(void)
 {
 	struct ibm_struct *ibm, *itmp;
 
 	tpacpi_lifecycle = TPACPI_LIFE_EXITING;
 
+	tptrace_close();
+	debugfs_remove_recursive(tpacpi_debugfs_dir);
+	tpacpi_debugfs_dir = NULL;
+
 	if (tpacpi_hwmon)
 		hwmon_device_unregister(tpacpi_hwmon);
 	if (tp_features.sensors_pdrv_registered)
@@ -11670,8 +17574,10 @@ static void thinkpad_acpi_module_exit(void)
 		platform_device_unregister(tpacpi_pdev);
 	if (proc_dir)
 		remove_proc_entry(TPACPI_PROC_DIR, acpi_root_dir);
-	if (tpacpi_wq)
+	if (tpacpi_wq) {
+		cancel_delayed_work_sync(&tpacpi_nvram_work);
 		destroy_workqueue(tpacpi_wq);
+	}
 
 	kfree(thinkpad_id.bios_version_str);
 	kfree(thinkpad_id.ec_version_str);
@@ -11738,6 +17644,8 @@ static int __init thinkpad_acpi_module_init(void)
 		return -ENODEV;
 	}
 
+	tpacpi_debugfs_dir = debugfs_create_dir(TPACPI_FILE, NULL);
+
 	dmi_id = dmi_first_match(fwbug_list);
 	if (dmi_id)
 		tp_features.quirks = dmi_id->driver_data;
@@ -5,6 +5,10 @@
 #ifndef THINKPAD_ACPI
 #define THINKPAD_ACPI
 
+#include <linux/list.h>
+#include <linux/notifier.h>
+#include <linux/types.h>
+
 #define TPACPI_LED_NUMLEDS 16
 
 /**
@@ -30,4 +34,215 @@ struct tpacpi_led_classdev {
  */ 
 struct tpacpi_led_classdev *tpacpi_get_led(unsigned int index);
 
+/**
+ * \brief A subscriber to the HKEY events drained from the firmware.
+ *
+ * nb.notifier_call is invoked in process context as
+ * notifier_call(&nb, hkey, NULL) for every event whose code lies within
+ * [hkey_first, hkey_last], in order of descending nb.priority. It may sleep.
+ * Returning NOTIFY_OK or NOTIFY_STOP marks the event as handled; a return
+ * value with NOTIFY_STOP_MASK set also skips lower priority subscribers.
+ */
+struct tpacpi_hkey_notifier {
+	struct notifier_block nb;
+	/**
+	 * \brief The first HKEY code the subscriber wants to see.
+	 */
+	u32 hkey_first;
+	/**
+	 * \brief The last HKEY code the subscriber wants to see.
+	 */
+	u32 hkey_last;
+	/**
+	 * \brief Private to thinkpad_acpi.
+	 */
+	struct list_head list;
+};
+
+/**
+ * \brief Subscribes to HKEY events.
+ * \returns 0 on success, or -EINVAL if the hkey range is empty.
+ */
+int tpacpi_register_hkey_notifier(struct tpacpi_hkey_notifier *notifier);
+
+/**
+ * \brief Unsubscribes from HKEY events.
+ *
+ * On return no call into the notifier is in progress any more.
+ */
+void tpacpi_unregister_hkey_notifier(struct tpacpi_hkey_notifier *notifier);
+
+/**
+ * \brief Decoded class of an HKEY event, i.e. the top nibble of the code.
+ */
+enum tpacpi_hkey_category {
+	TPACPI_HKEY_CAT_UNKNOWN = 0,
+	TPACPI_HKEY_CAT_HOTKEY,		/* 0x1xxx: key presses */
+	TPACPI_HKEY_CAT_WAKEUP,		/* 0x2xxx: wakeup reasons */
+	TPACPI_HKEY_CAT_BAY,		/* 0x3xxx: bay-related wakeups */
+	TPACPI_HKEY_CAT_DOCK,		/* 0x4xxx: dock-related events */
+	TPACPI_HKEY_CAT_USREVENT,	/* 0x5xxx: human interface helpers */
+	TPACPI_HKEY_CAT_THERMAL,	/* 0x6xxx: thermal and keyboard events */
+	TPACPI_HKEY_CAT_MISC,		/* 0x7xxx: misc */
+	TPACPI_HKEY_CAT_MISC2,		/* 0x8xxx: misc2 */
+};
+
+/* tpacpi_event_record flags */
+#define TPACPI_EVENT_F_KNOWN	0x0001	/* the driver handled the event */
+#define TPACPI_EVENT_F_NETLINK	0x0002	/* also sent as an ACPI netlink event */
+#define TPACPI_EVENT_F_INJECTED	0x0004	/* synthetic, from debugfs hotkey_inject */
+
+/**
+ * \brief One HKEY event as read() from /dev/tpacpi_events.
+ *
+ * A read returns as many whole records as fit in the buffer. Records are
+ * only lost when the reader falls behind by more than the size of its ring;
+ * the number lost right before a record is reported in its overflow field.
+ */
+struct tpacpi_event_record {
+	/**
+	 * \brief CLOCK_MONOTONIC time at which the event was fetched, in ns.
+	 */
+	u64 timestamp_ns;
+	/**
+	 * \brief The raw HKEY event code.
+	 */
+	u32 hkey;
+	/**
+	 * \brief An enum tpacpi_hkey_category.
+	 */
+	u16 category;
+	/**
+	 * \brief TPACPI_EVENT_F_* flags.
+	 */
+	u16 flags;
+	/**
+	 * \brief Id of the firmware notification the event was drained in.
+	 *
+	 * All events fetched from the firmware queue in response to a single
+	 * notification share the same batch id.
+	 */
+	u32 batch;
+	/**
+	 * \brief Records dropped on this file since the previous record.
+	 */
+	u32 overflow;
+};
+
+#define TPACPI_THERMAL_SAMPLE_NA	(-128000)
+
+/**
+ * \brief One sample of all thermal sensors as read() from debugfs
+ * thermal_history.
+ *
+ * The file holds the samples in the history ring, oldest first.
+ */
+struct tpacpi_thermal_sample {
+	/**
+	 * \brief CLOCK_MONOTONIC time at which the sample was taken, in ns.
+	 */
+	u64 timestamp_ns;
+	/**
+	 * \brief Temperatures in millidegrees Celsius, or
+	 * TPACPI_THERMAL_SAMPLE_NA.
+	 */
+	s32 temp[16];
+};
+
+/* tpacpi_trace_record flags */
+#define TPACPI_TRACE_F_THERMAL	0x0001	/* temp[] holds nsensors readings */
+#define TPACPI_TRACE_F_FAN1	0x0002	/* fan_rpm[0] is valid */
+#define TPACPI_TRACE_F_FAN2	0x0004	/* fan_rpm[1] is valid */
+#define TPACPI_TRACE_F_STATUS	0x0008	/* fan_status is valid */
+
+#define TPACPI_TRACE_TEMP_NA	(-32768)
+
+/**
+ * \brief One thermal/fan sample as written to the thermal_trace relay files.
+ *
+ * Samples land in the relay buffer of whichever CPU took them; merge the
+ * per-CPU files by seq to restore the sampling order.
+ */
+struct tpacpi_trace_record {
+	/**
+	 * \brief CLOCK_MONOTONIC time at which sampling started, in ns.
+	 */
+	u64 timestamp_ns;
+	/**
+	 * \brief Sample number since the trace was started.
+	 */
+	u32 seq;
+	/**
+	 * \brief Samples lost since the trace was started, up to this one.
+	 */
+	u32 dropped;
+	/**
+	 * \brief Fan speeds in RPM.
+	 */
+	u32 fan_rpm[2];
+	/**
+	 * \brief TPACPI_TRACE_F_* flags.
+	 */
+	u16 flags;
+	/**
+	 * \brief The raw fan status/level byte.
+	 */
+	u8 fan_status;
+	/**
+	 * \brief Number of valid entries in temp.
+	 */
+	u8 nsensors;
+	u32 reserved;
+	/**
+	 * \brief Temperatures in 0.1 degrees Celsius, or TPACPI_TRACE_TEMP_NA.
+	 */
+	s16 temp[16];
+};
+
+/**
+ * \brief Fan modes told apart by the fan telemetry.
+ *
+ * Levels 0-7 are the manual levels; "full-speed" is the same EC mode as
+ * disengaged.
+ */
+enum tpacpi_fan_mode {
+	TPACPI_FAN_MODE_LEVEL0 = 0,	/* ... TPACPI_FAN_MODE_LEVEL0 + 7 */
+	TPACPI_FAN_MODE_AUTO = 8,
+	TPACPI_FAN_MODE_DISENGAGED,
+	TPACPI_FAN_MODE_UNKNOWN,	/* manual mode on ECs without levels */
+	TPACPI_FAN_MODE_MAX
+};
+
+#define TPACPI_FAN_RPM_BUCKET_WIDTH	250
+#define TPACPI_FAN_RPM_BUCKETS		32	/* the last one is open-ended */
+
+/**
+ * \brief The fan telemetry as read() from debugfs fan_telemetry.
+ */
+struct tpacpi_fan_telemetry {
+	/**
+	 * \brief Time spent in each enum tpacpi_fan_mode, in ns, excluding
+	 * suspend.
+	 */
+	u64 mode_ns[TPACPI_FAN_MODE_MAX];
+	/**
+	 * \brief Number of fan status observations.
+	 */
+	u64 samples;
+	/**
+	 * \brief Number of mode changes observed.
+	 */
+	u64 transitions;
+	/**
+	 * \brief Mode changes by [from][to] mode.
+	 */
+	u32 transition[TPACPI_FAN_MODE_MAX][TPACPI_FAN_MODE_MAX];
+	/**
+	 * \brief Time spent per fan in each TPACPI_FAN_RPM_BUCKET_WIDTH RPM
+	 * bucket, in ns, excluding suspend.  A reading counts until the next
+	 * one.
+	 */
+	u64 rpm_hist[2][TPACPI_FAN_RPM_BUCKETS];
+};
+
 #endif /* THINKPAD_ACPI */
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Tracepoints for the ThinkPad ACPI Extras driver
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM thinkpad_acpi
+
+#if !defined(_TRACE_THINKPAD_ACPI_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_THINKPAD_ACPI_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(tpacpi_hkey_notify,
+
+	TP_PROTO(u32 event, u32 batch),
+
+	TP_ARGS(event, batch),
+
+	TP_STRUCT__entry(
+		__field(u32, event)
+		__field(u32, batch)
+	),
+
+	TP_fast_assign(
+		__entry->event = event;
+		__entry->batch = batch;
+	),
+
+	TP_printk("event=0x%x batch=%u", __entry->event, __entry->batch)
+);
+
+/* Latencies are measured from the firmware notification */
+DECLARE_EVENT_CLASS(tpacpi_hkey_stage,
+
+	TP_PROTO(u32 hkey, u32 batch, u64 latency_ns),
+
+	TP_ARGS(hkey, batch, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(u32, hkey)
+		__field(u32, batch)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->hkey = hkey;
+		__entry->batch = batch;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("hkey=0x%04x batch=%u latency=%llu ns",
+		  __entry->hkey, __entry->batch, __entry->latency_ns)
+);
+
+DEFINE_EVENT(tpacpi_hkey_stage, tpacpi_hkey_fetch,
+	TP_PROTO(u32 hkey, u32 batch, u64 latency_ns),
+	TP_ARGS(hkey, batch, latency_ns)
+);
+
+DEFINE_EVENT(tpacpi_hkey_stage, tpacpi_hkey_handled,
+	TP_PROTO(u32 hkey, u32 batch, u64 latency_ns),
+	TP_ARGS(hkey, batch, latency_ns)
+);
+
+DEFINE_EVENT(tpacpi_hkey_stage, tpacpi_hkey_delivered,
+	TP_PROTO(u32 hkey, u32 batch, u64 latency_ns),
+	TP_ARGS(hkey, batch, latency_ns)
+);
+
+#endif /* _TRACE_THINKPAD_ACPI_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE thinkpad_acpi_trace
+#include <trace/define_trace.h>